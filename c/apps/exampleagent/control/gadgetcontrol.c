@@ -95,7 +95,7 @@ void gadgetcontrol_execute(command_t *cmd) {
 
       // 3. This is a command I know how to execute!
       snprintf(url, sizeof(url), "%s/set.xml/%d", focusedGadget->ip, atoi(cmd->argument));
-      if(0 != libhttpcomm_getMsg(NULL, url, NULL, NULL, rxBuffer, sizeof(rxBuffer), params, NULL)) {
+      if(0 != libhttpcomm_getMsg(gadgetagent_getCurlShare(), url, NULL, NULL, rxBuffer, sizeof(rxBuffer), params, NULL)) {
         iotxml_sendResult(cmd->commandId, IOT_RESULT_DEVICECONNECTIONERROR);
         return;
       }
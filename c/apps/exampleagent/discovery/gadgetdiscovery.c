@@ -280,7 +280,7 @@ static error_t _gadgetdiscovery_captureGadgetDetails(gadget_t *gadget) {
   params.timeouts.transferTimeout = 15;
 
   snprintf(url, sizeof(url), "http://%s/get.xml", gadget->ip);
-  if (libhttpcomm_getMsg(NULL, url, NULL, NULL, rxBuffer, sizeof(rxBuffer), params, NULL) == 0) {
+  if (libhttpcomm_getMsg(gadgetagent_getCurlShare(), url, NULL, NULL, rxBuffer, sizeof(rxBuffer), params, NULL) == 0) {
     if ((jsonMsg = cJSON_Parse(rxBuffer)) != NULL) {
 
       if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "uuid")) != NULL) {
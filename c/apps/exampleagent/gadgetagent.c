@@ -137,6 +137,7 @@
 #include "proxyserver.h"
 #include "clientsocket.h"
 #include "iotapi.h"
+#include "libhttpcomm.h"
 
 #include "gadgetagent.h"
 
@@ -158,6 +159,12 @@ static struct timeval lastHeartbeatTime;
 /** Last measurement time */
 static struct timeval lastMeasurementTime;
 
+/** DNS and connection caches shared by all requests to the gadgets */
+static CURLSH *curlShare;
+
+/** Runs the requests made to many gadgets at once */
+static libhttpcomm_multi_t *httpMulti;
+
 
 /***************** Functions ****************/
 /**
@@ -175,6 +182,10 @@ int main(int argc, char *argv[]) {
 
   printf("Running gadget agent\n");
 
+  // Every gadget request shares the same DNS and connection caches
+  curlShare = libhttpcomm_curlShareInit();
+  httpMulti = libhttpcomm_multiOpen(curlShare, GADGET_MAX_MSG_SIZE);
+
   // Listen for all commands of type 'set'
   iotxml_addCommandListener(&gadgetcontrol_execute, "set");
 
@@ -216,6 +227,8 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  libhttpcomm_multiClose(httpMulti);
+  libhttpcomm_curlShareClose(curlShare);
   return 0;
 }
 
@@ -286,3 +299,19 @@ void gadgetagent_setHeartbeatPeriod(int seconds) {
 void gadgetagent_refreshDevices() {
   lastMeasurementTime.tv_sec = 0;
 }
+
+/**
+ * @return the curl caches shared by all HTTP requests to the gadgets,
+ *     NULL if they couldn't be created
+ */
+CURLSH *gadgetagent_getCurlShare() {
+  return curlShare;
+}
+
+/**
+ * @return the engine running HTTP requests to many gadgets at once,
+ *     NULL if it couldn't be created
+ */
+libhttpcomm_multi_t *gadgetagent_getHttpMulti() {
+  return httpMulti;
+}
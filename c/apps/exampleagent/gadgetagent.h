@@ -34,6 +34,8 @@
 #ifndef GADGETAGENT_H
 #define GADGETAGENT_H
 
+#include "libhttpcomm.h"
+
 #include "gadgetcontrol.h"
 #include "gadgetmanager.h"
 #include "gadgetdiscovery.h"
@@ -62,6 +64,10 @@ void gadgetagent_setMeasurementPeriod(int seconds);
 
 void gadgetagent_refreshDevices();
 
+CURLSH *gadgetagent_getCurlShare();
+
+libhttpcomm_multi_t *gadgetagent_getHttpMulti();
+
 
 #endif
 
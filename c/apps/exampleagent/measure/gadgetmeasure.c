@@ -58,33 +58,36 @@
 
 
 /***************** Private Prototypes ****************/
+static void _gadgetmeasure_onResponse(int result, http_rxbuffer_t *response, void *userData);
 
 /***************** Public Functions ****************/
 /**
  * Capture measurements for all known gadgets
  *
+ * All gadgets are asked at the same time, so a slow or unreachable gadget
+ * doesn't delay the measurements of the others.
+ *
  * THIS IS AN EXAMPLE ONLY! None of this code really works on any real device.
  */
 void gadgetmeasure_capture() {
   int i;
   gadget_t *focusedGadget;
   char url[PATH_MAX];
-  char rxBuffer[GADGET_MAX_MSG_SIZE];
-  cJSON *jsonMsg = NULL;
-  cJSON *jsonObject = NULL;
-  http_param_t params;
+  http_request_t request;
+  libhttpcomm_multi_t *multi = gadgetagent_getHttpMulti();
 
-  struct timeval curTime = { 0, 0 };
+  if (multi == NULL) {
+    SYSLOG_ERR("[gadget] No HTTP engine to capture measurements");
+    return;
+  }
 
-  params.verbose = false;
-  params.timeouts.connectTimeout = 3;
-  params.timeouts.transferTimeout = 15;
+  bzero(&request, sizeof(request));
+  request.httpMethod = CURLOPT_HTTPGET;
+  request.url = url;
+  request.params.verbose = false;
+  request.params.timeouts.connectTimeout = 3;
+  request.params.timeouts.transferTimeout = 15;
 
-  /*
-   * We keep a buffer of measurements until we know all measurements are good.
-   * Then at the end, we copy all the measurements from the buffer to the actual
-   * focusedGadget pointer.
-   */
   for(i = 0; i < gadgetmanager_size(); i++) {
     if((focusedGadget = gadgetmanager_get(i)) != NULL) {
       if(focusedGadget->inUse) {
@@ -94,48 +97,15 @@ void gadgetmeasure_capture() {
         // it gives me back all the information in JSON format.
         snprintf(url, sizeof(url), "http://%s/get.xml", focusedGadget->ip);
 
-        if (libhttpcomm_getMsg(NULL, url, NULL, NULL, rxBuffer, sizeof(rxBuffer), params, NULL) == 0) {
-          if ((jsonMsg = cJSON_Parse(rxBuffer)) != NULL) {
-
-            // State of the example gadget's outlet, 1 or 0
-            if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "state")) != NULL) {
-              focusedGadget->isOn = jsonObject->valueint;
-            }
-
-            // Current
-            if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "amps")) != NULL) {
-              focusedGadget->current_amps = jsonObject->valuedouble;
-            }
-
-            // Power
-            if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "watts")) != NULL) {
-              focusedGadget->power_watts = jsonObject->valuedouble;
-            }
-
-            // Volts
-            if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "volts")) != NULL) {
-              focusedGadget->voltage = jsonObject->valuedouble;
-            }
-
-            // Power Factor
-            if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "pf")) != NULL) {
-              focusedGadget->powerFactor = jsonObject->valueint;
-            }
-
-            // Energy
-            if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "energy")) != NULL) {
-              focusedGadget->energy_wh = jsonObject->valuedouble;
-            }
-
-            // Log that we updated the measurements and last contact time
-            focusedGadget->measurementsUpdated = true;
-            gettimeofday(&curTime, NULL);
-            focusedGadget->lastTouchTime.tv_sec = curTime.tv_sec;
-          }
+        if (libhttpcomm_submit(multi, &request, _gadgetmeasure_onResponse, focusedGadget) != 0) {
+          SYSLOG_ERR("[gadget] Couldn't ask %s for measurements", focusedGadget->ip);
         }
       }
     }
   }
+
+  // Wait for every gadget to answer or time out
+  while (libhttpcomm_multiRun(multi, 1000) > 0);
 }
 
 /**
@@ -252,6 +222,63 @@ void gadgetmeasure_send() {
 }
 
 
-/***************** Private Functions *****************/
+/***************** Private Functions ****************/
+/**
+ * Called when a gadget answered our request for measurements.
+ *
+ * The measurements found in its JSON answer are copied to the gadget, which
+ * is then marked as updated and touched. A failed request leaves the last
+ * measurements in place.
+ *
+ * @param result 0 if the gadget answered
+ * @param response The gadget's answer
+ * @param userData The gadget_t we asked
+ */
+static void _gadgetmeasure_onResponse(int result, http_rxbuffer_t *response, void *userData) {
+  gadget_t *focusedGadget = (gadget_t *) userData;
+  cJSON *jsonMsg = NULL;
+  cJSON *jsonObject = NULL;
+  struct timeval curTime = { 0, 0 };
+
+  if (result != 0) {
+    return;
+  }
 
+  if ((jsonMsg = cJSON_Parse(response->buffer)) != NULL) {
 
+    // State of the example gadget's outlet, 1 or 0
+    if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "state")) != NULL) {
+      focusedGadget->isOn = jsonObject->valueint;
+    }
+
+    // Current
+    if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "amps")) != NULL) {
+      focusedGadget->current_amps = jsonObject->valuedouble;
+    }
+
+    // Power
+    if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "watts")) != NULL) {
+      focusedGadget->power_watts = jsonObject->valuedouble;
+    }
+
+    // Volts
+    if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "volts")) != NULL) {
+      focusedGadget->voltage = jsonObject->valuedouble;
+    }
+
+    // Power Factor
+    if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "pf")) != NULL) {
+      focusedGadget->powerFactor = jsonObject->valueint;
+    }
+
+    // Energy
+    if ((jsonObject = cJSON_GetObjectItem(jsonMsg, "energy")) != NULL) {
+      focusedGadget->energy_wh = jsonObject->valuedouble;
+    }
+
+    // Log that we updated the measurements and last contact time
+    focusedGadget->measurementsUpdated = true;
+    gettimeofday(&curTime, NULL);
+    focusedGadget->lastTouchTime.tv_sec = curTime.tv_sec;
+  }
+}
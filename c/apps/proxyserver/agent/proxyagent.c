@@ -60,6 +60,7 @@
 #include "proxyserver.h"
 #include "proxyconfig.h"
 #include "iotapi.h"
+#include "libhttpcomm.h"
 
 
 /** Thread termination flag */
@@ -86,8 +87,11 @@ static int deviceType;
 /** Device ID of this proxy, our EUI64 */
 static char deviceId[EUI64_STRING_SIZE];
 
+/** Message from the server being parsed as it arrives */
+static iotxml_stream_t *inboundStream;
+
 /***************** Private Prototypes ****************/
-static void application_receive(const char *msg, int len);
+static void application_receive(proxystream_e event, const char *data, int len);
 
 static void *_proxyAgentThread(void *params);
 
@@ -99,6 +103,8 @@ static void _captureRebootCount();
 
 static void _captureDeviceType();
 
+static bool _getPushMetrics(int *latencyP99Ms, int *handshakeSharePercent);
+
 /***************** Public Functions ****************/
 /**
  * Start the proxy agent
@@ -111,8 +117,9 @@ error_t proxyagent_start() {
     return FAIL;
   }
 
-  // Add a listener directly to the inbound server messages
-  if(proxylisteners_addListener(&application_receive) != SUCCESS) {
+  // Add a listener directly to the inbound server messages, so commands
+  // execute as soon as they arrive
+  if(proxylisteners_addStreamListener(&application_receive) != SUCCESS) {
     SYSLOG_DEBUG("[proxyagent]: Proxy is out of listener slots");
     return FAIL;
   }
@@ -171,17 +178,36 @@ error_t application_send(const char *msg, int len) {
  * The application layer is responsible for routing inbound mesages
  * appropriately.
  *
- * Route inbound messages in this application directly to the XML parser.
+ * Route inbound messages in this application directly to the XML parser,
+ * chunk by chunk as they arrive from the server.
  *
- * @param msg Message received
- * @param len Length of the message received
+ * @param event What happened to the message being received
+ * @param data Next chunk of the message for PROXYSTREAM_DATA
+ * @param len Length of the chunk
  */
-void application_receive(const char *msg, int len) {
-  if(strstr(msg, "xml") != NULL) {
-     iotxml_parse(msg, len);
-
-  } else {
-    SYSLOG_INFO("[proxyagent] Unknown message format: %s", msg);
+static void application_receive(proxystream_e event, const char *data, int len) {
+  switch(event) {
+  case PROXYSTREAM_BEGIN:
+    iotxml_streamClose(inboundStream);
+    inboundStream = iotxml_streamOpen();
+    break;
+
+  case PROXYSTREAM_DATA:
+    iotxml_streamParse(inboundStream, data, len);
+    break;
+
+  case PROXYSTREAM_END:
+    if(iotxml_streamClose(inboundStream) != SUCCESS) {
+      SYSLOG_INFO("[proxyagent] Unknown message format");
+    }
+    inboundStream = NULL;
+    break;
+
+  case PROXYSTREAM_ABORT:
+    // Commands already parsed were executed, the rest is lost
+    iotxml_streamClose(inboundStream);
+    inboundStream = NULL;
+    break;
   }
 }
 
@@ -261,6 +287,8 @@ static void _sendHeartbeat() {
   char myMsg[1024];
   char firmwareVersion[8];
   int offset = 0;
+  int latencyP99Ms;
+  int handshakeSharePercent;
 
   // Get the Git SHA1 firmware version, padded on the left with 0's
   snprintf(firmwareVersion, sizeof(firmwareVersion), "%.07x", GIT_FIRMWARE_VERSION);
@@ -313,12 +341,65 @@ static void _sendHeartbeat() {
     0,
     (int) proxyconfig_getUploadIntervalSec());
 
+  // Tail latency of the pushes and the share of it spent on handshakes
+  if(_getPushMetrics(&latencyP99Ms, &handshakeSharePercent)) {
+    offset += iotxml_addInt(myMsg + offset, sizeof(myMsg) - offset,
+      deviceId,
+      deviceType,
+      IOT_PARAM_PROFILE,
+      PARAM_NAME_PUSH_LATENCY_P99,
+      NULL,
+      0,
+      latencyP99Ms);
+
+    offset += iotxml_addInt(myMsg + offset, sizeof(myMsg) - offset,
+      deviceId,
+      deviceType,
+      IOT_PARAM_PROFILE,
+      PARAM_NAME_PUSH_HANDSHAKE_SHARE,
+      NULL,
+      0,
+      handshakeSharePercent);
+  }
+
   // 3. Send the message
   if(iotxml_send(myMsg, sizeof(myMsg)) == SUCCESS) {
     SYSLOG_INFO("[proxyagent] Heartbeat");
   }
 }
 
+/**
+ * Read the HTTP metrics of the pushes to the server since the proxy started
+ *
+ * @param latencyP99Ms 99th percentile of the push duration in ms
+ * @param handshakeSharePercent Share of the push time spent on name lookups,
+ *     TCP and TLS handshakes
+ * @return true if the server was pushed to at least once
+ */
+static bool _getPushMetrics(int *latencyP99Ms, int *handshakeSharePercent) {
+  static http_endpoint_metrics_t metrics[HTTPCOMM_METRICS_MAX_ENDPOINTS];
+  char url[PROXY_URL_SIZE];
+  double handshakeMs;
+  int total;
+  int i;
+
+  proxyconfig_getUrl(url, sizeof(url));
+  total = libhttpcomm_getMetrics(metrics, HTTPCOMM_METRICS_MAX_ENDPOINTS);
+
+  for(i = 0; i < total; i++) {
+    if(strcmp(metrics[i].method, "POST") == 0 && strstr(metrics[i].endpoint, url) != NULL
+        && metrics[i].total.samples > 0) {
+      handshakeMs = (metrics[i].appConnect.sumMs > 0) ? metrics[i].appConnect.sumMs : metrics[i].connect.sumMs;
+
+      *latencyP99Ms = (int) libhttpcomm_histogramPercentileMs(&metrics[i].total, 99);
+      *handshakeSharePercent = (metrics[i].total.sumMs > 0) ? (int) (100 * handshakeMs / metrics[i].total.sumMs) : 0;
+      return true;
+    }
+  }
+
+  return false;
+}
+
 /**
  * Grab the reboot count from the configuration file, increment it, and
  * store it back in the configuration file
@@ -53,6 +53,12 @@
 /** Parameter name for the passive upload interval of the proxy */
 #define PARAM_NAME_UPLOAD_INTERVAL "UploadInterval"
 
+/** Parameter name for the 99th percentile of the push latency in ms */
+#define PARAM_NAME_PUSH_LATENCY_P99 "PushLatencyP99"
+
+/** Parameter name for the percentage of the push time spent setting up connections */
+#define PARAM_NAME_PUSH_HANDSHAKE_SHARE "PushHandshakeShare"
+
 
 /***************** Public Prototypes ****************/
 error_t proxyagent_start();
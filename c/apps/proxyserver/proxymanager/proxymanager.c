@@ -58,6 +58,8 @@ char *_proxymanager_getProxyActivationKeyFromConfigFile(char *buffer, int maxsiz
 
 bool _proxymanager_useSslFromConfigFile();
 
+void _proxymanager_setCompressionFromConfigFile();
+
 char *_proxymanager_getProxySslCertificateFromConfigFile(char *buffer, int maxsize);
 
 
@@ -78,6 +80,9 @@ void proxymanager_startProxy() {
   // Set the SSL certificate path, which may or may not exist
   proxyconfig_setCertificate(_proxymanager_getProxySslCertificateFromConfigFile(buffer, sizeof(buffer)));
 
+  // Compress messages to the server if the server supports it
+  _proxymanager_setCompressionFromConfigFile();
+
   // Start the proxy with our URL
   proxy_start(_proxymanager_getUrlFromConfigFile(buffer, sizeof(buffer)));
 
@@ -155,6 +160,34 @@ bool _proxymanager_useSslFromConfigFile() {
   return (strcmp(buffer, "true") == 0);
 }
 
+/**
+ * Determine how to compress messages to the server from the configuration file
+ */
+void _proxymanager_setCompressionFromConfigFile() {
+  char buffer[32];
+  int i;
+
+  bzero(buffer, sizeof(buffer));
+  libconfigio_read(proxycli_getConfigFilename(), CONFIGIO_CLOUD_COMPRESSION, buffer, sizeof(buffer));
+
+  for(i = 0; buffer[i]; i++) {
+    buffer[i] = tolower(buffer[i]);
+  }
+
+  if(strcmp(buffer, "gzip") == 0) {
+    proxyconfig_setCompression(HTTPCOMM_ENCODING_GZIP, false);
+
+  } else if(strcmp(buffer, "deflate") == 0) {
+    proxyconfig_setCompression(HTTPCOMM_ENCODING_DEFLATE, false);
+
+  } else if(strcmp(buffer, "deflate-dictionary") == 0) {
+    proxyconfig_setCompression(HTTPCOMM_ENCODING_DEFLATE, true);
+
+  } else {
+    proxyconfig_setCompression(HTTPCOMM_ENCODING_IDENTITY, false);
+  }
+}
+
 /**
  * Get the path to the SSL certificate from our configuration file
  * @param buffer Buffer to store the path in
@@ -79,7 +79,7 @@ static int clientSocketFd;
 /***************** Prototypes ***************/
 void _proxyserver_processMessage(int clientSocketFd);
 
-void _proxyserver_listener(const char *message, int len);
+void _proxyserver_listener(const char *message, int len, const proxyresponse_t *response);
 
 
 /***************** Functions *****************/
@@ -125,7 +125,7 @@ int main(int argc, char *argv[]) {
   }
 
   // Add a listener to the proxy so we can forward commands from the server to other clients / agents
-  if (proxylisteners_addListener(&_proxyserver_listener) != SUCCESS) {
+  if (proxylisteners_addResponseListener(&_proxyserver_listener) != SUCCESS) {
     SYSLOG_ERR("[%d]: Proxy is out of listener slots", getpid());
     exit(1);
   }
@@ -205,16 +205,22 @@ int main(int argc, char *argv[]) {
 
 /**
  * Registered listener to the proxy. This broadcasts received server messages
- * to all client sockets
+ * to all client sockets. Every <s2h> envelope is forwarded, with or without
+ * commands, since its status tells the clients whether a user is watching.
  *
  * @param message Message from the server
  * @param len Length of the message from the server
+ * @param response What the proxy found in the message
  */
-void _proxyserver_listener(const char *message, int len) {
+void _proxyserver_listener(const char *message, int len, const proxyresponse_t *response) {
   int i;
   int clients = 0;
   proxy_client_t *client;
 
+  if (!proxyresponse_forClients(response)) {
+    return;
+  }
+
   for(i = 0; i < proxyclientmanager_size(); i++) {
     client = proxyclientmanager_get(i);
     if(client->inUse) {
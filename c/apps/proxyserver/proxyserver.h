@@ -78,6 +78,13 @@
 /** Token for true or false to use SSL */
 #define CONFIGIO_CLOUD_USE_SSL "CLOUD_USE_SSL"
 
+/**
+ * Token for the compression of messages to the cloud: "gzip", "deflate", or
+ * "deflate-dictionary" to deflate with the preset IOT XML dictionary.
+ * Anything else sends messages uncompressed.
+ */
+#define CONFIGIO_CLOUD_COMPRESSION "CLOUD_COMPRESSION"
+
 /** Token to store the authentication key for the cloud */
 #define CONFIGIO_CLOUD_ACTIVATION_KEY "CLOUD_ACTIVATION_KEY"
 
@@ -46,6 +46,7 @@
 #include "eui64.h"
 #include "ioterror.h"
 #include "iotdebug.h"
+#include "h2swrapper.h"
 
 static uint32_t sequenceNum = 0;
 
@@ -59,25 +60,98 @@ static uint32_t sequenceNum = 0;
  */
 int h2swrapper_wrap(char *dest, char *message, int destSize) {
   int bytesWritten = 0;
-  char localAddress[EUI64_STRING_SIZE];
 
   assert(dest);
   assert(message);
 
-  sequenceNum++;
-
-  eui64_toString(localAddress, sizeof(localAddress));
-
-  bytesWritten += snprintf(dest, destSize - bytesWritten,
-      "<?xml version=\"1.0\" encoding=\"utf-8\" ?>"
-        "<h2s ver=\"2\" hubId=\"%s\" seq=\"%u\">", localAddress, sequenceNum);
+  bytesWritten += h2swrapper_header(dest, destSize);
 
   strncpy(dest + bytesWritten, message, destSize - bytesWritten);
 
   bytesWritten += strlen(message);
 
-  bytesWritten += snprintf(dest + bytesWritten, destSize - bytesWritten, "</h2s>");
+  bytesWritten += snprintf(dest + bytesWritten, destSize - bytesWritten, "%s", H2SWRAPPER_FOOTER);
+
+  return bytesWritten;
+}
+
+/**
+ * Writes the XML header of the next message to the server, with a new
+ * sequence number. The message must end with H2SWRAPPER_FOOTER.
+ *
+ * @param dest Buffer receiving the header
+ * @param destSize Size of dest, H2SWRAPPER_MAX_HEADER_LEN is always enough
+ * @return Number of bytes written
+ */
+int h2swrapper_header(char *dest, int destSize) {
+  return h2swrapper_headerSeq(dest, destSize, h2swrapper_nextSeq());
+}
+
+/**
+ * Takes a new sequence number, for a message that may be sent several times
+ * @return the sequence number
+ */
+uint32_t h2swrapper_nextSeq() {
+  return ++sequenceNum;
+}
+
+/**
+ * Writes the XML header of a message to the server with a given sequence
+ * number, the same each time the message is sent again so the server can
+ * drop the duplicates. The message must end with H2SWRAPPER_FOOTER.
+ *
+ * @param dest Buffer receiving the header
+ * @param destSize Size of dest, H2SWRAPPER_MAX_HEADER_LEN is always enough
+ * @param seq Sequence number from h2swrapper_nextSeq()
+ * @return Number of bytes written
+ */
+int h2swrapper_headerSeq(char *dest, int destSize, uint32_t seq) {
+  int bytesWritten;
+  char localAddress[EUI64_STRING_SIZE];
+
+  assert(dest);
+
+  eui64_toString(localAddress, sizeof(localAddress));
+
+  bytesWritten = snprintf(dest, destSize,
+      "<?xml version=\"1.0\" encoding=\"utf-8\" ?>"
+        "<h2s ver=\"2\" hubId=\"%s\" seq=\"%u\">", localAddress, seq);
+
+  if (bytesWritten >= destSize) {
+    bytesWritten = destSize - 1;
+  }
 
   return bytesWritten;
 }
 
+/**
+ * Describes the wrapped message as segments, the header, the ones of the
+ * message and the footer, so it can be sent without copying the message.
+ *
+ * @param segments segments[1] to segments[count - 2] already describe the
+ *     message, receives the header first and the footer last
+ * @param count Segments of the message + H2SWRAPPER_SEGMENTS
+ * @param header Buffer receiving the header, must live as long as segments
+ * @param headerSize Size of header, H2SWRAPPER_MAX_HEADER_LEN is always enough
+ * @param seq Sequence number from h2swrapper_nextSeq()
+ * @return Total number of bytes of the wrapped message
+ */
+int h2swrapper_wrapv(struct iovec *segments, int count, char *header, int headerSize, uint32_t seq) {
+  int length = 0;
+  int i;
+
+  assert(segments);
+  assert(count >= H2SWRAPPER_SEGMENTS);
+
+  segments[0].iov_base = header;
+  segments[0].iov_len = h2swrapper_headerSeq(header, headerSize, seq);
+
+  segments[count - 1].iov_base = (void *) H2SWRAPPER_FOOTER;
+  segments[count - 1].iov_len = sizeof(H2SWRAPPER_FOOTER) - 1;
+
+  for (i = 0; i < count; i++) {
+    length += segments[i].iov_len;
+  }
+
+  return length;
+}
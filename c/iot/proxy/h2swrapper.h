@@ -34,8 +34,30 @@
 #ifndef H2SWRAPPER_H
 #define H2SWRAPPER_H
 
+#include <stdint.h>
+#include <sys/uio.h>
+
+/** Closes every message to the server */
+#define H2SWRAPPER_FOOTER "</h2s>"
+
+enum {
+  /** Largest header written by h2swrapper_header() */
+  H2SWRAPPER_MAX_HEADER_LEN = 128,
+
+  /** Segments h2swrapper_wrapv() adds around the ones of the message, the header and the footer */
+  H2SWRAPPER_SEGMENTS = 2,
+};
+
 /***************** Public Prototypes ****************/
 int h2swrapper_wrap(char *dest, char *message, int destSize);
 
+int h2swrapper_header(char *dest, int destSize);
+
+uint32_t h2swrapper_nextSeq();
+
+int h2swrapper_headerSeq(char *dest, int destSize, uint32_t seq);
+
+int h2swrapper_wrapv(struct iovec *segments, int count, char *header, int headerSize, uint32_t seq);
+
 #endif
 
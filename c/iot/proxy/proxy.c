@@ -69,13 +69,26 @@
 #include <stdbool.h>
 #include <rpc/types.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <ctype.h>
+#include <sched.h>
 
 #include "libpipecomm.h"
 #include "libhttpcomm.h"
 #include "proxy.h"
 #include "proxylisteners.h"
 #include "proxyconfig.h"
+#include "proxyretry.h"
+#include "proxyqueue.h"
+#include "proxyjournal.h"
+#include "proxyresponse.h"
+#include "proxywindow.h"
+#include "proxybuffer.h"
 #include "h2swrapper.h"
+#include "iotxmlgen.h"
 #include "eui64.h"
 #include "ioterror.h"
 #include "iotdebug.h"
@@ -84,36 +97,218 @@
 /** Thread termination flag */
 static bool gTerminate;
 
+/** Set by proxy_stopWithin(): no more messages are taken, the thread flushes the ones it holds. Also true until the thread is started. */
+static volatile bool sStopping = true;
+
+/** Producers between their check of sStopping and the end of their push, waited for by the last persist */
+static volatile int sProducers = 0;
+
+/** Bytes the producers counted in sProducers are pushing */
+static volatile long sProducerBytes = 0;
+
+/** True from the creation of the queues and the pool until proxy_stopWithin() destroyed them */
+static bool sQueuesReady = false;
+
+/** Monotonic time in ms the messages the server didn't acknowledge by then are journaled */
+static unsigned long long sStopAtMs = 0;
+
+/** What the last stop did with the messages to the server, written by the thread before it exits */
+static proxy_shutdown_stats_t sShutdownStats;
+
+/** Backoff and circuit breaker shared by the pushes and polls to the server */
+static proxyretry_t sServerRetry;
+
 /** Thread */
 static pthread_t sThreadId;
 
+/** True from the creation of the thread until proxy_stopWithin() joined it */
+static bool sThreadStarted = false;
+
+/** Tags of the messages proxy_send() sends with PROXY_PRIORITY_HIGH */
+static const char *sUrgentTags[] = { "response", "alert", "add" };
+
 /** Thread attributes */
 static pthread_attr_t sThreadAttr;
 
-/** Mutex to protect router to server communications */
-static pthread_mutex_t sProxyToServerMutex;
+/** Buffers of the messages to the server, from the producers to the batch acknowledged by the server */
+static proxybuffer_pool_t sBufferPool;
+
+/** Messages of the threads of this process to the server, one queue per priority */
+static proxyqueue_t sProxyToServerQueues[PROXY_PRIORITIES];
 
-/** File descriptor to read from server */
+/** File descriptor to read from server, written by producers in other processes */
 static int sProxyToServerReadFd = -1;
 
-/** File descriptor to write to server */
+/** File descriptor to write to server, inherited by producers in other processes */
 static int sProxyToServerWriteFd = -1;
 
-/** Buffer allocating space for message(s) to send to the server */
-static char sMsgToServer[PROXY_MAX_HTTP_SEND_MESSAGE_LEN];
+/** Batches of messages to the server, kept until the server acknowledges them */
+static proxywindow_t sWindow;
+
+/** Batch of the window receiving the messages of the clients, NULL while all of them wait for the server */
+static proxywindow_batch_t *sFilling = NULL;
+
+/** Message read from the pipe, before it is copied to the batch being filled */
+static char sPipeMessage[PROXY_MAX_MSG_LEN];
+
+/** Request whose message from the server is handed to the stream listeners, if any */
+static http_request_t *sStreamOwner = NULL;
+
+/** Request whose message arrived while another one was streamed, streamed whole once received */
+static http_request_t *sStreamDeferred = NULL;
+
+/** Written by proxy_stop() to wake the thread up */
+static int sWakeupFd = -1;
+
+/** Events the thread waits for: pipe, timers and sockets to the server */
+static int sEpollFd = -1;
+
+/** Expires when the next request to the server can be sent */
+static int sDeadlineFd = -1;
+
+/** Expires when curl must be called for the timeouts of the requests in flight */
+static int sCurlTimerFd = -1;
+
+/** Engine running the requests to the server on the thread */
+static libhttpcomm_multi_t *sMulti;
+
+/** Compression of the requests to the server */
+static libhttpcomm_session_t *sSession;
+
+/** True while a poll is in flight, on its own connection next to the pushes */
+static bool sPolling = false;
+
+/** True to keep a GET open with the server, false to push often (CONT) */
+static bool sPoll = true;
+
+/** True from a failed request to the server until one goes through */
+static bool sServerFailing = false;
+
+/** Monotonic time in ms the last poll closed while the server wants one open, 0 if it is open */
+static unsigned long long sPollClosedMs = 0;
+
+/** Time-to-deliver in both directions */
+static proxy_delivery_stats_t sDeliveryStats;
+
+/** Mutex to protect sDeliveryStats */
+static pthread_mutex_t sDeliveryMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Monotonic time in ms before which no request is sent, to get the init messages of the application */
+static unsigned long long sNotBeforeMs = 0;
+
+/** Monotonic time in ms of the next empty push in CONT mode */
+static unsigned long long sNextEmptyPushMs = 0;
+
+/** Monotonic time in ms the oldest message of sFilling was read */
+static unsigned long long sBatchStartMs = 0;
+
+/** Average time a push takes, in ms */
+static unsigned int sPushLatencyMs = 0;
+
+/** Messages kept on disk while the server is unreachable */
+static proxyjournal_t sJournal;
+
+/** True once the journal was opened, or found disabled */
+static bool sJournalStarted = false;
 
-/** Size of the message to send to the server */
-static uint16_t sMsgToServerLen = 0;
+/** True while a record replayed from the journal is in the window */
+static bool sReplaying = false;
+
+/** True if the thread wakes up on the queue and the pipe from the clients */
+static bool sPipeWatched = false;
+
+/** Push of a batch of the window, its segments point to its header and to the buffers of the batch */
+typedef struct servercomm_push_t {
+  http_request_t request;
+
+  char header[H2SWRAPPER_MAX_HEADER_LEN];
+
+  struct iovec segments[PROXY_MAX_BATCH_BUFFERS + H2SWRAPPER_SEGMENTS];
+
+  /** Monotonic time in ms the oldest message of the batch was read, 0 if it was journaled */
+  unsigned long long batchStartMs;
+
+  /** Monotonic time in ms the push was submitted */
+  unsigned long long startMs;
+} servercomm_push_t;
+
+/** Pushes of the batches of the window, at the same index */
+static servercomm_push_t sPushes[PROXYWINDOW_MAX_SIZE];
+
+/** Poll in flight */
+static http_request_t sPollRequest;
 
 
 /***************** Private Prototypes ***************/
 static void *_serverCommThread(void *params);
 
-static void _serverCommPush(CURLSH * curlHandle, char *message, char *response, int responseMaxLen);
+static error_t _serverCommOpenEvents();
+
+static void _serverCommCloseEvents();
+
+static error_t _serverCommCtl(int op, int fd, uint32_t events);
+
+static void _serverCommWatch(int fd, int what, void *userData);
+
+static void _serverCommEvent(int fd, uint32_t events);
+
+static void _serverCommArmCurlTimer();
+
+static void _serverCommRead();
+
+static void _serverCommWatchPipe();
+
+static bool _serverCommHasRoom();
+
+static int _serverCommBatchCap();
+
+static void _serverCommNext();
+
+static unsigned int _serverCommLingerMs();
+
+static bool _serverCommProbing();
+
+static void _serverCommOpenJournal();
+
+static void _serverCommSpill();
+
+static void _serverCommReplay();
+
+static bool _serverCommFlushed();
+
+static void _serverCommPersist();
+
+static void _serverCommPersistBatch(proxywindow_batch_t *batch);
+
+static bool _serverCommPush(proxywindow_batch_t *batch);
+
+static void _serverCommPushed(int result, http_rxbuffer_t *response, void *userData);
+
+static void _serverCommForget(proxywindow_batch_t *batch, bool acknowledged);
+
+static void _serverCommPoll();
+
+static void _serverCommPolled(int result, http_rxbuffer_t *response, void *userData);
+
+static unsigned long long _serverCommNow();
 
-static void _serverCommPoll(CURLSH * curlHandle, char *pollMsg, int pollMsgMaxLen);
+static int _serverCommStream(const char *data, size_t length, void *userData);
 
-int _httpProgressCallback(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow);
+static void _serverCommStreamEnd(http_request_t *request, http_rxbuffer_t *response, bool complete);
+
+static void _serverCommPollClosed();
+
+static void _serverCommCountCommands(const proxyresponse_t *classified, bool onPush);
+
+static void _serverCommBroadcast(http_rxbuffer_t *msgFromServer, const proxyresponse_t *classified);
+
+static proxy_priority_e _proxyPriorityOf(const char *data, int len);
+
+static void _proxyQueueWatermark(proxyqueue_t *queue, bool above);
+
+static bool _proxyWaitProducers(unsigned long long untilMs);
+
+static void _proxyRelease();
 
 
 /***************** Proxy Public ****************/
@@ -124,18 +319,57 @@ int _httpProgressCallback(void *clientp, double dltotal, double dlnow, double ul
  */
 error_t proxy_start(const char *url) {
 	int pipeFds[2];
+  int highWatermark;
+  int lowWatermark;
+  int i;
+
+  if (sProducers > 0) {
+    SYSLOG_ERR("A producer of the last run is still pushing, can't start");
+    return FAIL;
+  }
+
+  // Queues the last stop couldn't free while a producer was stuck in them
+  _proxyRelease();
 
 	proxyconfig_start();
 	proxylisteners_start();
-  pthread_mutex_init(&sProxyToServerMutex, NULL);
+  proxyretry_init(&sServerRetry, NULL);
+
+  if (!proxybuffer_init(&sBufferPool, 0)) {
+    SYSLOG_ERR("Couldn't create the buffers of messages to the server");
+    return FAIL;
+  }
+
+  for (i = 0; i < PROXY_PRIORITIES; i++) {
+    if (!proxyqueue_init(&sProxyToServerQueues[i], 0, &sBufferPool)) {
+      SYSLOG_ERR("Couldn't create the queues of messages to the server");
+      while (--i >= 0) {
+        proxyqueue_destroy(&sProxyToServerQueues[i]);
+      }
+      proxybuffer_destroy(&sBufferPool);
+      return FAIL;
+    }
+  }
+
+  // From here on, every failure goes through _proxyRelease()
+  sQueuesReady = true;
+
+  // The newest measurements matter most, results and alerts are never dropped
+  proxyconfig_getQueueWatermarks(&highWatermark, &lowWatermark);
+  proxyqueue_setLimits(&sProxyToServerQueues[PROXY_PRIORITY_BULK], highWatermark, lowWatermark, PROXYQUEUE_DROP_OLDEST);
+  proxyqueue_setLimits(&sProxyToServerQueues[PROXY_PRIORITY_HIGH], highWatermark, lowWatermark, PROXYQUEUE_DROP_NEVER);
+  proxyqueue_setWatermarkListener(&sProxyToServerQueues[PROXY_PRIORITY_BULK], _proxyQueueWatermark);
+  proxyqueue_setWatermarkListener(&sProxyToServerQueues[PROXY_PRIORITY_HIGH], _proxyQueueWatermark);
 
 	if(proxyconfig_setUrl(url) != SUCCESS) {
 	  SYSLOG_ERR("Couldn't set the URL");
+	  _proxyRelease();
 	  return FAIL;
 	}
 
 	if(pipe(pipeFds)) {
 		SYSLOG_ERR("pipe() 3, cause:(%s)", strerror(errno));
+		_proxyRelease();
 		return FAIL;
 	}
 
@@ -152,13 +386,24 @@ error_t proxy_start(const char *url) {
 		SYSLOG_ERR("fcntl(sProxyToServerWriteFd), %s", strerror(errno));
 	}
 
+  // Lets proxy_stop() wake the thread up from epoll_wait()
+  sWakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (sWakeupFd < 0) {
+    SYSLOG_ERR("eventfd(), %s", strerror(errno));
+    _proxyRelease();
+    return FAIL;
+  }
+
   curl_global_init(CURL_GLOBAL_ALL);
 
+  gTerminate = false;
+  sStopping = false;
+
   // Initialize the thread
 	pthread_attr_init(&sThreadAttr);
 
-	// Will run detached from the main dispatcher thread
-	pthread_attr_setdetachstate(&sThreadAttr, PTHREAD_CREATE_DETACHED);
+	// Joined by proxy_stop() once it flushed the messages to the server
+	pthread_attr_setdetachstate(&sThreadAttr, PTHREAD_CREATE_JOINABLE);
 
 	// Round robin schedule is fine when processing is extremely low
 	pthread_attr_setschedpolicy(&sThreadAttr, SCHED_RR);
@@ -166,10 +411,15 @@ error_t proxy_start(const char *url) {
 	// Create the thread
 	if (pthread_create(&sThreadId, &sThreadAttr, &_serverCommThread, NULL)) {
 		SYSLOG_ERR("Creating proxy thread failed: %s", strerror(errno));
+		sStopping = true;
+		__sync_synchronize();
+		_proxyWaitProducers(_serverCommNow() + PROXY_DEFAULT_STOP_DEADLINE_MS);
+		_proxyRelease();
 		return FAIL;
 
 	} else {
 	  size_t stackSize = 0;
+	  sThreadStarted = true;
     pthread_attr_getstacksize(&sThreadAttr, &stackSize);
 
     if (stackSize < 65535) {
@@ -182,13 +432,145 @@ error_t proxy_start(const char *url) {
 }
 
 /**
- * Close all mutexes and threads
+ * Stop the proxy, giving the messages to the server up to
+ * PROXY_DEFAULT_STOP_DEADLINE_MS to be acknowledged, see proxy_stopWithin()
  */
 void proxy_stop() {
+  proxy_stopWithin(PROXY_DEFAULT_STOP_DEADLINE_MS);
+}
+
+/**
+ * Stop the proxy without losing the messages to the server. No more
+ * messages are taken, the ones queued are pushed right away without
+ * lingering, and the thread waits for the server to acknowledge them until
+ * the deadline. The ones still not acknowledged then, or as soon as the
+ * server is unreachable, are written to the journal for the next run to send
+ * them. The thread is joined before the queues, their buffers, the
+ * descriptors and the mutexes are released, so the proxy can be started
+ * again. A producer still in proxy_send() at the deadline, stuck in a queue
+ * listener for instance, isn't waited for: its bytes count as lost, even if
+ * its message made it into the journal.
+ *
+ * A listener calling this from the thread of the proxy can't wait for it:
+ * the thread then flushes and exits on its own, and the mutexes are left
+ * open.
+ *
+ * @param deadlineMs Time given to the server to acknowledge the messages, in ms
+ * @return SUCCESS if every message was acknowledged or journaled, FAIL if
+ *     some were lost, see proxy_getShutdownStats()
+ */
+error_t proxy_stopWithin(unsigned int deadlineMs) {
+  unsigned long long startMs = _serverCommNow();
+
+  bzero(&sShutdownStats, sizeof(sShutdownStats));
+  sStopAtMs = startMs + deadlineMs;
+  __sync_synchronize();
+  sStopping = true;
+  __sync_synchronize();
+
+  if (sWakeupFd >= 0 && eventfd_write(sWakeupFd, 1) < 0) {
+    SYSLOG_ERR("Couldn't wake the proxy thread up, %s", strerror(errno));
+  }
+
+  if (sThreadStarted) {
+    sThreadStarted = false;
+
+    if (pthread_equal(pthread_self(), sThreadId)) {
+      SYSLOG_WARNING("Proxy stopped from its own thread, not waiting for the flush");
+      pthread_detach(sThreadId);
+      return SUCCESS;
+    }
+
+    pthread_join(sThreadId, NULL);
+  }
+
+  _proxyRelease();
+
   proxyconfig_stop();
   proxylisteners_stop();
-  pthread_mutex_destroy(&sProxyToServerMutex);
-  gTerminate = true;
+  proxyretry_destroy(&sServerRetry);
+
+  sShutdownStats.durationMs = (unsigned int) (_serverCommNow() - startMs);
+  SYSLOG_INFO("Proxy stopped in %u ms: %llu bytes flushed, %llu journaled, %llu lost",
+      sShutdownStats.durationMs, sShutdownStats.flushedBytes, sShutdownStats.persistedBytes, sShutdownStats.lostBytes);
+
+  return sShutdownStats.lostBytes == 0 ? SUCCESS : FAIL;
+}
+
+/**
+ * Read the metrics of the retries to the server: failures, circuit breaker
+ * transitions and time spent in backoff
+ *
+ * @param stats Destination of the metrics
+ */
+void proxy_getRetryStats(proxyretry_stats_t *stats) {
+  proxyretry_getStats(&sServerRetry, stats);
+}
+
+/**
+ * Read the metrics of the journal of the messages the server couldn't take:
+ * depth, replay throughput and losses
+ *
+ * @param stats Destination of the metrics
+ */
+void proxy_getJournalStats(proxyjournal_stats_t *stats) {
+  proxyjournal_getStats(&sJournal, stats);
+}
+
+/**
+ * Read the time-to-deliver of the messages to the server, and the time the
+ * commands of the server couldn't reach the proxy because no poll was open
+ *
+ * @param stats Destination of the metrics
+ */
+void proxy_getDeliveryStats(proxy_delivery_stats_t *stats) {
+  pthread_mutex_lock(&sDeliveryMutex);
+  *stats = sDeliveryStats;
+  pthread_mutex_unlock(&sDeliveryMutex);
+}
+
+/**
+ * Read the metrics of the batches to the server: acknowledgements,
+ * retransmissions and batches in flight at once
+ *
+ * @param stats Destination of the metrics
+ */
+void proxy_getWindowStats(proxywindow_stats_t *stats) {
+  proxywindow_getStats(&sWindow, stats);
+}
+
+/**
+ * Read the metrics of the queue of messages to the server of a priority:
+ * occupancy, messages refused and measurements dropped
+ *
+ * @param priority PROXY_PRIORITY_HIGH or PROXY_PRIORITY_BULK
+ * @param stats Destination of the metrics
+ */
+void proxy_getQueueStats(proxy_priority_e priority, proxyqueue_stats_t *stats) {
+  if (priority != PROXY_PRIORITY_HIGH) {
+    priority = PROXY_PRIORITY_BULK;
+  }
+
+  proxyqueue_getStats(&sProxyToServerQueues[priority], stats);
+}
+
+/**
+ * Read the metrics of the buffers of the messages to the server
+ *
+ * @param stats Destination of the metrics
+ */
+void proxy_getBufferStats(proxybuffer_stats_t *stats) {
+  proxybuffer_getStats(&sBufferPool, stats);
+}
+
+/**
+ * Read what the last stop of the proxy did with the messages to the server:
+ * bytes flushed to it, journaled and lost
+ *
+ * @param stats Destination of the metrics
+ */
+void proxy_getShutdownStats(proxy_shutdown_stats_t *stats) {
+  *stats = sShutdownStats;
 }
 
 /**
@@ -211,335 +593,1380 @@ error_t proxy_removeListener(proxylistener l) {
   return proxylisteners_removeListener(l);
 }
 
+/**
+ * Add a listener to the messages sent by the server, also getting their
+ * status and the spans of their commands so it doesn't scan them again.
+ * This simply forwards to the proxylisteners module.
+ *
+ * @param l Function pointer to a function(const char *msg, int len, const proxyresponse_t *response)
+ */
+error_t proxy_addResponseListener(proxyresponselistener l) {
+  return proxylisteners_addResponseListener(l);
+}
+
+/**
+ * Remove a response listener. This simply forwards to the proxylisteners module.
+ *
+ * @param l Function pointer to remove
+ */
+error_t proxy_removeResponseListener(proxyresponselistener l) {
+  return proxylisteners_removeResponseListener(l);
+}
+
+/**
+ * Add a listener receiving the messages sent by the server as they arrive.
+ * This simply forwards to the proxylisteners module.
+ *
+ * @param l Function pointer to a function(proxystream_e event, const char *data, int len)
+ */
+error_t proxy_addStreamListener(proxystreamlistener l) {
+  return proxylisteners_addStreamListener(l);
+}
+
+/**
+ * Remove a stream listener. This simply forwards to the proxylisteners module.
+ *
+ * @param l Function pointer to remove
+ */
+error_t proxy_removeStreamListener(proxystreamlistener l) {
+  return proxylisteners_removeStreamListener(l);
+}
+
+/**
+ * Add a listener told when the producers should back off because the queue
+ * of messages to the server is past its high watermark, and when it's back
+ * to its low watermark. This is a convenience function that simply forwards
+ * to the proxylisteners module.
+ *
+ * @param l Function pointer to a function(int priority, bool above, int length)
+ */
+error_t proxy_addQueueListener(proxyqueuelistener l) {
+  return proxylisteners_addQueueListener(l);
+}
+
+/**
+ * Remove a queue listener
+ * @param l Function pointer to remove
+ */
+error_t proxy_removeQueueListener(proxyqueuelistener l) {
+  return proxylisteners_removeQueueListener(l);
+}
+
 /**
  * Use this function to send a message to the server.
  *
- * The process is to write the data into a pipe here, which is read out
- * in a different function and actually transmitted to the server later.
+ * The process is to copy the data into a queue here, which is read out
+ * in a different thread and actually transmitted to the server later.
+ * Command results, alerts and new devices are sent with PROXY_PRIORITY_HIGH,
+ * everything else with PROXY_PRIORITY_BULK.
+ *
  * @param data Buffer of data to send
  * @param len Length of the data to send
  *
- * @return SUCCESS if the data is being sent to the server
+ * @return SUCCESS if the data is being sent to the server, see proxy_sendPriority()
  */
 error_t proxy_send(const char *data, int len) {
-  int bytesWritten = 0;
+  return proxy_sendPriority(data, len, _proxyPriorityOf(data, len));
+}
+
+/**
+ * Send a message to the server with the given priority. High priority
+ * messages don't wait for others to share their push, and go ahead of the
+ * bulk in the next push.
+ *
+ * @param data Buffer of data to send
+ * @param len Length of the data to send
+ * @param priority PROXY_PRIORITY_HIGH or PROXY_PRIORITY_BULK
+ *
+ * @return SUCCESS if the data is being sent to the server, even if older
+ *     measurements were dropped to make room for it, which the queue stats
+ *     and the queue listeners report, PROXY_WOULD_BLOCK if the queue is full
+ *     and the data must be sent again later, FAIL if it can't be sent or the
+ *     proxy is stopping
+ */
+error_t proxy_sendPriority(const char *data, int len, proxy_priority_e priority) {
+  proxyqueue_result_e result;
 
-  if (len > 0) {
-    pthread_mutex_lock(&sProxyToServerMutex);
-    // Half-duplex pipe is protected for safety reasons on some deeply embedded platforms
-    bytesWritten = libpipecomm_write(sProxyToServerWriteFd, data, len);
-    pthread_mutex_unlock(&sProxyToServerMutex);
+  if (len > PROXY_MAX_MSG_LEN) {
+    SYSLOG_ERR("msg size is %d, max size = %d", len, PROXY_MAX_MSG_LEN);
+    return FAIL;
   }
 
-  return SUCCESS;
+  if (priority != PROXY_PRIORITY_HIGH) {
+    priority = PROXY_PRIORITY_BULK;
+  }
+
+  if (len <= 0) {
+    return SUCCESS;
+  }
+
+  // Counted before the check, so the last persist of the thread waits for this push
+  __sync_fetch_and_add(&sProducers, 1);
+  __sync_fetch_and_add(&sProducerBytes, len);
+  if (sStopping) {
+    __sync_fetch_and_sub(&sProducerBytes, len);
+    __sync_fetch_and_sub(&sProducers, 1);
+    SYSLOG_DEBUG("Refused %d bytes, the proxy is stopping", len);
+    return FAIL;
+  }
+
+  result = proxyqueue_push(&sProxyToServerQueues[priority], data, len);
+  __sync_fetch_and_sub(&sProducerBytes, len);
+  __sync_fetch_and_sub(&sProducers, 1);
+
+  switch (result) {
+  case PROXYQUEUE_QUEUED:
+    return SUCCESS;
+
+  case PROXYQUEUE_SHED:
+    SYSLOG_DEBUG("Dropped the oldest measurements for %d bytes", len);
+    return SUCCESS;
+
+  default:
+    SYSLOG_DEBUG("Refused %d bytes, the queue to the server is full", len);
+    return PROXY_WOULD_BLOCK;
+  }
 }
 
 
 /***************** Private Functions ****************/
 /**
- * Main thread function for server communication
+ * Main thread function for server communication. The thread sleeps in
+ * epoll_wait() until the clients write to the pipe, the server answers,
+ * a deadline expires or the proxy stops. A poll stays open on its own
+ * connection while the messages are pushed on another one.
  */
 static void *_serverCommThread(void *params) {
-  char msgFromServer[PROXY_MAX_MSG_LEN];
-  bool poll = true;
-  int msgLen = 0;
-  int forcedPushLoops = 0;
-  bool sentEmptyMsg = false;
+  struct epoll_event events[PROXY_MAX_EVENTS];
   CURLSH *curlHandle = NULL; // curl handle shared across connections for DNS caching
+  int count;
+  int i;
 
-  // Sleep briefly to obtain init messages from application
-  sleep(5);
+  sFilling = NULL;
+  sServerFailing = false;
 
-  // Initialize buffers, variables
-  bzero(msgFromServer, sizeof(msgFromServer));
-  bzero(sMsgToServer, sizeof(sMsgToServer));
-  sMsgToServerLen = 0;
+  // Initialize the DNS, SSL session and connection caches shared across connections
+  curlHandle = libhttpcomm_curlShareInit();
+  if (curlHandle == NULL) {
+    SYSLOG_WARNING("Couldn't create the shared curl caches, continuing without them");
+  }
 
-  // Initialize the shared curl library
-  libhttpcomm_curlShareInit(curlHandle);
+  // Pushes and polls go to the same server, so they share the same settings
+  sSession = libhttpcomm_sessionOpen(curlHandle);
+  sMulti = libhttpcomm_multiOpen(curlHandle, PROXY_MAX_HTTP_RECEIVE_MESSAGE_LEN);
+  if (sSession == NULL || sMulti == NULL || _serverCommOpenEvents() != SUCCESS
+      || !proxywindow_init(&sWindow, PROXYWINDOW_DEFAULT_SIZE)) {
+    SYSLOG_ERR("Couldn't set up the communication with the server");
+    goto out;
+  }
 
-  // Main loop
-  while (!gTerminate) {
-    sentEmptyMsg = false;
+  // Compress messages to the server to save on data, if the server supports it
+  if (proxyconfig_getCompressionDictionary()) {
+    libhttpcomm_sessionSetCompression(sSession, proxyconfig_getCompression(),
+        IOTGEN_COMPRESSION_DICTIONARY, sizeof(IOTGEN_COMPRESSION_DICTIONARY) - 1);
 
-    // Read until the pipe is empty or our buffer is full
-    msgLen = 0;
+  } else {
+    libhttpcomm_sessionSetCompression(sSession, proxyconfig_getCompression(), NULL, 0);
+  }
 
-    while (((sizeof(sMsgToServer) - sMsgToServerLen) >= PROXY_MAX_MSG_LEN)) {
-      pthread_mutex_lock(&sProxyToServerMutex);
-      msgLen = libpipecomm_read(sProxyToServerReadFd, sMsgToServer + sMsgToServerLen, sizeof(sMsgToServer) - sMsgToServerLen);
-      pthread_mutex_unlock(&sProxyToServerMutex);
+  libhttpcomm_multiSetWatcher(sMulti, _serverCommWatch, NULL);
 
-      if (msgLen > 0) {
-        sMsgToServerLen += msgLen;
+  // Give the application a moment to queue its init messages
+  sNotBeforeMs = _serverCommNow() + PROXY_STARTUP_DELAY_MS;
+  sPollClosedMs = 0;
+  sJournalStarted = false;
+  sReplaying = false;
+  _serverCommNext();
 
-      } else {
-        // pipe is empty or obtained an error reading it -> stop reading.
-        break;
-      }
-      usleep(2000);
+  // Main loop
+  while (!gTerminate) {
+    // Producers of this process only ring the doorbell when the thread may be asleep
+    if (sPipeWatched && (!proxyqueue_sleep(&sProxyToServerQueues[PROXY_PRIORITY_HIGH])
+        || !proxyqueue_sleep(&sProxyToServerQueues[PROXY_PRIORITY_BULK]))) {
+      _serverCommRead();
+      _serverCommNext();
+      continue;
     }
 
-    msgFromServer[0] = '\0';
-
-    if (sMsgToServerLen > 0) {
-      _serverCommPush(curlHandle, sMsgToServer, msgFromServer, sizeof(msgFromServer));
-      bzero(sMsgToServer, sizeof(sMsgToServer));
-      sMsgToServerLen = 0;
-
-    } else if (poll == false) {
-
-      /*
-       * CONT, or "Continuous Mode", is signaled from the cloud server when the
-       * detects a user is actively monitoring a UI.
-       *
-       * When in CONT mode, the router can't guarantee that a message will be
-       * pushed often. Here we send an empty message if none are sent, so that
-       * the server can send something to the UI. The persistent connection is
-       * effectively disabled. This is important especially
-       * when the use wants to control a device from the GUI and expects a quick
-       * response from the system.
-       */
-      _serverCommPush(curlHandle, (char *) "", msgFromServer, sizeof(msgFromServer));
-      sentEmptyMsg = true;
-    }
-
-
-    if(forcedPushLoops > 0) {
-      // Keep looping until we're out
-      forcedPushLoops--;
-    }
-
-    if (strlen(msgFromServer) > 0) {
-      msgFromServer[sizeof(msgFromServer) - 1] = '\0';
-
-      if(strstr(msgFromServer, "command") != NULL) {
-         /*
-         * We received a valid command from the server. Force the proxy to
-         * send updates for the next several iterations without waiting, as if
-         * we are handling a CONT request. Do not poll the server using GET.
-         */
-        poll = false;
-        forcedPushLoops = PROXY_MAX_PUSHES_ON_RECEIVED_COMMAND;
-
-      } else if (forcedPushLoops > 0) {
-        /**
-         * Keep looping as if we received a CONT
-         */
-        poll = false;
-
-      } else if (strstr(msgFromServer, "CONT") != NULL) {
-        /*
-         * When the server sends a CONT signal, it is telling the hub to close
-         * the persistent connection (which is the GET connection) and start
-         * POST'ing data often.
-         */
-        poll = false;
-
-      } else if (strstr(msgFromServer, "ACK") != NULL) {
-        /*
-         * When sending an ACK message, the server is telling the hub to open
-         * the persistent connection and only push when the connection times out
-         * or when pushing data becomes a priority.
-         */
-        poll = true;
-
-      }
-
-      proxylisteners_broadcast(msgFromServer, strlen(msgFromServer));
-
-      if (sentEmptyMsg == true) {
-        sleep(5);
+    // Also wakes up to force the new records of the journal to flash
+    count = epoll_wait(sEpollFd, events, PROXY_MAX_EVENTS, proxyjournal_syncTimeoutMs(&sJournal));
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
       }
+      SYSLOG_ERR("epoll_wait, %s", strerror(errno));
+      break;
     }
 
-    // Dedicated GET connection
-    if (poll == true) {
-      msgFromServer[0] = '\0';
-      // Only poll (GET) if the server wants you to.
-      _serverCommPoll(curlHandle, msgFromServer, sizeof(msgFromServer));
-
-      if (strlen(msgFromServer) > 0) {
-        msgFromServer[sizeof(msgFromServer) - 1] = '\0';
-        if (strstr(msgFromServer, "CONT") != NULL) {
-          poll = false;
+    for (i = 0; i < count && !gTerminate; i++) {
+      _serverCommEvent(events[i].data.fd, events[i].events);
+    }
 
-        } else if (strstr(msgFromServer, "ACK") != NULL) {
-          poll = true;
+    _serverCommNext();
+    proxyjournal_sync(&sJournal, false);
+  }
 
-        } else if(strstr(msgFromServer, "command") != NULL) {
-          poll = false;
-          forcedPushLoops = PROXY_MAX_PUSHES_ON_RECEIVED_COMMAND;
-        }
+out:
+  // Requests in flight complete with ECANCELED and leave their batch in the window
+  libhttpcomm_multiClose(sMulti);
+  sMulti = NULL;
+  libhttpcomm_sessionClose(sSession);
+  sSession = NULL;
+  libhttpcomm_curlShareClose(curlHandle);
 
-        proxylisteners_broadcast(msgFromServer, strlen(msgFromServer));
-      }
-    }
+  if (sStopping) {
+    _serverCommPersist();
   }
 
-  libhttpcomm_curlShareClose(curlHandle);
+  proxyjournal_close(&sJournal);
+  proxywindow_destroy(&sWindow);
+  sFilling = NULL;
+  _serverCommCloseEvents();
   SYSLOG_INFO("*** Exiting Proxy Thread ***");
   return NULL;
 }
 
-
 /**
- * Push message to the server
+ * Create the epoll instance of the thread and the timers it waits on, and
+ * watch the pipe from the clients and the wakeup descriptor
  *
- * @param curlHandle Curl handle shared across connection (mainly for DNS caching)
- * @param message Pointer to null-terminated message to send
- * @param messageLen length of the message
- * @param response pointer for storing message received by the server -> must exist
- * @param responseMaxLen max size of response in bytes.
- *
- * @return  none
+ * @return SUCCESS if the thread can wait for its events
  */
-static void _serverCommPush(CURLSH *curlHandle, char *message, char *response, int responseMaxLen) {
-  bool serverRetry = false;
-  int wrappedMessageLen = 0;
-  char wrappedMessage[PROXY_MAX_HTTP_SEND_MESSAGE_LEN];
-  char url[PATH_MAX];
-  int retries = 0;
-  http_param_t params;
-
-  assert(message);
-  assert(response);
-
-  bzero(wrappedMessage, sizeof(wrappedMessage));
+static error_t _serverCommOpenEvents() {
+  sEpollFd = epoll_create1(EPOLL_CLOEXEC);
+  sDeadlineFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  sCurlTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  if (sEpollFd < 0 || sDeadlineFd < 0 || sCurlTimerFd < 0) {
+    SYSLOG_ERR("Creating the events of the proxy thread, %s", strerror(errno));
+    return FAIL;
+  }
 
-  params.timeouts.connectTimeout = HTTPCOMM_DEFAULT_CONNECT_TIMEOUT_SEC;
-  params.timeouts.transferTimeout = HTTPCOMM_DEFAULT_TRANSFER_TIMEOUT_SEC;
-  params.verbose = false;
+  if (_serverCommCtl(EPOLL_CTL_ADD, sWakeupFd, EPOLLIN) != SUCCESS
+      || _serverCommCtl(EPOLL_CTL_ADD, sDeadlineFd, EPOLLIN) != SUCCESS
+      || _serverCommCtl(EPOLL_CTL_ADD, sCurlTimerFd, EPOLLIN) != SUCCESS
+      || _serverCommCtl(EPOLL_CTL_ADD, proxyqueue_getDoorbell(&sProxyToServerQueues[PROXY_PRIORITY_BULK]), EPOLLIN) != SUCCESS
+      || _serverCommCtl(EPOLL_CTL_ADD, proxyqueue_getDoorbell(&sProxyToServerQueues[PROXY_PRIORITY_HIGH]), EPOLLIN) != SUCCESS
+      || _serverCommCtl(EPOLL_CTL_ADD, sProxyToServerReadFd, EPOLLIN) != SUCCESS) {
+    return FAIL;
+  }
 
-  do {
-    if (serverRetry == true) {
-      retries++;
-      sleep(1);
-    }
+  sPipeWatched = true;
+  return SUCCESS;
+}
 
-    wrappedMessageLen = h2swrapper_wrap(wrappedMessage, message, sizeof(wrappedMessage));
+/**
+ * Close the epoll instance and the timers of the thread
+ */
+static void _serverCommCloseEvents() {
+  if (sCurlTimerFd >= 0) {
+    close(sCurlTimerFd);
+    sCurlTimerFd = -1;
+  }
 
-    SYSLOG_DEBUG("Wrapped: %s", wrappedMessage);
+  if (sDeadlineFd >= 0) {
+    close(sDeadlineFd);
+    sDeadlineFd = -1;
+  }
 
-    proxyconfig_getUrl(url, sizeof(url));
+  if (sEpollFd >= 0) {
+    close(sEpollFd);
+    sEpollFd = -1;
+  }
+}
 
-    SYSLOG_DEBUG("POST URL: %s", url);
+/**
+ * Add, change or remove a descriptor watched by the thread
+ *
+ * @param op EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+ * @param fd Descriptor
+ * @param events EPOLLIN and/or EPOLLOUT, 0 to keep it registered without waking up on it
+ * @return SUCCESS if epoll took the change
+ */
+static error_t _serverCommCtl(int op, int fd, uint32_t events) {
+  struct epoll_event event;
 
-    if (libhttpcomm_sendMsg(curlHandle, CURLOPT_POST, url,
-        proxyconfig_getCertificate(), proxyconfig_getActivationToken(), wrappedMessage,
-        wrappedMessageLen, response, responseMaxLen, params, NULL) == SUCCESS) {
+  bzero(&event, sizeof(event));
+  event.events = events;
+  event.data.fd = fd;
 
-       serverRetry = (strlen(response) == 0) || (strstr(response, "ERR") != NULL);
+  if (epoll_ctl(sEpollFd, op, fd, &event) < 0) {
+    SYSLOG_ERR("epoll_ctl(%d) on %d, %s", op, fd, strerror(errno));
+    return FAIL;
+  }
+  return SUCCESS;
+}
 
-       if(!serverRetry) {
-         SYSLOG_DEBUG("Send to server SUCCESS");
-       } else {
-         SYSLOG_DEBUG("Error sending to server: %s", response);
-       }
+/**
+ * Watches a socket of the requests to the server the way curl wants it
+ *
+ * @param fd Socket, or the wakeup descriptor of the engine
+ * @param what CURL_POLL_IN, CURL_POLL_OUT, CURL_POLL_INOUT or CURL_POLL_REMOVE
+ * @param userData Unused
+ */
+static void _serverCommWatch(int fd, int what, void *userData) {
+  struct epoll_event event;
+  uint32_t events = 0;
+
+  if (what == CURL_POLL_REMOVE) {
+    // curl may have closed the socket already, which removed it from epoll
+    epoll_ctl(sEpollFd, EPOLL_CTL_DEL, fd, &event);
+    return;
+  }
 
-    } else {
-      // Either the Internet or the server is down
-      // If the Internet is down, buffer messages and do not lose data
-      SYSLOG_DEBUG("Couldn't contact the server");
-      retries = 0;
-      serverRetry = true;
-    }
+  if (what & CURL_POLL_IN) {
+    events |= EPOLLIN;
+  }
 
-  } while (serverRetry == true && retries < PROXY_MAX_HTTP_RETRIES);
+  if (what & CURL_POLL_OUT) {
+    events |= EPOLLOUT;
+  }
 
+  bzero(&event, sizeof(event));
+  event.events = events;
+  event.data.fd = fd;
 
+  if (epoll_ctl(sEpollFd, EPOLL_CTL_MOD, fd, &event) < 0) {
+    if (errno != ENOENT || epoll_ctl(sEpollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      SYSLOG_ERR("Couldn't watch socket %d, %s", fd, strerror(errno));
+    }
+  }
 }
 
 /**
- * @brief   Polls server for new messages
- *
- * @param   curlHandle: curl handle shared across connections
- * @param   pollMsg: ptr for storing message received by the server -> must exist
- * @param   pollMsgMaxLen: max size of pollMsg in bytes.
+ * Handle one event of the thread
  *
- * @return  none
+ * @param fd Descriptor that is ready
+ * @param events EPOLL* events received on it
  */
-static void _serverCommPoll(CURLSH * curlHandle, char *pollMsg, int pollMsgMaxLen) {
-  int urlOffset = 0;
+static void _serverCommEvent(int fd, uint32_t events) {
+  uint64_t expirations;
+  int curlEvents = 0;
+
+  if (fd == sWakeupFd || fd == sDeadlineFd) {
+    // The main loop checks gTerminate and what to send next
+    while (read(fd, &expirations, sizeof(expirations)) > 0);
+
+    if (fd == sWakeupFd && sStopping && sPolling) {
+      // No command is taken while stopping, the poll would hold the thread until it times out
+      libhttpcomm_cancel(sMulti, &sPollRequest);
+    }
+
+  } else if (fd == sProxyToServerReadFd
+      || fd == proxyqueue_getDoorbell(&sProxyToServerQueues[PROXY_PRIORITY_BULK])
+      || fd == proxyqueue_getDoorbell(&sProxyToServerQueues[PROXY_PRIORITY_HIGH])) {
+    if (fd != sProxyToServerReadFd) {
+      proxyqueue_ackDoorbell(&sProxyToServerQueues[fd == proxyqueue_getDoorbell(&sProxyToServerQueues[PROXY_PRIORITY_HIGH])
+          ? PROXY_PRIORITY_HIGH : PROXY_PRIORITY_BULK]);
+    }
+
+    // The buffer must not change while it is pushed
+    if (sPipeWatched) {
+      _serverCommRead();
+    }
+
+  } else if (fd == sCurlTimerFd) {
+    while (read(fd, &expirations, sizeof(expirations)) > 0);
+    libhttpcomm_multiSocketAction(sMulti, CURL_SOCKET_TIMEOUT, 0);
+
+  } else {
+    if (events & EPOLLIN) {
+      curlEvents |= CURL_CSELECT_IN;
+    }
+
+    if (events & EPOLLOUT) {
+      curlEvents |= CURL_CSELECT_OUT;
+    }
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+      curlEvents |= CURL_CSELECT_ERR;
+    }
+
+    libhttpcomm_multiSocketAction(sMulti, fd, curlEvents);
+  }
+}
+
+/**
+ * Arm the timer of curl with the timeout of the requests in flight, if any
+ */
+static void _serverCommArmCurlTimer() {
+  struct itimerspec timer;
+  long timeoutMs = libhttpcomm_multiTimeout(sMulti);
+
+  bzero(&timer, sizeof(timer));
+
+  if (timeoutMs == 0) {
+    // Expired already: a zero it_value would disarm the timer
+    timer.it_value.tv_nsec = 1;
+
+  } else if (timeoutMs > 0) {
+    timer.it_value.tv_sec = timeoutMs / 1000;
+    timer.it_value.tv_nsec = (timeoutMs % 1000) * 1000000L;
+  }
+
+  timerfd_settime(sCurlTimerFd, 0, &timer, NULL);
+}
+
+/**
+ * Read the messages of the clients until the queues and the pipe are empty or
+ * our batch is full. High priority messages go ahead of the bulk already
+ * read. The buffers of the queued messages are moved to the batch, small
+ * messages are packed in its last buffer.
+ */
+static void _serverCommRead() {
+  proxybuffer_chain_t message;
+  int msgLen = 0;
+
+  if (sFilling == NULL && (sFilling = proxywindow_filling(&sWindow)) == NULL) {
+    // Every batch waits for the server, the messages wait in the queues
+    return;
+  }
+
+  while (_serverCommHasRoom()) {
+    msgLen = proxyqueue_popChain(&sProxyToServerQueues[PROXY_PRIORITY_HIGH], &message, PROXY_MAX_MSG_LEN);
+    if (msgLen <= 0) {
+      break;
+    }
+
+    if (proxywindow_length(sFilling) == 0) {
+      sBatchStartMs = _serverCommNow();
+    }
+
+    // After the high priority messages read before, in order
+    proxywindow_add(sFilling, &message, true);
+  }
+
+  while (_serverCommHasRoom()) {
+    msgLen = proxyqueue_popChain(&sProxyToServerQueues[PROXY_PRIORITY_BULK], &message, PROXY_MAX_MSG_LEN);
+    if (msgLen <= 0) {
+      msgLen = libpipecomm_read(sProxyToServerReadFd, sPipeMessage, sizeof(sPipeMessage));
+      if (msgLen > 0 && !proxybuffer_write(&sBufferPool, &message, sPipeMessage, msgLen)) {
+        SYSLOG_ERR("No buffer left for %d bytes from the pipe, dropped", msgLen);
+        continue;
+      }
+    }
+
+    if (msgLen > 0) {
+      if (proxywindow_length(sFilling) == 0) {
+        sBatchStartMs = _serverCommNow();
+      }
+      proxywindow_add(sFilling, &message, false);
+
+    } else {
+      // queue and pipe are empty or obtained an error reading it -> stop reading.
+      break;
+    }
+  }
+}
+
+/**
+ * Only wake up on the queue and the pipe when their messages can be read into a batch
+ */
+static void _serverCommWatchPipe() {
+  bool watch = _serverCommHasRoom();
+
+  if (watch != sPipeWatched
+      && _serverCommCtl(EPOLL_CTL_MOD, sProxyToServerReadFd, watch ? EPOLLIN : 0) == SUCCESS) {
+    sPipeWatched = watch;
+  }
+}
+
+/**
+ * @return true if the batch being filled can take the longest message, in
+ *     bytes and in buffers
+ */
+static bool _serverCommHasRoom() {
+  return sFilling != NULL
+      && proxywindow_length(sFilling) + PROXY_MAX_MSG_LEN <= _serverCommBatchCap()
+      && proxywindow_buffers(sFilling) + PROXY_MAX_MSG_BUFFERS <= PROXY_MAX_BATCH_BUFFERS;
+}
+
+/**
+ * Batches grow past PROXY_MAX_HTTP_SEND_MESSAGE_LEN while the link is good,
+ * pushes taking less than the linger without failing, so a backlog goes out
+ * in fewer requests
+ *
+ * @return the largest batch in bytes
+ */
+static int _serverCommBatchCap() {
+  if (!sServerFailing && sPushLatencyMs > 0 && sPushLatencyMs < proxyconfig_getBatchLingerMs()
+      && proxyretry_getState(&sServerRetry) == PROXYRETRY_CLOSED) {
+    return PROXY_MAX_FAST_SEND_MESSAGE_LEN;
+  }
+
+  return PROXY_MAX_HTTP_SEND_MESSAGE_LEN;
+}
+
+/**
+ * Seal the batch being filled once its time has come, push the batches of
+ * the window waiting for it, and open a poll if the server wants one and
+ * none is open. Otherwise arm the deadline timer for when they will be sent.
+ */
+static void _serverCommNext() {
+  unsigned long long now;
+  unsigned long long sendAtMs;
+  unsigned long long wakeAtMs = 0;
+  struct itimerspec timer;
+  proxywindow_batch_t *batch;
+
+  bool replay;
+  bool emptyPush;
+
+  now = _serverCommNow();
+
+  if (!sJournalStarted && now >= sNotBeforeMs && !gTerminate) {
+    _serverCommOpenJournal();
+  }
+
+  if (!gTerminate) {
+    // Stopping flushes the messages right away, without waiting for the startup delay or the linger
+    sendAtMs = sStopping ? now : sNotBeforeMs;
+
+    _serverCommRead();
+
+    if (sFilling != NULL && proxyretry_getState(&sServerRetry) == PROXYRETRY_OPEN && !_serverCommHasRoom()) {
+      // The server is unreachable: make room for the next messages
+      _serverCommSpill();
+      _serverCommRead();
+    }
+
+    // Once the server is healthy, the journal is replayed at its own pace, after the live messages
+    replay = !sStopping && sFilling != NULL && proxywindow_length(sFilling) == 0 && !sReplaying && !proxywindow_hasPending(&sWindow)
+        && !proxyjournal_isEmpty(&sJournal) && proxyretry_getState(&sServerRetry) == PROXYRETRY_CLOSED;
+    if (replay && sendAtMs < now + proxyjournal_replayDelayMs(&sJournal)) {
+      sendAtMs = now + proxyjournal_replayDelayMs(&sJournal);
+    }
+
+    if (!sStopping && sFilling != NULL && sFilling->bulk.length > 0 && sFilling->urgent.length == 0
+        && sFilling->bulk.length < proxyconfig_getBatchBytes() && _serverCommHasRoom()
+        && sendAtMs < sBatchStartMs + _serverCommLingerMs()) {
+      // Lingers for more messages to share the push, until enough bytes or a high priority message are ready
+      sendAtMs = sBatchStartMs + _serverCommLingerMs();
+    }
+
+    /*
+     * CONT, or "Continuous Mode", is signaled from the cloud server when the
+     * detects a user is actively monitoring a UI.
+     *
+     * When in CONT mode, the router can't guarantee that a message will be
+     * pushed often. Here we send an empty message if none are sent, so that
+     * the server can send something to the UI. The persistent connection is
+     * effectively disabled. This is important especially
+     * when the use wants to control a device from the GUI and expects a quick
+     * response from the system.
+     */
+    emptyPush = !sStopping && sFilling != NULL && proxywindow_length(sFilling) == 0 && !sPoll && !replay
+        && proxywindow_inFlight(&sWindow) == 0 && !proxywindow_hasPending(&sWindow);
+    if (emptyPush && sNextEmptyPushMs > sendAtMs) {
+      // Empty messages are only pushed every few seconds in CONT mode
+      sendAtMs = sNextEmptyPushMs;
+    }
+
+    if (replay || emptyPush || (sFilling != NULL && proxywindow_length(sFilling) > 0)) {
+      if (sendAtMs <= now && !_serverCommProbing() && proxyretry_delayMs(&sServerRetry) == 0) {
+        if (replay) {
+          _serverCommReplay();
+        }
+
+        if (proxywindow_length(sFilling) > 0 || emptyPush) {
+          // The sequence number is kept if the batch has to be sent again
+          sPushes[proxywindow_index(&sWindow, sFilling)].batchStartMs = sFilling->journaled ? 0 : sBatchStartMs;
+          proxywindow_seal(&sWindow, sFilling, h2swrapper_nextSeq());
+          sFilling = NULL;
+        }
+
+      } else if (!_serverCommProbing()) {
+        // Waits out the startup delay, the linger, the CONT or replay pacing, or the backoff and open circuit left by the last failures
+        wakeAtMs = sendAtMs;
+      }
+    }
+
+    // Several batches in flight while the server is healthy, the ones sent again first
+    while (!_serverCommProbing() && proxyretry_delayMs(&sServerRetry) == 0 && (batch = proxywindow_send(&sWindow)) != NULL) {
+      if (!_serverCommPush(batch)) {
+        break;
+      }
+    }
+
+    if (proxywindow_hasPending(&sWindow) && !_serverCommProbing()) {
+      // Pushed once the backoff is over
+      wakeAtMs = now;
+    }
+
+    if (sStopping) {
+      if (_serverCommFlushed()) {
+        gTerminate = true;
+
+      } else if (now >= sStopAtMs || proxyretry_getState(&sServerRetry) == PROXYRETRY_OPEN
+          || now + proxyretry_delayMs(&sServerRetry) >= sStopAtMs) {
+        // Journaled rather than waiting for the server past the deadline
+        sShutdownStats.timedOut = now >= sStopAtMs;
+        gTerminate = true;
+
+      } else if (wakeAtMs == 0 || sStopAtMs < wakeAtMs) {
+        wakeAtMs = sStopAtMs;
+      }
+    }
+  }
+
+  if (sPoll && !sPolling && !gTerminate && !sStopping) {
+    // Dedicated GET connection, kept open whatever the pushes do
+    if (now >= sNotBeforeMs && !_serverCommProbing() && proxyretry_delayMs(&sServerRetry) == 0) {
+      _serverCommPoll();
+    }
+
+    // Opened once the probe went through otherwise
+    if (!sPolling && !_serverCommProbing() && (wakeAtMs == 0 || sNotBeforeMs < wakeAtMs)) {
+      wakeAtMs = sNotBeforeMs;
+    }
+  }
+
+  if (wakeAtMs > 0) {
+    if (wakeAtMs < now + proxyretry_delayMs(&sServerRetry)) {
+      wakeAtMs = now + proxyretry_delayMs(&sServerRetry);
+    }
+
+    bzero(&timer, sizeof(timer));
+    timer.it_value.tv_sec = wakeAtMs / 1000;
+    timer.it_value.tv_nsec = (wakeAtMs % 1000) * 1000000L + 1;
+    timerfd_settime(sDeadlineFd, TFD_TIMER_ABSTIME, &timer, NULL);
+  }
+
+  _serverCommWatchPipe();
+  _serverCommArmCurlTimer();
+}
+
+/**
+ * How long a message waits for others before it is pushed. A user watching
+ * in CONT mode gets a short linger, while a slow link lingers for as long as
+ * a push takes, up to a few times the configured linger, since each push
+ * then costs more.
+ *
+ * @return the linger in ms
+ */
+static unsigned int _serverCommLingerMs() {
+  unsigned int lingerMs = proxyconfig_getBatchLingerMs();
+
+  if (!sPoll) {
+    return lingerMs / PROXY_CONT_LINGER_DIVISOR;
+  }
+
+  if (sPushLatencyMs > lingerMs) {
+    lingerMs = sPushLatencyMs < lingerMs * PROXY_MAX_LINGER_FACTOR ? sPushLatencyMs : lingerMs * PROXY_MAX_LINGER_FACTOR;
+  }
+
+  return lingerMs;
+}
+
+/**
+ * While the server fails, the request in flight is the only probe, so each
+ * outage counts once against the circuit breaker
+ *
+ * @return true if no other request may be sent
+ */
+static bool _serverCommProbing() {
+  return sServerFailing && proxywindow_inFlight(&sWindow) > 0;
+}
+
+/**
+ * Open the journal, unless it is disabled. Records left by the previous run
+ * are replayed once the server is reachable.
+ */
+static void _serverCommOpenJournal() {
+  char dir[PATH_MAX];
+
+  sJournalStarted = true;
+  proxyconfig_getJournalDir(dir, sizeof(dir));
+
+  if (dir[0] != '\0' && !proxyjournal_open(&sJournal, dir)) {
+    SYSLOG_WARNING("No journal in %s, messages will be lost while the server is unreachable", dir);
+  }
+}
+
+/**
+ * Move the messages of the batch being filled to the journal while the server
+ * is unreachable. They stay in memory if the journal is disabled or broken,
+ * like the batches already sealed, which keep their sequence number.
+ */
+static void _serverCommSpill() {
+  struct iovec segments[PROXY_MAX_BATCH_BUFFERS];
+  int count;
+
+  if (sFilling == NULL || sFilling->bulk.length == 0) {
+    return;
+  }
+
+  // High priority messages stay in memory, to be the first ones sent once the server is back
+  count = proxybuffer_segments(&sFilling->bulk, segments, PROXY_MAX_BATCH_BUFFERS);
+  if (count > 0 && proxyjournal_appendv(&sJournal, segments, count)) {
+    SYSLOG_DEBUG("Journaled %u bytes to the server", sFilling->bulk.length);
+    proxybuffer_clear(&sFilling->bulk);
+  }
+}
+
+/**
+ * Read the oldest record of the journal into the empty batch being filled,
+ * in buffers of the pool
+ */
+static void _serverCommReplay() {
+  struct iovec segments[PROXY_MAX_BATCH_BUFFERS];
+  int count;
+  int length = 0;
+
+  // Records are at most a batch, the buffers past the record go back to the pool
+  if (!proxybuffer_extend(&sBufferPool, &sFilling->bulk, PROXY_MAX_FAST_SEND_MESSAGE_LEN)) {
+    SYSLOG_WARNING("No buffer left to replay the journal");
+    return;
+  }
+
+  count = proxybuffer_segments(&sFilling->bulk, segments, PROXY_MAX_BATCH_BUFFERS);
+  if (count > 0) {
+    length = proxyjournal_peekv(&sJournal, segments, count);
+  }
+
+  proxybuffer_truncate(&sFilling->bulk, length);
+  sFilling->journaled = sReplaying = length > 0;
+}
+
+/**
+ * @return true once the server acknowledged every message read, and the
+ *     queues and the pipe are empty
+ */
+static bool _serverCommFlushed() {
+  return sFilling != NULL && proxywindow_length(sFilling) == 0
+      && proxywindow_inFlight(&sWindow) == 0 && !proxywindow_hasPending(&sWindow)
+      && proxyqueue_length(&sProxyToServerQueues[PROXY_PRIORITY_HIGH]) == 0
+      && proxyqueue_length(&sProxyToServerQueues[PROXY_PRIORITY_BULK]) == 0;
+}
+
+/**
+ * Journal the messages the server didn't acknowledge before the proxy
+ * stopped, for the next run to send them: the sealed batches the oldest
+ * first, then the batch being filled and the messages left in the queues and
+ * the pipe. The server may have taken the batches that were in flight, they
+ * are sent again.
+ */
+static void _serverCommPersist() {
+  proxywindow_batch_t *batch;
+
+  if (!sJournalStarted) {
+    _serverCommOpenJournal();
+  }
+
+  // The producers that didn't see sStopping finish their push before the queues are read for the last time
+  if (!_proxyWaitProducers(sStopAtMs)) {
+    SYSLOG_ERR("Lost %ld bytes of %d producers still pushing at the deadline", sProducerBytes, sProducers);
+    sShutdownStats.lostBytes += sProducerBytes;
+  }
+
+  while ((batch = proxywindow_oldest(&sWindow)) != NULL) {
+    // A record replayed from the journal is still there
+    if (!batch->journaled) {
+      _serverCommPersistBatch(batch);
+    }
+    proxywindow_release(&sWindow, batch);
+  }
+
+  do {
+    _serverCommRead();
+    if (sFilling == NULL || proxywindow_length(sFilling) == 0) {
+      break;
+    }
+
+    _serverCommPersistBatch(sFilling);
+    proxybuffer_clear(&sFilling->urgent);
+    proxybuffer_clear(&sFilling->bulk);
+  } while (true);
+}
+
+/**
+ * Write the messages of a batch to the journal as one record, the high
+ * priority ones first
+ *
+ * @param batch Batch of the window
+ */
+static void _serverCommPersistBatch(proxywindow_batch_t *batch) {
+  struct iovec segments[PROXY_MAX_BATCH_BUFFERS];
+  int length = proxywindow_length(batch);
+  int count;
+
+  if (length == 0) {
+    return;
+  }
+
+  count = proxywindow_segments(batch, segments, PROXY_MAX_BATCH_BUFFERS);
+  if (count > 0 && proxyjournal_appendv(&sJournal, segments, count)) {
+    sShutdownStats.persistedBytes += length;
+
+  } else {
+    SYSLOG_ERR("Lost %d bytes to the server, the journal couldn't take them", length);
+    sShutdownStats.lostBytes += length;
+  }
+}
+
+/**
+ * Push a batch of the window to the server
+ *
+ * @param batch Batch now in flight, sent from where it is between the header and the footer
+ * @return true if the push is in flight, false if it goes back to the window or was dropped
+ */
+static bool _serverCommPush(proxywindow_batch_t *batch) {
+  servercomm_push_t *push = &sPushes[proxywindow_index(&sWindow, batch)];
+  int wrappedMessageLen = 0;
+  char url[PATH_MAX];
+  int count;
+  int result;
+
+  // The buffers of the batch are sent where they are, between the header and the footer
+  count = proxywindow_segments(batch, push->segments + 1, PROXY_MAX_BATCH_BUFFERS) + H2SWRAPPER_SEGMENTS;
+  wrappedMessageLen = h2swrapper_wrapv(push->segments, count, push->header, sizeof(push->header), batch->seq);
+
+  SYSLOG_DEBUG("Wrapped: %s (%d bytes, sent %d times)", push->header, wrappedMessageLen, batch->sends);
+
+  proxyconfig_getUrl(url, sizeof(url));
+
+  SYSLOG_DEBUG("POST URL: %s", url);
+
+  bzero(&push->request, sizeof(push->request));
+  push->request.httpMethod = CURLOPT_POST;
+  push->request.url = url;
+  push->request.sslCertPath = proxyconfig_getCertificate();
+  push->request.authToken = proxyconfig_getActivationToken();
+  push->request.params.timeouts.connectTimeout = HTTPCOMM_DEFAULT_CONNECT_TIMEOUT_SEC;
+  push->request.params.timeouts.transferTimeout = HTTPCOMM_DEFAULT_TRANSFER_TIMEOUT_SEC;
+  push->request.params.verbose = false;
+  push->request.segments = push->segments;
+  push->request.segmentCount = count;
+  push->request.session = sSession;
+  push->request.sink = _serverCommStream;
+  push->request.sinkUserData = &push->request;
+
+  result = libhttpcomm_submit(sMulti, &push->request, _serverCommPushed, batch);
+  if (result != SUCCESS) {
+    SYSLOG_ERR("Couldn't push to the server, %s", strerror(result));
+    sServerFailing = true;
+
+    if (proxyretry_onFailure(&sServerRetry, result)) {
+      proxywindow_retry(&sWindow, batch);
+
+    } else {
+      SYSLOG_ERR("Dropping the message to the server");
+      _serverCommForget(batch, false);
+    }
+    return false;
+  }
+
+  push->startMs = _serverCommNow();
+  return true;
+}
+
+/**
+ * A push to the server is over. The batch is sent again with the same
+ * sequence number after a backoff until the server acknowledges it or
+ * refused it too many times, then the response tells whether to poll or to
+ * keep pushing.
+ *
+ * @param result 0 if the server answered, errno value otherwise
+ * @param response Response of the server
+ * @param userData Batch pushed
+ */
+static void _serverCommPushed(int result, http_rxbuffer_t *response, void *userData) {
+  proxywindow_batch_t *batch = userData;
+  servercomm_push_t *push = &sPushes[proxywindow_index(&sWindow, batch)];
+  proxyresponse_t classified;
+  unsigned int deliveryMs;
+  bool empty = proxywindow_length(batch) == 0;
+
+  if (result == ECANCELED) {
+    // The proxy is stopping
+    _serverCommStreamEnd(&push->request, response, false);
+    return;
+  }
+
+  // Only scanned once, then handed to the listeners
+  proxyresponse_classify(&classified, response->buffer, response->length);
+
+  if (result == SUCCESS) {
+    _serverCommStreamEnd(&push->request, response, true);
+
+    if (response->length > 0 && classified.status != PROXYRESPONSE_STATUS_ERR) {
+      SYSLOG_DEBUG("Send to server SUCCESS");
+      proxyretry_onSuccess(&sServerRetry);
+      sServerFailing = false;
+
+      // Empty pushes in CONT mode don't say much about the link
+      if (!empty) {
+        sPushLatencyMs = (sPushLatencyMs * 3 + (unsigned int) (_serverCommNow() - push->startMs)) / 4;
+      }
+
+      // The time a replayed message spent in the journal isn't known
+      if (!empty && push->batchStartMs > 0) {
+        deliveryMs = (unsigned int) (_serverCommNow() - push->batchStartMs);
+
+        pthread_mutex_lock(&sDeliveryMutex);
+        sDeliveryStats.pushes++;
+        sDeliveryStats.upstreamTotalMs += deliveryMs;
+        if (deliveryMs > sDeliveryStats.upstreamMaxMs) {
+          sDeliveryStats.upstreamMaxMs = deliveryMs;
+        }
+        pthread_mutex_unlock(&sDeliveryMutex);
+      }
+
+      _serverCommForget(batch, true);
+
+    } else if (++batch->rejections < PROXY_MAX_HTTP_RETRIES) {
+      // The server refuses the message, it only gets a few more chances
+      SYSLOG_DEBUG("Error sending to server: %s", response->buffer);
+      result = EPROTO;
+
+    } else {
+      SYSLOG_DEBUG("Error sending to server: %s", response->buffer);
+      SYSLOG_ERR("Dropping the message to the server");
+      _serverCommForget(batch, false);
+    }
+
+  } else {
+    // Either the Internet or the server is down
+    // If the Internet is down, buffer messages and do not lose data
+    SYSLOG_DEBUG("Couldn't contact the server");
+    _serverCommStreamEnd(&push->request, response, false);
+  }
+
+  if (result != SUCCESS) {
+    sServerFailing = true;
+
+    if (proxyretry_onFailure(&sServerRetry, result)) {
+      // Sent again alone once the backoff is over, the server drops it if it got it already
+      SYSLOG_DEBUG("Batch %u not acknowledged", batch->seq);
+      proxywindow_retry(&sWindow, batch);
+      return;
+    }
+
+    SYSLOG_ERR("Dropping the message to the server");
+    _serverCommForget(batch, false);
+  }
+
+  if (response->length > 0) {
+    /*
+     * A command from the server no longer stops the polls: the result is
+     * pushed right away next to the poll, which stays open for the next
+     * commands.
+     */
+    if (classified.status == PROXYRESPONSE_STATUS_CONT) {
+      /*
+       * When the server sends a CONT signal, it is telling the hub to close
+       * the persistent connection (which is the GET connection) and start
+       * POST'ing data often.
+       */
+      sPoll = false;
+
+      if (sPolling) {
+        libhttpcomm_cancel(sMulti, &sPollRequest);
+      }
+
+    } else if (classified.status == PROXYRESPONSE_STATUS_ACK) {
+      /*
+       * When sending an ACK message, the server is telling the hub to open
+       * the persistent connection and only push when the connection times out
+       * or when pushing data becomes a priority.
+       */
+      sPoll = true;
+    }
+
+    _serverCommPollClosed();
+    _serverCommCountCommands(&classified, true);
+    _serverCommBroadcast(response, &classified);
+
+    if (empty) {
+      sNextEmptyPushMs = _serverCommNow() + PROXY_CONTINUOUS_PUSH_INTERVAL_MS;
+    }
+  }
+}
+
+/**
+ * Remove a batch from the window once the server acknowledged it or it was
+ * given up on, and from the journal if it was replayed from there
+ *
+ * @param batch Batch of the window
+ * @param acknowledged true if the server took it
+ */
+static void _serverCommForget(proxywindow_batch_t *batch, bool acknowledged) {
+  if (sStopping && acknowledged) {
+    sShutdownStats.flushedBytes += proxywindow_length(batch);
+
+  } else if (sStopping) {
+    sShutdownStats.lostBytes += proxywindow_length(batch);
+  }
+
+  if (batch->journaled) {
+    proxyjournal_ack(&sJournal);
+    sReplaying = false;
+  }
+
+  if (acknowledged) {
+    proxywindow_ack(&sWindow, batch);
+
+  } else {
+    proxywindow_drop(&sWindow, batch);
+  }
+}
+
+/**
+ * @brief   Polls server for new messages
+ *
+ * @return  none
+ */
+static void _serverCommPoll() {
+  int urlOffset = 0;
+  int result;
+  unsigned int gapMs;
   char url[PATH_MAX];
   char tempUrl[PATH_MAX];
   char localAddress[EUI64_STRING_SIZE];
-  http_param_t params;
 
   eui64_toString(localAddress, sizeof(localAddress));
 
   proxyconfig_getUrl(tempUrl, sizeof(tempUrl));
 
-  params.timeouts.connectTimeout = HTTPCOMM_DEFAULT_CONNECT_TIMEOUT_SEC;
-  params.timeouts.transferTimeout = proxyconfig_getUploadIntervalSec();
-  params.verbose = false;
+  bzero(&sPollRequest, sizeof(sPollRequest));
+  sPollRequest.params.timeouts.connectTimeout = HTTPCOMM_DEFAULT_CONNECT_TIMEOUT_SEC;
+  sPollRequest.params.timeouts.transferTimeout = proxyconfig_getUploadIntervalSec();
+  sPollRequest.params.verbose = false;
 
   snprintf(url + urlOffset, sizeof(url) - urlOffset, "%s?id=%s&timeout=%lu",
-      tempUrl, localAddress, params.timeouts.transferTimeout);
+      tempUrl, localAddress, sPollRequest.params.timeouts.transferTimeout);
 
   // 30-second buffer to let server notify the timeout
-  params.timeouts.transferTimeout += 30;
+  sPollRequest.params.timeouts.transferTimeout += 30;
 
   SYSLOG_DEBUG("GET URL: %s", url);
 
-  if (libhttpcomm_sendMsg(curlHandle, CURLOPT_HTTPGET, url,
-      proxyconfig_getCertificate(), proxyconfig_getActivationToken(), NULL, 0, pollMsg, pollMsgMaxLen,
-      params, _httpProgressCallback) == false) {
-    sleep(1);
+  sPollRequest.httpMethod = CURLOPT_HTTPGET;
+  sPollRequest.url = url;
+  sPollRequest.sslCertPath = proxyconfig_getCertificate();
+  sPollRequest.authToken = proxyconfig_getActivationToken();
+  sPollRequest.session = sSession;
+  sPollRequest.sink = _serverCommStream;
+  sPollRequest.sinkUserData = &sPollRequest;
+
+  result = libhttpcomm_submit(sMulti, &sPollRequest, _serverCommPolled, &sPollRequest);
+  if (result != SUCCESS) {
+    SYSLOG_ERR("Couldn't poll the server, %s", strerror(result));
+    sServerFailing = true;
+    proxyretry_onFailure(&sServerRetry, result);
+    return;
+  }
+
+  sPolling = true;
+
+  if (sPollClosedMs > 0) {
+    gapMs = (unsigned int) (_serverCommNow() - sPollClosedMs);
+    sPollClosedMs = 0;
+
+    pthread_mutex_lock(&sDeliveryMutex);
+    sDeliveryStats.pollGapTotalMs += gapMs;
+    if (gapMs > sDeliveryStats.pollGapMaxMs) {
+      sDeliveryStats.pollGapMaxMs = gapMs;
+    }
+    pthread_mutex_unlock(&sDeliveryMutex);
+  }
+}
+
+/**
+ * A poll of the server is over: hand its message to the listeners
+ *
+ * @param result 0 if the server answered, errno value otherwise
+ * @param response Response of the server
+ * @param userData Unused
+ */
+static void _serverCommPolled(int result, http_rxbuffer_t *response, void *userData) {
+  static int count = 0;
+  proxyresponse_t classified;
+
+  sPolling = false;
+
+  if (result == SUCCESS) {
+    _serverCommStreamEnd(&sPollRequest, response, true);
+    proxyretry_onSuccess(&sServerRetry);
+    sServerFailing = false;
+
+    // Periodic "Connected to server" notifications...
+    if ((count++) >= PROXY_NUM_SERVER_CONNECTIONS_BEFORE_SYSLOG_NOTIFICATION) {
+      count = 0;
+      SYSLOG_DEBUG("Connected to server");
+    }
+
+  } else {
+    _serverCommStreamEnd(&sPollRequest, response, false);
+
+    // EAGAIN is the server timing out the poll, ECANCELED a CONT closing it or the proxy stopping
+    if (result != EAGAIN && result != ECANCELED) {
+      sServerFailing = true;
+      proxyretry_onFailure(&sServerRetry, result);
+    }
+  }
+
+  if (response->length > 0) {
+    proxyresponse_classify(&classified, response->buffer, response->length);
+
+    if (classified.status == PROXYRESPONSE_STATUS_CONT) {
+      sPoll = false;
+
+    } else if (classified.status == PROXYRESPONSE_STATUS_ACK) {
+      sPoll = true;
+    }
+
+    _serverCommPollClosed();
+    _serverCommCountCommands(&classified, false);
+    _serverCommBroadcast(response, &classified);
+
+  } else {
+    _serverCommPollClosed();
   }
 }
 
+/**
+ * @return the monotonic time in ms
+ */
+static unsigned long long _serverCommNow() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
 /**
- * Monitors whether the push pipe is getting full.  If it is, we stop the GET
- * operation and starting pushing.
+ * Hands each chunk of a message from the server to the stream listeners as
+ * it is received. The stream listeners get one message at a time: a message
+ * arriving on the other request meanwhile is handed to them once received.
  *
- * @param See Curl progress callback documentation
+ * @param data Next chunk of the message
+ * @param length Length of the chunk
+ * @param userData Request receiving the message
+ * @return 0 to go on receiving the message
+ */
+static int _serverCommStream(const char *data, size_t length, void *userData) {
+  if (sStreamOwner != userData) {
+    // Only XML is streamed, not the 1-character time-out message
+    if (sStreamDeferred == userData || memchr(data, '<', length) == NULL) {
+      return 0;
+    }
+
+    if (sStreamOwner != NULL) {
+      sStreamDeferred = userData;
+      return 0;
+    }
+
+    sStreamOwner = userData;
+    proxylisteners_streamBroadcast(PROXYSTREAM_BEGIN, NULL, 0);
+  }
+
+  proxylisteners_streamBroadcast(PROXYSTREAM_DATA, data, length);
+  return 0;
+}
+
+/**
+ * Tells the stream listeners the message being received on a request is
+ * over, or hands them the whole message if it waited for another one
  *
- * @return True to close the connection, false to take no action and keep it open
+ * @param request Request whose message is over
+ * @param response Message received on it
+ * @param complete true if the whole message was received
  */
-int _httpProgressCallback(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow) {
-  int msgLen = 0;
-  struct timeval curTime;
-  static unsigned int lastTimeoutTime = 0;
-  static int count = 0;
+static void _serverCommStreamEnd(http_request_t *request, http_rxbuffer_t *response, bool complete) {
+  if (sStreamOwner == request) {
+    sStreamOwner = NULL;
+    proxylisteners_streamBroadcast(complete ? PROXYSTREAM_END : PROXYSTREAM_ABORT, NULL, 0);
+
+  } else if (sStreamDeferred == request) {
+    sStreamDeferred = NULL;
+
+    if (complete && !response->truncated) {
+      proxylisteners_streamBroadcast(PROXYSTREAM_BEGIN, NULL, 0);
+      proxylisteners_streamBroadcast(PROXYSTREAM_DATA, response->buffer, response->length);
+      proxylisteners_streamBroadcast(PROXYSTREAM_END, NULL, 0);
+
+    } else if (complete) {
+      SYSLOG_WARNING("Message larger than %d bytes lost, it arrived while another one was streamed",
+          PROXY_MAX_HTTP_RECEIVE_MESSAGE_LEN);
+    }
+  }
+}
+
+/**
+ * Starts counting the time no poll is open while the server wants one,
+ * since a command the server queues meanwhile waits for the next poll
+ */
+static void _serverCommPollClosed() {
+  if (!sPoll) {
+    sPollClosedMs = 0;
 
-  // Periodic "Connected to server" notifications...
-  if ((count++) >= PROXY_NUM_SERVER_CONNECTIONS_BEFORE_SYSLOG_NOTIFICATION) {
-    count = 0;
-    SYSLOG_DEBUG("Connected to server");
+  } else if (!sPolling && sPollClosedMs == 0) {
+    sPollClosedMs = _serverCommNow();
   }
+}
 
-  while (((sizeof(sMsgToServer) - sMsgToServerLen) >= PROXY_MAX_MSG_LEN)) {
-    pthread_mutex_lock(&sProxyToServerMutex);
-    msgLen = libpipecomm_read(sProxyToServerReadFd, sMsgToServer + sMsgToServerLen, sizeof(sMsgToServer) - sMsgToServerLen);
-    pthread_mutex_unlock(&sProxyToServerMutex);
+/**
+ * Counts the commands received from the server
+ *
+ * @param classified What the message of the server holds
+ * @param onPush true if it answered a push rather than a poll
+ */
+static void _serverCommCountCommands(const proxyresponse_t *classified, bool onPush) {
+  if (classified->commandCount == 0) {
+    return;
+  }
 
-    if (msgLen > 0) {
-      sMsgToServerLen += msgLen;
-      SYSLOG_DEBUG("Read %d bytes", msgLen);
-      SYSLOG_DEBUG("Message to the server length = %d bytes", sMsgToServerLen);
+  pthread_mutex_lock(&sDeliveryMutex);
+  sDeliveryStats.commands += classified->commandCount;
+  if (onPush) {
+    sDeliveryStats.commandsOnPush += classified->commandCount;
+  }
+  pthread_mutex_unlock(&sDeliveryMutex);
+}
 
-    } else {
-      // Pipe is empty or had an error reading it... stop reading.
-      break;
+/**
+ * Broadcasts a whole message from the server to the listeners. A message too
+ * large for the buffer only reached the stream listeners.
+ *
+ * @param msgFromServer Message received from the server
+ * @param classified What the message holds
+ */
+static void _serverCommBroadcast(http_rxbuffer_t *msgFromServer, const proxyresponse_t *classified) {
+  if (msgFromServer->truncated) {
+    SYSLOG_WARNING("Message larger than %d bytes only sent to the stream listeners",
+        PROXY_MAX_HTTP_RECEIVE_MESSAGE_LEN);
+    return;
+  }
+
+  proxylisteners_broadcastResponse(msgFromServer->buffer, msgFromServer->length, classified);
+}
+
+
+/**
+ * Tells the priority of a message from its first tag: command results,
+ * alerts and new devices are the ones a user waits for.
+ *
+ * @param data Message to the server
+ * @param len Length of the message
+ * @return the priority of the message
+ */
+static proxy_priority_e _proxyPriorityOf(const char *data, int len) {
+  int tagLen;
+  int i;
+
+  while (len > 0 && isspace((unsigned char) *data)) {
+    data++;
+    len--;
+  }
+
+  if (len < 2 || data[0] != '<') {
+    return PROXY_PRIORITY_BULK;
+  }
+
+  for (i = 0; i < (int) (sizeof(sUrgentTags) / sizeof(sUrgentTags[0])); i++) {
+    tagLen = strlen(sUrgentTags[i]);
+    if (len > tagLen + 1 && strncmp(data + 1, sUrgentTags[i], tagLen) == 0
+        && (isspace((unsigned char) data[tagLen + 1]) || data[tagLen + 1] == '/' || data[tagLen + 1] == '>')) {
+      return PROXY_PRIORITY_HIGH;
     }
-    usleep(2000);
   }
 
-  gettimeofday(&curTime, NULL);
+  return PROXY_PRIORITY_BULK;
+}
 
-  if ((sizeof(sMsgToServer) - sMsgToServerLen) < PROXY_MAX_MSG_LEN) {
-    if (((unsigned int) curTime.tv_sec - lastTimeoutTime) > HTTPCOMM_DEFAULT_CONNECT_TIMEOUT_SEC) {
-      lastTimeoutTime = (unsigned int) curTime.tv_sec;
-      SYSLOG_DEBUG("Pipe is getting full -> need to push the data to the server");
-      return true; // return non-zero to close the GET connection and start pushing the data
-    } else {
-      SYSLOG_WARNING("Waiting for minimum timeout of %u sec to occur", (unsigned int) HTTPCOMM_DEFAULT_CONNECT_TIMEOUT_SEC);
+/**
+ * Tell the queue listeners a queue of messages to the server crossed one of
+ * its watermarks. Called by the producer going past the high watermark, or
+ * by the proxy thread bringing the queue back to the low one.
+ *
+ * @param queue Queue of sProxyToServerQueues
+ * @param above true past the high watermark
+ */
+static void _proxyQueueWatermark(proxyqueue_t *queue, bool above) {
+  int priority = (int) (queue - sProxyToServerQueues);
+  int length = proxyqueue_length(queue);
+
+  if (above) {
+    SYSLOG_WARNING("%d messages of priority %d wait for the server, shedding load", length, priority);
+  } else {
+    SYSLOG_INFO("Queue of priority %d back to %d messages", priority, length);
+  }
+
+  proxylisteners_queueBroadcast(priority, above, length);
+}
+
+/**
+ * Wait for the producers that didn't see sStopping to finish their push
+ *
+ * @param untilMs Monotonic time in ms to give up at
+ * @return true if no producer is pushing anymore
+ */
+static bool _proxyWaitProducers(unsigned long long untilMs) {
+  while (sProducers > 0) {
+    if (_serverCommNow() >= untilMs) {
       return false;
     }
+    sched_yield();
   }
 
-  // keep the GET connection until the timeout occurs or the push buffer is full.
-  return false;
+  return true;
+}
+
+/**
+ * Once the thread is joined, or when the proxy fails to start, count the
+ * messages still queued or in the pipe as lost, then free the queues and
+ * their pool and close the descriptors. Nothing is left unless the thread
+ * couldn't start, since producers are refused while stopping and the thread
+ * journals what was queued. The queues and the pool are kept while a
+ * producer is stuck in them, for the next start to free them.
+ */
+static void _proxyRelease() {
+  proxybuffer_chain_t message;
+  unsigned long long lostBytes = 0;
+  int length;
+  int i;
+
+  if (sQueuesReady) {
+    for (i = 0; i < PROXY_PRIORITIES; i++) {
+      while ((length = proxyqueue_popChain(&sProxyToServerQueues[i], &message, PROXY_MAX_MSG_LEN)) > 0) {
+        lostBytes += length;
+        proxybuffer_clear(&message);
+      }
+    }
+
+    if (sProducers > 0) {
+      SYSLOG_WARNING("%d producers still pushing, keeping the queues to the server", sProducers);
+
+    } else {
+      for (i = 0; i < PROXY_PRIORITIES; i++) {
+        proxyqueue_destroy(&sProxyToServerQueues[i]);
+      }
+      proxybuffer_destroy(&sBufferPool);
+      sQueuesReady = false;
+    }
+  }
+
+  if (sProxyToServerReadFd >= 0) {
+    while ((length = libpipecomm_read(sProxyToServerReadFd, sPipeMessage, sizeof(sPipeMessage))) > 0) {
+      lostBytes += length;
+    }
+    close(sProxyToServerReadFd);
+    sProxyToServerReadFd = -1;
+  }
+
+  if (sProxyToServerWriteFd >= 0) {
+    close(sProxyToServerWriteFd);
+    sProxyToServerWriteFd = -1;
+  }
+
+  if (sWakeupFd >= 0) {
+    close(sWakeupFd);
+    sWakeupFd = -1;
+  }
+
+  if (lostBytes > 0) {
+    SYSLOG_ERR("Lost %llu bytes to the server left after the proxy thread", lostBytes);
+    sShutdownStats.lostBytes += lostBytes;
+  }
 }
@@ -36,25 +36,140 @@
 
 #include "ioterror.h"
 #include "proxylisteners.h"
+#include "proxyretry.h"
+#include "proxyjournal.h"
+#include "proxywindow.h"
+#include "proxyqueue.h"
+#include "proxybuffer.h"
+
+/** Largest batch pushed while the link is good, the others are up to PROXY_MAX_HTTP_SEND_MESSAGE_LEN, can be overridden at compile time */
+#ifndef PROXY_MAX_FAST_SEND_MESSAGE_LEN
+#define PROXY_MAX_FAST_SEND_MESSAGE_LEN 131072
+#endif
+
+/** Time proxy_stop() gives the messages to reach the server before journaling them, can be overridden at compile time */
+#ifndef PROXY_DEFAULT_STOP_DEADLINE_MS
+#define PROXY_DEFAULT_STOP_DEADLINE_MS 5000
+#endif
 
 enum {
   PROXY_MAX_HTTP_RETRIES = 3,
   PROXY_MAX_MSG_LEN = 8192,
+  PROXY_MAX_HTTP_RECEIVE_MESSAGE_LEN = 262144,
   PROXY_NUM_SERVER_CONNECTIONS_BEFORE_SYSLOG_NOTIFICATION = 20,
-  PROXY_MAX_PUSHES_ON_RECEIVED_COMMAND = 10,
+  PROXY_STARTUP_DELAY_MS = 5000,
+  PROXY_CONTINUOUS_PUSH_INTERVAL_MS = 5000,
+  PROXY_MAX_EVENTS = 8,
+  PROXY_CONT_LINGER_DIVISOR = 4,
+  PROXY_MAX_LINGER_FACTOR = 4,
+
+  /** Buffers of the longest message */
+  PROXY_MAX_MSG_BUFFERS = PROXY_MAX_MSG_LEN / PROXYBUFFER_SIZE + 1,
+
+  /** Buffers of the largest batch, packed at least half full */
+  PROXY_MAX_BATCH_BUFFERS = 2 * PROXY_MAX_FAST_SEND_MESSAGE_LEN / PROXYBUFFER_SIZE,
 };
 
+/** Result of proxy_send() besides SUCCESS and FAIL */
+enum {
+  /** The queue to the server is full, the message wasn't taken: keep it and send it again later */
+  PROXY_WOULD_BLOCK = EAGAIN,
+};
+
+/** Priority of a message to the server */
+typedef enum proxy_priority_e {
+  /** Measurements, batched with the others */
+  PROXY_PRIORITY_BULK = 0,
+
+  /** Command results, alerts and new devices, pushed right away ahead of the bulk */
+  PROXY_PRIORITY_HIGH,
+
+  PROXY_PRIORITIES,
+} proxy_priority_e;
+
+/** Time-to-deliver of the messages in both directions */
+typedef struct proxy_delivery_stats_t {
+  /** Pushes the server took, not counting the empty ones and the replays of the journal */
+  unsigned long pushes;
+
+  /** Sum of the times in ms from reading the oldest message of a push to the server taking it */
+  unsigned long long upstreamTotalMs;
+
+  /** Longest of these times in ms */
+  unsigned int upstreamMaxMs;
+
+  /** Commands received from the server, at most PROXYRESPONSE_MAX_COMMANDS per message */
+  unsigned long commands;
+
+  /** Commands received in the response to a push rather than on the poll */
+  unsigned long commandsOnPush;
+
+  /** Time in ms no poll was open while the server wanted one, delaying the commands */
+  unsigned long long pollGapTotalMs;
+
+  /** Longest time in ms no poll was open */
+  unsigned int pollGapMaxMs;
+} proxy_delivery_stats_t;
+
+/** What the last stop of the proxy did with the messages to the server */
+typedef struct proxy_shutdown_stats_t {
+  /** Bytes the server acknowledged while the proxy was stopping */
+  unsigned long long flushedBytes;
+
+  /** Bytes written to the journal, sent by the next run */
+  unsigned long long persistedBytes;
+
+  /** Bytes neither acknowledged nor journaled, because the journal is disabled or full or their producer was still pushing at the deadline */
+  unsigned long long lostBytes;
+
+  /** Time the stop took in ms */
+  unsigned int durationMs;
+
+  /** True if the deadline expired before the server acknowledged everything */
+  bool timedOut;
+} proxy_shutdown_stats_t;
+
 /**************** Public Prototypes ****************/
 error_t proxy_start(const char *url);
 
 void proxy_stop();
 
+error_t proxy_stopWithin(unsigned int deadlineMs);
+
 error_t proxy_addListener(proxylistener l);
 
 error_t proxy_removeListener(proxylistener l);
 
+error_t proxy_addResponseListener(proxyresponselistener l);
+
+error_t proxy_removeResponseListener(proxyresponselistener l);
+
+error_t proxy_addStreamListener(proxystreamlistener l);
+
+error_t proxy_removeStreamListener(proxystreamlistener l);
+
+error_t proxy_addQueueListener(proxyqueuelistener l);
+
+error_t proxy_removeQueueListener(proxyqueuelistener l);
+
 error_t proxy_send(const char *data, int len);
 
+error_t proxy_sendPriority(const char *data, int len, proxy_priority_e priority);
+
+void proxy_getRetryStats(proxyretry_stats_t *stats);
+
+void proxy_getJournalStats(proxyjournal_stats_t *stats);
+
+void proxy_getDeliveryStats(proxy_delivery_stats_t *stats);
+
+void proxy_getWindowStats(proxywindow_stats_t *stats);
+
+void proxy_getQueueStats(proxy_priority_e priority, proxyqueue_stats_t *stats);
+
+void proxy_getBufferStats(proxybuffer_stats_t *stats);
+
+void proxy_getShutdownStats(proxy_shutdown_stats_t *stats);
+
 
 #endif
 
@@ -0,0 +1,490 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+/**
+ * This module holds the messages to the server in fixed size buffers taken
+ * from a pool, from the producer writing a message to the server
+ * acknowledging the batch it went in, so no message is allocated, zeroed or
+ * copied again on the way.
+ *
+ * The pool is one mapping, reserved without being touched: a buffer only
+ * costs memory once it was used. Free buffers are kept in a stack linked by
+ * their index, pushed and popped with a compare-and-swap by any thread. The
+ * top of the stack carries a tag changed on each update, so a thread holding
+ * an old top can't mistake it for the current one (the ABA problem), see
+ * proxybuffer_top_t for its width. A 64-bit top read in two halves on a 32-bit
+ * target is safe: the index is in the low half, and a torn tag only fails the
+ * compare-and-swap.
+ *
+ * A message or a batch is a chain of buffers. Small messages are packed
+ * into the last buffer of a batch rather than linked, so a batch is mostly
+ * made of full buffers. A buffer is reference counted, and goes back to the
+ * pool when its last holder releases it.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "proxybuffer.h"
+#include "iotdebug.h"
+
+enum {
+  /** Bits of the free list holding the index + 1 of its first buffer, the tag is above them */
+  PROXYBUFFER_INDEX_BITS = 16,
+};
+
+#define PROXYBUFFER_INDEX_MASK (((proxybuffer_top_t) 1 << PROXYBUFFER_INDEX_BITS) - 1)
+
+/***************** Private Prototypes ****************/
+static proxybuffer_top_t _proxybuffer_tagged(proxybuffer_top_t top, unsigned int index);
+
+static void _proxybuffer_link(proxybuffer_chain_t *chain, proxybuffer_t *buffer);
+
+/***************** Public Functions ****************/
+/**
+ * Initialize a pool. Its memory is reserved, not committed, until its
+ * buffers are used.
+ *
+ * @param pool Pool to initialize
+ * @param count Number of buffers, up to PROXYBUFFER_MAX_COUNT, 0 for the default
+ * @return true if the pool could be mapped
+ */
+bool proxybuffer_init(proxybuffer_pool_t *pool, unsigned int count) {
+  void *map;
+
+  // The index + 1 of the last buffer has to fit below the tag
+  assert(PROXYBUFFER_MAX_COUNT <= PROXYBUFFER_INDEX_MASK);
+
+  memset(pool, 0, sizeof(proxybuffer_pool_t));
+
+  if(count == 0) {
+    count = PROXYBUFFER_DEFAULT_COUNT;
+  }
+
+  if(count > PROXYBUFFER_MAX_COUNT) {
+    count = PROXYBUFFER_MAX_COUNT;
+  }
+
+  map = mmap(NULL, (size_t) count * sizeof(proxybuffer_t), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(map == MAP_FAILED) {
+    SYSLOG_ERR("Couldn't map %u buffers, %s", count, strerror(errno));
+    return false;
+  }
+
+  pool->buffers = (proxybuffer_t *) map;
+  pool->count = count;
+  return true;
+}
+
+/**
+ * Unmap a pool. No buffer of it may be used anymore.
+ * @param pool Pool initialized by proxybuffer_init()
+ */
+void proxybuffer_destroy(proxybuffer_pool_t *pool) {
+  if(pool->buffers == NULL) {
+    return;
+  }
+
+  munmap(pool->buffers, (size_t) pool->count * sizeof(proxybuffer_t));
+  pool->buffers = NULL;
+  pool->count = 0;
+}
+
+/**
+ * Take an empty buffer from the pool. Can be called from any thread.
+ *
+ * @param pool Pool
+ * @return the buffer, with one reference, NULL if every buffer is in use
+ */
+proxybuffer_t *proxybuffer_alloc(proxybuffer_pool_t *pool) {
+  proxybuffer_t *buffer = NULL;
+  proxybuffer_top_t top;
+  unsigned int index;
+  unsigned int inUse;
+  unsigned int maxInUse;
+
+  for(;;) {
+    top = pool->freeList;
+    __sync_synchronize();
+    index = (unsigned int) (top & PROXYBUFFER_INDEX_MASK);
+    if(index == 0) {
+      break;
+    }
+
+    // The buffer may be taken by another thread meanwhile, then the tag moved on and this fails
+    buffer = &pool->buffers[index - 1];
+    if(__sync_bool_compare_and_swap(&pool->freeList, top, _proxybuffer_tagged(top, buffer->nextFree))) {
+      break;
+    }
+    buffer = NULL;
+  }
+
+  if(buffer == NULL) {
+    do {
+      index = pool->unused;
+      if(index >= pool->count) {
+        __sync_fetch_and_add(&pool->exhausted, 1);
+        return NULL;
+      }
+    } while(!__sync_bool_compare_and_swap(&pool->unused, index, index + 1));
+
+    buffer = &pool->buffers[index];
+    buffer->pool = pool;
+  }
+
+  buffer->next = NULL;
+  buffer->refs = 1;
+  buffer->length = 0;
+
+  __sync_fetch_and_add(&pool->allocated, 1);
+  inUse = __sync_add_and_fetch(&pool->inUse, 1);
+  do {
+    maxInUse = pool->maxInUse;
+  } while(inUse > maxInUse && !__sync_bool_compare_and_swap(&pool->maxInUse, maxInUse, inUse));
+
+  return buffer;
+}
+
+/**
+ * Take one more reference to a buffer, for another holder to release
+ *
+ * @param buffer Buffer
+ * @return the buffer
+ */
+proxybuffer_t *proxybuffer_ref(proxybuffer_t *buffer) {
+  __sync_fetch_and_add(&buffer->refs, 1);
+  return buffer;
+}
+
+/**
+ * Release a reference to a buffer, the buffer goes back to its pool with the
+ * last one. The next buffers of its chain are not released.
+ *
+ * @param buffer Buffer, NULL for none
+ */
+void proxybuffer_release(proxybuffer_t *buffer) {
+  proxybuffer_pool_t *pool;
+  proxybuffer_top_t top;
+  unsigned int index;
+
+  if(buffer == NULL || __sync_sub_and_fetch(&buffer->refs, 1) > 0) {
+    return;
+  }
+
+  pool = buffer->pool;
+  index = (unsigned int) (buffer - pool->buffers) + 1;
+
+  do {
+    top = pool->freeList;
+    buffer->nextFree = (unsigned int) (top & PROXYBUFFER_INDEX_MASK);
+    // The link must be visible before the buffer is
+    __sync_synchronize();
+  } while(!__sync_bool_compare_and_swap(&pool->freeList, top, _proxybuffer_tagged(top, index)));
+
+  __sync_fetch_and_sub(&pool->inUse, 1);
+}
+
+/**
+ * Copy data at the end of a chain, in the room left in its last buffer
+ * first, then in new buffers
+ *
+ * @param pool Pool of the new buffers
+ * @param chain Chain, empty or owned by the caller
+ * @param data Data
+ * @param length Length of the data
+ * @return true if the data was copied, false if the pool ran out of buffers
+ *     and the chain was left as it was
+ */
+bool proxybuffer_write(proxybuffer_pool_t *pool, proxybuffer_chain_t *chain, const char *data, int length) {
+  proxybuffer_chain_t added;
+  proxybuffer_t *buffer;
+  int room = 0;
+  int size;
+
+  if(chain->tail != NULL && chain->tail->refs == 1) {
+    room = PROXYBUFFER_SIZE - chain->tail->length;
+    if(room > length) {
+      room = length;
+    }
+  }
+
+  memset(&added, 0, sizeof(added));
+  while(added.length < length - room) {
+    buffer = proxybuffer_alloc(pool);
+    if(buffer == NULL) {
+      proxybuffer_clear(&added);
+      return false;
+    }
+
+    size = length - room - added.length;
+    if(size > PROXYBUFFER_SIZE) {
+      size = PROXYBUFFER_SIZE;
+    }
+    memcpy(buffer->data, data + room + added.length, size);
+    buffer->length = size;
+    _proxybuffer_link(&added, buffer);
+  }
+
+  if(room > 0) {
+    memcpy(chain->tail->data + chain->tail->length, data, room);
+    chain->tail->length += room;
+    chain->length += room;
+  }
+
+  proxybuffer_append(chain, &added);
+  return true;
+}
+
+/**
+ * Add new buffers at the end of a chain, full of whatever they held, to be
+ * written in place then cut to the length written with proxybuffer_truncate()
+ *
+ * @param pool Pool of the new buffers
+ * @param chain Chain
+ * @param length Bytes to add
+ * @return true if the buffers were added, false if the pool ran out of them
+ *     and the chain was left as it was
+ */
+bool proxybuffer_extend(proxybuffer_pool_t *pool, proxybuffer_chain_t *chain, int length) {
+  proxybuffer_chain_t added;
+  proxybuffer_t *buffer;
+
+  memset(&added, 0, sizeof(added));
+  while(added.length < length) {
+    buffer = proxybuffer_alloc(pool);
+    if(buffer == NULL) {
+      proxybuffer_clear(&added);
+      return false;
+    }
+
+    buffer->length = length - added.length < PROXYBUFFER_SIZE ? length - added.length : PROXYBUFFER_SIZE;
+    _proxybuffer_link(&added, buffer);
+  }
+
+  // Linked rather than appended, the data isn't there yet
+  if(chain->head == NULL) {
+    *chain = added;
+
+  } else if(added.head != NULL) {
+    chain->tail->next = added.head;
+    chain->tail = added.tail;
+    chain->length += added.length;
+    chain->count += added.count;
+  }
+  return true;
+}
+
+/**
+ * Keep the first bytes of a chain, releasing the buffers past them
+ *
+ * @param chain Chain
+ * @param length Bytes to keep, 0 to release every buffer
+ */
+void proxybuffer_truncate(proxybuffer_chain_t *chain, int length) {
+  proxybuffer_chain_t rest;
+  proxybuffer_t *buffer;
+  int kept = 0;
+
+  if(length <= 0) {
+    proxybuffer_clear(chain);
+    return;
+  }
+
+  if(length >= chain->length) {
+    return;
+  }
+
+  chain->count = 1;
+  for(buffer = chain->head; kept + buffer->length < length; buffer = buffer->next) {
+    kept += buffer->length;
+    chain->count++;
+  }
+
+  memset(&rest, 0, sizeof(rest));
+  rest.head = buffer->next;
+  buffer->next = NULL;
+  buffer->length = length - kept;
+  chain->tail = buffer;
+  chain->length = length;
+  proxybuffer_clear(&rest);
+}
+
+/**
+ * Move a chain to the end of another one. It is copied in the room left in
+ * the last buffer if it fits, so small messages share the buffers of a
+ * batch, otherwise its buffers are linked.
+ *
+ * @param chain Chain receiving the other one
+ * @param other Chain moved, empty on return
+ */
+void proxybuffer_append(proxybuffer_chain_t *chain, proxybuffer_chain_t *other) {
+  proxybuffer_t *buffer;
+
+  if(other->head == NULL) {
+    return;
+  }
+
+  if(chain->head == NULL) {
+    *chain = *other;
+
+  } else if(chain->tail->refs == 1 && other->length <= PROXYBUFFER_SIZE - chain->tail->length) {
+    for(buffer = other->head; buffer != NULL; buffer = buffer->next) {
+      memcpy(chain->tail->data + chain->tail->length, buffer->data, buffer->length);
+      chain->tail->length += buffer->length;
+    }
+    chain->length += other->length;
+    proxybuffer_clear(other);
+
+  } else {
+    chain->tail->next = other->head;
+    chain->tail = other->tail;
+    chain->length += other->length;
+    chain->count += other->count;
+  }
+
+  memset(other, 0, sizeof(proxybuffer_chain_t));
+}
+
+/**
+ * Copy a chain into one buffer, only if it fits
+ *
+ * @param chain Chain
+ * @param dest Where to copy the data
+ * @param maxLength Size of dest
+ * @return the length of the data, 0 if the chain is empty or doesn't fit
+ */
+int proxybuffer_read(const proxybuffer_chain_t *chain, char *dest, int maxLength) {
+  proxybuffer_t *buffer;
+  int length = 0;
+
+  if(chain->length > maxLength) {
+    return 0;
+  }
+
+  for(buffer = chain->head; buffer != NULL; buffer = buffer->next) {
+    memcpy(dest + length, buffer->data, buffer->length);
+    length += buffer->length;
+  }
+
+  return length;
+}
+
+/**
+ * Describe the data of a chain as segments, to be sent or written without
+ * copying it
+ *
+ * @param chain Chain
+ * @param segments Receives one segment per buffer
+ * @param maxSegments Number of segments
+ * @return the number of segments, -1 if the chain has more buffers
+ */
+int proxybuffer_segments(const proxybuffer_chain_t *chain, struct iovec *segments, int maxSegments) {
+  proxybuffer_t *buffer;
+  int count = 0;
+
+  if(chain->count > maxSegments) {
+    return -1;
+  }
+
+  for(buffer = chain->head; buffer != NULL; buffer = buffer->next) {
+    segments[count].iov_base = buffer->data;
+    segments[count].iov_len = buffer->length;
+    count++;
+  }
+
+  return count;
+}
+
+/**
+ * Release the buffers of a chain
+ * @param chain Chain, empty on return
+ */
+void proxybuffer_clear(proxybuffer_chain_t *chain) {
+  proxybuffer_t *buffer = chain->head;
+  proxybuffer_t *next;
+
+  while(buffer != NULL) {
+    next = buffer->next;
+    proxybuffer_release(buffer);
+    buffer = next;
+  }
+
+  memset(chain, 0, sizeof(proxybuffer_chain_t));
+}
+
+/**
+ * Read the metrics of a pool, from any thread
+ *
+ * @param pool Pool
+ * @param stats Destination of the metrics
+ */
+void proxybuffer_getStats(proxybuffer_pool_t *pool, proxybuffer_stats_t *stats) {
+  __sync_synchronize();
+  stats->allocated = pool->allocated;
+  stats->exhausted = pool->exhausted;
+  stats->inUse = pool->inUse;
+  stats->maxInUse = pool->maxInUse;
+  stats->count = pool->count;
+}
+
+/***************** Private Functions ****************/
+/**
+ * @param top Current top of the free list
+ * @param index Index + 1 of the new first buffer, 0 for none
+ * @return the new top of the free list, with the next tag
+ */
+static proxybuffer_top_t _proxybuffer_tagged(proxybuffer_top_t top, unsigned int index) {
+  return (((top >> PROXYBUFFER_INDEX_BITS) + 1) << PROXYBUFFER_INDEX_BITS) | index;
+}
+
+/**
+ * Link a buffer at the end of a chain, without packing it
+ *
+ * @param chain Chain
+ * @param buffer Buffer, the last of its own chain
+ */
+static void _proxybuffer_link(proxybuffer_chain_t *chain, proxybuffer_t *buffer) {
+  if(chain->head == NULL) {
+    chain->head = buffer;
+
+  } else {
+    chain->tail->next = buffer;
+  }
+
+  chain->tail = buffer;
+  chain->length += buffer->length;
+  chain->count++;
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef PROXYBUFFER_H
+#define PROXYBUFFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/** Bytes of data in one buffer, can be overridden at compile time */
+#ifndef PROXYBUFFER_SIZE
+#define PROXYBUFFER_SIZE 2048
+#endif
+
+/** Buffers of the pool of the proxy, only the ones in use take memory, can be overridden at compile time */
+#ifndef PROXYBUFFER_DEFAULT_COUNT
+#define PROXYBUFFER_DEFAULT_COUNT 2048
+#endif
+
+enum {
+  /** Most buffers in a pool, their index has to fit next to the tag of the free list */
+  PROXYBUFFER_MAX_COUNT = 65535,
+};
+
+/**
+ * Top of the free list of a pool: the index + 1 of its first buffer in the
+ * low 16 bits, a tag changed on each update above them. The tag has 48 bits
+ * where a 64-bit compare-and-swap is available. Without one, e.g. on 32-bit
+ * MIPS, it only has 16 bits: a thread stalled between reading the top and
+ * its compare-and-swap while the free list changed a multiple of 65536 times
+ * could still take a buffer that was reused meanwhile.
+ */
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_8
+typedef uint64_t proxybuffer_top_t;
+#else
+typedef uint32_t proxybuffer_top_t;
+#endif
+
+struct proxybuffer_pool_t;
+
+/** Fixed size buffer of a pool, shared by reference counting */
+typedef struct proxybuffer_t {
+  /** Pool the buffer goes back to */
+  struct proxybuffer_pool_t *pool;
+
+  /** Next buffer of the chain, NULL for the last one */
+  struct proxybuffer_t *next;
+
+  /** References to the buffer, it goes back to the pool when the last one is released */
+  volatile int refs;
+
+  /** Index + 1 of the next free buffer, while the buffer is in the free list */
+  unsigned int nextFree;
+
+  /** Bytes of data */
+  int length;
+
+  char data[PROXYBUFFER_SIZE];
+} proxybuffer_t;
+
+/** Buffers holding one message or a batch of them, from the head to the tail */
+typedef struct proxybuffer_chain_t {
+  proxybuffer_t *head;
+
+  proxybuffer_t *tail;
+
+  /** Bytes of data of all the buffers */
+  int length;
+
+  int count;
+} proxybuffer_chain_t;
+
+/** Metrics of a pool, see proxybuffer_getStats() */
+typedef struct proxybuffer_stats_t {
+  unsigned long allocated;
+
+  /** Allocations that failed because every buffer was in use */
+  unsigned long exhausted;
+
+  unsigned int inUse;
+
+  /** Most buffers in use at once */
+  unsigned int maxInUse;
+
+  unsigned int count;
+} proxybuffer_stats_t;
+
+/** Pool of buffers taken and given back by any thread without a lock */
+typedef struct proxybuffer_pool_t {
+  proxybuffer_t *buffers;
+
+  unsigned int count;
+
+  /** Buffers never used yet start at this index, their memory isn't touched until then */
+  volatile unsigned int unused;
+
+  /** Index + 1 of the first free buffer, 0 if none, below a tag changed on each update */
+  volatile proxybuffer_top_t freeList;
+
+  volatile unsigned long allocated;
+
+  volatile unsigned long exhausted;
+
+  volatile unsigned int inUse;
+
+  volatile unsigned int maxInUse;
+} proxybuffer_pool_t;
+
+/***************** Public Prototypes ****************/
+bool proxybuffer_init(proxybuffer_pool_t *pool, unsigned int count);
+
+void proxybuffer_destroy(proxybuffer_pool_t *pool);
+
+proxybuffer_t *proxybuffer_alloc(proxybuffer_pool_t *pool);
+
+proxybuffer_t *proxybuffer_ref(proxybuffer_t *buffer);
+
+void proxybuffer_release(proxybuffer_t *buffer);
+
+bool proxybuffer_write(proxybuffer_pool_t *pool, proxybuffer_chain_t *chain, const char *data, int length);
+
+bool proxybuffer_extend(proxybuffer_pool_t *pool, proxybuffer_chain_t *chain, int length);
+
+void proxybuffer_truncate(proxybuffer_chain_t *chain, int length);
+
+void proxybuffer_append(proxybuffer_chain_t *chain, proxybuffer_chain_t *other);
+
+int proxybuffer_read(const proxybuffer_chain_t *chain, char *dest, int maxLength);
+
+int proxybuffer_segments(const proxybuffer_chain_t *chain, struct iovec *segments, int maxSegments);
+
+void proxybuffer_clear(proxybuffer_chain_t *chain);
+
+void proxybuffer_getStats(proxybuffer_pool_t *pool, proxybuffer_stats_t *stats);
+
+#endif
@@ -45,6 +45,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
 #include <rpc/types.h>
 
 #include "proxyconfig.h"
@@ -66,6 +67,18 @@ static pthread_mutex_t sCertificatePathMutex;
 /** Mutex to protect activation token */
 static pthread_mutex_t sActivationTokenMutex;
 
+/** Mutex to protect the compression settings */
+static pthread_mutex_t sCompressionMutex;
+
+/** Mutex to protect the batching thresholds */
+static pthread_mutex_t sBatchingMutex;
+
+/** Mutex to protect the journal directory */
+static pthread_mutex_t sJournalDirMutex;
+
+/** Mutex to protect the watermarks of the queues */
+static pthread_mutex_t sQueueMutex;
+
 /** Upload interval in seconds */
 static long sUploadIntervalSec = PROXY_DEFAULT_UPLOAD_INTERVAL_SEC;
 
@@ -78,9 +91,39 @@ static bool sUseSsl = false;
 /** SSL certificate path */
 static char sCertificatePath[PATH_MAX];
 
+/** True if the certificate exists, as of sCertificateCheckedSec */
+static bool sCertificateAvailable = false;
+
+/** Monotonic time the certificate was last looked for, 0 to look for it now */
+static time_t sCertificateCheckedSec = 0;
+
 /** Cloud activation token */
 static char sActivationToken[PROXY_MAX_ACTIVATION_TOKEN_SIZE];
 
+/** Content-Encoding of the messages to the server */
+static http_encoding_e sCompression = HTTPCOMM_ENCODING_IDENTITY;
+
+/** True to deflate messages with the preset IOT XML dictionary */
+static bool sCompressionDictionary = false;
+
+/** Bytes waiting that trigger a push right away */
+static int sBatchBytes = PROXY_DEFAULT_BATCH_BYTES;
+
+/** Longest time a message waits for others before it is pushed */
+static int sBatchLingerMs = PROXY_DEFAULT_BATCH_LINGER_MS;
+
+/** Directory of the journal, empty to lose the messages the server couldn't take */
+static char sJournalDir[PATH_MAX] = PROXY_DEFAULT_JOURNAL_DIR;
+
+/** Messages waiting in a queue to the server past which the producers should back off */
+static int sQueueHighWatermark = PROXY_DEFAULT_QUEUE_HIGH_WATERMARK;
+
+/** Messages waiting in a queue to the server once the producers can go on */
+static int sQueueLowWatermark = PROXY_DEFAULT_QUEUE_LOW_WATERMARK;
+
+/***************** Private Prototypes ****************/
+static bool _proxyconfig_hasCertificate();
+
 
 
 /***************** Proxyconfig Public ****************/
@@ -93,6 +136,10 @@ void proxyconfig_start() {
   pthread_mutex_init(&sUseSslMutex, NULL);
   pthread_mutex_init(&sCertificatePathMutex, NULL);
   pthread_mutex_init(&sActivationTokenMutex, NULL);
+  pthread_mutex_init(&sCompressionMutex, NULL);
+  pthread_mutex_init(&sBatchingMutex, NULL);
+  pthread_mutex_init(&sJournalDirMutex, NULL);
+  pthread_mutex_init(&sQueueMutex, NULL);
 }
 
 /**
@@ -104,6 +151,12 @@ void proxyconfig_stop() {
   pthread_mutex_destroy(&sUseSslMutex);
   pthread_mutex_destroy(&sCertificatePathMutex);
   pthread_mutex_destroy(&sActivationTokenMutex);
+  pthread_mutex_destroy(&sCompressionMutex);
+  pthread_mutex_destroy(&sBatchingMutex);
+  pthread_mutex_destroy(&sJournalDirMutex);
+  pthread_mutex_destroy(&sQueueMutex);
+  libhttpcomm_unloadCaStore();
+  libhttpcomm_resolverStop();
 }
 
 
@@ -148,17 +201,21 @@ void proxyconfig_setUploadIntervalSec(long uploadIntervalSec) {
  */
 void proxyconfig_getUrl(char *dest, int destLen) {
   int bytesWritten = 0;
+  bool ssl;
 
   assert(dest);
 
   memset(dest, 0x0, destLen);
 
+  // Looked up before locking the URL, the certificate has its own mutex
+  ssl = proxyconfig_getSsl() && _proxyconfig_hasCertificate();
+
   // Must be protected since multiple threads are accessing it
   pthread_mutex_lock(&sUrlMutex);
 
   // Ensure we have an http(s)://
   if (strstr(sUrl, "http") == NULL) {
-    if (sUseSsl == true && access(sCertificatePath, F_OK) == 0) {
+    if (ssl == true) {
       bytesWritten += snprintf(dest, destLen, "https://");
     } else {
       bytesWritten += snprintf(dest, destLen, "http://");
@@ -171,7 +228,9 @@ void proxyconfig_getUrl(char *dest, int destLen) {
 }
 
 /**
- * Set the server URL
+ * Set the server URL. Its host is looked up in the background from now on,
+ * so requests to the server don't wait for DNS.
+ *
  * @param url The desired server URL
  * @return SUCCESS if the URL is set, FAIL if the URL is invalid
  */
@@ -184,6 +243,8 @@ error_t proxyconfig_setUrl(const char *url) {
     strncpy(sUrl, url, sizeof(sUrl));
     pthread_mutex_unlock(&sUrlMutex);
     SYSLOG_DEBUG("Server URL set to %s", url);
+
+    libhttpcomm_resolverAdd(url);
     return SUCCESS;
   }
 
@@ -192,15 +253,22 @@ error_t proxyconfig_setUrl(const char *url) {
 }
 
 /**
- * Set the certificate path
+ * Set the certificate path. Its certificates are loaded in memory right away,
+ * so the first connection to the server doesn't have to read them.
+ *
  * @param certificatePath Pointer to a string containing the certificate path
  */
 void proxyconfig_setCertificate(const char *certificatePath) {
   pthread_mutex_lock(&sCertificatePathMutex);
   strncpy(sCertificatePath, certificatePath, sizeof(sCertificatePath));
+  sCertificateCheckedSec = 0;
   pthread_mutex_unlock(&sCertificatePathMutex);
 
   SYSLOG_DEBUG("SSL certificate path set to %s", certificatePath);
+
+  if (_proxyconfig_hasCertificate() == true) {
+    libhttpcomm_loadCaStore(certificatePath);
+  }
 }
 
 
@@ -208,17 +276,11 @@ void proxyconfig_setCertificate(const char *certificatePath) {
  * @return a pointer to the certificate path if we are using SSL, else NULL
  */
 const char *proxyconfig_getCertificate() {
-  const char *certificate = NULL;
-
-  if (proxyconfig_getSsl() == true) {
-    pthread_mutex_lock(&sCertificatePathMutex);
-    if (access(sCertificatePath, F_OK) == 0) {
-      certificate = sCertificatePath;
-    }
-    pthread_mutex_unlock(&sCertificatePathMutex);
+  if (proxyconfig_getSsl() == true && _proxyconfig_hasCertificate() == true) {
+    return sCertificatePath;
   }
 
-  return certificate;
+  return NULL;
 }
 
 /**
@@ -268,3 +330,175 @@ bool proxyconfig_getSsl() {
   return ssl;
 }
 
+/**
+ * Compress the messages sent to the server. The server must support the
+ * encoding, and the preset dictionary when it is used.
+ *
+ * @param encoding Content-Encoding of the messages, HTTPCOMM_ENCODING_IDENTITY for none
+ * @param useDictionary True to deflate with the preset IOT XML dictionary
+ */
+void proxyconfig_setCompression(http_encoding_e encoding, bool useDictionary) {
+  pthread_mutex_lock(&sCompressionMutex);
+  sCompression = encoding;
+  sCompressionDictionary = useDictionary;
+  pthread_mutex_unlock(&sCompressionMutex);
+  SYSLOG_DEBUG("Compression set to %d, dictionary %d", encoding, useDictionary);
+}
+
+/**
+ * @return the Content-Encoding of the messages to the server
+ */
+http_encoding_e proxyconfig_getCompression() {
+  http_encoding_e encoding;
+
+  pthread_mutex_lock(&sCompressionMutex);
+  encoding = sCompression;
+  pthread_mutex_unlock(&sCompressionMutex);
+
+  return encoding;
+}
+
+/**
+ * @return True if messages are deflated with the preset IOT XML dictionary
+ */
+bool proxyconfig_getCompressionDictionary() {
+  bool useDictionary;
+
+  pthread_mutex_lock(&sCompressionMutex);
+  useDictionary = sCompressionDictionary;
+  pthread_mutex_unlock(&sCompressionMutex);
+
+  return useDictionary;
+}
+
+/**
+ * Coalesce the messages to the server into fewer, fuller pushes. A push
+ * waits until batchBytes are ready or its oldest message lingered lingerMs,
+ * whichever comes first. The proxy shortens the linger in CONT mode and
+ * lengthens it when pushes are slow.
+ *
+ * @param batchBytes Bytes that trigger a push, 0 to keep the current value
+ * @param lingerMs Longest wait of a message in ms, 0 to push right away
+ */
+void proxyconfig_setBatching(int batchBytes, int lingerMs) {
+  pthread_mutex_lock(&sBatchingMutex);
+  if(batchBytes > 0) {
+    sBatchBytes = batchBytes;
+  }
+
+  if(lingerMs >= 0) {
+    sBatchLingerMs = lingerMs;
+  }
+  pthread_mutex_unlock(&sBatchingMutex);
+  SYSLOG_DEBUG("Batching set to %d bytes, %d ms", batchBytes, lingerMs);
+}
+
+/**
+ * @return the bytes waiting that trigger a push
+ */
+int proxyconfig_getBatchBytes() {
+  int batchBytes;
+
+  pthread_mutex_lock(&sBatchingMutex);
+  batchBytes = sBatchBytes;
+  pthread_mutex_unlock(&sBatchingMutex);
+
+  return batchBytes;
+}
+
+/**
+ * @return the longest time in ms a message lingers before it is pushed
+ */
+int proxyconfig_getBatchLingerMs() {
+  int lingerMs;
+
+  pthread_mutex_lock(&sBatchingMutex);
+  lingerMs = sBatchLingerMs;
+  pthread_mutex_unlock(&sBatchingMutex);
+
+  return lingerMs;
+}
+
+/**
+ * Keep the messages the server couldn't take in a journal on disk. Takes
+ * effect when the proxy thread starts sending, PROXY_STARTUP_DELAY_MS after
+ * proxy_start().
+ *
+ * @param dir Directory of the journal, on flash. NULL or "" to disable it.
+ */
+void proxyconfig_setJournalDir(const char *dir) {
+  pthread_mutex_lock(&sJournalDirMutex);
+  snprintf(sJournalDir, sizeof(sJournalDir), "%s", dir != NULL ? dir : "");
+  pthread_mutex_unlock(&sJournalDirMutex);
+  SYSLOG_DEBUG("Journal directory set to %s", dir != NULL ? dir : "");
+}
+
+/**
+ * @param dest Destination of the directory of the journal, empty if disabled
+ * @param destLen Size of the destination
+ */
+void proxyconfig_getJournalDir(char *dest, int destLen) {
+  assert(dest);
+
+  pthread_mutex_lock(&sJournalDirMutex);
+  snprintf(dest, destLen, "%s", sJournalDir);
+  pthread_mutex_unlock(&sJournalDirMutex);
+}
+
+/**
+ * Bound the queues of messages to the server. Past the high watermark, the
+ * queue listeners are told to back off and the oldest measurements are
+ * dropped for the new ones; command results and alerts are kept until the
+ * queue is at its capacity, then refused. Takes effect at proxy_start().
+ *
+ * @param highWatermark Messages past which the producers should back off, 0 to keep the current value
+ * @param lowWatermark Messages once the producers can go on, less than highWatermark
+ */
+void proxyconfig_setQueueWatermarks(int highWatermark, int lowWatermark) {
+  pthread_mutex_lock(&sQueueMutex);
+  if(highWatermark > 0) {
+    sQueueHighWatermark = highWatermark;
+  }
+
+  if(lowWatermark >= 0) {
+    sQueueLowWatermark = lowWatermark;
+  }
+  pthread_mutex_unlock(&sQueueMutex);
+  SYSLOG_DEBUG("Queue watermarks set to %d and %d messages", highWatermark, lowWatermark);
+}
+
+/**
+ * @param highWatermark Destination of the messages past which the producers should back off
+ * @param lowWatermark Destination of the messages once the producers can go on
+ */
+void proxyconfig_getQueueWatermarks(int *highWatermark, int *lowWatermark) {
+  pthread_mutex_lock(&sQueueMutex);
+  *highWatermark = sQueueHighWatermark;
+  *lowWatermark = sQueueLowWatermark;
+  pthread_mutex_unlock(&sQueueMutex);
+}
+
+
+/***************** Private Functions ****************/
+/**
+ * Tells if the certificate exists. The filesystem is only looked at every
+ * PROXY_CERTIFICATE_CHECK_SEC seconds, not for every request to the server.
+ *
+ * @return True if the certificate exists
+ */
+static bool _proxyconfig_hasCertificate() {
+  struct timespec now;
+  bool available;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&sCertificatePathMutex);
+  if (sCertificateCheckedSec == 0 || now.tv_sec - sCertificateCheckedSec >= PROXY_CERTIFICATE_CHECK_SEC) {
+    sCertificateAvailable = (sCertificatePath[0] != '\0' && access(sCertificatePath, F_OK) == 0);
+    sCertificateCheckedSec = (now.tv_sec > 0) ? now.tv_sec : 1;
+  }
+  available = sCertificateAvailable;
+  pthread_mutex_unlock(&sCertificatePathMutex);
+
+  return available;
+}
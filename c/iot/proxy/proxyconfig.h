@@ -36,16 +36,43 @@
 
 #include <stdbool.h>
 #include "ioterror.h"
+#include "libhttpcomm.h"
 
 /** Default upload interval in seconds, can be overridden at compile time */
 #ifndef PROXY_DEFAULT_UPLOAD_INTERVAL_SEC
 #define PROXY_DEFAULT_UPLOAD_INTERVAL_SEC 60
 #endif
 
+/** Directory of the journal of the messages the server couldn't take, can be overridden at compile time */
+#ifndef PROXY_DEFAULT_JOURNAL_DIR
+#define PROXY_DEFAULT_JOURNAL_DIR "journal"
+#endif
+
+/** Bytes waiting that trigger a push without lingering, can be overridden at compile time */
+#ifndef PROXY_DEFAULT_BATCH_BYTES
+#define PROXY_DEFAULT_BATCH_BYTES 4096
+#endif
+
+/** Longest time a message lingers for others to share its push, can be overridden at compile time */
+#ifndef PROXY_DEFAULT_BATCH_LINGER_MS
+#define PROXY_DEFAULT_BATCH_LINGER_MS 250
+#endif
+
+/** Messages waiting for the server past which the producers should back off, can be overridden at compile time */
+#ifndef PROXY_DEFAULT_QUEUE_HIGH_WATERMARK
+#define PROXY_DEFAULT_QUEUE_HIGH_WATERMARK 192
+#endif
+
+/** Messages waiting for the server once the producers can go on, can be overridden at compile time */
+#ifndef PROXY_DEFAULT_QUEUE_LOW_WATERMARK
+#define PROXY_DEFAULT_QUEUE_LOW_WATERMARK 64
+#endif
+
 enum {
   PROXY_URL_SIZE = 256,
   PROXY_MAX_HTTP_SEND_MESSAGE_LEN = 32768U,
   PROXY_MAX_ACTIVATION_TOKEN_SIZE = 128,
+  PROXY_CERTIFICATE_CHECK_SEC = 60,
 };
 
 /***************** Public Prototypes ****************/
@@ -73,5 +100,25 @@ void proxyconfig_setSsl(bool ssl);
 
 bool proxyconfig_getSsl();
 
+void proxyconfig_setCompression(http_encoding_e encoding, bool useDictionary);
+
+http_encoding_e proxyconfig_getCompression();
+
+bool proxyconfig_getCompressionDictionary();
+
+void proxyconfig_setBatching(int batchBytes, int lingerMs);
+
+int proxyconfig_getBatchBytes();
+
+int proxyconfig_getBatchLingerMs();
+
+void proxyconfig_setQueueWatermarks(int highWatermark, int lowWatermark);
+
+void proxyconfig_getQueueWatermarks(int *highWatermark, int *lowWatermark);
+
+void proxyconfig_setJournalDir(const char *dir);
+
+void proxyconfig_getJournalDir(char *dest, int destLen);
+
 
 #endif
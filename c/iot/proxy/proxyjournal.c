@@ -0,0 +1,725 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+/**
+ * This module keeps the messages the server couldn't take on disk until it
+ * comes back, so measurements survive an outage and a reboot.
+ *
+ * The journal is a directory of segment files of a fixed size, mapped in
+ * memory. Records are appended to the newest segment and replayed in order
+ * from the oldest one. Each record carries a CRC, and its magic number is
+ * written last, so a record torn by a power failure is found on the next
+ * start and skipped. A replayed record is marked as sent in place, and a
+ * segment is deleted once all its records were sent. Past the size cap, the
+ * oldest segment is dropped.
+ *
+ * New records are forced to flash at most every PROXYJOURNAL_SYNC_INTERVAL_MS
+ * to limit the wear, the owner of the journal calls proxyjournal_sync() when
+ * proxyjournal_syncTimeoutMs() says so.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "proxyjournal.h"
+#include "iotdebug.h"
+
+/** Magic numbers of the records */
+enum {
+  PROXYJOURNAL_MAGIC_PENDING = 0x4C4E524A,
+  PROXYJOURNAL_MAGIC_SENT = 0x544E4553,
+};
+
+/** Header of a record, followed by the message and padding to 4 bytes */
+typedef struct proxyjournal_record_t {
+  uint32_t magic;
+
+  uint32_t length;
+
+  /** CRC-32 of the length and the message */
+  uint32_t crc;
+} proxyjournal_record_t;
+
+/** Space taken by a record of a given length */
+#define PROXYJOURNAL_RECORD_SIZE(length) ((uint32_t) ((sizeof(proxyjournal_record_t) + (length) + 3) & ~3U))
+
+/***************** Private Prototypes ****************/
+static unsigned long long _proxyjournal_now();
+
+static bool _proxyjournal_path(proxyjournal_t *journal, unsigned long id, char *path, int pathSize);
+
+static bool _proxyjournal_map(proxyjournal_t *journal, unsigned long id, bool create);
+
+static void _proxyjournal_recover(proxyjournal_t *journal, proxyjournal_segment_t *segment);
+
+static proxyjournal_record_t *_proxyjournal_record(proxyjournal_segment_t *segment, uint32_t offset, bool checkCrc);
+
+static uint32_t _proxyjournal_crc(const proxyjournal_record_t *record);
+
+static void _proxyjournal_removeOldest(proxyjournal_t *journal, bool dropped);
+
+static void _proxyjournal_syncLocked(proxyjournal_t *journal);
+
+static int _proxyjournal_compareIds(const void *a, const void *b);
+
+/***************** Public Functions ****************/
+/**
+ * Open the journal of a directory, creating it if needed, and find the
+ * records not replayed yet
+ *
+ * @param journal Journal to open
+ * @param dir Directory of the segment files
+ * @return true if the journal can be used
+ */
+bool proxyjournal_open(proxyjournal_t *journal, const char *dir) {
+  unsigned long *ids = NULL;
+  unsigned long *grown;
+  unsigned long id;
+  int idCount = 0;
+  int idSize = 0;
+  char path[PATH_MAX];
+  struct dirent *entry;
+  DIR *directory;
+  int length;
+  int i;
+
+  memset(journal, 0, sizeof(proxyjournal_t));
+  journal->nextId = 1;
+
+  // Checked once with the longest id, so the path of every segment fits
+  if(snprintf(journal->dir, sizeof(journal->dir), "%s", dir) >= (int) sizeof(journal->dir)
+      || !_proxyjournal_path(journal, ULONG_MAX, path, sizeof(path))) {
+    SYSLOG_ERR("Journal directory %s, %s", dir, strerror(ENAMETOOLONG));
+    return false;
+  }
+
+  if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    SYSLOG_ERR("mkdir(%s), %s", dir, strerror(errno));
+    return false;
+  }
+
+  directory = opendir(dir);
+  if(directory == NULL) {
+    SYSLOG_ERR("opendir(%s), %s", dir, strerror(errno));
+    return false;
+  }
+
+  while((entry = readdir(directory)) != NULL) {
+    length = 0;
+    if(sscanf(entry->d_name, "journal-%lu.seg%n", &id, &length) != 1
+        || length != (int) strlen(entry->d_name)) {
+      continue;
+    }
+
+    if(idCount == idSize) {
+      idSize = idSize * 2 + PROXYJOURNAL_MAX_SEGMENTS;
+      grown = (unsigned long *) realloc(ids, idSize * sizeof(unsigned long));
+      if(grown == NULL) {
+        break;
+      }
+      ids = grown;
+    }
+    ids[idCount++] = id;
+  }
+  closedir(directory);
+
+  qsort(ids, idCount, sizeof(unsigned long), _proxyjournal_compareIds);
+
+  for(i = 0; i < idCount; i++) {
+    if(idCount - i > PROXYJOURNAL_MAX_SEGMENTS) {
+      // Left over from a larger cap
+      _proxyjournal_path(journal, ids[i], path, sizeof(path));
+      unlink(path);
+      continue;
+    }
+
+    if(_proxyjournal_map(journal, ids[i], false)) {
+      _proxyjournal_recover(journal, &journal->segments[journal->segmentCount - 1]);
+    }
+    journal->nextId = ids[i] + 1;
+  }
+  free(ids);
+
+  // Only now, so a journal that failed to open has nothing to destroy
+  pthread_mutex_init(&journal->mutex, NULL);
+  journal->opened = true;
+  journal->stats.segments = journal->segmentCount;
+
+  if(journal->stats.records > 0) {
+    SYSLOG_INFO("%lu messages (%llu bytes) to replay from %s", journal->stats.records,
+        journal->stats.bytes, dir);
+  }
+  return true;
+}
+
+/**
+ * Force the records to flash and close the journal
+ * @param journal Journal opened by proxyjournal_open()
+ */
+void proxyjournal_close(proxyjournal_t *journal) {
+  int i;
+
+  if(!journal->opened) {
+    return;
+  }
+
+  pthread_mutex_lock(&journal->mutex);
+  _proxyjournal_syncLocked(journal);
+
+  for(i = 0; i < journal->segmentCount; i++) {
+    munmap(journal->segments[i].map, PROXYJOURNAL_SEGMENT_SIZE);
+  }
+  journal->segmentCount = 0;
+  journal->opened = false;
+  pthread_mutex_unlock(&journal->mutex);
+
+  pthread_mutex_destroy(&journal->mutex);
+}
+
+/**
+ * Append a message at the end of the journal
+ *
+ * @param journal Journal
+ * @param data Message
+ * @param length Length of the message
+ * @return true if the message is in the journal
+ */
+bool proxyjournal_append(proxyjournal_t *journal, const char *data, int length) {
+  struct iovec segment;
+
+  segment.iov_base = (void *) data;
+  segment.iov_len = length;
+  return proxyjournal_appendv(journal, &segment, 1);
+}
+
+/**
+ * Append a message made of several segments at the end of the journal, as
+ * one record
+ *
+ * @param journal Journal
+ * @param segments Segments of the message
+ * @param count Number of segments
+ * @return true if the message is in the journal
+ */
+bool proxyjournal_appendv(proxyjournal_t *journal, const struct iovec *segments, int count) {
+  proxyjournal_segment_t *segment;
+  proxyjournal_record_t *record;
+  uint32_t size;
+  char *data;
+  int length = 0;
+  int i;
+
+  for(i = 0; i < count; i++) {
+    length += segments[i].iov_len;
+  }
+  size = PROXYJOURNAL_RECORD_SIZE(length);
+
+  if(!journal->opened || length <= 0 || size > PROXYJOURNAL_SEGMENT_SIZE) {
+    return false;
+  }
+
+  pthread_mutex_lock(&journal->mutex);
+
+  segment = journal->segmentCount > 0 ? &journal->segments[journal->segmentCount - 1] : NULL;
+  if(segment == NULL || segment->writeOffset + size > PROXYJOURNAL_SEGMENT_SIZE) {
+    if(journal->segmentCount == PROXYJOURNAL_MAX_SEGMENTS) {
+      SYSLOG_WARNING("Journal full, dropping its oldest messages");
+      _proxyjournal_removeOldest(journal, true);
+    }
+
+    if(!_proxyjournal_map(journal, journal->nextId, true)) {
+      pthread_mutex_unlock(&journal->mutex);
+      return false;
+    }
+    journal->nextId++;
+    segment = &journal->segments[journal->segmentCount - 1];
+  }
+
+  record = (proxyjournal_record_t *) (segment->map + segment->writeOffset);
+  record->length = length;
+  data = (char *) (record + 1);
+  for(i = 0; i < count; i++) {
+    memcpy(data, segments[i].iov_base, segments[i].iov_len);
+    data += segments[i].iov_len;
+  }
+  record->crc = _proxyjournal_crc(record);
+
+  // The magic number goes last: until it is there, the record doesn't exist
+  record->magic = PROXYJOURNAL_MAGIC_PENDING;
+  segment->writeOffset += size;
+
+  journal->stats.appended++;
+  journal->stats.records++;
+  journal->stats.bytes += length;
+  journal->stats.segments = journal->segmentCount;
+
+  if(journal->dirtyMs == 0) {
+    journal->dirtyMs = _proxyjournal_now();
+  }
+  pthread_mutex_unlock(&journal->mutex);
+
+  return true;
+}
+
+/**
+ * Copy the oldest message not replayed yet, skipping the corrupted ones
+ *
+ * @param journal Journal
+ * @param buffer Where to copy the message
+ * @param maxLength Size of the buffer
+ * @return the length of the message, 0 if there is none
+ */
+int proxyjournal_peek(proxyjournal_t *journal, char *buffer, int maxLength) {
+  struct iovec segment;
+
+  segment.iov_base = buffer;
+  segment.iov_len = maxLength;
+  return proxyjournal_peekv(journal, &segment, 1);
+}
+
+/**
+ * Copy the oldest message not replayed yet across several segments, skipping
+ * the corrupted ones. A message larger than the segments is dropped.
+ *
+ * @param journal Journal
+ * @param segments Where to copy the message, filled in order
+ * @param count Number of segments
+ * @return the length of the message, 0 if there is none
+ */
+int proxyjournal_peekv(proxyjournal_t *journal, const struct iovec *segments, int count) {
+  proxyjournal_segment_t *segment;
+  proxyjournal_record_t *record;
+  const char *data;
+  int maxLength = 0;
+  int length = 0;
+  int copied;
+  int i;
+
+  if(!journal->opened) {
+    return 0;
+  }
+
+  for(i = 0; i < count; i++) {
+    maxLength += segments[i].iov_len;
+  }
+
+  pthread_mutex_lock(&journal->mutex);
+
+  while(journal->segmentCount > 0 && length == 0) {
+    segment = &journal->segments[0];
+
+    if(journal->readOffset + sizeof(proxyjournal_record_t) > segment->writeOffset) {
+      if(journal->segmentCount == 1) {
+        // Records lost to a corruption can't be counted
+        journal->stats.records = 0;
+        journal->stats.bytes = 0;
+        break;
+      }
+      _proxyjournal_removeOldest(journal, false);
+      continue;
+    }
+
+    record = _proxyjournal_record(segment, journal->readOffset, true);
+    if(record == NULL) {
+      // The length can't be trusted, nothing after it in the segment can be found
+      SYSLOG_ERR("Corrupted record in journal segment %lu", segment->id);
+      journal->stats.corrupted++;
+      journal->readOffset = segment->writeOffset;
+      continue;
+    }
+
+    if(record->magic == PROXYJOURNAL_MAGIC_PENDING) {
+      if((int) record->length <= maxLength) {
+        length = record->length;
+        data = (const char *) (record + 1);
+        for(i = 0; i < count && length > 0; i++) {
+          copied = length < (int) segments[i].iov_len ? length : (int) segments[i].iov_len;
+          memcpy(segments[i].iov_base, data, copied);
+          data += copied;
+          length -= copied;
+        }
+        length = record->length;
+        break;
+      }
+
+      SYSLOG_ERR("Journal record of %u bytes larger than %d, dropped", record->length, maxLength);
+      record->magic = PROXYJOURNAL_MAGIC_SENT;
+      journal->stats.dropped++;
+      journal->stats.records--;
+      journal->stats.bytes -= record->length;
+    }
+
+    journal->readOffset += PROXYJOURNAL_RECORD_SIZE(record->length);
+  }
+
+  pthread_mutex_unlock(&journal->mutex);
+  return length;
+}
+
+/**
+ * The message returned by proxyjournal_peek() was delivered: mark it as sent
+ * and pace the next one
+ *
+ * @param journal Journal
+ */
+void proxyjournal_ack(proxyjournal_t *journal) {
+  proxyjournal_segment_t *segment;
+  proxyjournal_record_t *record;
+  unsigned long long now = _proxyjournal_now();
+  unsigned long long elapsedMs;
+
+  if(!journal->opened || journal->segmentCount == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&journal->mutex);
+  segment = &journal->segments[0];
+  record = _proxyjournal_record(segment, journal->readOffset, false);
+
+  if(record != NULL && record->magic == PROXYJOURNAL_MAGIC_PENDING) {
+    record->magic = PROXYJOURNAL_MAGIC_SENT;
+    journal->readOffset += PROXYJOURNAL_RECORD_SIZE(record->length);
+
+    journal->stats.replayed++;
+    journal->stats.replayedBytes += record->length;
+    journal->stats.records--;
+    journal->stats.bytes -= record->length;
+
+    // Recent throughput, averaged over the last few records
+    elapsedMs = now > journal->lastReplayMs ? now - journal->lastReplayMs : 1;
+    if(journal->lastReplayMs == 0 || elapsedMs > 60000) {
+      elapsedMs = 1000;
+    }
+    journal->stats.replayBytesPerSec = (journal->stats.replayBytesPerSec * 7
+        + (unsigned long) (record->length * 1000ULL / elapsedMs)) / 8;
+    journal->lastReplayMs = now;
+
+    if(journal->nextReplayMs < now) {
+      journal->nextReplayMs = now;
+    }
+    journal->nextReplayMs += record->length * 1000ULL / PROXYJOURNAL_REPLAY_BYTES_PER_SEC;
+
+    if(journal->dirtyMs == 0) {
+      journal->dirtyMs = now;
+    }
+  }
+
+  if(journal->readOffset >= segment->writeOffset) {
+    // Everything was sent, the space can be reclaimed
+    _proxyjournal_removeOldest(journal, false);
+  }
+  pthread_mutex_unlock(&journal->mutex);
+}
+
+/**
+ * @param journal Journal
+ * @return true if no message waits to be replayed
+ */
+bool proxyjournal_isEmpty(proxyjournal_t *journal) {
+  return !journal->opened || journal->stats.records == 0;
+}
+
+/**
+ * @param journal Journal
+ * @return the time to wait before replaying the next message, 0 to replay it now
+ */
+unsigned int proxyjournal_replayDelayMs(proxyjournal_t *journal) {
+  unsigned long long now = _proxyjournal_now();
+
+  if(journal->nextReplayMs <= now) {
+    return 0;
+  }
+  return (unsigned int) (journal->nextReplayMs - now);
+}
+
+/**
+ * Force the new records to flash if they waited long enough
+ *
+ * @param journal Journal
+ * @param force true to force them now
+ */
+void proxyjournal_sync(proxyjournal_t *journal, bool force) {
+  if(!journal->opened || journal->dirtyMs == 0) {
+    return;
+  }
+
+  if(force || _proxyjournal_now() >= journal->dirtyMs + PROXYJOURNAL_SYNC_INTERVAL_MS) {
+    pthread_mutex_lock(&journal->mutex);
+    _proxyjournal_syncLocked(journal);
+    pthread_mutex_unlock(&journal->mutex);
+  }
+}
+
+/**
+ * @param journal Journal
+ * @return the time in ms before proxyjournal_sync() must be called, -1 if
+ *     there is nothing to force to flash
+ */
+int proxyjournal_syncTimeoutMs(proxyjournal_t *journal) {
+  unsigned long long now;
+
+  if(!journal->opened || journal->dirtyMs == 0) {
+    return -1;
+  }
+
+  now = _proxyjournal_now();
+  if(now >= journal->dirtyMs + PROXYJOURNAL_SYNC_INTERVAL_MS) {
+    return 0;
+  }
+  return (int) (journal->dirtyMs + PROXYJOURNAL_SYNC_INTERVAL_MS - now);
+}
+
+/**
+ * Read the metrics of the journal: depth, replay throughput and losses
+ *
+ * @param journal Journal
+ * @param stats Destination of the metrics
+ */
+void proxyjournal_getStats(proxyjournal_t *journal, proxyjournal_stats_t *stats) {
+  if(!journal->opened) {
+    memset(stats, 0, sizeof(proxyjournal_stats_t));
+    return;
+  }
+
+  pthread_mutex_lock(&journal->mutex);
+  *stats = journal->stats;
+  pthread_mutex_unlock(&journal->mutex);
+}
+
+/***************** Private Functions ****************/
+/**
+ * @return the monotonic time in ms
+ */
+static unsigned long long _proxyjournal_now() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Path of a segment file
+ *
+ * @return false if the path doesn't fit, errno is then ENAMETOOLONG
+ */
+static bool _proxyjournal_path(proxyjournal_t *journal, unsigned long id, char *path, int pathSize) {
+  if(snprintf(path, pathSize, "%s/journal-%08lu.seg", journal->dir, id) >= pathSize) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Map a segment file after the newest segment
+ *
+ * @param journal Journal, locked
+ * @param id Id of the segment
+ * @param create true to create a new, empty segment
+ * @return true if the segment was added
+ */
+static bool _proxyjournal_map(proxyjournal_t *journal, unsigned long id, bool create) {
+  proxyjournal_segment_t *segment = &journal->segments[journal->segmentCount];
+  char path[PATH_MAX];
+  struct stat status;
+  int fd;
+
+  _proxyjournal_path(journal, id, path, sizeof(path));
+
+  fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+  if(fd < 0) {
+    SYSLOG_ERR("open(%s), %s", path, strerror(errno));
+    return false;
+  }
+
+  // A new file reads as zeros: no record
+  if(fstat(fd, &status) < 0 || (status.st_size < PROXYJOURNAL_SEGMENT_SIZE
+      && ftruncate(fd, PROXYJOURNAL_SEGMENT_SIZE) < 0)) {
+    SYSLOG_ERR("Sizing %s, %s", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  segment->map = (char *) mmap(NULL, PROXYJOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(segment->map == MAP_FAILED) {
+    SYSLOG_ERR("mmap(%s), %s", path, strerror(errno));
+    return false;
+  }
+
+  segment->id = id;
+  segment->writeOffset = 0;
+  journal->segmentCount++;
+  journal->stats.segments = journal->segmentCount;
+  return true;
+}
+
+/**
+ * Find the end of the records of a segment mapped at startup, and count the
+ * ones to replay. The records stop at the first one torn by a power failure.
+ *
+ * @param journal Journal
+ * @param segment Segment to scan
+ */
+static void _proxyjournal_recover(proxyjournal_t *journal, proxyjournal_segment_t *segment) {
+  proxyjournal_record_t *record;
+
+  while((record = _proxyjournal_record(segment, segment->writeOffset, true)) != NULL) {
+    if(record->magic == PROXYJOURNAL_MAGIC_PENDING) {
+      journal->stats.records++;
+      journal->stats.bytes += record->length;
+    }
+    segment->writeOffset += PROXYJOURNAL_RECORD_SIZE(record->length);
+  }
+}
+
+/**
+ * @param segment Segment
+ * @param offset Offset of the record in the segment
+ * @param checkCrc true to check the message of a record to replay
+ * @return the record, NULL if there is no valid record there
+ */
+static proxyjournal_record_t *_proxyjournal_record(proxyjournal_segment_t *segment, uint32_t offset, bool checkCrc) {
+  proxyjournal_record_t *record;
+
+  if(offset + sizeof(proxyjournal_record_t) > PROXYJOURNAL_SEGMENT_SIZE) {
+    return NULL;
+  }
+
+  record = (proxyjournal_record_t *) (segment->map + offset);
+
+  if((record->magic != PROXYJOURNAL_MAGIC_PENDING && record->magic != PROXYJOURNAL_MAGIC_SENT)
+      || record->length > PROXYJOURNAL_SEGMENT_SIZE
+      || offset + PROXYJOURNAL_RECORD_SIZE(record->length) > PROXYJOURNAL_SEGMENT_SIZE) {
+    return NULL;
+  }
+
+  if(checkCrc && record->magic == PROXYJOURNAL_MAGIC_PENDING && record->crc != _proxyjournal_crc(record)) {
+    return NULL;
+  }
+
+  return record;
+}
+
+/**
+ * @param record Record
+ * @return the CRC-32 of its length and message
+ */
+static uint32_t _proxyjournal_crc(const proxyjournal_record_t *record) {
+  uLong crc = crc32(0L, Z_NULL, 0);
+
+  crc = crc32(crc, (const Bytef *) &record->length, sizeof(record->length));
+  crc = crc32(crc, (const Bytef *) (record + 1), record->length);
+  return (uint32_t) crc;
+}
+
+/**
+ * Delete the oldest segment
+ *
+ * @param journal Journal, locked
+ * @param dropped true if its messages to replay are lost
+ */
+static void _proxyjournal_removeOldest(proxyjournal_t *journal, bool dropped) {
+  proxyjournal_segment_t *segment = &journal->segments[0];
+  proxyjournal_record_t *record;
+  char path[PATH_MAX];
+  uint32_t offset = journal->readOffset;
+
+  while(offset < segment->writeOffset
+      && (record = _proxyjournal_record(segment, offset, false)) != NULL) {
+    if(record->magic == PROXYJOURNAL_MAGIC_PENDING) {
+      if(dropped) {
+        journal->stats.dropped++;
+      } else {
+        journal->stats.corrupted++;
+      }
+      journal->stats.records--;
+      journal->stats.bytes -= record->length;
+    }
+    offset += PROXYJOURNAL_RECORD_SIZE(record->length);
+  }
+
+  munmap(segment->map, PROXYJOURNAL_SEGMENT_SIZE);
+  _proxyjournal_path(journal, segment->id, path, sizeof(path));
+  if(unlink(path) < 0) {
+    SYSLOG_ERR("unlink(%s), %s", path, strerror(errno));
+  }
+
+  journal->segmentCount--;
+  memmove(&journal->segments[0], &journal->segments[1], journal->segmentCount * sizeof(proxyjournal_segment_t));
+  journal->readOffset = 0;
+  journal->stats.segments = journal->segmentCount;
+}
+
+/**
+ * Force the segments to flash
+ * @param journal Journal, locked
+ */
+static void _proxyjournal_syncLocked(proxyjournal_t *journal) {
+  int i;
+
+  if(journal->dirtyMs == 0) {
+    return;
+  }
+
+  for(i = 0; i < journal->segmentCount; i++) {
+    if(msync(journal->segments[i].map, PROXYJOURNAL_SEGMENT_SIZE, MS_SYNC) < 0) {
+      SYSLOG_ERR("msync, %s", strerror(errno));
+    }
+  }
+
+  journal->dirtyMs = 0;
+  journal->stats.syncs++;
+}
+
+/**
+ * Sort the ids of the segments from the oldest
+ */
+static int _proxyjournal_compareIds(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *) a;
+  unsigned long y = *(const unsigned long *) b;
+
+  return x < y ? -1 : x > y;
+}
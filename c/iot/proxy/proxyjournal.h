@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef PROXYJOURNAL_H
+#define PROXYJOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/** Size of a segment file, can be overridden at compile time */
+#ifndef PROXYJOURNAL_SEGMENT_SIZE
+#define PROXYJOURNAL_SEGMENT_SIZE (256 * 1024)
+#endif
+
+/** Most segment files on disk, the oldest one is dropped past it, can be overridden at compile time */
+#ifndef PROXYJOURNAL_MAX_SEGMENTS
+#define PROXYJOURNAL_MAX_SEGMENTS 16
+#endif
+
+/** Longest time new records wait before being forced to flash, can be overridden at compile time */
+#ifndef PROXYJOURNAL_SYNC_INTERVAL_MS
+#define PROXYJOURNAL_SYNC_INTERVAL_MS 5000
+#endif
+
+/** Pace of the replay, so live messages still get through, can be overridden at compile time */
+#ifndef PROXYJOURNAL_REPLAY_BYTES_PER_SEC
+#define PROXYJOURNAL_REPLAY_BYTES_PER_SEC 4096
+#endif
+
+/** Metrics of a journal, see proxyjournal_getStats() */
+typedef struct proxyjournal_stats_t {
+  /** Records waiting to be replayed */
+  unsigned long records;
+
+  /** Bytes waiting to be replayed */
+  unsigned long long bytes;
+
+  unsigned int segments;
+
+  unsigned long appended;
+
+  unsigned long replayed;
+
+  unsigned long long replayedBytes;
+
+  /** Recent replay throughput */
+  unsigned long replayBytesPerSec;
+
+  /** Records lost to the size cap */
+  unsigned long dropped;
+
+  /** Records skipped because of a bad CRC */
+  unsigned long corrupted;
+
+  /** Times new records were forced to flash */
+  unsigned long syncs;
+} proxyjournal_stats_t;
+
+/** One segment file, mapped in memory */
+typedef struct proxyjournal_segment_t {
+  unsigned long id;
+
+  char *map;
+
+  /** End of the records of the segment */
+  uint32_t writeOffset;
+} proxyjournal_segment_t;
+
+/** Append-only journal of the messages the server couldn't take */
+typedef struct proxyjournal_t {
+  /** Protects the stats, the rest is only used by the thread owning the journal */
+  pthread_mutex_t mutex;
+
+  char dir[PATH_MAX];
+
+  bool opened;
+
+  /** Segments from the oldest to the newest */
+  proxyjournal_segment_t segments[PROXYJOURNAL_MAX_SEGMENTS];
+
+  int segmentCount;
+
+  /** Next record to replay, in the oldest segment */
+  uint32_t readOffset;
+
+  /** Next id of a segment file */
+  unsigned long nextId;
+
+  /** Monotonic time in ms of the oldest record not forced to flash, 0 if none */
+  unsigned long long dirtyMs;
+
+  /** Monotonic time in ms the next record can be replayed */
+  unsigned long long nextReplayMs;
+
+  unsigned long long lastReplayMs;
+
+  proxyjournal_stats_t stats;
+} proxyjournal_t;
+
+/***************** Public Prototypes ****************/
+bool proxyjournal_open(proxyjournal_t *journal, const char *dir);
+
+void proxyjournal_close(proxyjournal_t *journal);
+
+bool proxyjournal_append(proxyjournal_t *journal, const char *data, int length);
+
+bool proxyjournal_appendv(proxyjournal_t *journal, const struct iovec *segments, int count);
+
+int proxyjournal_peek(proxyjournal_t *journal, char *buffer, int maxLength);
+
+int proxyjournal_peekv(proxyjournal_t *journal, const struct iovec *segments, int count);
+
+void proxyjournal_ack(proxyjournal_t *journal);
+
+bool proxyjournal_isEmpty(proxyjournal_t *journal);
+
+unsigned int proxyjournal_replayDelayMs(proxyjournal_t *journal);
+
+void proxyjournal_sync(proxyjournal_t *journal, bool force);
+
+int proxyjournal_syncTimeoutMs(proxyjournal_t *journal);
+
+void proxyjournal_getStats(proxyjournal_t *journal, proxyjournal_stats_t *stats);
+
+#endif
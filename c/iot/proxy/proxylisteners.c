@@ -55,7 +55,39 @@ static struct {
 
 } proxyListeners[TOTAL_PROXY_LISTENERS];
 
-/** Mutex to protect proxyListeners */
+/** Array of response listeners */
+static struct {
+
+  proxyresponselistener l;
+
+  bool inUse;
+
+} proxyResponseListeners[TOTAL_PROXY_LISTENERS];
+
+/** Array of stream listeners */
+static struct {
+
+  proxystreamlistener l;
+
+  bool inUse;
+
+} proxyStreamListeners[TOTAL_PROXY_LISTENERS];
+
+/** Array of queue listeners */
+static struct {
+
+  proxyqueuelistener l;
+
+  bool inUse;
+
+} proxyQueueListeners[TOTAL_PROXY_LISTENERS];
+
+/**
+ * Mutex to protect proxyListeners, proxyResponseListeners, proxyStreamListeners
+ * and proxyQueueListeners. It is never held while a listener runs: a listener
+ * may send to the server, which tells the queue listeners when a queue fills
+ * up. A listener removed during a broadcast may still get that broadcast.
+ */
 static pthread_mutex_t sProxyListenersMutex;
 
 
@@ -137,6 +169,76 @@ error_t proxylisteners_removeListener(proxylistener l) {
  * @param len Length of the message
  */
 error_t proxylisteners_broadcast(const char *msg, int len) {
+  return proxylisteners_broadcastResponse(msg, len, NULL);
+}
+
+/**
+ * Add a listener to the messages sent by the server, which also gets what
+ * the proxy found in each message: its status and where its commands are.
+ *
+ * @param l Function pointer to a function(const char *msg, int len, const proxyresponse_t *response)
+ * @return SUCCESS if the listener was added
+ */
+error_t proxylisteners_addResponseListener(proxyresponselistener l) {
+  int i;
+
+  pthread_mutex_lock(&sProxyListenersMutex);
+  for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
+    if(proxyResponseListeners[i].inUse && proxyResponseListeners[i].l == l) {
+      SYSLOG_DEBUG("Response listener already exists");
+      pthread_mutex_unlock(&sProxyListenersMutex);
+      return SUCCESS;
+    }
+  }
+
+  for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
+    if(!proxyResponseListeners[i].inUse) {
+      SYSLOG_DEBUG("Adding proxy response listener to element %d", i);
+      proxyResponseListeners[i].inUse = true;
+      proxyResponseListeners[i].l = l;
+      pthread_mutex_unlock(&sProxyListenersMutex);
+      return SUCCESS;
+    }
+  }
+  pthread_mutex_unlock(&sProxyListenersMutex);
+
+  return FAIL;
+}
+
+/**
+ * Remove a response listener from the proxy
+ * @param l Function pointer to remove
+ * @return SUCCESS if the listener was found and removed
+ */
+error_t proxylisteners_removeResponseListener(proxyresponselistener l) {
+  int i;
+
+  pthread_mutex_lock(&sProxyListenersMutex);
+  for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
+    if(proxyResponseListeners[i].inUse && proxyResponseListeners[i].l == l) {
+      SYSLOG_DEBUG("Removing proxy response listener at element %d", i);
+      proxyResponseListeners[i].inUse = false;
+      pthread_mutex_unlock(&sProxyListenersMutex);
+      return SUCCESS;
+    }
+  }
+  pthread_mutex_unlock(&sProxyListenersMutex);
+
+  return FAIL;
+}
+
+/**
+ * Broadcast a message to all proxy listeners and response listeners
+ * @param msg Message to broadcast
+ * @param len Length of the message
+ * @param response What the message holds, NULL to classify it here if a response listener needs it
+ */
+error_t proxylisteners_broadcastResponse(const char *msg, int len, const proxyresponse_t *response) {
+  proxylistener listeners[TOTAL_PROXY_LISTENERS];
+  proxyresponselistener responseListeners[TOTAL_PROXY_LISTENERS];
+  proxyresponse_t classified;
+  int count = 0;
+  int responseCount = 0;
   int i;
 
   if(*msg && len > 0) {
@@ -145,12 +247,28 @@ error_t proxylisteners_broadcast(const char *msg, int len) {
     pthread_mutex_lock(&sProxyListenersMutex);
     for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
       if(proxyListeners[i].inUse) {
-        SYSLOG_INFO("[broadcast]: Broadcasting to known client");
-        proxyListeners[i].l(msg, len);
+        listeners[count++] = proxyListeners[i].l;
+      }
+
+      if(proxyResponseListeners[i].inUse) {
+        responseListeners[responseCount++] = proxyResponseListeners[i].l;
       }
     }
     pthread_mutex_unlock(&sProxyListenersMutex);
 
+    for(i = 0; i < count; i++) {
+      SYSLOG_INFO("[broadcast]: Broadcasting to known client");
+      listeners[i](msg, len);
+    }
+
+    for(i = 0; i < responseCount; i++) {
+      if(response == NULL) {
+        proxyresponse_classify(&classified, msg, len);
+        response = &classified;
+      }
+      responseListeners[i](msg, len, response);
+    }
+
   } else {
     SYSLOG_INFO("[broadcast]: Nobody to broadcast to :(");
     return FAIL;
@@ -159,6 +277,165 @@ error_t proxylisteners_broadcast(const char *msg, int len) {
   return SUCCESS;
 }
 
+/**
+ * Add a listener receiving the messages sent by the server chunk by chunk,
+ * as they arrive, so it can act on them before the whole message is in.
+ *
+ * @param l Function pointer to a function(proxystream_e event, const char *data, int len)
+ * @return SUCCESS if the listener was added
+ */
+error_t proxylisteners_addStreamListener(proxystreamlistener l) {
+  int i;
+
+  pthread_mutex_lock(&sProxyListenersMutex);
+  for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
+    if(proxyStreamListeners[i].inUse && proxyStreamListeners[i].l == l) {
+      SYSLOG_DEBUG("Stream listener already exists");
+      pthread_mutex_unlock(&sProxyListenersMutex);
+      return SUCCESS;
+    }
+  }
+
+  for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
+    if(!proxyStreamListeners[i].inUse) {
+      SYSLOG_DEBUG("Adding proxy stream listener to element %d", i);
+      proxyStreamListeners[i].inUse = true;
+      proxyStreamListeners[i].l = l;
+      pthread_mutex_unlock(&sProxyListenersMutex);
+      return SUCCESS;
+    }
+  }
+  pthread_mutex_unlock(&sProxyListenersMutex);
+
+  return FAIL;
+}
+
+/**
+ * Remove a stream listener from the proxy
+ * @param l Function pointer to remove
+ * @return SUCCESS if the listener was found and removed
+ */
+error_t proxylisteners_removeStreamListener(proxystreamlistener l) {
+  int i;
+
+  pthread_mutex_lock(&sProxyListenersMutex);
+  for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
+    if(proxyStreamListeners[i].inUse && proxyStreamListeners[i].l == l) {
+      SYSLOG_DEBUG("Removing proxy stream listener at element %d", i);
+      proxyStreamListeners[i].inUse = false;
+      pthread_mutex_unlock(&sProxyListenersMutex);
+      return SUCCESS;
+    }
+  }
+  pthread_mutex_unlock(&sProxyListenersMutex);
+
+  return FAIL;
+}
+
+/**
+ * Hand an event of the message being received to all stream listeners
+ * @param event What happened to the message
+ * @param data Next chunk of the message for PROXYSTREAM_DATA, NULL otherwise
+ * @param len Length of the chunk
+ */
+void proxylisteners_streamBroadcast(proxystream_e event, const char *data, int len) {
+  proxystreamlistener listeners[TOTAL_PROXY_LISTENERS];
+  int count = 0;
+  int i;
+
+  pthread_mutex_lock(&sProxyListenersMutex);
+  for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
+    if(proxyStreamListeners[i].inUse) {
+      listeners[count++] = proxyStreamListeners[i].l;
+    }
+  }
+  pthread_mutex_unlock(&sProxyListenersMutex);
+
+  // Commands run in the listeners, and send their results to the server
+  for(i = 0; i < count; i++) {
+    listeners[i](event, data, len);
+  }
+}
+
+/**
+ * Add a listener told when the producers should back off because a queue of
+ * messages to the server is past its high watermark, and when they can go on
+ *
+ * @param l Function pointer to a function(int priority, bool above, int length)
+ * @return SUCCESS if the listener was added
+ */
+error_t proxylisteners_addQueueListener(proxyqueuelistener l) {
+  int i;
+
+  pthread_mutex_lock(&sProxyListenersMutex);
+  for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
+    if(proxyQueueListeners[i].inUse && proxyQueueListeners[i].l == l) {
+      SYSLOG_DEBUG("Queue listener already exists");
+      pthread_mutex_unlock(&sProxyListenersMutex);
+      return SUCCESS;
+    }
+  }
+
+  for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
+    if(!proxyQueueListeners[i].inUse) {
+      SYSLOG_DEBUG("Adding proxy queue listener to element %d", i);
+      proxyQueueListeners[i].inUse = true;
+      proxyQueueListeners[i].l = l;
+      pthread_mutex_unlock(&sProxyListenersMutex);
+      return SUCCESS;
+    }
+  }
+  pthread_mutex_unlock(&sProxyListenersMutex);
+
+  return FAIL;
+}
+
+/**
+ * Remove a queue listener from the proxy
+ * @param l Function pointer to remove
+ * @return SUCCESS if the listener was found and removed
+ */
+error_t proxylisteners_removeQueueListener(proxyqueuelistener l) {
+  int i;
+
+  pthread_mutex_lock(&sProxyListenersMutex);
+  for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
+    if(proxyQueueListeners[i].inUse && proxyQueueListeners[i].l == l) {
+      SYSLOG_DEBUG("Removing proxy queue listener at element %d", i);
+      proxyQueueListeners[i].inUse = false;
+      pthread_mutex_unlock(&sProxyListenersMutex);
+      return SUCCESS;
+    }
+  }
+  pthread_mutex_unlock(&sProxyListenersMutex);
+
+  return FAIL;
+}
+
+/**
+ * Tell all queue listeners a queue crossed one of its watermarks
+ * @param priority Priority of the queue
+ * @param above true past the high watermark, false back to the low watermark
+ * @param length Messages in the queue
+ */
+void proxylisteners_queueBroadcast(int priority, bool above, int length) {
+  proxyqueuelistener listeners[TOTAL_PROXY_LISTENERS];
+  int count = 0;
+  int i;
+
+  pthread_mutex_lock(&sProxyListenersMutex);
+  for(i = 0; i < TOTAL_PROXY_LISTENERS; i++) {
+    if(proxyQueueListeners[i].inUse) {
+      listeners[count++] = proxyQueueListeners[i].l;
+    }
+  }
+  pthread_mutex_unlock(&sProxyListenersMutex);
+
+  for(i = 0; i < count; i++) {
+    listeners[i](priority, above, length);
+  }
+}
+
 /**
  * @return the total number of registered listeners
  */
@@ -171,6 +448,10 @@ int proxylisteners_totalListeners() {
     if(proxyListeners[i].inUse) {
       total++;
     }
+
+    if(proxyResponseListeners[i].inUse) {
+      total++;
+    }
   }
   pthread_mutex_unlock(&sProxyListenersMutex);
 
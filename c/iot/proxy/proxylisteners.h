@@ -35,6 +35,7 @@
 #define PROXYLISTENERS_H
 
 #include "ioterror.h"
+#include "proxyresponse.h"
 
 #ifndef __error_t_defined
 #warning "error_t not defined"
@@ -48,6 +49,34 @@
 /** Proxy listener function pointer definition */
 typedef void (*proxylistener)(const char *, int);
 
+/** Proxy response listener, receiving the classification of the message along with it */
+typedef void (*proxyresponselistener)(const char *msg, int len, const proxyresponse_t *response);
+
+/** Events of a message from the server handed to stream listeners as it arrives */
+typedef enum proxystream_e {
+  /** A new message starts, no data */
+  PROXYSTREAM_BEGIN,
+
+  /** Next chunk of the message */
+  PROXYSTREAM_DATA,
+
+  /** The whole message was received, no data */
+  PROXYSTREAM_END,
+
+  /** The transfer failed before the end of the message, no data */
+  PROXYSTREAM_ABORT,
+} proxystream_e;
+
+/** Proxy stream listener function pointer definition */
+typedef void (*proxystreamlistener)(proxystream_e event, const char *data, int len);
+
+/**
+ * Proxy queue listener, told when the queue of a priority (a proxy_priority_e)
+ * goes past its high watermark and the producers should back off, then when
+ * it's back to its low watermark
+ */
+typedef void (*proxyqueuelistener)(int priority, bool above, int length);
+
 /***************** Public Prototypes ****************/
 void proxylisteners_start();
 
@@ -59,6 +88,24 @@ error_t proxylisteners_removeListener(proxylistener l);
 
 error_t proxylisteners_broadcast(const char *msg, int len);
 
+error_t proxylisteners_addResponseListener(proxyresponselistener l);
+
+error_t proxylisteners_removeResponseListener(proxyresponselistener l);
+
+error_t proxylisteners_broadcastResponse(const char *msg, int len, const proxyresponse_t *response);
+
 int proxylisteners_totalListeners();
 
+error_t proxylisteners_addStreamListener(proxystreamlistener l);
+
+error_t proxylisteners_removeStreamListener(proxystreamlistener l);
+
+void proxylisteners_streamBroadcast(proxystream_e event, const char *data, int len);
+
+error_t proxylisteners_addQueueListener(proxyqueuelistener l);
+
+error_t proxylisteners_removeQueueListener(proxyqueuelistener l);
+
+void proxylisteners_queueBroadcast(int priority, bool above, int length);
+
 #endif
@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+/**
+ * This module carries the messages of the threads of the proxy process to the
+ * thread talking to the server, without a lock or a system call per message.
+ *
+ * The queue is a ring of slots, each one with a sequence number telling the
+ * lap it belongs to (D. Vyukov's bounded queue). Producers copy the message
+ * into buffers of a pool, claim a position with a compare-and-swap, then
+ * publish the slot by moving its sequence. The consumer takes the buffers as
+ * they are. The only consumer reads the slots in order. Before sleeping,
+ * the consumer raises a flag and checks the queue one last time; a producer
+ * only writes the eventfd doorbell when it finds the flag raised.
+ *
+ * Past its high watermark, a queue either drops its oldest messages to make
+ * room (measurements, whose newest values matter most) or keeps taking
+ * messages up to its capacity, and then refuses them (results, that the
+ * producer has to keep). The position to read is claimed with a
+ * compare-and-swap too, since the producers dropping the oldest message take
+ * it from under the consumer. The watermark listener hears about the queue
+ * going past the high watermark, then back to the low one, once each.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "proxyqueue.h"
+#include "iotdebug.h"
+
+/***************** Private Prototypes ****************/
+static bool _proxyqueue_isEmpty(proxyqueue_t *queue);
+
+static int _proxyqueue_take(proxyqueue_t *queue, proxybuffer_chain_t *message, int maxLength);
+
+static void _proxyqueue_taken(proxyqueue_t *queue);
+
+static void _proxyqueue_measure(proxyqueue_t *queue);
+
+/***************** Public Functions ****************/
+/**
+ * Initialize an empty queue
+ *
+ * @param queue Queue to initialize
+ * @param capacity Most messages the queue holds, 0 for the default
+ * @param pool Pool the messages are copied to, shared with the other queues
+ * @return true if the queue could be allocated
+ */
+bool proxyqueue_init(proxyqueue_t *queue, unsigned int capacity, proxybuffer_pool_t *pool) {
+  unsigned long size = 2;
+  unsigned long i;
+
+  memset(queue, 0, sizeof(proxyqueue_t));
+  queue->doorbellFd = -1;
+
+  if(capacity == 0) {
+    capacity = PROXYQUEUE_DEFAULT_CAPACITY;
+  }
+
+  while(size < capacity) {
+    size <<= 1;
+  }
+
+  queue->slots = (proxyqueue_slot_t *) calloc(size, sizeof(proxyqueue_slot_t));
+  if(queue->slots == NULL) {
+    SYSLOG_ERR("Couldn't allocate %lu slots", size);
+    return false;
+  }
+
+  queue->doorbellFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(queue->doorbellFd < 0) {
+    SYSLOG_ERR("eventfd(), %s", strerror(errno));
+    free(queue->slots);
+    queue->slots = NULL;
+    return false;
+  }
+
+  for(i = 0; i < size; i++) {
+    queue->slots[i].sequence = i;
+  }
+  queue->mask = size - 1;
+  queue->pool = pool;
+  queue->highWatermark = size;
+  queue->lowWatermark = size / 2;
+  queue->policy = PROXYQUEUE_DROP_NEVER;
+  return true;
+}
+
+/**
+ * Set the watermarks of a queue and what it does past the high one. Can be
+ * called while the queue is in use.
+ *
+ * @param queue Queue
+ * @param highWatermark Messages past which the queue is above its high watermark, 0 for its capacity
+ * @param lowWatermark Messages the queue must be back to, less than the high watermark
+ * @param policy What to do with new messages past the high watermark
+ */
+void proxyqueue_setLimits(proxyqueue_t *queue, unsigned int highWatermark, unsigned int lowWatermark, proxyqueue_policy_e policy) {
+  if(highWatermark == 0 || highWatermark > queue->mask + 1) {
+    highWatermark = queue->mask + 1;
+  }
+
+  if(lowWatermark >= highWatermark) {
+    lowWatermark = highWatermark - 1;
+  }
+
+  queue->highWatermark = highWatermark;
+  queue->lowWatermark = lowWatermark;
+  queue->policy = policy;
+  __sync_synchronize();
+}
+
+/**
+ * The listener is called by the producer taking the queue past its high
+ * watermark, and by the consumer bringing it back to its low watermark.
+ *
+ * @param queue Queue
+ * @param listener Function to call, NULL for none
+ */
+void proxyqueue_setWatermarkListener(proxyqueue_t *queue, proxyqueue_watermark_f listener) {
+  queue->watermarkListener = listener;
+  __sync_synchronize();
+}
+
+/**
+ * Free the queue and the messages left in it. No thread may use it anymore.
+ * @param queue Queue initialized by proxyqueue_init()
+ */
+void proxyqueue_destroy(proxyqueue_t *queue) {
+  while(_proxyqueue_take(queue, NULL, 0) > 0);
+
+  if(queue->doorbellFd >= 0) {
+    close(queue->doorbellFd);
+    queue->doorbellFd = -1;
+  }
+
+  free(queue->slots);
+  queue->slots = NULL;
+}
+
+/**
+ * Copy a message into the queue. Can be called from any thread.
+ *
+ * @param queue Queue
+ * @param data Message
+ * @param length Length of the message, more than 0
+ * @return PROXYQUEUE_QUEUED, PROXYQUEUE_SHED if older messages were dropped
+ *     for it, PROXYQUEUE_REFUSED if the queue or its pool is full
+ */
+proxyqueue_result_e proxyqueue_push(proxyqueue_t *queue, const char *data, int length) {
+  proxyqueue_result_e result = PROXYQUEUE_QUEUED;
+  proxyqueue_slot_t *slot;
+  unsigned long position;
+  long lap;
+  proxybuffer_chain_t copy;
+
+  memset(&copy, 0, sizeof(copy));
+  if(!proxybuffer_write(queue->pool, &copy, data, length)) {
+    __sync_fetch_and_add(&queue->full, 1);
+    return PROXYQUEUE_REFUSED;
+  }
+
+  while(queue->policy == PROXYQUEUE_DROP_OLDEST
+      && (unsigned long) proxyqueue_length(queue) >= queue->highWatermark) {
+    if(_proxyqueue_take(queue, NULL, 0) <= 0) {
+      // The oldest message is still being written, the capacity is the limit
+      break;
+    }
+    __sync_fetch_and_add(&queue->dropped, 1);
+    result = PROXYQUEUE_SHED;
+  }
+
+  position = queue->tail;
+  for(;;) {
+    slot = &queue->slots[position & queue->mask];
+    __sync_synchronize();
+    lap = (long) (slot->sequence - position);
+
+    if(lap == 0) {
+      if(__sync_bool_compare_and_swap(&queue->tail, position, position + 1)) {
+        break;
+      }
+
+    } else if(lap < 0) {
+      // The consumer didn't free this slot since the last lap
+      __sync_fetch_and_add(&queue->full, 1);
+      proxybuffer_clear(&copy);
+      return PROXYQUEUE_REFUSED;
+    }
+
+    position = queue->tail;
+  }
+
+  slot->message = copy;
+
+  // The message must be visible before the slot is, and the slot before the flag is read
+  __sync_synchronize();
+  slot->sequence = position + 1;
+  __sync_synchronize();
+
+  __sync_fetch_and_add(&queue->pushed, 1);
+  _proxyqueue_measure(queue);
+
+  if(queue->waiting && __sync_bool_compare_and_swap(&queue->waiting, 1, 0)) {
+    __sync_fetch_and_add(&queue->doorbells, 1);
+    if(eventfd_write(queue->doorbellFd, 1) < 0) {
+      SYSLOG_ERR("Couldn't ring the doorbell, %s", strerror(errno));
+    }
+  }
+
+  return result;
+}
+
+/**
+ * Only called by the consumer thread, and only exact on a queue that doesn't
+ * drop its oldest messages
+ *
+ * @param queue Queue
+ * @return the length of the next message, 0 if the queue is empty
+ */
+int proxyqueue_peek(proxyqueue_t *queue) {
+  if(_proxyqueue_isEmpty(queue)) {
+    return 0;
+  }
+
+  return queue->slots[queue->head & queue->mask].message.length;
+}
+
+/**
+ * Take the next message out of the queue, only if it fits. Only called by the
+ * consumer thread.
+ *
+ * @param queue Queue
+ * @param buffer Where to copy the message, NULL to drop it
+ * @param maxLength Size of the buffer
+ * @return the length of the message, 0 if the queue is empty or the message
+ *     doesn't fit in the buffer
+ */
+int proxyqueue_pop(proxyqueue_t *queue, char *buffer, int maxLength) {
+  proxybuffer_chain_t message;
+  int length;
+
+  if(buffer == NULL) {
+    length = _proxyqueue_take(queue, NULL, 0);
+
+  } else if((length = _proxyqueue_take(queue, &message, maxLength)) > 0) {
+    proxybuffer_read(&message, buffer, maxLength);
+    proxybuffer_clear(&message);
+  }
+
+  if(length > 0) {
+    _proxyqueue_taken(queue);
+  }
+
+  return length;
+}
+
+/**
+ * Take the next message out of the queue without copying it, only if it is
+ * not too long. Only called by the consumer thread.
+ *
+ * @param queue Queue
+ * @param message Receives the buffers of the message, for the caller to release
+ * @param maxLength Longest message taken
+ * @return the length of the message, 0 if the queue is empty or the message
+ *     is too long
+ */
+int proxyqueue_popChain(proxyqueue_t *queue, proxybuffer_chain_t *message, int maxLength) {
+  int length = _proxyqueue_take(queue, message, maxLength);
+
+  if(length > 0) {
+    _proxyqueue_taken(queue);
+  }
+
+  return length;
+}
+
+/**
+ * Tell the producers the consumer is about to sleep, so the next message
+ * rings the doorbell. Only called by the consumer thread.
+ *
+ * @param queue Queue
+ * @return true if the consumer can sleep until the doorbell rings, false if
+ *     messages are already waiting
+ */
+bool proxyqueue_sleep(proxyqueue_t *queue) {
+  queue->waiting = 1;
+  __sync_synchronize();
+
+  if(!_proxyqueue_isEmpty(queue)) {
+    queue->waiting = 0;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Can be called from any thread
+ *
+ * @param queue Queue
+ * @return the number of messages in the queue, counting the ones being written
+ */
+int proxyqueue_length(proxyqueue_t *queue) {
+  unsigned long tail = queue->tail;
+  long length;
+
+  // The tail first, the length can be short but never beyond the capacity
+  __sync_synchronize();
+  length = (long) (tail - queue->head);
+  return length > 0 ? (int) length : 0;
+}
+
+/**
+ * @param queue Queue
+ * @return the eventfd the consumer sleeps on, readable once the doorbell rang
+ */
+int proxyqueue_getDoorbell(proxyqueue_t *queue) {
+  return queue->doorbellFd;
+}
+
+/**
+ * Silence the doorbell after it woke the consumer up
+ * @param queue Queue
+ */
+void proxyqueue_ackDoorbell(proxyqueue_t *queue) {
+  eventfd_t rings;
+
+  eventfd_read(queue->doorbellFd, &rings);
+}
+
+/**
+ * Read the metrics of a queue
+ *
+ * @param queue Queue
+ * @param stats Destination of the metrics
+ */
+void proxyqueue_getStats(proxyqueue_t *queue, proxyqueue_stats_t *stats) {
+  __sync_synchronize();
+  stats->pushed = queue->pushed;
+  stats->full = queue->full;
+  stats->dropped = queue->dropped;
+  stats->doorbells = queue->doorbells;
+  stats->highWatermarks = queue->highWatermarks;
+  stats->length = proxyqueue_length(queue);
+  stats->maxLength = queue->maxLength;
+}
+
+/***************** Private Functions ****************/
+/**
+ * @param queue Queue
+ * @return true if the next slot of the consumer wasn't published yet
+ */
+static bool _proxyqueue_isEmpty(proxyqueue_t *queue) {
+  unsigned long sequence = queue->slots[queue->head & queue->mask].sequence;
+
+  // The message must not be read before the sequence publishing it
+  __sync_synchronize();
+  return (long) (sequence - (queue->head + 1)) < 0;
+}
+
+/**
+ * Take the oldest message out of the queue, only if it fits. The consumer
+ * and the producers dropping the oldest message race for it.
+ *
+ * @param queue Queue
+ * @param message Receives the buffers of the message, NULL to release them
+ * @param maxLength Longest message taken, unless it is released
+ * @return the length of the message, 0 if the queue is empty or the message
+ *     is too long
+ */
+static int _proxyqueue_take(proxyqueue_t *queue, proxybuffer_chain_t *message, int maxLength) {
+  proxyqueue_slot_t *slot;
+  unsigned long position;
+  long lap;
+  int length;
+
+  position = queue->head;
+  for(;;) {
+    slot = &queue->slots[position & queue->mask];
+    __sync_synchronize();
+    lap = (long) (slot->sequence - (position + 1));
+
+    if(lap == 0) {
+      length = slot->message.length;
+      if(message != NULL && length > maxLength) {
+        return 0;
+      }
+
+      if(__sync_bool_compare_and_swap(&queue->head, position, position + 1)) {
+        break;
+      }
+
+    } else if(lap < 0) {
+      // The message at this position isn't published yet
+      return 0;
+    }
+
+    position = queue->head;
+  }
+
+  if(message != NULL) {
+    *message = slot->message;
+
+  } else {
+    proxybuffer_clear(&slot->message);
+  }
+
+  // Hand the slot over to the producers of the next lap
+  __sync_synchronize();
+  slot->sequence = position + queue->mask + 1;
+
+  return length;
+}
+
+/**
+ * Tell the listener once the queue is back to its low watermark
+ *
+ * @param queue Queue a message was just taken from by the consumer
+ */
+static void _proxyqueue_taken(proxyqueue_t *queue) {
+  proxyqueue_watermark_f listener;
+
+  if(queue->above
+      && (unsigned long) proxyqueue_length(queue) <= queue->lowWatermark
+      && __sync_bool_compare_and_swap(&queue->above, 1, 0)) {
+    listener = queue->watermarkListener;
+    if(listener != NULL) {
+      listener(queue, false);
+    }
+  }
+}
+
+/**
+ * Keep the most messages the queue held, and tell the listener once the queue
+ * goes past its high watermark
+ *
+ * @param queue Queue a message was just pushed to
+ */
+static void _proxyqueue_measure(proxyqueue_t *queue) {
+  proxyqueue_watermark_f listener;
+  unsigned long length = proxyqueue_length(queue);
+  unsigned long maxLength;
+
+  do {
+    maxLength = queue->maxLength;
+  } while(length > maxLength && !__sync_bool_compare_and_swap(&queue->maxLength, maxLength, length));
+
+  if(length >= queue->highWatermark && !queue->above
+      && __sync_bool_compare_and_swap(&queue->above, 0, 1)) {
+    __sync_fetch_and_add(&queue->highWatermarks, 1);
+    listener = queue->watermarkListener;
+    if(listener != NULL) {
+      listener(queue, true);
+    }
+  }
+}
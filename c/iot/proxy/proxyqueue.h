@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef PROXYQUEUE_H
+#define PROXYQUEUE_H
+
+#include <stdbool.h>
+
+#include "proxybuffer.h"
+
+/** Messages the queue holds, rounded up to a power of 2, can be overridden at compile time */
+#ifndef PROXYQUEUE_DEFAULT_CAPACITY
+#define PROXYQUEUE_DEFAULT_CAPACITY 256
+#endif
+
+/** What a queue past its high watermark does with a new message */
+typedef enum proxyqueue_policy_e {
+  /** Nothing is dropped, the new message is only refused once the queue is at its capacity */
+  PROXYQUEUE_DROP_NEVER = 0,
+
+  /** The oldest message is dropped to make room for the new one */
+  PROXYQUEUE_DROP_OLDEST,
+} proxyqueue_policy_e;
+
+/** Result of proxyqueue_push(), 0 when the message was refused so it still reads as a boolean */
+typedef enum proxyqueue_result_e {
+  /** The queue is full, the message was not queued */
+  PROXYQUEUE_REFUSED = 0,
+
+  PROXYQUEUE_QUEUED,
+
+  /** The message was queued after dropping the oldest one */
+  PROXYQUEUE_SHED,
+} proxyqueue_result_e;
+
+struct proxyqueue_t;
+
+/** Called when a queue goes past its high watermark, then when it's back to its low watermark */
+typedef void (*proxyqueue_watermark_f)(struct proxyqueue_t *queue, bool above);
+
+/** One message of the queue */
+typedef struct proxyqueue_slot_t {
+  /** Position the slot can be written at, or that position + 1 once the message is in */
+  volatile unsigned long sequence;
+
+  /** Buffers of the message, taken from the pool of the queue */
+  proxybuffer_chain_t message;
+} proxyqueue_slot_t;
+
+/** Metrics of a queue, see proxyqueue_getStats() */
+typedef struct proxyqueue_stats_t {
+  unsigned long pushed;
+
+  /** Messages refused because the queue or its pool was full */
+  unsigned long full;
+
+  /** Oldest messages dropped to make room for new ones */
+  unsigned long dropped;
+
+  /** Times a producer had to wake the consumer up */
+  unsigned long doorbells;
+
+  /** Times the queue went past its high watermark */
+  unsigned long highWatermarks;
+
+  /** Messages in the queue */
+  unsigned int length;
+
+  /** Most messages the queue held at once */
+  unsigned int maxLength;
+} proxyqueue_stats_t;
+
+/** Bounded queue of messages from many threads to one consumer thread */
+typedef struct proxyqueue_t {
+  proxyqueue_slot_t *slots;
+
+  unsigned long mask;
+
+  /** Pool the messages are copied to */
+  proxybuffer_pool_t *pool;
+
+  /** Next position to write, claimed by the producers */
+  volatile unsigned long tail;
+
+  /** Next position to read, claimed by the consumer and by the producers dropping the oldest message */
+  volatile unsigned long head;
+
+  /** Messages past which the queue is above its high watermark */
+  volatile unsigned long highWatermark;
+
+  /** Messages the queue must be back to before it's below its watermarks again */
+  volatile unsigned long lowWatermark;
+
+  volatile proxyqueue_policy_e policy;
+
+  /** 1 from the high watermark until the low watermark */
+  volatile int above;
+
+  /** Told when the queue crosses its watermarks, NULL if none */
+  volatile proxyqueue_watermark_f watermarkListener;
+
+  /** 1 while the consumer may be sleeping on the doorbell */
+  volatile int waiting;
+
+  /** eventfd readable when the consumer has to wake up */
+  int doorbellFd;
+
+  volatile unsigned long pushed;
+
+  volatile unsigned long full;
+
+  volatile unsigned long dropped;
+
+  volatile unsigned long doorbells;
+
+  volatile unsigned long highWatermarks;
+
+  volatile unsigned long maxLength;
+} proxyqueue_t;
+
+/***************** Public Prototypes ****************/
+bool proxyqueue_init(proxyqueue_t *queue, unsigned int capacity, proxybuffer_pool_t *pool);
+
+void proxyqueue_destroy(proxyqueue_t *queue);
+
+void proxyqueue_setLimits(proxyqueue_t *queue, unsigned int highWatermark, unsigned int lowWatermark, proxyqueue_policy_e policy);
+
+void proxyqueue_setWatermarkListener(proxyqueue_t *queue, proxyqueue_watermark_f listener);
+
+proxyqueue_result_e proxyqueue_push(proxyqueue_t *queue, const char *data, int length);
+
+int proxyqueue_peek(proxyqueue_t *queue);
+
+int proxyqueue_pop(proxyqueue_t *queue, char *buffer, int maxLength);
+
+int proxyqueue_popChain(proxyqueue_t *queue, proxybuffer_chain_t *message, int maxLength);
+
+bool proxyqueue_sleep(proxyqueue_t *queue);
+
+int proxyqueue_length(proxyqueue_t *queue);
+
+int proxyqueue_getDoorbell(proxyqueue_t *queue);
+
+void proxyqueue_ackDoorbell(proxyqueue_t *queue);
+
+void proxyqueue_getStats(proxyqueue_t *queue, proxyqueue_stats_t *stats);
+
+#endif
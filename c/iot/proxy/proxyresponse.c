@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+/**
+ * This module classifies a response of the server in one pass, without
+ * allocating: the status of the <s2h> envelope and where its commands are.
+ * The proxy uses it to choose between polling and pushing, and hands it to
+ * the response listeners so they don't scan the message again.
+ *
+ * It is a tokenizer, not an XML parser: it only knows tags, attributes,
+ * comments, CDATA and processing instructions. Text and attribute values
+ * are skipped, so a command argument can't pass for a control signal. The
+ * status comes first in the envelope, so the scan stops after a few commands
+ * however large the response is.
+ */
+
+#include <string.h>
+#include <ctype.h>
+
+#include "proxyresponse.h"
+
+/** Names of the statuses, indexed by proxyresponse_status_e */
+static const char *sStatusNames[] = { "", "ACK", "CONT", "ERR", "" };
+
+/***************** Private Prototypes ****************/
+static const char *_proxyresponse_attributes(const char *p, const char *end, proxyresponse_status_e *status, bool *selfClosing);
+
+static const char *_proxyresponse_tagEnd(const char *p, const char *end);
+
+static const char *_proxyresponse_skip(const char *p, const char *end, const char *terminator);
+
+static int _proxyresponse_isName(const char *name, const char *end, const char *expected);
+
+static proxyresponse_status_e _proxyresponse_status(const char *value, int valueLen);
+
+/***************** Public Functions ****************/
+/**
+ * Classify a response of the server. Only the attributes of <s2h> and
+ * <command> are read, the other tags are skipped along with the text.
+ *
+ * @param response Where to write what the response holds
+ * @param msg Response, not necessarily terminated
+ * @param len Length of the response
+ */
+void proxyresponse_classify(proxyresponse_t *response, const char *msg, int len) {
+  const char *end = msg + len;
+  const char *p = msg;
+  const char *name;
+  int nameLen;
+  bool closing;
+  bool selfClosing;
+  int open = -1;
+
+  memset(response, 0, sizeof(proxyresponse_t));
+
+  while (p < end && (p = memchr(p, '<', end - p)) != NULL) {
+    if (p + 1 < end && p[1] == '!') {
+      if (p + 4 <= end && strncmp(p, "<!--", 4) == 0) {
+        p = _proxyresponse_skip(p + 4, end, "-->");
+
+      } else if (p + 9 <= end && strncmp(p, "<![CDATA[", 9) == 0) {
+        p = _proxyresponse_skip(p + 9, end, "]]>");
+
+      } else {
+        p = _proxyresponse_skip(p + 2, end, ">");
+      }
+      continue;
+
+    } else if (p + 1 < end && p[1] == '?') {
+      p = _proxyresponse_skip(p + 2, end, "?>");
+      continue;
+    }
+
+    closing = p + 1 < end && p[1] == '/';
+    name = p + (closing ? 2 : 1);
+
+    if ((nameLen = _proxyresponse_isName(name, end, "command")) > 0) {
+      if (closing) {
+        p = _proxyresponse_skip(name + nameLen, end, ">");
+        if (open >= 0) {
+          response->commands[open].length = p - msg - response->commands[open].offset;
+          open = -1;
+        }
+        continue;
+      }
+
+      if (response->commandCount == PROXYRESPONSE_MAX_COMMANDS) {
+        response->moreCommands = true;
+        break;
+      }
+
+      open = response->commandCount++;
+      response->commands[open].offset = p - msg;
+
+      // Its attributes are for the listeners
+      p = _proxyresponse_tagEnd(name + nameLen, end);
+      selfClosing = p[-1] == '>' && p[-2] == '/';
+      if (selfClosing) {
+        response->commands[open].length = p - msg - response->commands[open].offset;
+        open = -1;
+      }
+      continue;
+
+    } else if (!closing && (nameLen = _proxyresponse_isName(name, end, "s2h")) > 0) {
+      response->envelope = true;
+      p = _proxyresponse_attributes(name + nameLen, end, &response->status, &selfClosing);
+      continue;
+    }
+
+    // Any other tag
+    p = name;
+  }
+
+  if (open >= 0) {
+    // Truncated in the middle of the command
+    response->commands[open].length = len - response->commands[open].offset;
+  }
+}
+
+/**
+ * @param status Status
+ * @return its name in the <s2h> envelope, "" if it has none
+ */
+const char *proxyresponse_statusName(proxyresponse_status_e status) {
+  if (status < PROXYRESPONSE_STATUS_NONE || status > PROXYRESPONSE_STATUS_OTHER) {
+    return "";
+  }
+  return sStatusNames[status];
+}
+
+/**
+ * Whether the clients of the proxy need a response: the ones with commands,
+ * and every <s2h> envelope, since its status tells them whether a user is
+ * watching even when it carries no command
+ *
+ * @param response Response classified by proxyresponse_classify()
+ * @return true if the response must be handed to the clients
+ */
+bool proxyresponse_forClients(const proxyresponse_t *response) {
+  return response->envelope || response->commandCount > 0;
+}
+
+/***************** Private Functions ****************/
+/**
+ * Read the attributes of a tag
+ *
+ * @param p After the name of the tag
+ * @param end End of the response
+ * @param status Where to write the value of the status attribute, NULL to ignore it
+ * @param selfClosing Where to write true if the tag ends with "/>"
+ * @return the character after the end of the tag, or the end of the response
+ */
+static const char *_proxyresponse_attributes(const char *p, const char *end, proxyresponse_status_e *status, bool *selfClosing) {
+  const char *attr;
+  const char *value;
+  int attrLen;
+  char quote;
+
+  *selfClosing = false;
+
+  while (p < end && *p != '>') {
+    if (*p == '/' && p + 1 < end && p[1] == '>') {
+      *selfClosing = true;
+      p++;
+      break;
+    }
+
+    if (isspace((unsigned char) *p) || *p == '/') {
+      p++;
+      continue;
+    }
+
+    attr = p;
+    for (attrLen = 0; p < end && *p != '=' && *p != '>' && *p != '/' && !isspace((unsigned char) *p); p++, attrLen++);
+    while (p < end && isspace((unsigned char) *p)) {
+      p++;
+    }
+
+    if (p >= end || *p != '=') {
+      continue;
+    }
+
+    p++;
+    while (p < end && isspace((unsigned char) *p)) {
+      p++;
+    }
+
+    if (p < end && (*p == '"' || *p == '\'')) {
+      quote = *p++;
+      value = p;
+      p = memchr(p, quote, end - p);
+      if (p == NULL) {
+        // A truncated value says nothing
+        return end;
+      }
+
+      if (status != NULL && _proxyresponse_isName(attr, attr + attrLen, "status") > 0) {
+        *status = _proxyresponse_status(value, p - value);
+      }
+      p++;
+
+    } else {
+      value = p;
+      while (p < end && *p != '>' && !isspace((unsigned char) *p)) {
+        p++;
+      }
+
+      if (status != NULL && _proxyresponse_isName(attr, attr + attrLen, "status") > 0) {
+        *status = _proxyresponse_status(value, p - value);
+      }
+    }
+  }
+
+  return p < end ? p + 1 : end;
+}
+
+/**
+ * @param p After the name of a tag
+ * @param end End of the response
+ * @return the character after the end of the tag, or the end of the response
+ */
+static const char *_proxyresponse_tagEnd(const char *p, const char *end) {
+  for (; p < end; p++) {
+    if (*p == '>') {
+      return p + 1;
+
+    } else if (*p == '"' || *p == '\'') {
+      // A '>' may be in the value of an attribute
+      p = memchr(p + 1, *p, end - p - 1);
+      if (p == NULL) {
+        break;
+      }
+    }
+  }
+  return end;
+}
+
+/**
+ * @param p Where to start looking
+ * @param end End of the response
+ * @param terminator End of the construct to skip
+ * @return the character after the terminator, or the end of the response
+ */
+static const char *_proxyresponse_skip(const char *p, const char *end, const char *terminator) {
+  int terminatorLen = strlen(terminator);
+
+  while (p < end && (p = memchr(p, terminator[0], end - p)) != NULL) {
+    if (p + terminatorLen <= end && strncmp(p, terminator, terminatorLen) == 0) {
+      return p + terminatorLen;
+    }
+    p++;
+  }
+  return end;
+}
+
+/**
+ * @param name Name of a tag or an attribute
+ * @param end End of the response
+ * @param expected Name to look for
+ * @return the length of the name if it is the expected one, 0 otherwise
+ */
+static int _proxyresponse_isName(const char *name, const char *end, const char *expected) {
+  int expectedLen;
+
+  // Most tags are told apart by their first letter
+  if (name >= end || *name != *expected) {
+    return 0;
+  }
+
+  expectedLen = strlen(expected);
+  if (name + expectedLen > end || memcmp(name, expected, expectedLen) != 0) {
+    return 0;
+  }
+
+  if (name + expectedLen < end && name[expectedLen] > ' ' && name[expectedLen] != '>'
+      && name[expectedLen] != '/' && name[expectedLen] != '=') {
+    return 0;
+  }
+
+  return expectedLen;
+}
+
+/**
+ * @return the status matching the value of a status attribute
+ */
+static proxyresponse_status_e _proxyresponse_status(const char *value, int valueLen) {
+  int i;
+
+  for (i = PROXYRESPONSE_STATUS_ACK; i <= PROXYRESPONSE_STATUS_ERR; i++) {
+    if ((int) strlen(sStatusNames[i]) == valueLen && strncmp(value, sStatusNames[i], valueLen) == 0) {
+      return (proxyresponse_status_e) i;
+    }
+  }
+  return PROXYRESPONSE_STATUS_OTHER;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef PROXYRESPONSE_H
+#define PROXYRESPONSE_H
+
+#include <stdbool.h>
+
+/** Commands of a response the scan stops at, can be overridden at compile time */
+#ifndef PROXYRESPONSE_MAX_COMMANDS
+#define PROXYRESPONSE_MAX_COMMANDS 16
+#endif
+
+/** Control signal in the status attribute of the <s2h> envelope */
+typedef enum proxyresponse_status_e {
+  /** No envelope, or no status */
+  PROXYRESPONSE_STATUS_NONE = 0,
+
+  /** Poll the server, only push when there is something to send */
+  PROXYRESPONSE_STATUS_ACK,
+
+  /** A user is watching, push often */
+  PROXYRESPONSE_STATUS_CONT,
+
+  /** The server refused the message */
+  PROXYRESPONSE_STATUS_ERR,
+
+  /** Any other status */
+  PROXYRESPONSE_STATUS_OTHER,
+} proxyresponse_status_e;
+
+/** Where an element is in a response */
+typedef struct proxyresponse_span_t {
+  /** Offset of its '<' */
+  int offset;
+
+  /** Up to the '>' closing it */
+  int length;
+} proxyresponse_span_t;
+
+/** What a response of the server holds, see proxyresponse_classify() */
+typedef struct proxyresponse_t {
+  /** True if the response has an <s2h> element */
+  bool envelope;
+
+  proxyresponse_status_e status;
+
+  /** Number of <command> elements found */
+  int commandCount;
+
+  /** Spans of the commands */
+  proxyresponse_span_t commands[PROXYRESPONSE_MAX_COMMANDS];
+
+  /** True if the scan stopped at PROXYRESPONSE_MAX_COMMANDS commands, more may follow */
+  bool moreCommands;
+} proxyresponse_t;
+
+/***************** Public Prototypes ****************/
+void proxyresponse_classify(proxyresponse_t *response, const char *msg, int len);
+
+const char *proxyresponse_statusName(proxyresponse_status_e status);
+
+bool proxyresponse_forClients(const proxyresponse_t *response);
+
+#endif
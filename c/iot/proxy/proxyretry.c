@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+/**
+ * This module decides when the proxy retries a request to the server.
+ *
+ * Retries are spaced by an exponential backoff with jitter, so hubs that lost
+ * the server at the same time don't come back in lockstep. After too many
+ * failures in a row the circuit opens: no request is made until the server had
+ * time to recover, then a single probe tells if it is back. Errors that can't
+ * be fixed by trying again, like a local setup failure, are not retried.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proxyretry.h"
+#include "iotdebug.h"
+
+/** Names of the states, for logs */
+static const char *stateNames[] = {
+    "closed",
+    "open",
+    "half-open",
+};
+
+/***************** Private Prototypes ****************/
+static unsigned long long _proxyretry_now();
+
+static unsigned int _proxyretry_jitter(proxyretry_t *retry, unsigned int capMs);
+
+static void _proxyretry_setState(proxyretry_t *retry, proxyretry_state_e state);
+
+/***************** Public Functions ****************/
+/**
+ * Initialize the retry state of the requests to a server
+ *
+ * @param retry Retry state to initialize
+ * @param policy How to retry, NULL for the defaults
+ */
+void proxyretry_init(proxyretry_t *retry, const proxyretry_policy_t *policy) {
+  struct timespec now;
+
+  memset(retry, 0, sizeof(proxyretry_t));
+  pthread_mutex_init(&retry->mutex, NULL);
+
+  if(policy != NULL) {
+    retry->policy = *policy;
+
+  } else {
+    retry->policy.baseDelayMs = PROXYRETRY_DEFAULT_BASE_DELAY_MS;
+    retry->policy.maxDelayMs = PROXYRETRY_DEFAULT_MAX_DELAY_MS;
+    retry->policy.failureThreshold = PROXYRETRY_DEFAULT_FAILURE_THRESHOLD;
+    retry->policy.openDurationMs = PROXYRETRY_DEFAULT_OPEN_DURATION_MS;
+  }
+
+  if(retry->policy.retryable == NULL) {
+    retry->policy.retryable = proxyretry_isRetryable;
+  }
+
+  if(retry->policy.baseDelayMs == 0) {
+    retry->policy.baseDelayMs = 1;
+  }
+
+  if(retry->policy.maxDelayMs < retry->policy.baseDelayMs) {
+    retry->policy.maxDelayMs = retry->policy.baseDelayMs;
+  }
+
+  // Every hub must draw different delays, even if they all booted together
+  clock_gettime(CLOCK_REALTIME, &now);
+  retry->seed = (unsigned int) now.tv_nsec ^ (unsigned int) now.tv_sec ^ (unsigned int) getpid()
+      ^ (unsigned int) (uintptr_t) retry;
+
+  retry->state = PROXYRETRY_CLOSED;
+}
+
+/**
+ * Release the retry state
+ * @param retry Retry state initialized by proxyretry_init()
+ */
+void proxyretry_destroy(proxyretry_t *retry) {
+  pthread_mutex_destroy(&retry->mutex);
+}
+
+/**
+ * Time to wait before the next request. Once an open circuit waited long
+ * enough, it turns half-open and lets the next request through as a probe.
+ *
+ * @param retry Retry state
+ * @return the number of ms to wait, 0 to send the request now
+ */
+unsigned int proxyretry_delayMs(proxyretry_t *retry) {
+  unsigned long long now = _proxyretry_now();
+  unsigned int delayMs = 0;
+
+  pthread_mutex_lock(&retry->mutex);
+  if(now < retry->nextAttemptMs) {
+    delayMs = (unsigned int) (retry->nextAttemptMs - now);
+
+  } else if(retry->state == PROXYRETRY_OPEN) {
+    _proxyretry_setState(retry, PROXYRETRY_HALF_OPEN);
+  }
+  pthread_mutex_unlock(&retry->mutex);
+
+  return delayMs;
+}
+
+/**
+ * Sleep until the next request can be sent, counting the time spent in backoff
+ * @param retry Retry state
+ */
+void proxyretry_wait(proxyretry_t *retry) {
+  unsigned int delayMs;
+  struct timespec delay;
+
+  while((delayMs = proxyretry_delayMs(retry)) > 0) {
+    delay.tv_sec = delayMs / 1000;
+    delay.tv_nsec = (delayMs % 1000) * 1000000L;
+    nanosleep(&delay, NULL);
+
+    pthread_mutex_lock(&retry->mutex);
+    retry->stats.backoffMs += delayMs;
+    pthread_mutex_unlock(&retry->mutex);
+  }
+}
+
+/**
+ * A request went through: the server is healthy
+ * @param retry Retry state
+ */
+void proxyretry_onSuccess(proxyretry_t *retry) {
+  pthread_mutex_lock(&retry->mutex);
+  retry->consecutiveFailures = 0;
+  retry->nextAttemptMs = 0;
+  if(retry->state != PROXYRETRY_CLOSED) {
+    _proxyretry_setState(retry, PROXYRETRY_CLOSED);
+  }
+  pthread_mutex_unlock(&retry->mutex);
+}
+
+/**
+ * A request failed. Schedules the next attempt, and opens the circuit after
+ * too many failures in a row or when the probe of a half-open circuit failed.
+ *
+ * @param retry Retry state
+ * @param error errno value returned by libhttpcomm
+ * @return true if the request is worth retrying after proxyretry_wait(),
+ *     false if the error is fatal
+ */
+bool proxyretry_onFailure(proxyretry_t *retry, int error) {
+  unsigned int capMs;
+  unsigned int delayMs;
+  unsigned int exponent;
+
+  if(!retry->policy.retryable(error)) {
+    pthread_mutex_lock(&retry->mutex);
+    retry->stats.fatalFailures++;
+    pthread_mutex_unlock(&retry->mutex);
+
+    SYSLOG_WARNING("Not retrying after fatal error: %s", strerror(error));
+    return false;
+  }
+
+  pthread_mutex_lock(&retry->mutex);
+  retry->stats.failures++;
+  retry->consecutiveFailures++;
+
+  if(retry->state != PROXYRETRY_CLOSED
+      || retry->consecutiveFailures >= retry->policy.failureThreshold) {
+    _proxyretry_setState(retry, PROXYRETRY_OPEN);
+    delayMs = _proxyretry_jitter(retry, retry->policy.openDurationMs);
+
+  } else {
+    exponent = retry->consecutiveFailures - 1;
+    if(exponent > 16) {
+      exponent = 16;
+    }
+
+    capMs = retry->policy.baseDelayMs << exponent;
+    if(capMs > retry->policy.maxDelayMs || (capMs >> exponent) != retry->policy.baseDelayMs) {
+      capMs = retry->policy.maxDelayMs;
+    }
+    delayMs = _proxyretry_jitter(retry, capMs);
+  }
+
+  retry->nextAttemptMs = _proxyretry_now() + delayMs;
+  pthread_mutex_unlock(&retry->mutex);
+
+  SYSLOG_DEBUG("Retrying in %u ms after %s", delayMs, strerror(error));
+  return true;
+}
+
+/**
+ * @param retry Retry state
+ * @return the state of the circuit breaker
+ */
+proxyretry_state_e proxyretry_getState(proxyretry_t *retry) {
+  proxyretry_state_e state;
+
+  pthread_mutex_lock(&retry->mutex);
+  state = retry->state;
+  pthread_mutex_unlock(&retry->mutex);
+
+  return state;
+}
+
+/**
+ * Read the metrics of a retry policy: failures, circuit transitions and time
+ * spent in backoff
+ *
+ * @param retry Retry state
+ * @param stats Destination of the metrics
+ */
+void proxyretry_getStats(proxyretry_t *retry, proxyretry_stats_t *stats) {
+  pthread_mutex_lock(&retry->mutex);
+  *stats = retry->stats;
+  pthread_mutex_unlock(&retry->mutex);
+}
+
+/**
+ * Default classification of the errno values returned by libhttpcomm. The
+ * network and the server may come back, but a request that couldn't even be
+ * set up or that was cancelled will fail the same way again.
+ *
+ * @param error errno value
+ * @return true if the error is worth retrying
+ */
+bool proxyretry_isRetryable(int error) {
+  switch(error) {
+  case ENOEXEC:
+  case EINVAL:
+  case ENOMEM:
+  case ECANCELED:
+    return false;
+
+  default:
+    return true;
+  }
+}
+
+/***************** Private Functions ****************/
+/**
+ * @return the monotonic time in ms
+ */
+static unsigned long long _proxyretry_now() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Pick a delay between half the cap and the cap. The random half spreads the
+ * hubs out, the fixed half keeps them from retrying right away.
+ *
+ * @param retry Retry state, locked
+ * @param capMs Longest delay
+ * @return the delay in ms
+ */
+static unsigned int _proxyretry_jitter(proxyretry_t *retry, unsigned int capMs) {
+  return capMs / 2 + (unsigned int) rand_r(&retry->seed) % (capMs / 2 + 1);
+}
+
+/**
+ * Change the state of the circuit breaker and count the transition
+ *
+ * @param retry Retry state, locked
+ * @param state New state
+ */
+static void _proxyretry_setState(proxyretry_t *retry, proxyretry_state_e state) {
+  if(state == retry->state) {
+    return;
+  }
+
+  switch(state) {
+  case PROXYRETRY_OPEN:
+    retry->stats.opened++;
+    break;
+
+  case PROXYRETRY_HALF_OPEN:
+    retry->stats.halfOpened++;
+    break;
+
+  case PROXYRETRY_CLOSED:
+    retry->stats.closed++;
+    break;
+  }
+
+  SYSLOG_INFO("Circuit to the server %s -> %s after %u failures in a row",
+      stateNames[retry->state], stateNames[state], retry->consecutiveFailures);
+  retry->state = state;
+}
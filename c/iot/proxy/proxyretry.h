@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef PROXYRETRY_H
+#define PROXYRETRY_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/** First delay before retrying, can be overridden at compile time */
+#ifndef PROXYRETRY_DEFAULT_BASE_DELAY_MS
+#define PROXYRETRY_DEFAULT_BASE_DELAY_MS 500
+#endif
+
+/** Longest delay between two retries, can be overridden at compile time */
+#ifndef PROXYRETRY_DEFAULT_MAX_DELAY_MS
+#define PROXYRETRY_DEFAULT_MAX_DELAY_MS 60000
+#endif
+
+/** Consecutive failures opening the circuit, can be overridden at compile time */
+#ifndef PROXYRETRY_DEFAULT_FAILURE_THRESHOLD
+#define PROXYRETRY_DEFAULT_FAILURE_THRESHOLD 5
+#endif
+
+/** Time the circuit stays open before a probe is let through, can be overridden at compile time */
+#ifndef PROXYRETRY_DEFAULT_OPEN_DURATION_MS
+#define PROXYRETRY_DEFAULT_OPEN_DURATION_MS 30000
+#endif
+
+/** State of the circuit breaker */
+typedef enum proxyretry_state_e {
+  /** Requests go through, failures are retried with backoff */
+  PROXYRETRY_CLOSED,
+
+  /** Too many failures in a row, requests wait until the server had time to recover */
+  PROXYRETRY_OPEN,
+
+  /** One probe request goes through, its outcome closes or opens the circuit again */
+  PROXYRETRY_HALF_OPEN,
+} proxyretry_state_e;
+
+/** How to retry, see proxyretry_init() */
+typedef struct proxyretry_policy_t {
+  unsigned int baseDelayMs;
+
+  unsigned int maxDelayMs;
+
+  unsigned int failureThreshold;
+
+  unsigned int openDurationMs;
+
+  /** Tells if an errno value from libhttpcomm is worth retrying, see proxyretry_isRetryable() */
+  bool (*retryable)(int error);
+} proxyretry_policy_t;
+
+/** Metrics of a retry policy, see proxyretry_getStats() */
+typedef struct proxyretry_stats_t {
+  unsigned long failures;
+
+  unsigned long fatalFailures;
+
+  unsigned long opened;
+
+  unsigned long halfOpened;
+
+  unsigned long closed;
+
+  unsigned long long backoffMs;
+} proxyretry_stats_t;
+
+/** Retry state of the requests to one server */
+typedef struct proxyretry_t {
+  pthread_mutex_t mutex;
+
+  proxyretry_policy_t policy;
+
+  proxyretry_state_e state;
+
+  /** Failures since the last success, the exponent of the backoff */
+  unsigned int consecutiveFailures;
+
+  /** Monotonic time in ms before which no request should be made */
+  unsigned long long nextAttemptMs;
+
+  unsigned int seed;
+
+  proxyretry_stats_t stats;
+} proxyretry_t;
+
+/***************** Public Prototypes ****************/
+void proxyretry_init(proxyretry_t *retry, const proxyretry_policy_t *policy);
+
+void proxyretry_destroy(proxyretry_t *retry);
+
+unsigned int proxyretry_delayMs(proxyretry_t *retry);
+
+void proxyretry_wait(proxyretry_t *retry);
+
+void proxyretry_onSuccess(proxyretry_t *retry);
+
+bool proxyretry_onFailure(proxyretry_t *retry, int error);
+
+proxyretry_state_e proxyretry_getState(proxyretry_t *retry);
+
+void proxyretry_getStats(proxyretry_t *retry, proxyretry_stats_t *stats);
+
+bool proxyretry_isRetryable(int error);
+
+#endif
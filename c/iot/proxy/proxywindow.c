@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+/**
+ * This module keeps the batches of messages to the server until the server
+ * acknowledges them, so the messages are delivered at least once without
+ * sending more than the batches that weren't acknowledged.
+ *
+ * A batch is filled with the messages of the clients, then sealed with the
+ * sequence number of its h2s header. Several batches can be in flight at
+ * once. A batch that failed is sent again alone with the same sequence
+ * number, the oldest first, rather than merged with the next messages under
+ * a new one, so the server can tell it already has it.
+ *
+ * A batch holds the buffers of its messages until it is acknowledged or
+ * dropped, the high priority ones in a chain sent ahead of the others.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "proxywindow.h"
+#include "iotdebug.h"
+
+/***************** Private Prototypes ****************/
+static bool _proxywindow_before(uint32_t a, uint32_t b);
+
+/***************** Public Functions ****************/
+/**
+ * Initialize an empty window
+ *
+ * @param window Window to initialize
+ * @param size Batches held at once, up to PROXYWINDOW_MAX_SIZE
+ * @return true
+ */
+bool proxywindow_init(proxywindow_t *window, int size) {
+  assert(window);
+  assert(size > 0);
+
+  memset(window, 0, sizeof(proxywindow_t));
+
+  if(size > PROXYWINDOW_MAX_SIZE) {
+    size = PROXYWINDOW_MAX_SIZE;
+  }
+
+  window->size = size;
+  pthread_mutex_init(&window->mutex, NULL);
+  return true;
+}
+
+/**
+ * Release the buffers of the batches of a window, the ones not acknowledged
+ * are lost
+ *
+ * @param window Window to destroy
+ */
+void proxywindow_destroy(proxywindow_t *window) {
+  int i;
+
+  if(window->size == 0) {
+    return;
+  }
+
+  for(i = 0; i < window->size; i++) {
+    proxybuffer_clear(&window->batches[i].urgent);
+    proxybuffer_clear(&window->batches[i].bulk);
+  }
+
+  window->size = 0;
+  pthread_mutex_destroy(&window->mutex);
+}
+
+/**
+ * The batch receiving the next messages, taking a free one if none is
+ *
+ * @param window Window
+ * @return the batch being filled, NULL if all the batches wait for the server
+ */
+proxywindow_batch_t *proxywindow_filling(proxywindow_t *window) {
+  proxywindow_batch_t *batch;
+  int i;
+
+  for(i = 0; i < window->size; i++) {
+    if(window->batches[i].state == PROXYWINDOW_FILLING) {
+      return &window->batches[i];
+    }
+  }
+
+  for(i = 0; i < window->size; i++) {
+    batch = &window->batches[i];
+    if(batch->state == PROXYWINDOW_FREE) {
+      batch->state = PROXYWINDOW_FILLING;
+      batch->sends = 0;
+      batch->rejections = 0;
+      batch->journaled = false;
+      return batch;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Add a message at the end of the batch being filled, or of its high
+ * priority messages
+ *
+ * @param batch Batch being filled
+ * @param message Buffers of the message, moved to the batch
+ * @param urgent true to send the message ahead of the bulk
+ */
+void proxywindow_add(proxywindow_batch_t *batch, proxybuffer_chain_t *message, bool urgent) {
+  assert(batch->state == PROXYWINDOW_FILLING);
+
+  proxybuffer_append(urgent ? &batch->urgent : &batch->bulk, message);
+}
+
+/**
+ * @param batch Batch
+ * @return the bytes of its messages
+ */
+int proxywindow_length(const proxywindow_batch_t *batch) {
+  return batch->urgent.length + batch->bulk.length;
+}
+
+/**
+ * @param batch Batch
+ * @return the buffers holding its messages
+ */
+int proxywindow_buffers(const proxywindow_batch_t *batch) {
+  return batch->urgent.count + batch->bulk.count;
+}
+
+/**
+ * Describe the messages of a batch as segments, the high priority ones first
+ *
+ * @param batch Batch
+ * @param segments Receives one segment per buffer
+ * @param maxSegments Number of segments
+ * @return the number of segments, -1 if the batch has more buffers
+ */
+int proxywindow_segments(const proxywindow_batch_t *batch, struct iovec *segments, int maxSegments) {
+  int urgent = proxybuffer_segments(&batch->urgent, segments, maxSegments);
+  int bulk;
+
+  if(urgent < 0) {
+    return -1;
+  }
+
+  bulk = proxybuffer_segments(&batch->bulk, segments + urgent, maxSegments - urgent);
+  return bulk < 0 ? -1 : urgent + bulk;
+}
+
+/**
+ * The batch being filled is ready to be sent
+ *
+ * @param window Window
+ * @param batch Batch being filled, possibly empty
+ * @param seq Sequence number of its h2s header
+ */
+void proxywindow_seal(proxywindow_t *window, proxywindow_batch_t *batch, uint32_t seq) {
+  assert(batch->state == PROXYWINDOW_FILLING);
+
+  batch->seq = seq;
+  batch->state = PROXYWINDOW_PENDING;
+
+  pthread_mutex_lock(&window->mutex);
+  window->stats.sealed++;
+  pthread_mutex_unlock(&window->mutex);
+}
+
+/**
+ * Take the oldest batch waiting to be sent, sent again ones first since they
+ * are older than the new ones
+ *
+ * @param window Window
+ * @return the batch now in flight, NULL if none is waiting
+ */
+proxywindow_batch_t *proxywindow_send(proxywindow_t *window) {
+  proxywindow_batch_t *oldest = NULL;
+  int i;
+
+  for(i = 0; i < window->size; i++) {
+    if(window->batches[i].state == PROXYWINDOW_PENDING
+        && (oldest == NULL || _proxywindow_before(window->batches[i].seq, oldest->seq))) {
+      oldest = &window->batches[i];
+    }
+  }
+
+  if(oldest == NULL) {
+    return NULL;
+  }
+
+  oldest->state = PROXYWINDOW_IN_FLIGHT;
+  oldest->sends++;
+
+  pthread_mutex_lock(&window->mutex);
+  if(oldest->sends > 1) {
+    window->stats.retransmitted++;
+    window->stats.retransmittedBytes += proxywindow_length(oldest);
+  }
+
+  if(proxywindow_inFlight(window) > window->stats.maxInFlight) {
+    window->stats.maxInFlight = proxywindow_inFlight(window);
+  }
+  pthread_mutex_unlock(&window->mutex);
+
+  return oldest;
+}
+
+/**
+ * The server acknowledged a batch, it is never sent again and its buffers
+ * go back to their pool
+ *
+ * @param window Window
+ * @param batch Batch in flight
+ */
+void proxywindow_ack(proxywindow_t *window, proxywindow_batch_t *batch) {
+  assert(batch->state == PROXYWINDOW_IN_FLIGHT);
+
+  proxybuffer_clear(&batch->urgent);
+  proxybuffer_clear(&batch->bulk);
+  batch->state = PROXYWINDOW_FREE;
+
+  pthread_mutex_lock(&window->mutex);
+  window->stats.acknowledged++;
+  pthread_mutex_unlock(&window->mutex);
+}
+
+/**
+ * A batch wasn't acknowledged, it waits to be sent again with the same
+ * sequence number
+ *
+ * @param window Window
+ * @param batch Batch in flight
+ */
+void proxywindow_retry(proxywindow_t *window, proxywindow_batch_t *batch) {
+  assert(batch->state == PROXYWINDOW_IN_FLIGHT);
+
+  batch->state = PROXYWINDOW_PENDING;
+}
+
+/**
+ * Give up on a batch
+ *
+ * @param window Window
+ * @param batch Batch in flight or waiting
+ */
+void proxywindow_drop(proxywindow_t *window, proxywindow_batch_t *batch) {
+  proxybuffer_clear(&batch->urgent);
+  proxybuffer_clear(&batch->bulk);
+  batch->state = PROXYWINDOW_FREE;
+
+  pthread_mutex_lock(&window->mutex);
+  window->stats.dropped++;
+  pthread_mutex_unlock(&window->mutex);
+}
+
+/**
+ * The oldest batch the server didn't acknowledge, without changing its state
+ *
+ * @param window Window
+ * @return the sealed batch with the oldest sequence number, waiting or in
+ *     flight, NULL if none
+ */
+proxywindow_batch_t *proxywindow_oldest(proxywindow_t *window) {
+  proxywindow_batch_t *oldest = NULL;
+  int i;
+
+  for(i = 0; i < window->size; i++) {
+    if((window->batches[i].state == PROXYWINDOW_PENDING || window->batches[i].state == PROXYWINDOW_IN_FLIGHT)
+        && (oldest == NULL || _proxywindow_before(window->batches[i].seq, oldest->seq))) {
+      oldest = &window->batches[i];
+    }
+  }
+
+  return oldest;
+}
+
+/**
+ * The owner kept a batch elsewhere, e.g. in the journal when the proxy stops:
+ * its buffers go back to their pool without counting it as dropped
+ *
+ * @param window Window
+ * @param batch Batch of the window
+ */
+void proxywindow_release(proxywindow_t *window, proxywindow_batch_t *batch) {
+  proxybuffer_clear(&batch->urgent);
+  proxybuffer_clear(&batch->bulk);
+  batch->state = PROXYWINDOW_FREE;
+}
+
+/**
+ * @param window Window
+ * @param batch Batch of the window
+ * @return the index of the batch, from 0 to the size of the window, for the
+ *     owner to keep what goes with it
+ */
+int proxywindow_index(proxywindow_t *window, proxywindow_batch_t *batch) {
+  return (int) (batch - window->batches);
+}
+
+/**
+ * @param window Window
+ * @return the number of batches in flight
+ */
+int proxywindow_inFlight(proxywindow_t *window) {
+  int count = 0;
+  int i;
+
+  for(i = 0; i < window->size; i++) {
+    if(window->batches[i].state == PROXYWINDOW_IN_FLIGHT) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+/**
+ * @param window Window
+ * @return true if a sealed batch waits to be sent
+ */
+bool proxywindow_hasPending(proxywindow_t *window) {
+  int i;
+
+  for(i = 0; i < window->size; i++) {
+    if(window->batches[i].state == PROXYWINDOW_PENDING) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Read the metrics of a window, from any thread
+ *
+ * @param window Window
+ * @param stats Destination of the metrics
+ */
+void proxywindow_getStats(proxywindow_t *window, proxywindow_stats_t *stats) {
+  if(window->size == 0) {
+    memset(stats, 0, sizeof(proxywindow_stats_t));
+    return;
+  }
+
+  pthread_mutex_lock(&window->mutex);
+  *stats = window->stats;
+  pthread_mutex_unlock(&window->mutex);
+}
+
+/***************** Private Functions ****************/
+/**
+ * Compares sequence numbers across their wrap around
+ *
+ * @return true if a comes before b
+ */
+static bool _proxywindow_before(uint32_t a, uint32_t b) {
+  return (int32_t) (a - b) < 0;
+}
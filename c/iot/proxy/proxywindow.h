@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+#ifndef PROXYWINDOW_H
+#define PROXYWINDOW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "proxybuffer.h"
+
+/** Batches to the server held at once, being filled, waiting or in flight, can be overridden at compile time */
+#ifndef PROXYWINDOW_DEFAULT_SIZE
+#define PROXYWINDOW_DEFAULT_SIZE 4
+#endif
+
+enum {
+  PROXYWINDOW_MAX_SIZE = 8,
+};
+
+/** Where a batch is in its delivery */
+typedef enum proxywindow_state_e {
+  PROXYWINDOW_FREE = 0,
+
+  /** Receiving the messages of the next batch */
+  PROXYWINDOW_FILLING,
+
+  /** Sealed with its sequence number, waiting to be sent or sent again */
+  PROXYWINDOW_PENDING,
+
+  /** Sent, kept until the server acknowledges it */
+  PROXYWINDOW_IN_FLIGHT,
+} proxywindow_state_e;
+
+/** Messages sent to the server in one request */
+typedef struct proxywindow_batch_t {
+  proxywindow_state_e state;
+
+  /** Sequence number, the same each time the batch is sent so the server can drop the duplicates */
+  uint32_t seq;
+
+  /** High priority messages, sent ahead of the others */
+  proxybuffer_chain_t urgent;
+
+  /** The other messages, the only ones that can be moved to the journal */
+  proxybuffer_chain_t bulk;
+
+  /** Times the batch was sent */
+  int sends;
+
+  /** Times the server refused it */
+  int rejections;
+
+  /** True if the batch is a record replayed from the journal */
+  bool journaled;
+} proxywindow_batch_t;
+
+/** Metrics of a window, see proxywindow_getStats() */
+typedef struct proxywindow_stats_t {
+  unsigned long sealed;
+
+  unsigned long acknowledged;
+
+  /** Sends of a batch after its first one */
+  unsigned long retransmitted;
+
+  unsigned long long retransmittedBytes;
+
+  /** Batches given up on */
+  unsigned long dropped;
+
+  /** Most batches in flight at once */
+  int maxInFlight;
+} proxywindow_stats_t;
+
+/** Batches to the server kept until they are acknowledged */
+typedef struct proxywindow_t {
+  /** Protects the stats, the rest is only used by the thread owning the window */
+  pthread_mutex_t mutex;
+
+  proxywindow_batch_t batches[PROXYWINDOW_MAX_SIZE];
+
+  int size;
+
+  proxywindow_stats_t stats;
+} proxywindow_t;
+
+/***************** Public Prototypes ****************/
+bool proxywindow_init(proxywindow_t *window, int size);
+
+void proxywindow_destroy(proxywindow_t *window);
+
+proxywindow_batch_t *proxywindow_filling(proxywindow_t *window);
+
+void proxywindow_add(proxywindow_batch_t *batch, proxybuffer_chain_t *message, bool urgent);
+
+int proxywindow_length(const proxywindow_batch_t *batch);
+
+int proxywindow_buffers(const proxywindow_batch_t *batch);
+
+int proxywindow_segments(const proxywindow_batch_t *batch, struct iovec *segments, int maxSegments);
+
+void proxywindow_seal(proxywindow_t *window, proxywindow_batch_t *batch, uint32_t seq);
+
+proxywindow_batch_t *proxywindow_send(proxywindow_t *window);
+
+void proxywindow_ack(proxywindow_t *window, proxywindow_batch_t *batch);
+
+void proxywindow_retry(proxywindow_t *window, proxywindow_batch_t *batch);
+
+void proxywindow_drop(proxywindow_t *window, proxywindow_batch_t *batch);
+
+proxywindow_batch_t *proxywindow_oldest(proxywindow_t *window);
+
+void proxywindow_release(proxywindow_t *window, proxywindow_batch_t *batch);
+
+int proxywindow_index(proxywindow_t *window, proxywindow_batch_t *batch);
+
+int proxywindow_inFlight(proxywindow_t *window);
+
+bool proxywindow_hasPending(proxywindow_t *window);
+
+void proxywindow_getStats(proxywindow_t *window, proxywindow_stats_t *stats);
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "cppunit/extensions/HelperMacros.h"
+
+extern "C" {
+#include "ioterror.h"
+#include "proxybuffer_test.h"
+#include "proxybuffer.h"
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ProxyBufferTest );
+
+/** Threads taking and giving back buffers at once */
+#define THREADS 4
+
+/** Buffers each thread takes and gives back */
+#define THREAD_ALLOCATIONS 100000
+
+/** Buffers a thread holds at once */
+#define THREAD_HELD 8
+
+/** Pool shared by the threads of testThreads() */
+static proxybuffer_pool_t sPool;
+
+/** Buffers found holding the mark of another thread, given to two threads at once */
+static volatile int sCollisions;
+
+/**
+ * Take and give back buffers, checking nobody else wrote to them meanwhile
+ */
+static void *churn(void *arg) {
+  proxybuffer_t *held[THREAD_HELD];
+  char mark = (char) (long) arg;
+  int count = 0;
+  int i;
+
+  memset(held, 0, sizeof(held));
+
+  while(count < THREAD_ALLOCATIONS) {
+    i = count % THREAD_HELD;
+
+    if(held[i] != NULL) {
+      if(held[i]->data[0] != mark || held[i]->data[PROXYBUFFER_SIZE - 1] != mark) {
+        __sync_fetch_and_add(&sCollisions, 1);
+      }
+      proxybuffer_release(held[i]);
+    }
+
+    held[i] = proxybuffer_alloc(&sPool);
+    if(held[i] == NULL) {
+      sched_yield();
+      continue;
+    }
+
+    held[i]->data[0] = mark;
+    held[i]->data[PROXYBUFFER_SIZE - 1] = mark;
+    count++;
+  }
+
+  for(i = 0; i < THREAD_HELD; i++) {
+    proxybuffer_release(held[i]);
+  }
+
+  return NULL;
+}
+
+void ProxyBufferTest::testAllocRelease(void) {
+  proxybuffer_pool_t pool;
+  proxybuffer_stats_t stats;
+  proxybuffer_t *buffers[4];
+  proxybuffer_t *buffer;
+  int i;
+
+  CPPUNIT_ASSERT(proxybuffer_init(&pool, 4));
+
+  for(i = 0; i < 4; i++) {
+    buffers[i] = proxybuffer_alloc(&pool);
+    CPPUNIT_ASSERT_MESSAGE("Pool empty too early\n", buffers[i] != NULL);
+    CPPUNIT_ASSERT(buffers[i]->refs == 1 && buffers[i]->length == 0 && buffers[i]->next == NULL);
+  }
+  CPPUNIT_ASSERT_MESSAGE("Pool went past its count\n", proxybuffer_alloc(&pool) == NULL);
+
+  // The last buffer given back is the next one taken
+  proxybuffer_release(buffers[2]);
+  buffer = proxybuffer_alloc(&pool);
+  CPPUNIT_ASSERT_MESSAGE("Released buffer not reused\n", buffer == buffers[2]);
+
+  // A buffer only goes back to the pool with its last reference
+  CPPUNIT_ASSERT(proxybuffer_ref(buffer) == buffer && buffer->refs == 2);
+  proxybuffer_release(buffer);
+  CPPUNIT_ASSERT(proxybuffer_alloc(&pool) == NULL);
+  proxybuffer_release(buffer);
+  CPPUNIT_ASSERT(proxybuffer_alloc(&pool) == buffer);
+
+  proxybuffer_getStats(&pool, &stats);
+  CPPUNIT_ASSERT(stats.count == 4 && stats.inUse == 4 && stats.maxInUse == 4);
+  CPPUNIT_ASSERT(stats.allocated == 6 && stats.exhausted == 2);
+
+  for(i = 0; i < 4; i++) {
+    proxybuffer_release(buffers[i]);
+  }
+  proxybuffer_getStats(&pool, &stats);
+  CPPUNIT_ASSERT(stats.inUse == 0);
+
+  // The tag of the free list goes past 16 bits instead of wrapping where a 64-bit CAS is
+  for(i = 0; i < 70000; i++) {
+    proxybuffer_release(proxybuffer_alloc(&pool));
+  }
+  if(sizeof(proxybuffer_top_t) == sizeof(uint64_t)) {
+    CPPUNIT_ASSERT_MESSAGE("The tag wrapped around\n", (pool.freeList >> 16) > 0xFFFF);
+  }
+
+  proxybuffer_destroy(&pool);
+}
+
+void ProxyBufferTest::testChains(void) {
+  proxybuffer_pool_t pool;
+  proxybuffer_chain_t chain;
+  proxybuffer_chain_t other;
+  struct iovec segments[4];
+  char data[PROXYBUFFER_SIZE * 2 + 100];
+  char copy[sizeof(data)];
+  static char big[PROXYBUFFER_SIZE * 5 + 1];
+  int i;
+
+  CPPUNIT_ASSERT(proxybuffer_init(&pool, 8));
+  memset(&chain, 0, sizeof(chain));
+  memset(&other, 0, sizeof(other));
+
+  for(i = 0; i < (int) sizeof(data); i++) {
+    data[i] = (char) i;
+  }
+
+  // A long message spans buffers, read back as it was written
+  CPPUNIT_ASSERT(proxybuffer_write(&pool, &chain, data, sizeof(data)));
+  CPPUNIT_ASSERT(chain.length == (int) sizeof(data) && chain.count == 3);
+  CPPUNIT_ASSERT(proxybuffer_read(&chain, copy, sizeof(copy)) == (int) sizeof(data));
+  CPPUNIT_ASSERT(memcmp(copy, data, sizeof(data)) == 0);
+  CPPUNIT_ASSERT_MESSAGE("Read past the destination\n", proxybuffer_read(&chain, copy, 100) == 0);
+
+  // Written in the room left in the last buffer first
+  CPPUNIT_ASSERT(proxybuffer_write(&pool, &chain, "abc", 3));
+  CPPUNIT_ASSERT(chain.count == 3 && chain.tail->length == 103);
+
+  CPPUNIT_ASSERT(proxybuffer_segments(&chain, segments, 2) == -1);
+  CPPUNIT_ASSERT(proxybuffer_segments(&chain, segments, 4) == 3);
+  CPPUNIT_ASSERT(segments[0].iov_len == PROXYBUFFER_SIZE && segments[2].iov_len == 103);
+  CPPUNIT_ASSERT(memcmp((char *) segments[2].iov_base + 100, "abc", 3) == 0);
+
+  // A small chain is copied in the last buffer, and its buffer goes back to the pool
+  CPPUNIT_ASSERT(proxybuffer_write(&pool, &other, "def", 3));
+  CPPUNIT_ASSERT(pool.inUse == 4);
+  proxybuffer_append(&chain, &other);
+  CPPUNIT_ASSERT(other.head == NULL && other.length == 0);
+  CPPUNIT_ASSERT(chain.count == 3 && chain.length == (int) sizeof(data) + 6 && pool.inUse == 3);
+
+  // A shared buffer isn't written to, the next chain is linked
+  proxybuffer_ref(chain.tail);
+  CPPUNIT_ASSERT(proxybuffer_write(&pool, &other, "ghi", 3));
+  proxybuffer_append(&chain, &other);
+  CPPUNIT_ASSERT(chain.count == 4 && chain.tail->length == 3 && pool.inUse == 4);
+  proxybuffer_release(chain.head->next->next);
+
+  // The pool running out leaves the chain as it was
+  CPPUNIT_ASSERT(proxybuffer_write(&pool, &other, big, PROXYBUFFER_SIZE * 4 + 1) == false);
+  CPPUNIT_ASSERT(other.head == NULL && pool.inUse == 4);
+  CPPUNIT_ASSERT(proxybuffer_write(&pool, &chain, big, sizeof(big)) == false);
+  CPPUNIT_ASSERT(chain.count == 4 && chain.tail->length == 3 && pool.inUse == 4);
+
+  proxybuffer_clear(&chain);
+  CPPUNIT_ASSERT(chain.head == NULL && chain.length == 0 && pool.inUse == 0);
+
+  proxybuffer_destroy(&pool);
+}
+
+void ProxyBufferTest::testExtend(void) {
+  proxybuffer_pool_t pool;
+  proxybuffer_chain_t chain;
+  struct iovec segments[8];
+  int count;
+
+  CPPUNIT_ASSERT(proxybuffer_init(&pool, 8));
+  memset(&chain, 0, sizeof(chain));
+
+  // Room for a record, written in place then cut to its length
+  CPPUNIT_ASSERT(proxybuffer_extend(&pool, &chain, PROXYBUFFER_SIZE * 4));
+  CPPUNIT_ASSERT(chain.count == 4 && chain.length == PROXYBUFFER_SIZE * 4);
+
+  count = proxybuffer_segments(&chain, segments, 8);
+  CPPUNIT_ASSERT(count == 4);
+  memset(segments[0].iov_base, 'a', segments[0].iov_len);
+  memset(segments[1].iov_base, 'b', 10);
+
+  proxybuffer_truncate(&chain, PROXYBUFFER_SIZE + 10);
+  CPPUNIT_ASSERT(chain.count == 2 && chain.length == PROXYBUFFER_SIZE + 10);
+  CPPUNIT_ASSERT(chain.tail->length == 10 && chain.tail->next == NULL && chain.tail->data[9] == 'b');
+  CPPUNIT_ASSERT_MESSAGE("Buffers past the length not released\n", pool.inUse == 2);
+
+  // Not more buffers than the pool has
+  CPPUNIT_ASSERT(!proxybuffer_extend(&pool, &chain, PROXYBUFFER_SIZE * 7));
+  CPPUNIT_ASSERT(chain.count == 2 && pool.inUse == 2);
+
+  proxybuffer_truncate(&chain, 0);
+  CPPUNIT_ASSERT(chain.head == NULL && pool.inUse == 0);
+
+  proxybuffer_destroy(&pool);
+}
+
+void ProxyBufferTest::testThreads(void) {
+  pthread_t threads[THREADS];
+  proxybuffer_stats_t stats;
+  long i;
+
+  // Just enough buffers for the threads, every one of them changes hands
+  CPPUNIT_ASSERT(proxybuffer_init(&sPool, THREADS * THREAD_HELD));
+  sCollisions = 0;
+
+  for(i = 0; i < THREADS; i++) {
+    pthread_create(&threads[i], NULL, churn, (void *) (i + 1));
+  }
+
+  for(i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  proxybuffer_getStats(&sPool, &stats);
+  printf("\n%lu buffers taken by %d threads from a pool of %u\n", stats.allocated, THREADS, stats.count);
+
+  CPPUNIT_ASSERT_MESSAGE("A buffer was given to two threads\n", sCollisions == 0);
+  CPPUNIT_ASSERT(stats.allocated == THREADS * THREAD_ALLOCATIONS && stats.exhausted == 0);
+  CPPUNIT_ASSERT_MESSAGE("Buffers not given back\n", stats.inUse == 0 && stats.maxInUse <= stats.count);
+
+  proxybuffer_destroy(&sPool);
+}
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include "cppunit/extensions/HelperMacros.h"
+
+extern "C" {
+#include "ioterror.h"
+#include "proxyjournal_test.h"
+#include "proxyjournal.h"
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ProxyJournalTest );
+
+/**
+ * @param dir Where to write the path of a new, empty directory
+ */
+static void makeDir(char *dir) {
+  strcpy(dir, "/tmp/proxyjournal_test.XXXXXX");
+  CPPUNIT_ASSERT_MESSAGE("Couldn't create a directory for the journal\n", mkdtemp(dir) != NULL);
+}
+
+/**
+ * Delete the directory of a journal and its segments
+ */
+static void removeDir(const char *dir) {
+  char path[PATH_MAX];
+  struct dirent *entry;
+  DIR *directory = opendir(dir);
+
+  while(directory != NULL && (entry = readdir(directory)) != NULL) {
+    if(entry->d_name[0] != '.') {
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      unlink(path);
+    }
+  }
+
+  if(directory != NULL) {
+    closedir(directory);
+  }
+  rmdir(dir);
+}
+
+/**
+ * Append "msg<i>" for i in [first, last)
+ */
+static void append(proxyjournal_t *journal, int first, int last) {
+  char message[16];
+  int i;
+
+  for(i = first; i < last; i++) {
+    snprintf(message, sizeof(message), "msg%d", i);
+    CPPUNIT_ASSERT_MESSAGE("Append failed\n", proxyjournal_append(journal, message, strlen(message) + 1));
+  }
+}
+
+/**
+ * @return the number of the next message to replay, -1 if there is none
+ */
+static int peek(proxyjournal_t *journal) {
+  char message[16];
+
+  memset(message, 0, sizeof(message));
+  if(proxyjournal_peek(journal, message, sizeof(message)) <= 0) {
+    return -1;
+  }
+  return atoi(message + 3);
+}
+
+void ProxyJournalTest::testReplay(void) {
+  proxyjournal_t journal;
+  proxyjournal_stats_t stats;
+  char dir[PATH_MAX];
+
+  makeDir(dir);
+  CPPUNIT_ASSERT_MESSAGE("Couldn't open the journal\n", proxyjournal_open(&journal, dir));
+  CPPUNIT_ASSERT_MESSAGE("New journal isn't empty\n", proxyjournal_isEmpty(&journal));
+  CPPUNIT_ASSERT(peek(&journal) == -1);
+
+  append(&journal, 0, 3);
+  proxyjournal_getStats(&journal, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Wrong depth\n", stats.records == 3 && stats.bytes == 15 && stats.segments == 1);
+
+  // A message stays at the head of the journal until it is acknowledged
+  CPPUNIT_ASSERT_MESSAGE("Wrong first message\n", peek(&journal) == 0);
+  CPPUNIT_ASSERT_MESSAGE("Message lost before its ack\n", peek(&journal) == 0);
+  proxyjournal_ack(&journal);
+  CPPUNIT_ASSERT_MESSAGE("Wrong second message\n", peek(&journal) == 1);
+  proxyjournal_ack(&journal);
+  CPPUNIT_ASSERT(peek(&journal) == 2);
+  proxyjournal_ack(&journal);
+
+  proxyjournal_getStats(&journal, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Journal not empty after the replay\n", proxyjournal_isEmpty(&journal) && stats.records == 0);
+  CPPUNIT_ASSERT_MESSAGE("Wrong replay counts\n", stats.replayed == 3 && stats.replayedBytes == 15);
+  CPPUNIT_ASSERT_MESSAGE("Fully sent segment kept\n", stats.segments == 0);
+
+  proxyjournal_close(&journal);
+  removeDir(dir);
+}
+
+void ProxyJournalTest::testSegments(void) {
+  proxyjournal_t journal;
+  struct iovec segments[3];
+  char first[8];
+  char second[8];
+  char third[8];
+  char dir[PATH_MAX];
+
+  makeDir(dir);
+  CPPUNIT_ASSERT(proxyjournal_open(&journal, dir));
+
+  // A message made of segments is one record
+  segments[0].iov_base = (void *) "<m1/>";
+  segments[0].iov_len = 5;
+  segments[1].iov_base = (void *) "<m2/>";
+  segments[1].iov_len = 5;
+  CPPUNIT_ASSERT(proxyjournal_appendv(&journal, segments, 2));
+  CPPUNIT_ASSERT(proxyjournal_append(&journal, "<m3/>", 5));
+
+  // Read back across segments of another size
+  segments[0].iov_base = first;
+  segments[0].iov_len = 4;
+  segments[1].iov_base = second;
+  segments[1].iov_len = 4;
+  segments[2].iov_base = third;
+  segments[2].iov_len = sizeof(third);
+  CPPUNIT_ASSERT_MESSAGE("Wrong length of the record\n", proxyjournal_peekv(&journal, segments, 3) == 10);
+  CPPUNIT_ASSERT(memcmp(first, "<m1/", 4) == 0 && memcmp(second, "><m2", 4) == 0 && memcmp(third, "/>", 2) == 0);
+  proxyjournal_ack(&journal);
+
+  // A record larger than the segments is dropped
+  CPPUNIT_ASSERT(proxyjournal_peekv(&journal, segments, 1) == 0);
+  CPPUNIT_ASSERT(proxyjournal_isEmpty(&journal));
+
+  proxyjournal_close(&journal);
+  removeDir(dir);
+}
+
+void ProxyJournalTest::testRecovery(void) {
+  proxyjournal_t journal;
+  proxyjournal_stats_t stats;
+  char dir[PATH_MAX];
+
+  makeDir(dir);
+  proxyjournal_open(&journal, dir);
+  append(&journal, 0, 4);
+  peek(&journal);
+  proxyjournal_ack(&journal);
+  proxyjournal_close(&journal);
+
+  // The message already sent isn't replayed again by the next run
+  CPPUNIT_ASSERT_MESSAGE("Couldn't reopen the journal\n", proxyjournal_open(&journal, dir));
+  proxyjournal_getStats(&journal, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Wrong depth after a restart\n", stats.records == 3);
+  CPPUNIT_ASSERT_MESSAGE("Sent message replayed again\n", peek(&journal) == 1);
+
+  // New messages go after the recovered ones
+  append(&journal, 4, 5);
+  proxyjournal_ack(&journal);
+  CPPUNIT_ASSERT(peek(&journal) == 2);
+  proxyjournal_ack(&journal);
+  CPPUNIT_ASSERT(peek(&journal) == 3);
+  proxyjournal_ack(&journal);
+  CPPUNIT_ASSERT_MESSAGE("Message appended after a restart lost\n", peek(&journal) == 4);
+
+  proxyjournal_close(&journal);
+  removeDir(dir);
+}
+
+void ProxyJournalTest::testCorruption(void) {
+  proxyjournal_t journal;
+  proxyjournal_stats_t stats;
+  char dir[PATH_MAX];
+  char path[PATH_MAX + 32];
+  char byte;
+  int fd;
+
+  makeDir(dir);
+  proxyjournal_open(&journal, dir);
+  append(&journal, 0, 3);
+  proxyjournal_close(&journal);
+
+  // Flip a byte of the second message, like a write torn by a power failure
+  snprintf(path, sizeof(path), "%s/journal-%08lu.seg", dir, 1UL);
+  fd = open(path, O_RDWR);
+  CPPUNIT_ASSERT_MESSAGE("Segment file not found\n", fd >= 0);
+  CPPUNIT_ASSERT(pread(fd, &byte, 1, 16 + 12 + 3) == 1);
+  byte ^= 0x40;
+  CPPUNIT_ASSERT(pwrite(fd, &byte, 1, 16 + 12 + 3) == 1);
+  close(fd);
+
+  // The records stop at the bad CRC
+  proxyjournal_open(&journal, dir);
+  proxyjournal_getStats(&journal, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Corrupted record recovered\n", stats.records == 1);
+  CPPUNIT_ASSERT(peek(&journal) == 0);
+  proxyjournal_ack(&journal);
+  CPPUNIT_ASSERT_MESSAGE("Corrupted record replayed\n", peek(&journal) == -1);
+
+  // Its space is reused
+  append(&journal, 3, 4);
+  CPPUNIT_ASSERT_MESSAGE("Record written over the corrupted one lost\n", peek(&journal) == 3);
+
+  proxyjournal_close(&journal);
+  removeDir(dir);
+}
+
+void ProxyJournalTest::testSizeCap(void) {
+  proxyjournal_t journal;
+  proxyjournal_stats_t stats;
+  char dir[PATH_MAX];
+  char *message;
+  int length = PROXYJOURNAL_SEGMENT_SIZE / 4;
+  int total = (PROXYJOURNAL_MAX_SEGMENTS + 2) * 3;
+  int i;
+
+  // Three messages per segment
+  message = (char *) calloc(1, length);
+  makeDir(dir);
+  proxyjournal_open(&journal, dir);
+
+  for(i = 0; i < total; i++) {
+    snprintf(message, length, "msg%d", i);
+    CPPUNIT_ASSERT_MESSAGE("Append failed past the cap\n", proxyjournal_append(&journal, message, length));
+  }
+
+  proxyjournal_getStats(&journal, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Journal went past its size cap\n", stats.segments == PROXYJOURNAL_MAX_SEGMENTS);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of dropped messages\n", stats.dropped == 6);
+  CPPUNIT_ASSERT(stats.records == (unsigned long) total - 6);
+
+  // The oldest messages were dropped
+  CPPUNIT_ASSERT(proxyjournal_peek(&journal, message, length) == length);
+  CPPUNIT_ASSERT_MESSAGE("Newest messages dropped instead of the oldest\n", atoi(message + 3) == 6);
+
+  // Too large for a segment
+  CPPUNIT_ASSERT(!proxyjournal_append(&journal, message, PROXYJOURNAL_SEGMENT_SIZE));
+
+  free(message);
+  proxyjournal_close(&journal);
+  removeDir(dir);
+}
+
+void ProxyJournalTest::testPacing(void) {
+  proxyjournal_t journal;
+  proxyjournal_stats_t stats;
+  char dir[PATH_MAX];
+  char message[PROXYJOURNAL_REPLAY_BYTES_PER_SEC / 2];
+
+  memset(message, 'x', sizeof(message));
+  makeDir(dir);
+  proxyjournal_open(&journal, dir);
+  proxyjournal_append(&journal, message, sizeof(message));
+  proxyjournal_append(&journal, message, sizeof(message));
+
+  CPPUNIT_ASSERT_MESSAGE("First message of the replay delayed\n", proxyjournal_replayDelayMs(&journal) == 0);
+  CPPUNIT_ASSERT(proxyjournal_peek(&journal, message, sizeof(message)) == sizeof(message));
+  proxyjournal_ack(&journal);
+
+  // Half a second worth of bytes were replayed
+  CPPUNIT_ASSERT_MESSAGE("Replay not paced\n", proxyjournal_replayDelayMs(&journal) > 400);
+  CPPUNIT_ASSERT_MESSAGE("Replay paced too slowly\n", proxyjournal_replayDelayMs(&journal) <= 500);
+
+  proxyjournal_getStats(&journal, &stats);
+  CPPUNIT_ASSERT_MESSAGE("No replay throughput\n", stats.replayBytesPerSec > 0);
+
+  proxyjournal_close(&journal);
+  removeDir(dir);
+}
+
+void ProxyJournalTest::testSync(void) {
+  proxyjournal_t journal;
+  proxyjournal_stats_t stats;
+  char dir[PATH_MAX];
+  int timeoutMs;
+
+  makeDir(dir);
+  proxyjournal_open(&journal, dir);
+  CPPUNIT_ASSERT_MESSAGE("Clean journal waits for a sync\n", proxyjournal_syncTimeoutMs(&journal) == -1);
+
+  // Records are batched, then forced to flash together
+  append(&journal, 0, 10);
+  timeoutMs = proxyjournal_syncTimeoutMs(&journal);
+  CPPUNIT_ASSERT_MESSAGE("Wrong sync timeout\n", timeoutMs > 0 && timeoutMs <= PROXYJOURNAL_SYNC_INTERVAL_MS);
+
+  proxyjournal_sync(&journal, false);
+  proxyjournal_getStats(&journal, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Synced before the interval\n", stats.syncs == 0);
+
+  proxyjournal_sync(&journal, true);
+  proxyjournal_getStats(&journal, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Forced sync not done\n", stats.syncs == 1);
+  CPPUNIT_ASSERT(proxyjournal_syncTimeoutMs(&journal) == -1);
+
+  proxyjournal_close(&journal);
+  removeDir(dir);
+}
+
+void ProxyJournalTest::testLongDir(void) {
+  proxyjournal_t journal;
+  char dir[PATH_MAX];
+
+  // The directory fits, not the paths of its segments
+  memset(dir, 'j', sizeof(dir) - 8);
+  dir[0] = '/';
+  dir[sizeof(dir) - 8] = '\0';
+  CPPUNIT_ASSERT_MESSAGE("Opened a journal whose segments can't be named\n", !proxyjournal_open(&journal, dir));
+  CPPUNIT_ASSERT(proxyjournal_isEmpty(&journal));
+}
@@ -130,4 +130,114 @@ void ProxyListenersTest::testListeners(void) {
   CPPUNIT_ASSERT_MESSAGE("Wrong number of listeners registered\n", proxylisteners_totalListeners() == 0);
 }
 
+static char streamedMessage[64];
 
+static int streamedMessageLength;
+
+static int streamEvents[PROXYSTREAM_ABORT + 1];
+
+void streamlistener(proxystream_e event, const char *data, int len) {
+  streamEvents[event]++;
+
+  if(event == PROXYSTREAM_DATA) {
+    CPPUNIT_ASSERT_MESSAGE("streamlistener() - chunk doesn't fit", streamedMessageLength + len < (int) sizeof(streamedMessage));
+    memcpy(streamedMessage + streamedMessageLength, data, len);
+    streamedMessageLength += len;
+  }
+}
+
+void dummystreamlistener(proxystream_e event, const char *data, int len) {
+  CPPUNIT_ASSERT_MESSAGE("Dummy stream listener got an event!", false);
+}
+
+void ProxyListenersTest::testStreamListeners(void) {
+  memset(streamedMessage, 0, sizeof(streamedMessage));
+  memset(streamEvents, 0, sizeof(streamEvents));
+  streamedMessageLength = 0;
+
+  // Add listeners
+  CPPUNIT_ASSERT_MESSAGE("Couldn't add the stream listener\n", proxylisteners_addStreamListener(&streamlistener) == SUCCESS);
+  CPPUNIT_ASSERT_MESSAGE("Couldn't add the stream listener again\n", proxylisteners_addStreamListener(&streamlistener) == SUCCESS);
+  CPPUNIT_ASSERT_MESSAGE("Stream listeners counted as listeners\n", proxylisteners_totalListeners() == 0);
+
+  // Chunks come out in order, between the begin and the end
+  proxylisteners_streamBroadcast(PROXYSTREAM_BEGIN, NULL, 0);
+  proxylisteners_streamBroadcast(PROXYSTREAM_DATA, "<s2h>", 5);
+  proxylisteners_streamBroadcast(PROXYSTREAM_DATA, "</s2h>", 6);
+  proxylisteners_streamBroadcast(PROXYSTREAM_END, NULL, 0);
+
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of begin events\n", streamEvents[PROXYSTREAM_BEGIN] == 1);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of data events\n", streamEvents[PROXYSTREAM_DATA] == 2);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of end events\n", streamEvents[PROXYSTREAM_END] == 1);
+  CPPUNIT_ASSERT_MESSAGE("Chunks weren't put back together\n", strcmp(streamedMessage, "<s2h></s2h>") == 0);
+
+  // Remove listeners
+  CPPUNIT_ASSERT_MESSAGE("Dummy stream listener was removed\n", proxylisteners_removeStreamListener(&dummystreamlistener) == FAIL);
+  CPPUNIT_ASSERT_MESSAGE("Stream listener couldn't get removed\n", proxylisteners_removeStreamListener(&streamlistener) == SUCCESS);
+  CPPUNIT_ASSERT_MESSAGE("Stream listener was removed twice\n", proxylisteners_removeStreamListener(&streamlistener) == FAIL);
+
+  proxylisteners_streamBroadcast(PROXYSTREAM_ABORT, NULL, 0);
+  CPPUNIT_ASSERT_MESSAGE("Removed stream listener got an event\n", streamEvents[PROXYSTREAM_ABORT] == 0);
+}
+
+
+static int queueAbove;
+
+static int queueBelow;
+
+void queuelistener(int priority, bool above, int length) {
+  CPPUNIT_ASSERT_MESSAGE("queuelistener() - wrong priority", priority == 1);
+
+  if(above) {
+    queueAbove++;
+    CPPUNIT_ASSERT_MESSAGE("queuelistener() - wrong length", length == 192);
+  } else {
+    queueBelow++;
+  }
+}
+
+void ProxyListenersTest::testQueueListeners(void) {
+  queueAbove = 0;
+  queueBelow = 0;
+
+  CPPUNIT_ASSERT_MESSAGE("Couldn't add the queue listener\n", proxylisteners_addQueueListener(&queuelistener) == SUCCESS);
+  CPPUNIT_ASSERT_MESSAGE("Couldn't add the queue listener again\n", proxylisteners_addQueueListener(&queuelistener) == SUCCESS);
+  CPPUNIT_ASSERT_MESSAGE("Queue listeners counted as listeners\n", proxylisteners_totalListeners() == 0);
+
+  proxylisteners_queueBroadcast(1, true, 192);
+  proxylisteners_queueBroadcast(1, false, 64);
+  CPPUNIT_ASSERT_MESSAGE("Added twice, or not told\n", queueAbove == 1 && queueBelow == 1);
+
+  CPPUNIT_ASSERT_MESSAGE("Queue listener couldn't get removed\n", proxylisteners_removeQueueListener(&queuelistener) == SUCCESS);
+  CPPUNIT_ASSERT_MESSAGE("Queue listener was removed twice\n", proxylisteners_removeQueueListener(&queuelistener) == FAIL);
+
+  proxylisteners_queueBroadcast(1, true, 192);
+  CPPUNIT_ASSERT_MESSAGE("Removed queue listener was told\n", queueAbove == 1);
+}
+
+
+static int reentrantEvents;
+
+/**
+ * Runs a command whose result fills the queue to the server, as proxyagent
+ * does while the message of the server is streamed
+ */
+void reentrantstreamlistener(proxystream_e event, const char *data, int len) {
+  reentrantEvents++;
+  proxylisteners_queueBroadcast(1, true, 192);
+}
+
+void ProxyListenersTest::testReentrantBroadcast(void) {
+  queueAbove = 0;
+  reentrantEvents = 0;
+
+  CPPUNIT_ASSERT(proxylisteners_addStreamListener(&reentrantstreamlistener) == SUCCESS);
+  CPPUNIT_ASSERT(proxylisteners_addQueueListener(&queuelistener) == SUCCESS);
+
+  // Would deadlock if the listeners ran with the mutex held
+  proxylisteners_streamBroadcast(PROXYSTREAM_END, NULL, 0);
+  CPPUNIT_ASSERT_MESSAGE("Queue listener wasn't told from a stream listener\n", reentrantEvents == 1 && queueAbove == 1);
+
+  CPPUNIT_ASSERT(proxylisteners_removeStreamListener(&reentrantstreamlistener) == SUCCESS);
+  CPPUNIT_ASSERT(proxylisteners_removeQueueListener(&queuelistener) == SUCCESS);
+}
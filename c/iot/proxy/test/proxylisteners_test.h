@@ -40,6 +40,9 @@ class ProxyListenersTest : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE( ProxyListenersTest );
     CPPUNIT_TEST( testListeners );
+    CPPUNIT_TEST( testStreamListeners );
+    CPPUNIT_TEST( testQueueListeners );
+    CPPUNIT_TEST( testReentrantBroadcast );
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -48,6 +51,9 @@ public:
 
 private:
     void testListeners (void);
+    void testStreamListeners (void);
+    void testQueueListeners (void);
+    void testReentrantBroadcast (void);
 };
 
 #endif
@@ -0,0 +1,529 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "cppunit/extensions/HelperMacros.h"
+
+extern "C" {
+#include "ioterror.h"
+#include "libpipecomm.h"
+#include "proxyqueue_test.h"
+#include "proxyqueue.h"
+#include "proxybuffer.h"
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ProxyQueueTest );
+
+/** Threads sending messages at once */
+#define PRODUCERS 4
+
+/** Messages sent by each producer in the benchmark */
+#define BENCHMARK_MESSAGES 20000
+
+/** Size of the messages of the benchmark, a small measurement */
+#define BENCHMARK_MESSAGE_LEN 96
+
+/** Buffers of the messages of the queue under test */
+static proxybuffer_pool_t sPool;
+
+/** Watermark crossings heard by watermarkListener() */
+static int sAbove;
+
+static int sBelow;
+
+static void watermarkListener(proxyqueue_t *queue, bool above) {
+  if(above) {
+    sAbove++;
+  } else {
+    sBelow++;
+  }
+}
+
+/** One producer of a benchmark or of testProducers() */
+typedef struct producer_t {
+  int id;
+
+  int messages;
+
+  /** Queue to push to, NULL to write to the pipe like proxy_send() used to */
+  proxyqueue_t *queue;
+
+  int pipeFd;
+
+  pthread_mutex_t *mutex;
+
+  /** Time each message took to be accepted, in ns */
+  unsigned long *latencies;
+} producer_t;
+
+static unsigned long long now() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int compareLatencies(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *) a;
+  unsigned long y = *(const unsigned long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Messages start with the producer id and their number, then padding
+ */
+static void *produce(void *arg) {
+  producer_t *producer = (producer_t *) arg;
+  char message[BENCHMARK_MESSAGE_LEN];
+  unsigned long long start;
+  int written;
+  int i;
+
+  memset(message, 'x', sizeof(message));
+
+  for(i = 0; i < producer->messages; i++) {
+    snprintf(message, sizeof(message), "%d %d ", producer->id, i);
+    start = now();
+
+    if(producer->queue != NULL) {
+      while(!proxyqueue_push(producer->queue, message, sizeof(message))) {
+        sched_yield();
+      }
+
+    } else {
+      // The pipe is non-blocking, a writer finding it full tries again
+      for(;;) {
+        pthread_mutex_lock(producer->mutex);
+        written = libpipecomm_write(producer->pipeFd, message, sizeof(message));
+        pthread_mutex_unlock(producer->mutex);
+
+        if(written == (int) sizeof(message) + 2) {
+          break;
+        }
+        sched_yield();
+      }
+    }
+
+    if(producer->latencies != NULL) {
+      producer->latencies[i] = (unsigned long) (now() - start);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Start the producers, each one sending the given number of messages
+ */
+static void startProducers(pthread_t *threads, producer_t *producers, int messages,
+    proxyqueue_t *queue, int pipeFd, pthread_mutex_t *mutex, bool measure) {
+  int i;
+
+  for(i = 0; i < PRODUCERS; i++) {
+    producers[i].id = i;
+    producers[i].messages = messages;
+    producers[i].queue = queue;
+    producers[i].pipeFd = pipeFd;
+    producers[i].mutex = mutex;
+    producers[i].latencies = measure ? (unsigned long *) calloc(messages, sizeof(unsigned long)) : NULL;
+    pthread_create(&threads[i], NULL, produce, &producers[i]);
+  }
+}
+
+/**
+ * Consume the messages of the producers the way the proxy thread does, and
+ * check each producer's messages arrive in order
+ *
+ * @return the number of messages received
+ */
+static int consume(proxyqueue_t *queue, int pipeFd, pthread_mutex_t *mutex, int total) {
+  char message[BENCHMARK_MESSAGE_LEN + 1];
+  int next[PRODUCERS];
+  struct pollfd event;
+  int received = 0;
+  int length;
+  int id;
+  int number;
+
+  memset(next, 0, sizeof(next));
+
+  while(received < total) {
+    if(queue != NULL) {
+      length = proxyqueue_pop(queue, message, sizeof(message) - 1);
+
+    } else {
+      pthread_mutex_lock(mutex);
+      length = libpipecomm_read(pipeFd, message, sizeof(message) - 1);
+      pthread_mutex_unlock(mutex);
+    }
+
+    if(length <= 0) {
+      if(queue != NULL && !proxyqueue_sleep(queue)) {
+        continue;
+      }
+
+      event.fd = queue != NULL ? proxyqueue_getDoorbell(queue) : pipeFd;
+      event.events = POLLIN;
+      if(poll(&event, 1, 1000) <= 0) {
+        break;
+      }
+
+      if(queue != NULL) {
+        proxyqueue_ackDoorbell(queue);
+      }
+      continue;
+    }
+
+    message[length] = '\0';
+    if(sscanf(message, "%d %d", &id, &number) != 2 || id < 0 || id >= PRODUCERS
+        || number != next[id]) {
+      break;
+    }
+    next[id]++;
+    received++;
+  }
+
+  return received;
+}
+
+/**
+ * Run PRODUCERS threads against one consumer and print the throughput and
+ * the 99th percentile of the time to hand a message over. On one core, the
+ * p99 of the queue is higher than the one of the pipe: the producer ringing
+ * the doorbell can wait for the consumer it woke up to drain the queue.
+ */
+static int benchmark(const char *name, proxyqueue_t *queue, int pipeFds[2], pthread_mutex_t *mutex) {
+  pthread_t threads[PRODUCERS];
+  producer_t producers[PRODUCERS];
+  unsigned long *latencies;
+  unsigned long long start;
+  unsigned long long elapsed;
+  int total = PRODUCERS * BENCHMARK_MESSAGES;
+  int received;
+  int i;
+
+  start = now();
+  startProducers(threads, producers, BENCHMARK_MESSAGES, queue, pipeFds[1], mutex, true);
+  received = consume(queue, pipeFds[0], mutex, total);
+  elapsed = now() - start;
+
+  latencies = (unsigned long *) malloc(total * sizeof(unsigned long));
+  for(i = 0; i < PRODUCERS; i++) {
+    pthread_join(threads[i], NULL);
+    memcpy(latencies + i * BENCHMARK_MESSAGES, producers[i].latencies, BENCHMARK_MESSAGES * sizeof(unsigned long));
+    free(producers[i].latencies);
+  }
+
+  qsort(latencies, total, sizeof(unsigned long), compareLatencies);
+  printf("\n%s: %d producers, %d messages, %llu msg/s, p50 enqueue %lu ns, p99 enqueue %lu ns\n",
+      name, PRODUCERS, received, elapsed > 0 ? received * 1000000000ULL / elapsed : 0,
+      latencies[total / 2], latencies[total * 99 / 100]);
+
+  free(latencies);
+  return received;
+}
+
+void ProxyQueueTest::testOrder(void) {
+  proxyqueue_t queue;
+  char message[16];
+  int i;
+
+  CPPUNIT_ASSERT(proxybuffer_init(&sPool, 0));
+  CPPUNIT_ASSERT_MESSAGE("Couldn't create the queue\n", proxyqueue_init(&queue, 8, &sPool));
+  CPPUNIT_ASSERT_MESSAGE("A new queue isn't empty\n", proxyqueue_pop(&queue, message, sizeof(message)) == 0);
+
+  // Wraps around the ring a few times
+  for(i = 0; i < 20; i++) {
+    snprintf(message, sizeof(message), "msg%d", i);
+    CPPUNIT_ASSERT_MESSAGE("Push failed\n", proxyqueue_push(&queue, message, strlen(message) + 1));
+    CPPUNIT_ASSERT_MESSAGE("Wrong length of the next message\n", proxyqueue_peek(&queue) == (int) strlen(message) + 1);
+
+    memset(message, 0, sizeof(message));
+    CPPUNIT_ASSERT_MESSAGE("Pop failed\n", proxyqueue_pop(&queue, message, sizeof(message)) > 0);
+    CPPUNIT_ASSERT_MESSAGE("Wrong message\n", atoi(message + 3) == i);
+  }
+
+  // A message that doesn't fit stays in the queue
+  CPPUNIT_ASSERT(proxyqueue_push(&queue, "0123456789", 10));
+  CPPUNIT_ASSERT_MESSAGE("Message didn't fit but was popped\n", proxyqueue_pop(&queue, message, 4) == 0);
+  CPPUNIT_ASSERT_MESSAGE("Message lost\n", proxyqueue_pop(&queue, message, sizeof(message)) == 10);
+
+  proxyqueue_destroy(&queue);
+  CPPUNIT_ASSERT_MESSAGE("Buffers not given back\n", sPool.inUse == 0);
+  proxybuffer_destroy(&sPool);
+}
+
+void ProxyQueueTest::testFull(void) {
+  proxyqueue_t queue;
+  proxyqueue_stats_t stats;
+  char message[16];
+  int i;
+
+  // The capacity is rounded up to a power of 2
+  proxybuffer_init(&sPool, 0);
+  proxyqueue_init(&queue, 5, &sPool);
+
+  for(i = 0; i < 8; i++) {
+    CPPUNIT_ASSERT_MESSAGE("Queue full too early\n", proxyqueue_push(&queue, "m", 1));
+  }
+  CPPUNIT_ASSERT_MESSAGE("Queue went past its capacity\n", !proxyqueue_push(&queue, "m", 1));
+
+  // Freeing a slot makes room for one more
+  CPPUNIT_ASSERT(proxyqueue_pop(&queue, message, sizeof(message)) == 1);
+  CPPUNIT_ASSERT_MESSAGE("Freed slot not reused\n", proxyqueue_push(&queue, "m", 1));
+
+  proxyqueue_getStats(&queue, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of pushes\n", stats.pushed == 9);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of refusals\n", stats.full == 1);
+
+  // Messages left in the queue are freed with it
+  proxyqueue_destroy(&queue);
+  CPPUNIT_ASSERT_MESSAGE("Buffers not given back\n", sPool.inUse == 0);
+  proxybuffer_destroy(&sPool);
+
+  // A queue whose pool ran out of buffers refuses the message
+  proxybuffer_init(&sPool, 2);
+  proxyqueue_init(&queue, 8, &sPool);
+  CPPUNIT_ASSERT(proxyqueue_push(&queue, "m", 1) && proxyqueue_push(&queue, "m", 1));
+  CPPUNIT_ASSERT_MESSAGE("Queue went past its pool\n", !proxyqueue_push(&queue, "m", 1));
+  CPPUNIT_ASSERT(proxyqueue_pop(&queue, message, sizeof(message)) == 1);
+  CPPUNIT_ASSERT_MESSAGE("Buffer not reused\n", proxyqueue_push(&queue, "m", 1));
+
+  proxyqueue_destroy(&queue);
+  CPPUNIT_ASSERT_MESSAGE("Buffers not given back\n", sPool.inUse == 0);
+  proxybuffer_destroy(&sPool);
+}
+
+void ProxyQueueTest::testDoorbell(void) {
+  proxyqueue_t queue;
+  proxyqueue_stats_t stats;
+  struct pollfd event;
+  char message[16];
+
+  proxybuffer_init(&sPool, 0);
+  proxyqueue_init(&queue, 0, &sPool);
+  event.fd = proxyqueue_getDoorbell(&queue);
+  event.events = POLLIN;
+
+  // Producers don't ring while the consumer is awake
+  proxyqueue_push(&queue, "a", 1);
+  CPPUNIT_ASSERT_MESSAGE("Doorbell rang for an awake consumer\n", poll(&event, 1, 0) == 0);
+  CPPUNIT_ASSERT_MESSAGE("Consumer slept with a message waiting\n", !proxyqueue_sleep(&queue));
+  proxyqueue_pop(&queue, message, sizeof(message));
+
+  // The first message after the consumer went to sleep rings once
+  CPPUNIT_ASSERT_MESSAGE("Consumer couldn't sleep on an empty queue\n", proxyqueue_sleep(&queue));
+  proxyqueue_push(&queue, "b", 1);
+  proxyqueue_push(&queue, "c", 1);
+  CPPUNIT_ASSERT_MESSAGE("Doorbell didn't ring\n", poll(&event, 1, 0) == 1);
+  proxyqueue_ackDoorbell(&queue);
+  CPPUNIT_ASSERT_MESSAGE("Doorbell still ringing\n", poll(&event, 1, 0) == 0);
+
+  proxyqueue_getStats(&queue, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of doorbells\n", stats.doorbells == 1);
+
+  proxyqueue_destroy(&queue);
+  CPPUNIT_ASSERT_MESSAGE("Buffers not given back\n", sPool.inUse == 0);
+  proxybuffer_destroy(&sPool);
+}
+
+void ProxyQueueTest::testWatermarks(void) {
+  proxyqueue_t queue;
+  proxyqueue_stats_t stats;
+  char message[16];
+  int i;
+
+  sAbove = sBelow = 0;
+  proxybuffer_init(&sPool, 0);
+  proxyqueue_init(&queue, 16, &sPool);
+  proxyqueue_setLimits(&queue, 8, 2, PROXYQUEUE_DROP_NEVER);
+  proxyqueue_setWatermarkListener(&queue, watermarkListener);
+
+  // Told once past the high watermark, the messages are still taken up to the capacity
+  for(i = 0; i < 16; i++) {
+    CPPUNIT_ASSERT_MESSAGE("Message refused before the capacity\n", proxyqueue_push(&queue, "m", 1) == PROXYQUEUE_QUEUED);
+    CPPUNIT_ASSERT_MESSAGE("Wrong watermark crossings\n", sAbove == (i >= 7 ? 1 : 0));
+  }
+  CPPUNIT_ASSERT_MESSAGE("Queue went past its capacity\n", proxyqueue_push(&queue, "m", 1) == PROXYQUEUE_REFUSED);
+
+  // Back below only at the low watermark
+  for(i = 0; i < 13; i++) {
+    proxyqueue_pop(&queue, message, sizeof(message));
+  }
+  CPPUNIT_ASSERT_MESSAGE("Below too early\n", sBelow == 0 && proxyqueue_length(&queue) == 3);
+  proxyqueue_pop(&queue, message, sizeof(message));
+  CPPUNIT_ASSERT_MESSAGE("Not told about the low watermark\n", sBelow == 1);
+  while(proxyqueue_pop(&queue, message, sizeof(message)) > 0);
+  CPPUNIT_ASSERT(sBelow == 1);
+
+  // A queue dropping its oldest messages stays at its high watermark
+  proxyqueue_setLimits(&queue, 4, 1, PROXYQUEUE_DROP_OLDEST);
+  for(i = 0; i < 10; i++) {
+    snprintf(message, sizeof(message), "%d", i);
+    CPPUNIT_ASSERT_MESSAGE("Wrong result of a push\n", proxyqueue_push(&queue, message, strlen(message) + 1)
+        == (i < 4 ? PROXYQUEUE_QUEUED : PROXYQUEUE_SHED));
+  }
+  CPPUNIT_ASSERT_MESSAGE("Queue went past its high watermark\n", proxyqueue_length(&queue) == 4);
+  CPPUNIT_ASSERT(sAbove == 2);
+
+  proxyqueue_getStats(&queue, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of drops\n", stats.dropped == 6 && stats.full == 1);
+  CPPUNIT_ASSERT(stats.length == 4 && stats.maxLength == 16 && stats.highWatermarks == 2);
+
+  // The newest ones are left, in order
+  for(i = 6; i < 10; i++) {
+    CPPUNIT_ASSERT(proxyqueue_pop(&queue, message, sizeof(message)) > 0);
+    CPPUNIT_ASSERT_MESSAGE("Wrong message left\n", atoi(message) == i);
+  }
+  CPPUNIT_ASSERT(sBelow == 2);
+
+  proxyqueue_destroy(&queue);
+  CPPUNIT_ASSERT_MESSAGE("Buffers not given back\n", sPool.inUse == 0);
+  proxybuffer_destroy(&sPool);
+}
+
+void ProxyQueueTest::testDropOldest(void) {
+  pthread_t threads[PRODUCERS];
+  producer_t producers[PRODUCERS];
+  proxyqueue_t queue;
+  proxyqueue_stats_t stats;
+  char message[BENCHMARK_MESSAGE_LEN + 1];
+  int last[PRODUCERS];
+  int received = 0;
+  int joined;
+  int length;
+  int id;
+  int number;
+  int i;
+
+  // Producers dropping messages from under a slow consumer
+  proxybuffer_init(&sPool, 0);
+  proxyqueue_init(&queue, 64, &sPool);
+  proxyqueue_setLimits(&queue, 32, 8, PROXYQUEUE_DROP_OLDEST);
+  for(i = 0; i < PRODUCERS; i++) {
+    last[i] = -1;
+  }
+
+  startProducers(threads, producers, 5000, &queue, -1, NULL, false);
+
+  joined = 0;
+  while(joined < PRODUCERS || proxyqueue_length(&queue) > 0) {
+    length = proxyqueue_pop(&queue, message, sizeof(message) - 1);
+    if(length <= 0) {
+      if(joined < PRODUCERS && pthread_tryjoin_np(threads[joined], NULL) == 0) {
+        joined++;
+      } else {
+        sched_yield();
+      }
+      continue;
+    }
+
+    message[length] = '\0';
+    CPPUNIT_ASSERT_MESSAGE("Corrupted message\n", sscanf(message, "%d %d", &id, &number) == 2 && id >= 0 && id < PRODUCERS);
+    CPPUNIT_ASSERT_MESSAGE("Messages out of order\n", number > last[id]);
+    last[id] = number;
+    received++;
+
+    if(received % 64 == 0) {
+      sched_yield();
+    }
+  }
+
+  proxyqueue_getStats(&queue, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Messages lost without being counted\n", received + stats.dropped == PRODUCERS * 5000);
+  CPPUNIT_ASSERT_MESSAGE("Queue went past its capacity\n", stats.maxLength <= 64);
+  proxyqueue_destroy(&queue);
+  CPPUNIT_ASSERT_MESSAGE("Buffers not given back\n", sPool.inUse == 0);
+  proxybuffer_destroy(&sPool);
+}
+
+void ProxyQueueTest::testProducers(void) {
+  pthread_t threads[PRODUCERS];
+  producer_t producers[PRODUCERS];
+  proxyqueue_t queue;
+  int received;
+  int i;
+
+  // A small queue keeps the producers contending for the slots
+  proxybuffer_init(&sPool, 0);
+  proxyqueue_init(&queue, 16, &sPool);
+
+  startProducers(threads, producers, 5000, &queue, -1, NULL, false);
+  received = consume(&queue, -1, NULL, PRODUCERS * 5000);
+
+  for(i = 0; i < PRODUCERS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  CPPUNIT_ASSERT_MESSAGE("Messages lost or out of order\n", received == PRODUCERS * 5000);
+  proxyqueue_destroy(&queue);
+  CPPUNIT_ASSERT_MESSAGE("Buffers not given back\n", sPool.inUse == 0);
+  proxybuffer_destroy(&sPool);
+}
+
+void ProxyQueueTest::testBenchmark(void) {
+  proxyqueue_t queue;
+  pthread_mutex_t mutex;
+  int pipeFds[2];
+
+  // Former path: a mutex and a write() per message, a mutex and three read() per message
+  CPPUNIT_ASSERT(pipe(pipeFds) == 0);
+  fcntl(pipeFds[0], F_SETFL, O_NONBLOCK);
+  fcntl(pipeFds[1], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&mutex, NULL);
+
+  CPPUNIT_ASSERT_MESSAGE("Messages lost through the pipe\n",
+      benchmark("pipe+mutex", NULL, pipeFds, &mutex) == PRODUCERS * BENCHMARK_MESSAGES);
+  close(pipeFds[0]);
+  close(pipeFds[1]);
+  pthread_mutex_destroy(&mutex);
+
+  pipeFds[0] = pipeFds[1] = -1;
+  proxybuffer_init(&sPool, 0);
+  proxyqueue_init(&queue, 0, &sPool);
+  CPPUNIT_ASSERT_MESSAGE("Messages lost through the queue\n",
+      benchmark("proxyqueue", &queue, pipeFds, NULL) == PRODUCERS * BENCHMARK_MESSAGES);
+  proxyqueue_destroy(&queue);
+  CPPUNIT_ASSERT_MESSAGE("Buffers not given back\n", sPool.inUse == 0);
+  proxybuffer_destroy(&sPool);
+}
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cppunit/extensions/HelperMacros.h"
+
+extern "C" {
+#include "ioterror.h"
+#include "proxyresponse_test.h"
+#include "proxyresponse.h"
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ProxyResponseTest );
+
+/** Commands in the response of the benchmark */
+#define BENCHMARK_COMMANDS 2000
+
+/** Times the response of the benchmark is classified */
+#define BENCHMARK_ROUNDS 200
+
+/** Control signals the proxy used to find with strstr() */
+typedef struct legacy_t {
+  bool rejected;
+
+  bool command;
+
+  bool cont;
+
+  bool ack;
+} legacy_t;
+
+/**
+ * What the proxy used to find in a response
+ */
+static legacy_t legacy(const char *msg) {
+  legacy_t found;
+
+  found.rejected = strstr(msg, "ERR") != NULL;
+  found.command = strstr(msg, "command") != NULL;
+  found.cont = strstr(msg, "CONT") != NULL;
+  found.ack = strstr(msg, "ACK") != NULL;
+  return found;
+}
+
+static void classify(proxyresponse_t *response, const char *msg) {
+  proxyresponse_classify(response, msg, strlen(msg));
+}
+
+static unsigned long long now() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void ProxyResponseTest::testStatus(void) {
+  proxyresponse_t response;
+
+  classify(&response, "<?xml version=\"1.0\" encoding=\"UTF-8\"?><s2h status=\"ACK\"/>");
+  CPPUNIT_ASSERT_MESSAGE("Envelope not found\n", response.envelope);
+  CPPUNIT_ASSERT_MESSAGE("ACK not found\n", response.status == PROXYRESPONSE_STATUS_ACK);
+  CPPUNIT_ASSERT(response.commandCount == 0);
+
+  classify(&response, "<s2h version='2' status='CONT'></s2h>");
+  CPPUNIT_ASSERT_MESSAGE("CONT in single quotes not found\n", response.status == PROXYRESPONSE_STATUS_CONT);
+
+  classify(&response, "<s2h status = \"ERR\" />");
+  CPPUNIT_ASSERT_MESSAGE("ERR not found\n", response.status == PROXYRESPONSE_STATUS_ERR);
+
+  classify(&response, "<s2h status=\"UNKNOWN\"/>");
+  CPPUNIT_ASSERT(response.status == PROXYRESPONSE_STATUS_OTHER);
+
+  classify(&response, "<s2h/>");
+  CPPUNIT_ASSERT(response.envelope && response.status == PROXYRESPONSE_STATUS_NONE);
+
+  classify(&response, "OK");
+  CPPUNIT_ASSERT_MESSAGE("Plain text taken for an envelope\n", !response.envelope && response.status == PROXYRESPONSE_STATUS_NONE);
+
+  CPPUNIT_ASSERT(strcmp(proxyresponse_statusName(PROXYRESPONSE_STATUS_CONT), "CONT") == 0);
+}
+
+void ProxyResponseTest::testForClients(void) {
+  proxyresponse_t response;
+
+  // The clients learn from it that the user is watching, or stopped
+  classify(&response, "<s2h status=\"CONT\"/>");
+  CPPUNIT_ASSERT_MESSAGE("CONT without commands kept from the clients\n", proxyresponse_forClients(&response));
+
+  classify(&response, "<s2h status=\"ACK\"></s2h>");
+  CPPUNIT_ASSERT_MESSAGE("ACK without commands kept from the clients\n", proxyresponse_forClients(&response));
+
+  classify(&response, "<s2h status=\"ACK\"><commands><command type=\"1\" commandId=\"1\"/></commands></s2h>");
+  CPPUNIT_ASSERT(proxyresponse_forClients(&response));
+
+  classify(&response, "OK");
+  CPPUNIT_ASSERT_MESSAGE("Plain text handed to the clients\n", !proxyresponse_forClients(&response));
+}
+
+void ProxyResponseTest::testCommands(void) {
+  proxyresponse_t response;
+  const char *msg = "<s2h status=\"ACK\">"
+      "<command cmdId=\"5\" type=\"0\" deviceId=\"A1\" name=\"set\"><param index=\"0\">1</param></command>"
+      "<!-- <command cmdId=\"6\"/> -->"
+      "<command cmdId=\"7\" name=\"ping\"/>"
+      "</s2h>";
+  const char *first = strstr(msg, "<command");
+  const char *last = strstr(msg, "<command cmdId=\"7\"");
+
+  classify(&response, msg);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of commands\n", response.commandCount == 2 && !response.moreCommands);
+
+  CPPUNIT_ASSERT_MESSAGE("Wrong start of the first command\n", response.commands[0].offset == first - msg);
+  CPPUNIT_ASSERT_MESSAGE("Wrong end of the first command\n",
+      strncmp(msg + response.commands[0].offset + response.commands[0].length - 10, "</command>", 10) == 0);
+
+  CPPUNIT_ASSERT_MESSAGE("Wrong span of the self-closing command\n", response.commands[1].offset == last - msg
+      && response.commands[1].length == (int) strlen("<command cmdId=\"7\" name=\"ping\"/>"));
+}
+
+void ProxyResponseTest::testLegacy(void) {
+  proxyresponse_t response;
+  legacy_t found;
+  int i;
+
+  // Responses of the server the proxy handled the same way before
+  const char *responses[] = {
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?><s2h status=\"ACK\"/>",
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?><s2h status=\"CONT\"/>",
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?><s2h status=\"ERR\"/>",
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?><s2h status=\"ACK\"><command cmdId=\"1\" name=\"set\" deviceId=\"A\"><param>1</param></command></s2h>",
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?><s2h status=\"CONT\"><command cmdId=\"2\" name=\"set\" deviceId=\"A\"/></s2h>",
+    "<s2h><command cmdId=\"3\" name=\"set\" deviceId=\"A\"/></s2h>",
+  };
+
+  for(i = 0; i < (int) (sizeof(responses) / sizeof(responses[0])); i++) {
+    found = legacy(responses[i]);
+    classify(&response, responses[i]);
+
+    CPPUNIT_ASSERT_MESSAGE("Rejection differs\n", found.rejected == (response.status == PROXYRESPONSE_STATUS_ERR));
+    CPPUNIT_ASSERT_MESSAGE("Command differs\n", found.command == (response.commandCount > 0));
+    CPPUNIT_ASSERT_MESSAGE("CONT differs\n", found.cont == (response.status == PROXYRESPONSE_STATUS_CONT));
+    CPPUNIT_ASSERT_MESSAGE("ACK differs\n", found.ack == (response.status == PROXYRESPONSE_STATUS_ACK));
+  }
+}
+
+void ProxyResponseTest::testMisfires(void) {
+  proxyresponse_t response;
+  legacy_t found;
+
+  // An argument with "ACK" in it used to turn a command into an acknowledgement
+  const char *nack = "<s2h><command cmdId=\"1\" name=\"display\" deviceId=\"A\"><param>NACK</param></command></s2h>";
+  found = legacy(nack);
+  classify(&response, nack);
+  CPPUNIT_ASSERT(found.ack);
+  CPPUNIT_ASSERT_MESSAGE("Argument taken for ACK\n", response.status == PROXYRESPONSE_STATUS_NONE && response.commandCount == 1);
+
+  // An argument with "ERR" in it used to reject the push
+  const char *error = "<s2h status=\"ACK\"><command cmdId=\"2\" name=\"clear\" deviceId=\"ERR_LOG\"/></s2h>";
+  found = legacy(error);
+  classify(&response, error);
+  CPPUNIT_ASSERT(found.rejected);
+  CPPUNIT_ASSERT_MESSAGE("Attribute taken for ERR\n", response.status == PROXYRESPONSE_STATUS_ACK);
+
+  // "command" in an attribute isn't a command
+  const char *attribute = "<s2h status=\"CONT\" note=\"no command\"/>";
+  found = legacy(attribute);
+  classify(&response, attribute);
+  CPPUNIT_ASSERT(found.command);
+  CPPUNIT_ASSERT_MESSAGE("Attribute taken for a command\n", response.commandCount == 0 && response.status == PROXYRESPONSE_STATUS_CONT);
+
+  // Nor is a <commands> element
+  classify(&response, "<s2h><commands/><![CDATA[<command>]]></s2h>");
+  CPPUNIT_ASSERT_MESSAGE("Other element or CDATA taken for a command\n", response.commandCount == 0);
+}
+
+void ProxyResponseTest::testMalformed(void) {
+  proxyresponse_t response;
+  const char *msg = "<s2h status=\"ACK\"><command cmdId=\"1\" name=\"set\"><param>1</par";
+  int i;
+
+  // Truncated responses, at every length
+  for(i = 0; i <= (int) strlen(msg); i++) {
+    proxyresponse_classify(&response, msg, i);
+    CPPUNIT_ASSERT(response.commandCount <= 1);
+    if(response.commandCount == 1) {
+      CPPUNIT_ASSERT_MESSAGE("Span past the end of the response\n",
+          response.commands[0].offset + response.commands[0].length <= i);
+    }
+  }
+  CPPUNIT_ASSERT(response.status == PROXYRESPONSE_STATUS_ACK && response.commandCount == 1);
+
+  classify(&response, "<<s2h status=\"CONT\"><");
+  CPPUNIT_ASSERT(response.status == PROXYRESPONSE_STATUS_CONT);
+
+  classify(&response, "<s2h status=\"CONT");
+  CPPUNIT_ASSERT_MESSAGE("Truncated value read\n", response.envelope && response.status == PROXYRESPONSE_STATUS_NONE);
+
+  classify(&response, "");
+  CPPUNIT_ASSERT(!response.envelope && response.commandCount == 0);
+}
+
+/**
+ * Classify a large response full of commands, the way the proxy does now,
+ * and the way it used to with strstr(), listeners included
+ */
+void ProxyResponseTest::testBenchmark(void) {
+  proxyresponse_t response;
+  legacy_t found;
+  unsigned long long start;
+  unsigned long long legacyNs;
+  unsigned long long classifyNs;
+  char *msg;
+  int len = 0;
+  int size = 128 + BENCHMARK_COMMANDS * 160;
+  int hits = 0;
+  int i;
+
+  msg = (char *) malloc(size);
+  len += snprintf(msg + len, size - len, "<?xml version=\"1.0\" encoding=\"UTF-8\"?><s2h status=\"ACK\">");
+  for(i = 0; i < BENCHMARK_COMMANDS; i++) {
+    len += snprintf(msg + len, size - len, "<command cmdId=\"%d\" type=\"0\" deviceId=\"0123456789ABCDEF\" name=\"set\">"
+        "<param index=\"0\">%d</param><param index=\"1\">on</param></command>", i, i);
+  }
+  len += snprintf(msg + len, size - len, "</s2h>");
+
+  start = now();
+  for(i = 0; i < BENCHMARK_ROUNDS; i++) {
+    // The push then the poll checks, then the listener looking for XML
+    found = legacy(msg);
+    hits += found.command + found.ack + (strstr(msg, "xml") != NULL);
+  }
+  legacyNs = now() - start;
+
+  start = now();
+  for(i = 0; i < BENCHMARK_ROUNDS; i++) {
+    proxyresponse_classify(&response, msg, len);
+    hits += response.commandCount;
+  }
+  classifyNs = now() - start;
+
+  printf("\n%d bytes, %d commands: strstr() %llu ns, proxyresponse_classify() %llu ns per response (%d)\n",
+      len, BENCHMARK_COMMANDS, legacyNs / BENCHMARK_ROUNDS, classifyNs / BENCHMARK_ROUNDS, hits > 0);
+
+  // The scan stops once it has enough commands
+  CPPUNIT_ASSERT(response.commandCount == PROXYRESPONSE_MAX_COMMANDS && response.moreCommands);
+  CPPUNIT_ASSERT(response.status == PROXYRESPONSE_STATUS_ACK);
+  CPPUNIT_ASSERT(response.commands[PROXYRESPONSE_MAX_COMMANDS - 1].length > 0);
+  free(msg);
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "cppunit/extensions/HelperMacros.h"
+
+extern "C" {
+#include "ioterror.h"
+#include "proxyretry_test.h"
+#include "proxyretry.h"
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ProxyRetryTest );
+
+
+static void setPolicy(proxyretry_policy_t *policy) {
+  memset(policy, 0, sizeof(proxyretry_policy_t));
+  policy->baseDelayMs = 100;
+  policy->maxDelayMs = 1000;
+  policy->failureThreshold = 3;
+  policy->openDurationMs = 20;
+}
+
+void ProxyRetryTest::testBackoff(void) {
+  proxyretry_t retry;
+  proxyretry_policy_t policy;
+  unsigned int capMs = 100;
+  unsigned int delayMs;
+  int i;
+
+  setPolicy(&policy);
+  policy.failureThreshold = 100;
+  proxyretry_init(&retry, &policy);
+
+  CPPUNIT_ASSERT_MESSAGE("A new circuit must be closed\n", proxyretry_getState(&retry) == PROXYRETRY_CLOSED);
+  CPPUNIT_ASSERT_MESSAGE("A new circuit must not wait\n", proxyretry_delayMs(&retry) == 0);
+
+  // Each failure doubles the cap up to the max, the delay stays between half the cap and the cap
+  for(i = 0; i < 8; i++) {
+    CPPUNIT_ASSERT_MESSAGE("A timeout wasn't retryable\n", proxyretry_onFailure(&retry, ETIMEDOUT));
+    delayMs = proxyretry_delayMs(&retry);
+    CPPUNIT_ASSERT_MESSAGE("Delay longer than the cap\n", delayMs <= capMs);
+    CPPUNIT_ASSERT_MESSAGE("Delay shorter than half the cap\n", delayMs + 5 >= capMs / 2);
+
+    capMs *= 2;
+    if(capMs > policy.maxDelayMs) {
+      capMs = policy.maxDelayMs;
+    }
+  }
+
+  CPPUNIT_ASSERT_MESSAGE("Circuit opened before the threshold\n", proxyretry_getState(&retry) == PROXYRETRY_CLOSED);
+
+  // A success resets the backoff
+  proxyretry_onSuccess(&retry);
+  CPPUNIT_ASSERT_MESSAGE("Still waiting after a success\n", proxyretry_delayMs(&retry) == 0);
+
+  proxyretry_destroy(&retry);
+}
+
+void ProxyRetryTest::testCircuitBreaker(void) {
+  proxyretry_t retry;
+  proxyretry_policy_t policy;
+  proxyretry_stats_t stats;
+  unsigned int i;
+
+  setPolicy(&policy);
+  policy.baseDelayMs = 1;
+  proxyretry_init(&retry, &policy);
+
+  for(i = 0; i < policy.failureThreshold - 1; i++) {
+    proxyretry_onFailure(&retry, ECONNREFUSED);
+    CPPUNIT_ASSERT_MESSAGE("Circuit opened before the threshold\n", proxyretry_getState(&retry) == PROXYRETRY_CLOSED);
+  }
+
+  proxyretry_onFailure(&retry, ECONNREFUSED);
+  CPPUNIT_ASSERT_MESSAGE("Circuit didn't open at the threshold\n", proxyretry_getState(&retry) == PROXYRETRY_OPEN);
+
+  // Once the open duration is over, one probe goes through
+  proxyretry_wait(&retry);
+  CPPUNIT_ASSERT_MESSAGE("Circuit didn't turn half-open\n", proxyretry_getState(&retry) == PROXYRETRY_HALF_OPEN);
+
+  // A failed probe opens the circuit again right away
+  proxyretry_onFailure(&retry, ECONNREFUSED);
+  CPPUNIT_ASSERT_MESSAGE("Failed probe didn't open the circuit\n", proxyretry_getState(&retry) == PROXYRETRY_OPEN);
+
+  // A successful probe closes it
+  proxyretry_wait(&retry);
+  CPPUNIT_ASSERT_MESSAGE("Circuit didn't turn half-open again\n", proxyretry_getState(&retry) == PROXYRETRY_HALF_OPEN);
+  proxyretry_onSuccess(&retry);
+  CPPUNIT_ASSERT_MESSAGE("Successful probe didn't close the circuit\n", proxyretry_getState(&retry) == PROXYRETRY_CLOSED);
+
+  proxyretry_getStats(&retry, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of failures\n", stats.failures == policy.failureThreshold + 1);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of openings\n", stats.opened == 2);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of half-openings\n", stats.halfOpened == 2);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of closings\n", stats.closed == 1);
+  CPPUNIT_ASSERT_MESSAGE("Time in backoff wasn't counted\n", stats.backoffMs >= policy.openDurationMs);
+
+  proxyretry_destroy(&retry);
+}
+
+void ProxyRetryTest::testFatalErrors(void) {
+  proxyretry_t retry;
+  proxyretry_policy_t policy;
+  proxyretry_stats_t stats;
+  unsigned int i;
+
+  setPolicy(&policy);
+  proxyretry_init(&retry, &policy);
+
+  // Fatal errors are not retried and don't count toward opening the circuit
+  for(i = 0; i < policy.failureThreshold; i++) {
+    CPPUNIT_ASSERT_MESSAGE("A setup failure was retryable\n", !proxyretry_onFailure(&retry, ENOEXEC));
+  }
+
+  CPPUNIT_ASSERT_MESSAGE("Fatal errors opened the circuit\n", proxyretry_getState(&retry) == PROXYRETRY_CLOSED);
+  CPPUNIT_ASSERT_MESSAGE("Fatal errors delayed the next request\n", proxyretry_delayMs(&retry) == 0);
+
+  proxyretry_getStats(&retry, &stats);
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of fatal failures\n", stats.fatalFailures == policy.failureThreshold);
+  CPPUNIT_ASSERT_MESSAGE("Fatal errors counted as failures\n", stats.failures == 0);
+
+  proxyretry_destroy(&retry);
+}
@@ -0,0 +1,712 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "cppunit/extensions/HelperMacros.h"
+
+extern "C" {
+#include "ioterror.h"
+#include "proxywindow_test.h"
+#include "proxywindow.h"
+#include "proxybuffer.h"
+#include "proxy.h"
+#include "proxyconfig.h"
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ProxyWindowTest );
+
+enum {
+  BATCH_SIZE = 64,
+
+  /** Buffers of the pool of the batches */
+  POOL_BUFFERS = 16,
+
+  /** Messages sent through the proxy to the stand-in server */
+  STANDIN_MESSAGES = 60,
+
+  /** The stand-in server keeps this POST but the connection closes before the response */
+  STANDIN_LOSE_RESPONSE = 1,
+
+  /** The connection of this POST closes before the stand-in server reads it */
+  STANDIN_LOSE_REQUEST = 4,
+
+  /** Time the stand-in server takes to answer a POST, so several are in flight */
+  STANDIN_POST_MS = 300,
+
+  STANDIN_MAX_SEQS = 256,
+
+  STANDIN_BUFFER_SIZE = 65536,
+
+  /** Messages of each run of the proxy stopped with messages to the server */
+  STOP_MESSAGES = 20,
+
+  STOP_DEADLINE_MS = 2000,
+};
+
+/** Local stand-in for the server, dropping the duplicates by sequence number */
+static struct {
+  pthread_mutex_t mutex;
+
+  int listenFd;
+
+  bool stop;
+
+  /** True to lose the response of STANDIN_LOSE_RESPONSE and the request of STANDIN_LOSE_REQUEST */
+  bool lossy;
+
+  /** POSTs received */
+  int posts;
+
+  /** Sequence numbers of the batches taken */
+  uint32_t seqs[STANDIN_MAX_SEQS];
+
+  int seqCount;
+
+  /** Batches received again with a sequence number already taken */
+  int duplicates;
+
+  /** Times each message was taken */
+  int received[STANDIN_MESSAGES];
+} sStandIn;
+
+/**
+ * Take a batch, unless its sequence number was taken already
+ */
+static void standInTake(const char *body) {
+  const char *p = strstr(body, "seq=\"");
+  uint32_t seq;
+  int i;
+
+  CPPUNIT_ASSERT_MESSAGE("No sequence number\n", p != NULL);
+  seq = strtoul(p + 5, NULL, 10);
+
+  for(i = 0; i < sStandIn.seqCount; i++) {
+    if(sStandIn.seqs[i] == seq) {
+      sStandIn.duplicates++;
+      return;
+    }
+  }
+
+  if(sStandIn.seqCount < STANDIN_MAX_SEQS) {
+    sStandIn.seqs[sStandIn.seqCount++] = seq;
+  }
+
+  for(p = body; (p = strstr(p, "<m>")) != NULL; p += 3) {
+    i = atoi(p + 3);
+    if(i >= 0 && i < STANDIN_MESSAGES) {
+      sStandIn.received[i]++;
+    }
+  }
+}
+
+/**
+ * Answers the requests of one connection, HTTP/1.1 with keep-alive
+ */
+static void *standInConnection(void *arg) {
+  int fd = (int) (intptr_t) arg;
+  char *buffer = (char *) malloc(STANDIN_BUFFER_SIZE);
+  const char *response = "HTTP/1.1 200 OK\r\nContent-Length: 19\r\n\r\n<s2h status=\"ACK\"/>";
+  struct pollfd ready;
+  char *headerEnd;
+  char *contentLength;
+  int length = 0;
+  int total;
+  int post = 0;
+  int waitedMs;
+  ssize_t received;
+
+  while(!sStandIn.stop && length < STANDIN_BUFFER_SIZE - 1) {
+    ready.fd = fd;
+    ready.events = POLLIN;
+    if(poll(&ready, 1, 100) <= 0) {
+      continue;
+    }
+
+    received = recv(fd, buffer + length, STANDIN_BUFFER_SIZE - 1 - length, 0);
+    if(received <= 0) {
+      break;
+    }
+    length += received;
+    buffer[length] = '\0';
+
+    if((headerEnd = strstr(buffer, "\r\n\r\n")) == NULL) {
+      continue;
+    }
+
+    contentLength = strcasestr(buffer, "Content-Length:");
+    total = headerEnd + 4 - buffer + (contentLength != NULL && contentLength < headerEnd ? atoi(contentLength + 15) : 0);
+
+    if(strncmp(buffer, "POST", 4) == 0 && post == 0) {
+      pthread_mutex_lock(&sStandIn.mutex);
+      post = ++sStandIn.posts;
+      pthread_mutex_unlock(&sStandIn.mutex);
+
+      if(sStandIn.lossy && post == STANDIN_LOSE_REQUEST) {
+        break;
+      }
+    }
+
+    if(length < total) {
+      continue;
+    }
+
+    if(strncmp(buffer, "POST", 4) == 0) {
+      usleep(STANDIN_POST_MS * 1000);
+
+      buffer[total] = '\0';
+      pthread_mutex_lock(&sStandIn.mutex);
+      standInTake(headerEnd + 4);
+      pthread_mutex_unlock(&sStandIn.mutex);
+
+      if(sStandIn.lossy && post == STANDIN_LOSE_RESPONSE) {
+        break;
+      }
+
+    } else {
+      // Long poll, answered before the proxy times it out
+      for(waitedMs = 0; waitedMs < 1000 && !sStandIn.stop; waitedMs += 50) {
+        usleep(50000);
+      }
+    }
+
+    if(send(fd, response, strlen(response), MSG_NOSIGNAL) < 0) {
+      break;
+    }
+
+    memmove(buffer, buffer + total, length - total);
+    length -= total;
+    buffer[length] = '\0';
+    post = 0;
+  }
+
+  close(fd);
+  free(buffer);
+  return NULL;
+}
+
+/**
+ * Accepts the connections of the proxy until the stand-in server stops
+ */
+static void *standInListen(void *arg) {
+  struct pollfd ready;
+  pthread_t thread;
+  int fd;
+
+  while(!sStandIn.stop) {
+    ready.fd = sStandIn.listenFd;
+    ready.events = POLLIN;
+    if(poll(&ready, 1, 100) <= 0) {
+      continue;
+    }
+
+    fd = accept(sStandIn.listenFd, NULL, NULL);
+    if(fd >= 0) {
+      pthread_create(&thread, NULL, standInConnection, (void *) (intptr_t) fd);
+      pthread_detach(thread);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Start the stand-in server on a free port of the loopback interface
+ * @param lossy true to lose a response and a request
+ * @return the port
+ */
+static int standInStart(pthread_t *thread, bool lossy) {
+  struct sockaddr_in address;
+  socklen_t addressLen = sizeof(address);
+
+  memset(&sStandIn, 0, sizeof(sStandIn));
+  pthread_mutex_init(&sStandIn.mutex, NULL);
+  sStandIn.lossy = lossy;
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  sStandIn.listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  CPPUNIT_ASSERT(sStandIn.listenFd >= 0);
+  CPPUNIT_ASSERT(bind(sStandIn.listenFd, (struct sockaddr *) &address, sizeof(address)) == 0);
+  CPPUNIT_ASSERT(listen(sStandIn.listenFd, 8) == 0);
+  CPPUNIT_ASSERT(getsockname(sStandIn.listenFd, (struct sockaddr *) &address, &addressLen) == 0);
+
+  CPPUNIT_ASSERT(pthread_create(thread, NULL, standInListen, NULL) == 0);
+  return ntohs(address.sin_port);
+}
+
+/**
+ * @param count Messages sent
+ * @return true once every message was taken by the stand-in server
+ */
+static bool standInDone(int count) {
+  bool done = true;
+  int i;
+
+  pthread_mutex_lock(&sStandIn.mutex);
+  for(i = 0; i < count; i++) {
+    done = done && sStandIn.received[i] > 0;
+  }
+  pthread_mutex_unlock(&sStandIn.mutex);
+
+  return done;
+}
+
+/**
+ * Send the messages <m>first</m> to <m>last - 1</m> through the proxy
+ * @return the bytes sent
+ */
+static int sendMessages(int first, int last) {
+  char message[16];
+  int bytes = 0;
+  int i;
+
+  for(i = first; i < last; i++) {
+    snprintf(message, sizeof(message), "<m>%d</m>", i);
+    CPPUNIT_ASSERT(proxy_send(message, strlen(message)) == SUCCESS);
+    bytes += strlen(message);
+  }
+
+  return bytes;
+}
+
+/**
+ * Delete the directory of a journal and its segments
+ */
+static void removeDir(const char *dir) {
+  char path[PATH_MAX];
+  struct dirent *entry;
+  DIR *directory = opendir(dir);
+
+  while(directory != NULL && (entry = readdir(directory)) != NULL) {
+    if(entry->d_name[0] != '.') {
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      unlink(path);
+    }
+  }
+
+  if(directory != NULL) {
+    closedir(directory);
+  }
+  rmdir(dir);
+}
+
+/** Buffers of the batches */
+static proxybuffer_pool_t sPool;
+
+/**
+ * Add a message to the batch being filled
+ */
+static void add(proxywindow_batch_t *batch, const char *message, bool urgent) {
+  proxybuffer_chain_t chain;
+
+  memset(&chain, 0, sizeof(chain));
+  CPPUNIT_ASSERT(proxybuffer_write(&sPool, &chain, message, strlen(message)));
+  proxywindow_add(batch, &chain, urgent);
+  CPPUNIT_ASSERT(chain.head == NULL && chain.length == 0);
+}
+
+/**
+ * Fill a batch of the window with a message and seal it
+ */
+static proxywindow_batch_t *seal(proxywindow_t *window, uint32_t seq) {
+  proxywindow_batch_t *batch = proxywindow_filling(window);
+  char message[BATCH_SIZE];
+
+  CPPUNIT_ASSERT_MESSAGE("No batch to fill\n", batch != NULL);
+  snprintf(message, sizeof(message), "<m>%u</m>", seq);
+  add(batch, message, false);
+  proxywindow_seal(window, batch, seq);
+  return batch;
+}
+
+void ProxyWindowTest::testOrder(void) {
+  proxywindow_t window;
+  proxywindow_stats_t stats;
+  proxybuffer_stats_t poolStats;
+  proxywindow_batch_t *batch;
+  char data[BATCH_SIZE];
+
+  CPPUNIT_ASSERT(proxybuffer_init(&sPool, POOL_BUFFERS));
+  CPPUNIT_ASSERT(proxywindow_init(&window, 4));
+  CPPUNIT_ASSERT(proxywindow_send(&window) == NULL);
+
+  seal(&window, 10);
+  seal(&window, 11);
+  seal(&window, 12);
+
+  // Several batches in flight, in order
+  CPPUNIT_ASSERT(proxywindow_send(&window)->seq == 10);
+  CPPUNIT_ASSERT(proxywindow_send(&window)->seq == 11);
+  batch = proxywindow_send(&window);
+  CPPUNIT_ASSERT(batch->seq == 12);
+  CPPUNIT_ASSERT(proxywindow_inFlight(&window) == 3 && !proxywindow_hasPending(&window));
+  CPPUNIT_ASSERT(proxywindow_send(&window) == NULL);
+
+  // Only the batch that failed is sent again, with its sequence number and its data
+  proxywindow_ack(&window, &window.batches[1]);
+  proxywindow_retry(&window, &window.batches[0]);
+  seal(&window, 13);
+  CPPUNIT_ASSERT(proxywindow_hasPending(&window));
+
+  batch = proxywindow_send(&window);
+  CPPUNIT_ASSERT_MESSAGE("The oldest batch isn't sent again first\n", batch->seq == 10 && batch->sends == 2);
+  CPPUNIT_ASSERT(proxybuffer_read(&batch->bulk, data, sizeof(data)) == 9 && memcmp(data, "<m>10</m>", 9) == 0);
+  CPPUNIT_ASSERT(proxywindow_send(&window)->seq == 13);
+
+  proxywindow_ack(&window, &window.batches[0]);
+  proxywindow_drop(&window, &window.batches[2]);
+
+  proxywindow_getStats(&window, &stats);
+  CPPUNIT_ASSERT(stats.sealed == 4 && stats.acknowledged == 2 && stats.dropped == 1);
+  CPPUNIT_ASSERT(stats.retransmitted == 1 && stats.retransmittedBytes == 9);
+  CPPUNIT_ASSERT(stats.maxInFlight == 3);
+
+  // The buffers of the batches acknowledged or dropped went back to the pool
+  proxybuffer_getStats(&sPool, &poolStats);
+  CPPUNIT_ASSERT(poolStats.inUse == 1 && poolStats.maxInUse == 3);
+
+  proxywindow_destroy(&window);
+  proxywindow_getStats(&window, &stats);
+  CPPUNIT_ASSERT(stats.sealed == 0);
+  proxybuffer_getStats(&sPool, &poolStats);
+  CPPUNIT_ASSERT(poolStats.inUse == 0);
+  proxybuffer_destroy(&sPool);
+}
+
+void ProxyWindowTest::testFull(void) {
+  proxywindow_t window;
+  proxywindow_batch_t *batch;
+
+  CPPUNIT_ASSERT(proxybuffer_init(&sPool, POOL_BUFFERS));
+  CPPUNIT_ASSERT(proxywindow_init(&window, 2));
+
+  // The batch being filled stays the same until it is sealed
+  batch = proxywindow_filling(&window);
+  CPPUNIT_ASSERT(batch != NULL && proxywindow_filling(&window) == batch);
+  add(batch, "abc", false);
+  CPPUNIT_ASSERT(proxywindow_length(proxywindow_filling(&window)) == 3);
+  proxywindow_seal(&window, batch, 1);
+
+  seal(&window, 2);
+  CPPUNIT_ASSERT_MESSAGE("A full window gave a batch\n", proxywindow_filling(&window) == NULL);
+
+  // A batch is only reused once acknowledged
+  batch = proxywindow_send(&window);
+  CPPUNIT_ASSERT(proxywindow_filling(&window) == NULL);
+  proxywindow_ack(&window, batch);
+  batch = proxywindow_filling(&window);
+  CPPUNIT_ASSERT(batch != NULL && proxywindow_length(batch) == 0 && batch->sends == 0);
+  CPPUNIT_ASSERT(proxywindow_index(&window, batch) == 0);
+
+  proxywindow_destroy(&window);
+
+  // Never more than PROXYWINDOW_MAX_SIZE
+  CPPUNIT_ASSERT(proxywindow_init(&window, PROXYWINDOW_MAX_SIZE + 4));
+  CPPUNIT_ASSERT(window.size == PROXYWINDOW_MAX_SIZE);
+  proxywindow_destroy(&window);
+  proxybuffer_destroy(&sPool);
+}
+
+void ProxyWindowTest::testSegments(void) {
+  proxywindow_t window;
+  proxywindow_batch_t *batch;
+  struct iovec segments[4];
+  char big[PROXYBUFFER_SIZE + 10];
+
+  CPPUNIT_ASSERT(proxybuffer_init(&sPool, POOL_BUFFERS));
+  CPPUNIT_ASSERT(proxywindow_init(&window, 2));
+
+  // High priority messages go ahead of the bulk read before them, small messages share a buffer
+  batch = proxywindow_filling(&window);
+  add(batch, "<b1/>", false);
+  add(batch, "<u1/>", true);
+  add(batch, "<b2/>", false);
+  add(batch, "<u2/>", true);
+  CPPUNIT_ASSERT(proxywindow_length(batch) == 20 && proxywindow_buffers(batch) == 2);
+
+  CPPUNIT_ASSERT(proxywindow_segments(batch, segments, 4) == 2);
+  CPPUNIT_ASSERT(segments[0].iov_len == 10 && memcmp(segments[0].iov_base, "<u1/><u2/>", 10) == 0);
+  CPPUNIT_ASSERT(segments[1].iov_len == 10 && memcmp(segments[1].iov_base, "<b1/><b2/>", 10) == 0);
+
+  // A message that doesn't fit in the last buffer is linked, not copied
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  add(batch, big, false);
+  CPPUNIT_ASSERT(proxywindow_buffers(batch) == 4);
+  CPPUNIT_ASSERT(proxywindow_segments(batch, segments, 3) == -1);
+  CPPUNIT_ASSERT(proxywindow_segments(batch, segments, 4) == 4);
+  CPPUNIT_ASSERT(segments[2].iov_len == PROXYBUFFER_SIZE && segments[3].iov_len == 9);
+
+  proxywindow_seal(&window, batch, 1);
+  proxywindow_drop(&window, proxywindow_send(&window));
+  CPPUNIT_ASSERT(proxywindow_length(batch) == 0 && sPool.inUse == 0);
+
+  proxywindow_destroy(&window);
+  proxybuffer_destroy(&sPool);
+}
+
+void ProxyWindowTest::testWrapAround(void) {
+  proxywindow_t window;
+
+  CPPUNIT_ASSERT(proxybuffer_init(&sPool, POOL_BUFFERS));
+  CPPUNIT_ASSERT(proxywindow_init(&window, 4));
+
+  seal(&window, 1);
+  seal(&window, 0xFFFFFFFF);
+  seal(&window, 0);
+
+  CPPUNIT_ASSERT(proxywindow_oldest(&window)->seq == 0xFFFFFFFF);
+  CPPUNIT_ASSERT_MESSAGE("Wrong order across the wrap around\n", proxywindow_send(&window)->seq == 0xFFFFFFFF);
+  CPPUNIT_ASSERT(proxywindow_send(&window)->seq == 0);
+  CPPUNIT_ASSERT(proxywindow_send(&window)->seq == 1);
+
+  // Batches kept elsewhere leave the window the oldest first, without counting as dropped
+  while(proxywindow_oldest(&window) != NULL) {
+    proxywindow_release(&window, proxywindow_oldest(&window));
+  }
+  CPPUNIT_ASSERT(proxywindow_inFlight(&window) == 0 && window.stats.dropped == 0 && sPool.inUse == 0);
+
+  proxywindow_destroy(&window);
+  proxybuffer_destroy(&sPool);
+}
+
+void ProxyWindowTest::testStandInServer(void) {
+  proxywindow_stats_t stats;
+  pthread_t thread;
+  char url[64];
+  char message[16];
+  int i;
+
+  snprintf(url, sizeof(url), "127.0.0.1:%d/standin", standInStart(&thread, true));
+
+  proxyconfig_setJournalDir("");
+  proxyconfig_setBatching(PROXY_DEFAULT_BATCH_BYTES, 50);
+  CPPUNIT_ASSERT(proxy_start(url) == SUCCESS);
+
+  // Past the startup delay, so the messages make several batches
+  usleep((PROXY_STARTUP_DELAY_MS + 500) * 1000);
+
+  for(i = 0; i < STANDIN_MESSAGES; i++) {
+    snprintf(message, sizeof(message), "<m>%d</m>", i);
+    CPPUNIT_ASSERT(proxy_send(message, strlen(message)) == SUCCESS);
+
+    if(i % 3 == 2) {
+      usleep(150000);
+    }
+  }
+
+  for(i = 0; i < 300 && !standInDone(STANDIN_MESSAGES); i++) {
+    usleep(100000);
+  }
+
+  proxy_getWindowStats(&stats);
+  proxy_stop();
+  sStandIn.stop = true;
+  pthread_join(thread, NULL);
+  close(sStandIn.listenFd);
+  usleep(200000);
+
+  // At least once, and exactly once once the server dropped the duplicates
+  for(i = 0; i < STANDIN_MESSAGES; i++) {
+    CPPUNIT_ASSERT_MESSAGE("A message was lost or duplicated\n", sStandIn.received[i] == 1);
+  }
+
+  // The lost response made the one duplicate, the lost request none
+  CPPUNIT_ASSERT_MESSAGE("Wrong number of duplicates\n", sStandIn.duplicates == 1);
+
+  // Only the 2 batches that weren't acknowledged were sent again, by curl on a new
+  // connection or by the window
+  CPPUNIT_ASSERT_MESSAGE("Sent more than the batches not acknowledged\n", sStandIn.posts == (int) stats.sealed + 2);
+  CPPUNIT_ASSERT(stats.retransmitted <= 2);
+  CPPUNIT_ASSERT(stats.dropped == 0 && stats.acknowledged == stats.sealed);
+  CPPUNIT_ASSERT_MESSAGE("Never several batches in flight\n", stats.maxInFlight > 1);
+}
+
+/**
+ * @return the descriptors open in the process
+ */
+static int openDescriptors() {
+  struct dirent *entry;
+  DIR *directory = opendir("/proc/self/fd");
+  int count = 0;
+
+  while(directory != NULL && (entry = readdir(directory)) != NULL) {
+    if(entry->d_name[0] != '.') {
+      count++;
+    }
+  }
+
+  if(directory != NULL) {
+    closedir(directory);
+  }
+  return count;
+}
+
+void ProxyWindowTest::testStopAndRestart(void) {
+  proxy_shutdown_stats_t stats;
+  proxybuffer_stats_t poolStats;
+  int descriptors = openDescriptors();
+  pthread_t thread;
+  char dir[PATH_MAX];
+  char url[64];
+  int bytes;
+  int i;
+
+  strcpy(dir, "/tmp/proxywindow_test.XXXXXX");
+  CPPUNIT_ASSERT_MESSAGE("Couldn't create a directory for the journal\n", mkdtemp(dir) != NULL);
+
+  // Nothing listens on the port: the messages are journaled without waiting for the deadline
+  proxyconfig_setJournalDir(dir);
+  proxyconfig_setBatching(PROXY_DEFAULT_BATCH_BYTES, 50);
+  CPPUNIT_ASSERT(proxy_start("127.0.0.1:1/standin") == SUCCESS);
+  bytes = sendMessages(0, STOP_MESSAGES);
+
+  CPPUNIT_ASSERT(proxy_stopWithin(STOP_DEADLINE_MS) == SUCCESS);
+  proxy_getShutdownStats(&stats);
+  CPPUNIT_ASSERT_MESSAGE("Messages weren't journaled\n", stats.persistedBytes == (unsigned long long) bytes);
+  CPPUNIT_ASSERT(stats.flushedBytes == 0 && stats.lostBytes == 0);
+  CPPUNIT_ASSERT_MESSAGE("Waited past the deadline\n", stats.durationMs < STOP_DEADLINE_MS + 1000);
+  CPPUNIT_ASSERT_MESSAGE("Took a message while stopped\n", proxy_send("<m>0</m>", 8) == FAIL);
+
+  // The queues, their buffers and the descriptors are released for the next start
+  proxy_getBufferStats(&poolStats);
+  CPPUNIT_ASSERT_MESSAGE("Buffers left after the stop\n", poolStats.count == 0 && poolStats.inUse == 0);
+  CPPUNIT_ASSERT_MESSAGE("Descriptors left after the stop\n", openDescriptors() <= descriptors);
+
+  // The next run sends them, then flushes the new ones still lingering when it stops
+  snprintf(url, sizeof(url), "127.0.0.1:%d/standin", standInStart(&thread, false));
+  proxyconfig_setBatching(PROXY_DEFAULT_BATCH_BYTES, 60000);
+  CPPUNIT_ASSERT(proxy_start(url) == SUCCESS);
+
+  for(i = 0; i < 300 && !standInDone(STOP_MESSAGES); i++) {
+    usleep(100000);
+  }
+  CPPUNIT_ASSERT_MESSAGE("The journal wasn't replayed\n", standInDone(STOP_MESSAGES));
+
+  bytes = sendMessages(STOP_MESSAGES, 2 * STOP_MESSAGES);
+  usleep(200000);
+
+  CPPUNIT_ASSERT(proxy_stopWithin(STOP_DEADLINE_MS) == SUCCESS);
+  proxy_getShutdownStats(&stats);
+  CPPUNIT_ASSERT_MESSAGE("Messages weren't flushed\n", stats.flushedBytes == (unsigned long long) bytes);
+  CPPUNIT_ASSERT(stats.persistedBytes == 0 && stats.lostBytes == 0 && !stats.timedOut);
+  CPPUNIT_ASSERT_MESSAGE("Flushing waited for the linger\n", stats.durationMs < STOP_DEADLINE_MS);
+
+  sStandIn.stop = true;
+  pthread_join(thread, NULL);
+  close(sStandIn.listenFd);
+  proxyconfig_setJournalDir("");
+  removeDir(dir);
+
+  for(i = 0; i < 2 * STOP_MESSAGES; i++) {
+    CPPUNIT_ASSERT_MESSAGE("A message was lost or duplicated\n", sStandIn.received[i] == 1);
+  }
+}
+
+/** Set by stuckListener() once the producer is stuck in it */
+static volatile bool sStuck;
+
+/**
+ * Queue listener keeping its producer in proxy_send() past the deadline of
+ * the stop
+ */
+static void stuckListener(int priority, bool above, int length) {
+  if(above) {
+    sStuck = true;
+    usleep(STOP_DEADLINE_MS * 1000);
+  }
+}
+
+static void *stuckProducer(void *arg) {
+  proxy_send("<m>0</m>", 8);
+  return NULL;
+}
+
+void ProxyWindowTest::testStuckProducer(void) {
+  proxy_shutdown_stats_t stats;
+  proxybuffer_stats_t poolStats;
+  int descriptors = openDescriptors();
+  pthread_t producer;
+  int i;
+
+  // The first message takes the queue past its high watermark
+  proxyconfig_setQueueWatermarks(1, 0);
+  CPPUNIT_ASSERT(proxy_start("127.0.0.1:1/standin") == SUCCESS);
+  proxy_addQueueListener(stuckListener);
+
+  sStuck = false;
+  pthread_create(&producer, NULL, stuckProducer, NULL);
+  for(i = 0; i < 100 && !sStuck; i++) {
+    usleep(10000);
+  }
+  CPPUNIT_ASSERT(sStuck);
+
+  // The stop doesn't wait for the producer past its deadline
+  CPPUNIT_ASSERT_MESSAGE("The stuck producer wasn't counted\n", proxy_stopWithin(STOP_DEADLINE_MS / 4) == FAIL);
+  proxy_getShutdownStats(&stats);
+  CPPUNIT_ASSERT(stats.lostBytes >= 8);
+  CPPUNIT_ASSERT_MESSAGE("Waited for the stuck producer\n", stats.durationMs < STOP_DEADLINE_MS / 2);
+  CPPUNIT_ASSERT_MESSAGE("Started under a stuck producer\n", proxy_start("127.0.0.1:1/standin") == FAIL);
+
+  // The next start frees the queues it was stuck in
+  pthread_join(producer, NULL);
+  CPPUNIT_ASSERT(proxy_start("127.0.0.1:1/standin") == SUCCESS);
+  proxy_removeQueueListener(stuckListener);
+  proxy_stopWithin(STOP_DEADLINE_MS);
+  proxyconfig_setQueueWatermarks(PROXY_DEFAULT_QUEUE_HIGH_WATERMARK, PROXY_DEFAULT_QUEUE_LOW_WATERMARK);
+
+  proxy_getBufferStats(&poolStats);
+  CPPUNIT_ASSERT_MESSAGE("Buffers left after the stop\n", poolStats.count == 0 && poolStats.inUse == 0);
+  CPPUNIT_ASSERT_MESSAGE("Descriptors left after the stop\n", openDescriptors() <= descriptors);
+
+  // A start failing once the queues are created releases them
+  CPPUNIT_ASSERT(proxy_start("") == FAIL);
+  CPPUNIT_ASSERT_MESSAGE("Took a message without a proxy\n", proxy_send("<m>0</m>", 8) == FAIL);
+  proxy_getBufferStats(&poolStats);
+  CPPUNIT_ASSERT_MESSAGE("Buffers left after a failed start\n", poolStats.count == 0);
+  CPPUNIT_ASSERT_MESSAGE("Descriptors left after a failed start\n", openDescriptors() <= descriptors);
+}
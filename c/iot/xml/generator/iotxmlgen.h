@@ -34,6 +34,22 @@
 #ifndef IOTGEN_H
 #define IOTGEN_H
 
+/**
+ * Preset compression dictionary made of the strings the generator and the
+ * h2s wrapper write, the most frequent last so they are the closest to the
+ * data. The server inflates messages with the same dictionary, so changing
+ * it changes the protocol.
+ */
+#define IOTGEN_COMPRESSION_DICTIONARY \
+  "<alert deviceId=\"\" type=\"no_read\" />" \
+  "<add deviceId=\"\" deviceType=\"\" />" \
+  "<response cmdId=\"\" result=\"\"/>" \
+  "<?xml version=\"1.0\" encoding=\"utf-8\" ?><h2s ver=\"2\" hubId=\"\" seq=\"\"></h2s>" \
+  "<profile deviceId=\"\" deviceType=\"\" timestamp=\"\"></profile>" \
+  "<alert deviceId=\"\" deviceType=\"\" timestamp=\"\"></alert>" \
+  "<measure deviceId=\"\" deviceType=\"\" timestamp=\"\"></measure>" \
+  "<param name=\"\" index=\"\" multiplier=\"\"></param>"
+
 enum {
   IOTGEN_NUMERIC_STRING_SIZE = 32,
   IOTGEN_DEVICE_ID_SIZE = 32,
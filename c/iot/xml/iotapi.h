@@ -114,6 +114,9 @@ typedef struct command_t {
 
 } command_t;
 
+/** Message from the server parsed as it arrives, see iotxml_streamOpen() */
+typedef struct iotxml_stream_t iotxml_stream_t;
+
 /**
  * Command listener function definitions take on the form:
  *
@@ -154,6 +157,12 @@ error_t iotxml_sendResult(int commandId, result_code_e result);
 
 error_t iotxml_parse(const char *xml, int len);
 
+iotxml_stream_t *iotxml_streamOpen();
+
+error_t iotxml_streamParse(iotxml_stream_t *stream, const char *chunk, int len);
+
+error_t iotxml_streamClose(iotxml_stream_t *stream);
+
 error_t iotxml_addCommandListener(commandlistener_f l, char *type);
 
 error_t iotxml_removeCommandListener(commandlistener_f l);
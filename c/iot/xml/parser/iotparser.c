@@ -53,8 +53,36 @@
 #include "eui64.h"
 
 
-/** True if a param tag was found in the command */
-static bool paramTagFound;
+/** State of one message being parsed, passed to the SAX handlers */
+typedef struct iotparser_state_t {
+  /** Command being parsed, broadcast to the command listeners */
+  command_t command;
+
+  /** True if a param tag was found in the command */
+  bool paramTagFound;
+
+  /**
+   * True when the message is parsed as it arrives. The parser's buffer
+   * moves between chunks, so the argument is copied into value.
+   */
+  bool streaming;
+
+  /** Copy of the argument when streaming */
+  char value[IOTPARSER_VALUE_SIZE];
+
+  /** Length of value */
+  int valueLen;
+} iotparser_state_t;
+
+/** Message parsed as it arrives, see iotxml_streamOpen() */
+struct iotxml_stream_t {
+  iotparser_state_t state;
+
+  xmlParserCtxtPtr parser;
+
+  /** True once the message was found malformed, the rest is ignored */
+  bool failed;
+};
 
 /***************** Private Prototypes ****************/
 static void _iotparser_xml_startElementHandler(void *ctx, const xmlChar *name, const xmlChar **atts);
@@ -63,12 +91,8 @@ static void _iotparser_xml_endElementHandler(void *ctx, const xmlChar *name);
 
 static void _iotparser_xml_charactersHandler(void *ctx, const xmlChar *ch, int len);
 
-/***************** Public Functions ****************/
-error_t iotxml_parse(const char *xml, int len) {
-  command_t command;
-  memset(&command, 0x0, sizeof(command));
-
-  xmlSAXHandler saxHandler = {
+/** SAX handlers shared by the memory and the streaming parsers */
+static xmlSAXHandler saxHandler = {
       NULL, // internalSubsetHandler,
       NULL, // isStandaloneHandler,
       NULL, // hasInternalSubsetHandler,
@@ -93,19 +117,95 @@ error_t iotxml_parse(const char *xml, int len) {
       NULL, // warning
       NULL, // error
       NULL, // fatal
-  };
+};
+
+/***************** Public Functions ****************/
+error_t iotxml_parse(const char *xml, int len) {
+  iotparser_state_t state;
+  memset(&state, 0x0, sizeof(state));
 
-  command.userIsWatching = (strstr(xml, "CONT") != NULL);
+  state.command.userIsWatching = (strstr(xml, "CONT") != NULL);
 
   SYSLOG_DEBUG("Parsing XML: %s", xml);
-  if(0 != xmlSAXUserParseMemory(&saxHandler, &command, xml, len)) {
+  if(0 != xmlSAXUserParseMemory(&saxHandler, &state, xml, len)) {
+    SYSLOG_ERR("Couldn't parse XML");
+    return FAIL;
+  }
+
+  return SUCCESS;
+}
+
+/**
+ * Start parsing a message from the server as it arrives. Each command is
+ * broadcast to the command listeners as soon as its closing tag is parsed,
+ * without waiting for the rest of the message.
+ *
+ * @return the stream to feed with iotxml_streamParse(), NULL on failure
+ */
+iotxml_stream_t *iotxml_streamOpen() {
+  iotxml_stream_t *stream;
+
+  if((stream = calloc(1, sizeof(iotxml_stream_t))) == NULL) {
+    SYSLOG_ERR("Out of memory");
+    return NULL;
+  }
+
+  stream->state.streaming = true;
+
+  stream->parser = xmlCreatePushParserCtxt(&saxHandler, &stream->state, NULL, 0, NULL);
+  if(stream->parser == NULL) {
+    SYSLOG_ERR("Couldn't create the XML push parser");
+    free(stream);
+    return NULL;
+  }
+
+  return stream;
+}
+
+/**
+ * Parse the next part of a message from the server
+ *
+ * @param stream Stream returned by iotxml_streamOpen()
+ * @param chunk Next bytes of the message, of any size
+ * @param len Length of the chunk
+ * @return SUCCESS if the message is well formed so far
+ */
+error_t iotxml_streamParse(iotxml_stream_t *stream, const char *chunk, int len) {
+  if(stream == NULL || stream->failed) {
+    return FAIL;
+  }
+
+  if(len > 0 && xmlParseChunk(stream->parser, chunk, len, 0) != 0) {
     SYSLOG_ERR("Couldn't parse XML");
+    stream->failed = true;
     return FAIL;
   }
 
   return SUCCESS;
 }
 
+/**
+ * Finish parsing a message from the server and release the stream
+ *
+ * @param stream Stream returned by iotxml_streamOpen(), may be NULL
+ * @return SUCCESS if the whole message was well formed
+ */
+error_t iotxml_streamClose(iotxml_stream_t *stream) {
+  error_t result = SUCCESS;
+
+  if(stream == NULL) {
+    return FAIL;
+  }
+
+  if(stream->failed || xmlParseChunk(stream->parser, NULL, 0, 1) != 0) {
+    result = FAIL;
+  }
+
+  xmlFreeParserCtxt(stream->parser);
+  free(stream);
+  return result;
+}
+
 /***************** Private Functions ****************/
 /**
  * XML start element handler
@@ -114,12 +214,14 @@ static void _iotparser_xml_startElementHandler(void *ctx, const xmlChar *name, c
   int i;
   char *attr;
   char *value;
-  command_t *command = (command_t *) ctx;
+  iotparser_state_t *state = (iotparser_state_t *) ctx;
+  command_t *command = &state->command;
 
+  state->valueLen = 0;
 
   if(strcmp((char *) name, IOTPARSER_TAG_COMMAND) == 0) {
     // New command, clear out all the residual command and argument information
-    paramTagFound = false;
+    state->paramTagFound = false;
     bzero(command->deviceId, EUI64_STRING_SIZE);
     bzero(command->commandName, IOT_COMMAND_NAME_STRING_SIZE);
     command->commandId = -1;
@@ -130,7 +232,7 @@ static void _iotparser_xml_startElementHandler(void *ctx, const xmlChar *name, c
   } else if(strcmp((char *) name, IOTPARSER_TAG_PARAM) == 0) {
     // New parameter, clear out the residual argument information but leave
     // everything else intact
-    paramTagFound = true;
+    state->paramTagFound = true;
     command->asciiIndex = 0;
     command->argument = NULL;
     command->argSize = 0;
@@ -161,6 +263,11 @@ static void _iotparser_xml_startElementHandler(void *ctx, const xmlChar *name, c
       } else if(strcmp(attr, IOTPARSER_ATTR_COMMANDNAME) == 0) {
         // If the parameter has a name, then that is the real command name
         strncpy(command->commandName, value, IOT_COMMAND_NAME_STRING_SIZE);
+
+      } else if(strcmp(attr, IOTPARSER_ATTR_STATUS) == 0
+          && strcmp((char *) name, IOTPARSER_TAG_S2H) == 0) {
+        // A streamed message can't be searched for CONT before it is parsed
+        command->userIsWatching |= (strcmp(value, IOTPARSER_STATUS_CONT) == 0);
       }
     }
   }
@@ -170,8 +277,10 @@ static void _iotparser_xml_startElementHandler(void *ctx, const xmlChar *name, c
  * XML end element handler
  */
 static void _iotparser_xml_endElementHandler(void *ctx, const xmlChar *name) {
+  iotparser_state_t *state = (iotparser_state_t *) ctx;
+
   if(strcmp((char *) name, IOTPARSER_TAG_S2H) == 0) {
-    command_t *command = (command_t *) ctx;
+    command_t *command = &state->command;
 
     // Send out a command to all listeners that there are no more commands
     // This is useful when we might receive several commands that we buffered
@@ -188,12 +297,12 @@ static void _iotparser_xml_endElementHandler(void *ctx, const xmlChar *name) {
 
   } else if(strcmp((char *) name, IOTPARSER_TAG_PARAM) == 0) {
     // This is the end of a param tag
-    paramTagFound = true;
-    iotcommandlisteners_broadcast((command_t *) ctx);
+    state->paramTagFound = true;
+    iotcommandlisteners_broadcast(&state->command);
 
-  } else if(strcmp((char *) name, IOTPARSER_TAG_COMMAND) == 0 && !paramTagFound) {
+  } else if(strcmp((char *) name, IOTPARSER_TAG_COMMAND) == 0 && !state->paramTagFound) {
     // This is the end of a command tag where there were no param tags within it
-    iotcommandlisteners_broadcast((command_t *) ctx);
+    iotcommandlisteners_broadcast(&state->command);
   }
 }
 
@@ -202,9 +311,27 @@ static void _iotparser_xml_endElementHandler(void *ctx, const xmlChar *name) {
  * XML character handler
  */
 static void _iotparser_xml_charactersHandler(void *ctx, const xmlChar *ch, int len) {
-  command_t *command = (command_t *) ctx;
-  command->argument = (char *) ch;
-  command->argSize = len;
+  iotparser_state_t *state = (iotparser_state_t *) ctx;
+  command_t *command = &state->command;
+
+  if(!state->streaming) {
+    command->argument = (char *) ch;
+    command->argSize = len;
+    return;
+  }
+
+  // The characters of a streamed value may come in several pieces
+  if(len > (int) sizeof(state->value) - 1 - state->valueLen) {
+    SYSLOG_WARNING("Value longer than %d bytes truncated", IOTPARSER_VALUE_SIZE - 1);
+    len = sizeof(state->value) - 1 - state->valueLen;
+  }
+
+  memcpy(state->value + state->valueLen, ch, len);
+  state->valueLen += len;
+  state->value[state->valueLen] = '\0';
+
+  command->argument = state->value;
+  command->argSize = state->valueLen;
 }
 
 
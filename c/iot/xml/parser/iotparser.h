@@ -67,5 +67,11 @@
 /** index attribute */
 #define IOTPARSER_ATTR_INDEX "index"
 
+/** status attribute of the <s2h ..> tag */
+#define IOTPARSER_ATTR_STATUS "status"
+
+/** status telling a user is watching in real time */
+#define IOTPARSER_STATUS_CONT "CONT"
+
 #endif
 
@@ -61,44 +61,382 @@
 #include <time.h>
 #include <stdint.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
 #include <syslog.h>
 #include <rpc/types.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/err.h>
 
 #include "iotdebug.h"
 #include "libhttpcomm.h"
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define X509_STORE_up_ref(store) CRYPTO_add(&(store)->references, 1, CRYPTO_LOCK_X509_STORE)
+#endif
+
 struct HttpIoInfo /// structure used to store data to be sent to the server.
 {
     char * buffer;
     int size;
+    int offset;                                 /// bytes already sent, back to 0 when curl rewinds
+};
+
+struct HttpIoVector /// message made of several segments, streamed to the server without joining them
+{
+    const struct iovec *segments;               /// all the segments, kept for curl to rewind
+    int segmentCount;
+    int segment;                                /// index of the segment being sent
+    size_t offset;                              /// bytes of the current segment already sent
+};
+
+struct HttpDeflateBuffer /// compressed message, in a buffer kept from one message to the next
+{
+    char *buffer;
+    size_t capacity;                            /// grown to the deflateBound() of the largest message
+    struct HttpIoInfo info;                     /// read state of the compressed message
+};
+
+struct HttpConfigCache /// options and header lines a curl handle was last configured with
+{
+    bool valid;                                 /// false until configured, or after a failure
+    CURLoption httpMethod;
+    char *url;
+    char *sslCertPath;
+    http_timeout_t timeouts;
+    int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow);
+    const char *contentType;                    /// static string, NULL if none
+    char *authToken;
+    struct curl_slist *headers;                 /// lines that stay the same from one request to the next
+    struct curl_slist *headersTail;             /// last of them, the lines of one request are linked after it
+    struct curl_slist requestLines[HTTPCOMM_MAX_EXTRA_HEADERS + 1];
+    int requestLineCount;
+    struct curl_slist resolveLine;              /// address of the host given to curl, data is NULL if none
+    char resolve[HTTPCOMM_HOST_STRING_SIZE + HTTPCOMM_PORT_STRING_SIZE + INET6_ADDRSTRLEN + 2];
+    char extraHeaders[HTTPCOMM_MAX_EXTRA_HEADERS][HTTPCOMM_HEADER_LINE_SIZE];
+};
+
+struct HttpDownloadTransfer /// one attempt of a download
+{
+    CURL *curlHandle;
+    http_download_t *download;
+    curl_off_t startOffset;                     /// offset the attempt resumed from
+    long httpResponseCode;                      /// 0 until the first bytes of the body
+    int error;                                  /// errno value that aborted the attempt, 0 if none
+    int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow);
+};
+
+struct HttpUploadTransfer /// one streamed upload
+{
+    http_upload_t *upload;
+    curl_off_t sent;                            /// bytes handed to curl
+    int error;                                  /// errno value that aborted the upload, 0 if none
+};
+
+struct HttpSessionHandle /// one reusable connection owned by a session
+{
+    CURL *curlHandle;
+    CURLSH *shareCurlHandle;                    /// share handle currently attached to curlHandle
+    char host[HTTPCOMM_HOST_STRING_SIZE];       /// "scheme://host:port" this handle last talked to
+    char errorBuffer[CURL_ERROR_SIZE];
+    struct HttpConfigCache config;
+    struct HttpDeflateBuffer compressed;
+    bool inUse;
+    bool temporary;                             /// true if not part of the session pool
+    time_t lastUsed;
+};
+
+struct libhttpcomm_session_t /// long-lived connections to upstream hosts
+{
+    pthread_mutex_t mutex;
+    CURLSH *shareCurlHandle;
+    struct HttpSessionHandle handles[HTTPCOMM_SESSION_MAX_HANDLES];
+    http_encoding_e encoding;                   /// Content-Encoding of the messages sent
+    unsigned char *dictionary;                  /// preset deflate dictionary, NULL if none
+    size_t dictionaryLength;
+    http_header_hook_t headerHook;              /// adds the lines of each request, NULL if none
+    void *headerHookUserData;
+};
+
+struct HttpTransfer /// one transfer of a libhttpcomm_multi_t engine
+{
+    CURL *curlHandle;
+    char errorBuffer[CURL_ERROR_SIZE];
+    struct HttpConfigCache config;
+    CURLoption httpMethod;
+    struct HttpIoInfo outBoundCommInfo;
+    struct HttpIoVector outBoundVector;         /// message made of segments
+    struct HttpDeflateBuffer compressed;
+    http_rxbuffer_t rx;
+    http_param_t params;
+    http_completion_t onComplete;
+    void *userData;
+    struct HttpTransfer *next;
+};
+
+struct HttpMultiSocket /// socket curl asked the engine to watch
+{
+    curl_socket_t fd;
+    int events;                                 /// CURL_POLL_IN, CURL_POLL_OUT or CURL_POLL_INOUT
 };
 
-static int _libhttpcomm_configureHttp(CURL * curlHandle, CURLSH * shareCurlHandle, struct curl_slist *slist, CURLoption httpMethod,
+struct libhttpcomm_multi_t /// many transfers run at once by one thread
+{
+    pthread_mutex_t mutex;                      /// protects pending and idle, submitted from any thread
+    CURLM *multiHandle;
+    CURLSH *shareCurlHandle;
+    size_t maxResponseSize;
+    int wakeupFd[2];                            /// written by libhttpcomm_submit to wake the loop up
+    struct HttpTransfer *pending;               /// submitted, not handed to curl yet
+    struct HttpTransfer *pendingTail;
+    int pendingCount;
+    struct HttpTransfer *active;                /// handed to curl
+    int running;
+    struct HttpTransfer *idle;                  /// done, curl handles kept for the next transfers
+    int idleCount;
+    long long timeoutAtMs;                      /// monotonic time curl wants to be called at, -1 for never
+    struct HttpMultiSocket sockets[HTTPCOMM_MULTI_MAX_SOCKETS];
+    http_watcher_t watcher;
+    void *watcherUserData;
+};
+
+/** Key to the per-thread session used by the one-shot functions */
+static pthread_key_t sThreadSessionKey;
+
+/** Makes sure sThreadSessionKey is only created once */
+static pthread_once_t sThreadSessionOnce = PTHREAD_ONCE_INIT;
+
+/** Mutexes protecting each kind of data shared between connections */
+static pthread_mutex_t sShareMutex[CURL_LOCK_DATA_LAST];
+
+/** Makes sure the share mutexes are only created once */
+static pthread_once_t sShareMutexOnce = PTHREAD_ONCE_INIT;
+
+/** Mutex protecting sCacheStats */
+static pthread_mutex_t sCacheStatsMutex;
+
+/** Connection, DNS and SSL cache counters */
+static http_cache_stats_t sCacheStats;
+
+/** Mutex protecting sMetrics */
+static pthread_mutex_t sMetricsMutex;
+
+/** Metrics of each endpoint, the last slot gathers the endpoints that didn't fit */
+static http_endpoint_metrics_t sMetrics[HTTPCOMM_METRICS_MAX_ENDPOINTS];
+
+/** Slots of sMetrics in use */
+static int sMetricsEndpoints;
+
+/** Mutex protecting the CA store */
+static pthread_mutex_t sCaStoreMutex;
+
+/** Trust store shared by the TLS contexts of every connection, NULL if not loaded */
+static X509_STORE *sCaStore;
+
+/** Certificate file or directory the CA store belongs to */
+static char sCaStorePath[PATH_MAX];
+
+/** Identity and modification time of sCaStorePath when the CA store was loaded */
+static struct stat sCaStoreStat;
+
+/** Monotonic time sCaStorePath was last checked for changes */
+static time_t sCaStoreCheckedSec;
+
+struct HttpResolverHost /// upstream host resolved in the background
+{
+    char name[HTTPCOMM_HOST_STRING_SIZE];
+    char address[INET6_ADDRSTRLEN];             /// last known good address, empty until resolved
+    time_t refreshSec;                          /// monotonic time of the next lookup
+};
+
+/** Mutex protecting the resolver */
+static pthread_mutex_t sResolverMutex;
+
+/** Wakes the resolver up when a host is added or when it has to stop */
+static pthread_cond_t sResolverCond;
+
+/** Hosts resolved in the background */
+static struct HttpResolverHost sResolverHosts[HTTPCOMM_RESOLVER_MAX_HOSTS];
+
+/** Slots of sResolverHosts in use */
+static int sResolverHostCount;
+
+/** Thread refreshing the addresses of sResolverHosts */
+static pthread_t sResolverThread;
+
+/** True while sResolverThread runs */
+static bool sResolverRunning;
+
+/** True to ask sResolverThread to stop */
+static bool sResolverStopping;
+
+static struct HttpSessionHandle *_libhttpcomm_sessionAcquire(libhttpcomm_session_t *session,
+        CURLSH *shareCurlHandle, const char *url);
+
+static void _libhttpcomm_sessionRelease(libhttpcomm_session_t *session, struct HttpSessionHandle *handle);
+
+static libhttpcomm_session_t *_libhttpcomm_threadSession(void);
+
+static int _libhttpcomm_sendMsg(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, CURLoption httpMethod,
+        const char *url, const char *sslCertPath, const char *authToken,
+        char *msgToSendPtr, int msgToSendSize, http_rxbuffer_t *rx, http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow));
+
+static int _libhttpcomm_sendMsgv(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, CURLoption httpMethod,
+        const char *url, const char *sslCertPath, const char *authToken,
+        const struct iovec *segments, int segmentCount, http_rxbuffer_t *rx, http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow));
+
+static int _libhttpcomm_exchange(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, CURLoption httpMethod,
+        const char *url, const char *sslCertPath, const char *authToken,
+        size_t (*readFunction) (void *ptr, size_t size, size_t nmemb, void *userp), void *readData,
+        long msgToSendSize, http_rxbuffer_t *rx, http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow));
+
+static int _libhttpcomm_getFile(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, const char *url,
+        const char *sslCertPath, const char *authToken, FILE *rxFile, int maxRxFileSize, http_timeout_t timeouts,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow));
+
+static int _libhttpcomm_download(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, const char *url,
+        const char *sslCertPath, const char *authToken, http_download_t *download, http_timeout_t timeouts,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow));
+
+static int _libhttpcomm_downloadAttempt(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, const char *url,
+        const char *sslCertPath, const char *authToken, http_download_t *download, http_timeout_t timeouts,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow),
+        bool *retry);
+
+static size_t _libhttpcomm_downloadWriter(void *ptr, size_t size, size_t nmemb, void *userp);
+
+static int _libhttpcomm_downloadProgress(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow);
+
+static void _libhttpcomm_downloadSync(http_download_t *download);
+
+static void _libhttpcomm_downloadRestart(http_download_t *download);
+
+static int _libhttpcomm_upload(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, const char *url,
+        const char *sslCertPath, const char *authToken, http_upload_t *upload, http_rxbuffer_t *rx,
+        http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow));
+
+static size_t _libhttpcomm_uploadReader(void *ptr, size_t size, size_t nmemb, void *userp);
+
+static int _libhttpcomm_sendFile(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, const char *url,
+        const char *sslCertPath, const char *authToken, char *fileName, http_rxbuffer_t *rx,
+        http_timeout_t timeouts);
+
+static bool _libhttpcomm_rxBufferGrow(http_rxbuffer_t *rx, size_t neededSize);
+
+static bool _libhttpcomm_sessionSetup(libhttpcomm_session_t *session, CURL *curlHandle,
+        struct HttpConfigCache *config, CURLoption httpMethod, const char *url, const char *sslCertPath,
+        const char *authToken, size_t (*readFunction) (void *ptr, size_t size, size_t nmemb, void *userp),
+        void *readData, long msgToSendSize, http_rxbuffer_t *rx, http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow),
+        struct HttpDeflateBuffer *compressed);
+
+static bool _libhttpcomm_compress(libhttpcomm_session_t *session, const struct iovec *segments,
+        int segmentCount, long msgToSendSize, struct HttpDeflateBuffer *compressed);
+
+static int _libhttpcomm_setupMsg(CURL *curlHandle, struct HttpConfigCache *config, const char *contentType,
+        CURLoption httpMethod, const char *url, const char *sslCertPath, const char *authToken,
+        size_t (*readFunction) (void *ptr, size_t size, size_t nmemb, void *userp), void *readData,
+        long msgToSendSize, http_rxbuffer_t *rx, http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow));
+
+static int _libhttpcomm_msgResult(CURL *curlHandle, CURLcode curlResult, const char *url, http_rxbuffer_t *rx,
+        http_param_t params);
+
+static bool _libhttpcomm_connectionLost(CURLcode curlResult);
+
+static int _libhttpcomm_initHttp(CURL * curlHandle, char *errorBuffer);
+
+static int _libhttpcomm_configureHttp(CURL * curlHandle, struct HttpConfigCache *config, const char *contentType, CURLoption httpMethod,
         const char *url, const char *sslCertPath, const char *authToken, http_timeout_t timeouts,
         int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow));
 
-static void _libhttpcomm_closeHttp(CURL * curlHandle, struct curl_slist *slist);
+static void _libhttpcomm_closeHttp(struct HttpConfigCache *config);
+
+static bool _libhttpcomm_headersBuild(struct HttpConfigCache *config, const char *contentType, const char *authToken);
+
+static bool _libhttpcomm_headersAdd(struct HttpConfigCache *config, char *line);
+
+static void _libhttpcomm_configFree(struct HttpConfigCache *config);
+
+static bool _libhttpcomm_stringChanged(const char *cached, const char *value);
+
+static bool _libhttpcomm_stringSet(char **cached, const char *value);
+
+static void _libhttpcomm_getHost(const char *url, char *host, int hostSize);
+
+static int _libhttpcomm_getHostName(const char *url, char *name, int nameSize);
+
+static bool _libhttpcomm_resolverFeed(CURL *curlHandle, struct HttpConfigCache *config, const char *url);
+
+static void *_libhttpcomm_resolverThread(void *params);
+
+static bool _libhttpcomm_resolve(const char *name, char *address, int addressSize);
+
+static void _libhttpcomm_updateCacheStats(CURL *curlHandle);
+
+static bool _libhttpcomm_setCaStore(CURL *curlHandle, const char *sslCertPath);
+
+static CURLcode _libhttpcomm_sslContext(CURL *curlHandle, void *sslContext, void *userData);
+
+static X509_STORE *_libhttpcomm_caStoreGet(const char *path, bool force);
+
+static X509_STORE *_libhttpcomm_caStoreRead(const char *path, const struct stat *fileStat);
+
+static void _libhttpcomm_updateMetrics(CURL *curlHandle, CURLoption httpMethod, CURLcode curlResult);
+
+static void _libhttpcomm_histogramAdd(http_histogram_t *histogram, double durationSec);
+
+static struct HttpTransfer *_libhttpcomm_transferNew(libhttpcomm_multi_t *multi);
+
+static void _libhttpcomm_transferFree(struct HttpTransfer *transfer);
+
+static void _libhttpcomm_multiAddPending(libhttpcomm_multi_t *multi);
+
+static void _libhttpcomm_multiComplete(libhttpcomm_multi_t *multi);
+
+static void _libhttpcomm_transferRecycle(libhttpcomm_multi_t *multi, struct HttpTransfer *transfer);
+
+static int _libhttpcomm_multiSocketCallback(CURL *easy, curl_socket_t fd, int what, void *userp, void *socketp);
+
+static int _libhttpcomm_multiTimerCallback(CURLM *multiHandle, long timeoutMs, void *userp);
+
+static long long _libhttpcomm_nowMs(void);
 
 /**********************************************************************************************//**
  * @brief   Called when a message has to be received from the server. this is a standard streamer
  *              if the size of the data to read, equal to size*nmemb, the function can return
  *              what was read and the function will be called again by libcurl.
+ *              Data is appended after the bytes already received, so receiving a message
+ *              costs O(n) whatever the number of chunks, and it may contain null bytes.
  *
  * @param   ptr: where the received message resides
  * @param   size: size*nmemb == number of bytes to read
  * @param   nmemb: size*nmemb == number of bytes to read
- * @param   userp: ptr to where the message will be written -> inputted by CURLOPT_WRITEDATA call below
+ * @param   userp: http_rxbuffer_t where the message will be written -> inputted by CURLOPT_WRITEDATA call below
  *
  * @return  number of bytes that were written
  ***************************************************************************************************/
 static size_t writer(void *ptr, size_t size, size_t nmemb, void *userp)
 {
-    struct HttpIoInfo *dataToRead = (struct HttpIoInfo *) userp;
-    char *data = (char *)ptr;
+    http_rxbuffer_t *dataToRead = (http_rxbuffer_t *) userp;
+    size_t dataSize = size * nmemb;
 
     if (dataToRead == NULL || dataToRead->buffer == NULL)
     {
@@ -106,19 +444,40 @@ static size_t writer(void *ptr, size_t size, size_t nmemb, void *userp)
         return 0;
     }
 
-    // keeping one byte for the null byte
-    if((strlen(dataToRead->buffer)+(size * nmemb)) > (dataToRead->size - 1))
+    if (dataToRead->sink != NULL && dataToRead->sink((const char *) ptr, dataSize, dataToRead->sinkUserData) != 0)
     {
-        SYSLOG_WARNING ("buffer overflow would result -> strlen(writeData): %u, (size * nmemb): %u, max size: %u",
-                strlen(dataToRead->buffer), (size * nmemb), dataToRead->size);
+        SYSLOG_DEBUG("transfer aborted by the sink");
         return 0;
     }
-    else
+
+    if (dataToRead->truncated == true)
+    {
+        return dataSize;
+    }
+
+    // keeping one byte for the null byte
+    if ((dataToRead->length + dataSize) > (dataToRead->size - 1))
     {
+        if (_libhttpcomm_rxBufferGrow(dataToRead, dataToRead->length + dataSize + 1) == false)
+        {
+            if (dataToRead->sink != NULL)
+            {
+                // the sink has the whole message, keep what fits and go on
+                SYSLOG_DEBUG("message larger than %zu bytes only streamed to the sink", dataToRead->maxSize);
+                dataToRead->truncated = true;
+                return dataSize;
+            }
 
+            SYSLOG_WARNING ("buffer overflow would result -> length: %zu, (size * nmemb): %zu, max size: %zu",
+                    dataToRead->length, dataSize, dataToRead->maxSize);
+            return 0;
+        }
     }
-    strncat(dataToRead->buffer, data, (size * nmemb));
-    return (size * nmemb);
+
+    memcpy(dataToRead->buffer + dataToRead->length, ptr, dataSize);
+    dataToRead->length += dataSize;
+    dataToRead->buffer[dataToRead->length] = '\0';
+    return dataSize;
 }
 
 /**
@@ -150,21 +509,20 @@ static size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userp)
         return 0;
     }
 
-    if (dataToWrite->size > 0)
+    if (dataToWrite->size > dataToWrite->offset)
     {
-        if (dataToWrite->size > (size * nmemb))
+        if (dataToWrite->size - dataToWrite->offset > (size * nmemb))
         {
             dataWritten = size * nmemb;
             SYSLOG_DEBUG("dataToWrite->size = %u is larger than size * nmemb = %u",
-                    dataToWrite->size, size * nmemb);
+                    dataToWrite->size - dataToWrite->offset, size * nmemb);
         }
         else
         {
-            dataWritten = dataToWrite->size;
+            dataWritten = dataToWrite->size - dataToWrite->offset;
         }
-        memcpy (ptr, dataToWrite->buffer, dataWritten);
-        dataToWrite->buffer += dataWritten;
-        dataToWrite->size -= dataWritten;
+        memcpy (ptr, dataToWrite->buffer + dataToWrite->offset, dataWritten);
+        dataToWrite->offset += dataWritten;
 
         return dataWritten; /* we return 1 byte at a time! */
     }
@@ -177,795 +535,4648 @@ static size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userp)
 }
 
 /**
- * @brief   Called when creating a curl data structure that will be shared across different
- *              http connections. DNS caching data is such data structure.
+ * @brief   Called when curl has to send the message again from the start, mostly because
+ *              a kept-alive connection died under it and the request is retried on a new one
  *
- * @param   curlShHandle: pointer to a CURLSH structure that will be instantiated by curl_share_init
+ * @param   userp: ptr to message to write -> inputted by CURLOPT_SEEKDATA
+ * @param   offset: where to send the message from
+ * @param   origin: SEEK_SET, the only one curl uses
  *
- * @return  none
+ * @return  CURL_SEEKFUNC_OK, or CURL_SEEKFUNC_CANTSEEK if the offset is not in the message
  **/
-void libhttpcomm_curlShareInit(CURLSH *curlShHandle)
+static int seek_callback(void *userp, curl_off_t offset, int origin)
 {
-    curlShHandle = curl_share_init();
+    struct HttpIoInfo *dataToWrite = (struct HttpIoInfo *) userp;
+
+    if (dataToWrite == NULL || origin != SEEK_SET || offset < 0 || offset > dataToWrite->size)
+    {
+        SYSLOG_ERR("cannot seek to %ld", (long) offset);
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+
+    dataToWrite->offset = (int) offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+/**
+ * @brief   Same as read_callback, for a message made of several segments. Each segment
+ *              is copied once, straight into curl's buffer.
+ *
+ * @param   ptr: where data has to be written
+ * @param   size: size*nmemb == maximum number of bytes that can be written each time
+ * @param   nmemb: size*nmemb == maximum number of bytes that can be written each time
+ * @param   userp: struct HttpIoVector -> inputted by CURLOPT_READDATA
+ *
+ * @return  number of bytes that were written
+ */
+static size_t read_vector_callback(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    struct HttpIoVector *dataToWrite = (struct HttpIoVector *) userp;
+    const struct iovec *segment;
+    size_t room = size * nmemb;
+    size_t dataWritten = 0;
+    size_t length;
+
+    if (dataToWrite == NULL)
+    {
+        SYSLOG_ERR ("dataToWrite == NULL");
+        return 0;
+    }
 
-    if (curlShHandle != NULL)
+    while (room > 0 && dataToWrite->segment < dataToWrite->segmentCount)
     {
-        if(curl_share_setopt(curlShHandle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK)
+        segment = &dataToWrite->segments[dataToWrite->segment];
+        length = segment->iov_len - dataToWrite->offset;
+        if (length > room)
         {
-            SYSLOG_ERR("curl_easy_setopt CURLSHOPT_SHARE");
+            length = room;
         }
-    }else
+
+        memcpy((char *) ptr + dataWritten, (const char *) segment->iov_base + dataToWrite->offset, length);
+        dataWritten += length;
+        room -= length;
+        dataToWrite->offset += length;
+
+        if (dataToWrite->offset == segment->iov_len)
+        {
+            dataToWrite->segment++;
+            dataToWrite->offset = 0;
+        }
+    }
+
+    return dataWritten;
+}
+
+/**
+ * @brief   Same as seek_callback, for a message made of several segments
+ *
+ * @param   userp: struct HttpIoVector -> inputted by CURLOPT_SEEKDATA
+ * @param   offset: where to send the message from
+ * @param   origin: SEEK_SET, the only one curl uses
+ *
+ * @return  CURL_SEEKFUNC_OK, or CURL_SEEKFUNC_CANTSEEK if the offset is not in the message
+ */
+static int seek_vector_callback(void *userp, curl_off_t offset, int origin)
+{
+    struct HttpIoVector *dataToWrite = (struct HttpIoVector *) userp;
+    int segment = 0;
+
+    if (dataToWrite == NULL || origin != SEEK_SET || offset < 0)
     {
-        SYSLOG_ERR("curl_share_init");
+        SYSLOG_ERR("cannot seek to %ld", (long) offset);
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+
+    // Walk to the segment holding the offset
+    while (segment < dataToWrite->segmentCount && (curl_off_t) dataToWrite->segments[segment].iov_len <= offset)
+    {
+        offset -= dataToWrite->segments[segment].iov_len;
+        segment++;
+    }
+
+    if (segment == dataToWrite->segmentCount && offset > 0)
+    {
+        SYSLOG_ERR("cannot seek %ld bytes past the message", (long) offset);
+        return CURL_SEEKFUNC_CANTSEEK;
     }
+
+    dataToWrite->segment = segment;
+    dataToWrite->offset = (size_t) offset;
+    return CURL_SEEKFUNC_OK;
 }
 
 /**
- * @brief   Called when closing the shared curl data structure
+ * @brief   Creates the mutexes protecting the data shared between connections
  *
  * @return  none
- **/
-void libhttpcomm_curlShareClose(CURLSH *curHandle)
+ */
+static void _libhttpcomm_shareMutexInit(void)
 {
-    curl_share_cleanup(curHandle);
+    pthread_condattr_t condAttr;
+    int i;
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    {
+        pthread_mutex_init(&sShareMutex[i], NULL);
+    }
+    pthread_mutex_init(&sCacheStatsMutex, NULL);
+    pthread_mutex_init(&sMetricsMutex, NULL);
+    pthread_mutex_init(&sCaStoreMutex, NULL);
+    pthread_mutex_init(&sResolverMutex, NULL);
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sResolverCond, &condAttr);
+    pthread_condattr_destroy(&condAttr);
 }
 
 /**
- * @brief   Performs a HTTP Get
+ * @brief   Called by curl before it touches data shared across connections
+ *              (CURLSHOPT_LOCKFUNC)
  *
- * @param   shareCurlHandle: Curl handle shared across connections
- * @param   url: url of the server (hostname + uri)
- * @param   sslCertPath: location of where the certificate is
- * @param   authToken: authentication token to be added in the header
- * @param   rxBuffer: ptr for storing message received by the server -> must exist
- * @param   maxRxBufferSize: max size of rxBuffer in bytes -> if 0 it is assumed that rxBuffer is of type FILE*
- * @param   timeouts: specifies connect and transfer timeouts for the connection
- * @param   ProgressCallback: function pointer that will be called every second during the connection
+ * @param   handle: easy handle accessing the data
+ * @param   data: which kind of shared data is accessed
+ * @param   access: shared or exclusive access, both are exclusive here
+ * @param   userptr: unused
  *
- * @return  true for success, false for failure
+ * @return  none
  */
-int libhttpcomm_getMsg(CURLSH * shareCurlHandle, const char *url, const char *sslCertPath, const char *authToken,
-                char *rxBuffer, int maxRxBufferSize, http_param_t params,
-                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+static void _libhttpcomm_shareLock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
 {
-    return libhttpcomm_sendMsg(shareCurlHandle, CURLOPT_HTTPGET, url, sslCertPath, authToken,
-            NULL, 0, rxBuffer, maxRxBufferSize, params, ProgressCallback);
+    if (data >= 0 && data < CURL_LOCK_DATA_LAST)
+    {
+        pthread_mutex_lock(&sShareMutex[data]);
+    }
 }
+
 /**
- * @brief   Sends a message through HTTP to PPC servers
+ * @brief   Called by curl when it is done with data shared across connections
+ *              (CURLSHOPT_UNLOCKFUNC)
  *
- * @param   shareCurlHandle: Curl handle shared across connections
- * @param   httpMethod: CURLOPT_POST or CURLOPT_HTTPGET
- * @param   url: url of the server (hostname + uri)
- * @param   sslCertPath: location of where the certificate is
- * @param   authToken: authentication token to be added in the header
- * @param   msgToSendPtr: ptr to message to send. NULL if none
- * @param   msgToSendSize: send of msgToSendPtr
- * @param   rxBuffer: ptr for storing message received by the server -> must exist
- * @param   maxRxBufferSize: max size of rxBuffer in bytes -> if 0 it is assumed that rxBuffer is of type FILE*
- * @param   timeouts: specifies connect and transfer timeouts for the connection
- * @param   ProgressCallback: function pointer that will be called every second during the connection
+ * @param   handle: easy handle that accessed the data
+ * @param   data: which kind of shared data was accessed
+ * @param   userptr: unused
  *
- * @return  true for success, false for failure
+ * @return  none
  */
-int libhttpcomm_sendMsg(CURLSH * shareCurlHandle, CURLoption httpMethod, const char *url, const char *sslCertPath, const char *authToken,
-                char *msgToSendPtr, int msgToSendSize, char *rxBuffer, int maxRxBufferSize, http_param_t params,
-                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+static void _libhttpcomm_shareUnlock(CURL *handle, curl_lock_data data, void *userptr)
 {
-    CURL * curlHandle = NULL;
-    CURLcode curlResult;
-    char tempString[PATH_MAX];
-    char errorBuffer[CURL_ERROR_SIZE];
-    struct HttpIoInfo outBoundCommInfo;
-    struct HttpIoInfo inBoundCommInfo;
-    struct curl_slist *slist = NULL;
-    double connectDuration = 0.0;
-    double transferDuration = 0.0;
-    double nameResolvingDuration = 0.0;
-    long httpResponseCode = 0;
-    long httpConnectCode = 0;
-    long curlErrno = 0;
+    if (data >= 0 && data < CURL_LOCK_DATA_LAST)
+    {
+        pthread_mutex_unlock(&sShareMutex[data]);
+    }
+}
 
-    assert (rxBuffer);
-    assert(url);
+/**
+ * @brief   Called when creating a curl data structure that will be shared across different
+ *              http connections: the DNS cache, the SSL session IDs and, when libcurl
+ *              supports it, the connection cache. Access is protected by mutexes, so the
+ *              handle can be used by several threads at the same time.
+ *
+ * @return  the share handle, NULL on failure
+ **/
+CURLSH *libhttpcomm_curlShareInit(void)
+{
+    CURLSH *curlShHandle = NULL;
 
-    if (params.verbose == true)
+    pthread_once(&sShareMutexOnce, _libhttpcomm_shareMutexInit);
+
+    curlShHandle = curl_share_init();
+    if (curlShHandle == NULL)
     {
-        if (msgToSendPtr != NULL)
-        {
-            SYSLOG_DEBUG("httpMethod: 0x%x, url: %s, size: %d, outgoing msg: %s",
-                    httpMethod, url, msgToSendSize, msgToSendPtr);
-        }else
-        {
-            SYSLOG_DEBUG("httpMethod: 0x%x, url: %s", httpMethod, url);
-        }
+        SYSLOG_ERR("curl_share_init");
+        return NULL;
     }
 
-    rxBuffer[0] = 0;
+    if (curl_share_setopt(curlShHandle, CURLSHOPT_LOCKFUNC, _libhttpcomm_shareLock) != CURLSHE_OK
+            || curl_share_setopt(curlShHandle, CURLSHOPT_UNLOCKFUNC, _libhttpcomm_shareUnlock) != CURLSHE_OK)
+    {
+        SYSLOG_ERR("curl_share_setopt CURLSHOPT_LOCKFUNC");
+        curl_share_cleanup(curlShHandle);
+        return NULL;
+    }
 
-    curlHandle = curl_easy_init();
-    if (curlHandle)
+    if (curl_share_setopt(curlShHandle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK)
     {
-        slist = curl_slist_append(slist, "Content-Type: text/xml");
-        snprintf(tempString, sizeof(tempString), "Content-Length: %d", msgToSendSize);
-        slist = curl_slist_append(slist, tempString);
+        SYSLOG_ERR("curl_share_setopt CURL_LOCK_DATA_DNS");
+    }
 
-        if (_libhttpcomm_configureHttp(curlHandle, shareCurlHandle, slist, httpMethod, url,
-                sslCertPath, authToken, params.timeouts, ProgressCallback) == false)
-        {
-            curlErrno = ENOEXEC;
-            goto out;
-        }
+    if (curl_share_setopt(curlShHandle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK)
+    {
+        SYSLOG_ERR("curl_share_setopt CURL_LOCK_DATA_SSL_SESSION");
+    }
 
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_ERRORBUFFER, errorBuffer);
-        if (curlResult != CURLE_OK)
-        {
-            SYSLOG_ERR("%s CURLOPT_ERRORBUFFER", curl_easy_strerror(curlResult));
-            curlErrno = ENOEXEC;
-            goto out;
-        }
+#if LIBCURL_VERSION_NUM >= 0x073900
+    // sharing the connection cache is only available since libcurl 7.57.0
+    if (curl_share_setopt(curlShHandle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK)
+    {
+        SYSLOG_ERR("curl_share_setopt CURL_LOCK_DATA_CONNECT");
+    }
+#endif
 
-        // CURLOPT_READFUNCTION and CURLOPT_READDATA in this context refers to
-        // data to be sent to the server... so curl will read data from us.
-        if(msgToSendPtr != NULL)
-        {
-            curlResult = curl_easy_setopt(curlHandle, CURLOPT_READFUNCTION, read_callback);
-            if (curlResult != CURLE_OK)
-            {
-                SYSLOG_ERR("%s CURLOPT_READFUNCTION", curl_easy_strerror(curlResult));
-                curlErrno = ENOEXEC;
-                goto out;
-            }
+    return curlShHandle;
+}
 
-            //creating the curl object
-            // TODO: not sure that setting a pointer to a pointer that is scoped elsewhere is correct.
-            outBoundCommInfo.buffer = msgToSendPtr;
-            outBoundCommInfo.size = msgToSendSize;
-            /* pointer to pass to our read function */
-            // here you must put the file info
-            curlResult = curl_easy_setopt(curlHandle, CURLOPT_READDATA, &outBoundCommInfo);
-            if (curlResult != CURLE_OK)
-            {
-                SYSLOG_ERR("%s CURLOPT_READDATA", curl_easy_strerror(curlResult));
-                curlErrno = ENOEXEC;
-                goto out;
-            }
-        }
+/**
+ * @brief   Called when closing the shared curl data structure. No connection may be
+ *              using it anymore.
+ *
+ * @return  none
+ **/
+void libhttpcomm_curlShareClose(CURLSH *curHandle)
+{
+    if (curHandle != NULL)
+    {
+        curl_share_cleanup(curHandle);
+    }
+}
 
-        // sets maximum size of our internal buffer
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_BUFFERSIZE, maxRxBufferSize);
-        if (curlResult != CURLE_OK)
+/**
+ * @brief   Reads the counters telling how often connections, name lookups and TLS
+ *              handshakes were avoided. Useful to confirm the caches are warm.
+ *
+ * @param   stats: destination of the counters
+ *
+ * @return  none
+ **/
+void libhttpcomm_getCacheStats(http_cache_stats_t *stats)
+{
+    assert(stats);
+
+    pthread_once(&sShareMutexOnce, _libhttpcomm_shareMutexInit);
+
+    pthread_mutex_lock(&sCacheStatsMutex);
+    *stats = sCacheStats;
+    pthread_mutex_unlock(&sCacheStatsMutex);
+}
+
+/**
+ * @brief   Updates the cache counters after a transfer. A transfer that reused an open
+ *              connection skipped the name lookup and the TLS handshake. On a new
+ *              connection, a name lookup answered within HTTPCOMM_DNS_CACHE_HIT_SEC is
+ *              counted as a DNS cache hit, since curl does not report cache hits itself.
+ *
+ * @param   curlHandle: curl handle that just performed a transfer
+ *
+ * @return  none
+ **/
+static void _libhttpcomm_updateCacheStats(CURL *curlHandle)
+{
+    long newConnections = 0;
+    double nameResolvingDuration = 0.0;
+    double connectDuration = 0.0;
+    double sslConnectDuration = 0.0;
+
+    if (curl_easy_getinfo(curlHandle, CURLINFO_NUM_CONNECTS, &newConnections) != CURLE_OK)
+    {
+        return;
+    }
+
+    curl_easy_getinfo(curlHandle, CURLINFO_NAMELOOKUP_TIME, &nameResolvingDuration);
+    curl_easy_getinfo(curlHandle, CURLINFO_CONNECT_TIME, &connectDuration);
+    curl_easy_getinfo(curlHandle, CURLINFO_APPCONNECT_TIME, &sslConnectDuration);
+
+    pthread_once(&sShareMutexOnce, _libhttpcomm_shareMutexInit);
+
+    pthread_mutex_lock(&sCacheStatsMutex);
+    if (newConnections == 0)
+    {
+        sCacheStats.connectionsReused++;
+    }
+    else if (connectDuration > 0.0)
+    {
+        sCacheStats.connectionsCreated += newConnections;
+
+        if (nameResolvingDuration < HTTPCOMM_DNS_CACHE_HIT_SEC)
         {
-            SYSLOG_ERR("%s CURLOPT_BUFFERSIZE", curl_easy_strerror(curlResult));
-            curlErrno = ENOEXEC;
-            goto out;
+            sCacheStats.dnsHits++;
+        }
+        else
+        {
+            sCacheStats.dnsMisses++;
         }
 
-        // CURLOPT_WRITEFUNCTION and CURLOPT_WRITEDATA in this context refers to
-        // data received from the server... so curl will write data to us.
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, writer);
-        if (curlResult != CURLE_OK)
+        if (sslConnectDuration > 0.0)
         {
-            SYSLOG_ERR("%s CURLOPT_WRITEFUNCTION", curl_easy_strerror(curlResult));
-            curlErrno = ENOEXEC;
-            goto out;
+            sCacheStats.sslHandshakes++;
         }
+    }
+    pthread_mutex_unlock(&sCacheStatsMutex);
+}
+
+/**
+ * @brief   Loads the trusted certificates into memory, so the TLS handshakes of new
+ *              connections don't read them from the filesystem again. Connections load
+ *              them by themselves on their first handshake, calling this beforehand only
+ *              takes the work out of the first request. The certificates are loaded
+ *              again when the file changes, which is checked at most every
+ *              HTTPCOMM_CA_STORE_CHECK_SEC seconds.
+ *
+ * @param   sslCertPath: PEM file, or directory of PEM files, given to the requests
+ *
+ * @return  true if the certificates are loaded, false otherwise
+ **/
+bool libhttpcomm_loadCaStore(const char *sslCertPath)
+{
+    X509_STORE *store;
+
+    assert(sslCertPath);
+
+    store = _libhttpcomm_caStoreGet(sslCertPath, true);
+    if (store == NULL)
+    {
+        return false;
+    }
+
+    X509_STORE_free(store);
+    return true;
+}
 
-        inBoundCommInfo.buffer = rxBuffer;
-        inBoundCommInfo.size = maxRxBufferSize;
+/**
+ * @brief   Releases the trusted certificates loaded in memory. The TLS contexts of open
+ *              connections keep their own reference.
+ *
+ * @return  none
+ **/
+void libhttpcomm_unloadCaStore(void)
+{
+    pthread_once(&sShareMutexOnce, _libhttpcomm_shareMutexInit);
+
+    pthread_mutex_lock(&sCaStoreMutex);
+    if (sCaStore != NULL)
+    {
+        X509_STORE_free(sCaStore);
+        sCaStore = NULL;
+    }
+    sCaStorePath[0] = '\0';
+    pthread_mutex_unlock(&sCaStoreMutex);
+}
+
+/**
+ * @brief   Points the TLS contexts of a curl handle to the shared CA store. When libcurl
+ *              is not built with OpenSSL, it reads the certificates by itself instead.
+ *              curl's default CA bundle is not read either: peers are not verified
+ *              when a certificate is given.
+ *
+ * @param   curlHandle: curl handle to configure
+ * @param   sslCertPath: certificate path, owned by the configuration cache of the handle,
+ *              NULL if none
+ *
+ * @return  true for success, false for failure
+ **/
+static bool _libhttpcomm_setCaStore(CURL *curlHandle, const char *sslCertPath)
+{
+    const char *caPath = NULL;
+    CURLcode curlResult;
 
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &inBoundCommInfo);
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_SSL_CTX_FUNCTION,
+            (sslCertPath != NULL) ? _libhttpcomm_sslContext : NULL);
+    if (curlResult == CURLE_NOT_BUILT_IN || curlResult == CURLE_UNKNOWN_OPTION)
+    {
+        caPath = sslCertPath;
+    }
+    else if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_SSL_CTX_FUNCTION", curl_easy_strerror(curlResult));
+        return false;
+    }
+    else
+    {
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_SSL_CTX_DATA, sslCertPath);
         if (curlResult != CURLE_OK)
         {
-            SYSLOG_ERR("%s CURLOPT_WRITEDATA", curl_easy_strerror(curlResult));
-            curlErrno = ENOEXEC;
-            goto out;
+            SYSLOG_ERR("%s CURLOPT_SSL_CTX_DATA", curl_easy_strerror(curlResult));
+            return false;
         }
 
-        curlResult = curl_easy_perform(curlHandle);
+        if (sslCertPath != NULL)
+        {
+            curlResult = curl_easy_setopt(curlHandle, CURLOPT_CAINFO, NULL);
+            if (curlResult != CURLE_OK)
+            {
+                SYSLOG_ERR("%s CURLOPT_CAINFO", curl_easy_strerror(curlResult));
+                return false;
+            }
+        }
+    }
 
-        curl_easy_getinfo(curlHandle, CURLINFO_APPCONNECT_TIME, &connectDuration );
-        curl_easy_getinfo(curlHandle, CURLINFO_NAMELOOKUP_TIME, &nameResolvingDuration );
-        curl_easy_getinfo(curlHandle, CURLINFO_TOTAL_TIME, &transferDuration );
-        curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &httpResponseCode );
-        curl_easy_getinfo(curlHandle, CURLINFO_HTTP_CONNECTCODE, &httpConnectCode );
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_CAPATH, caPath);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_CAPATH", curl_easy_strerror(curlResult));
+        return false;
+    }
 
-        if (httpResponseCode >= 300 || httpConnectCode >= 300)
+    return true;
+}
+
+/**
+ * @brief   Called by curl when it creates the TLS context of a new connection
+ *              (CURLOPT_SSL_CTX_FUNCTION). Hands it a reference to the shared CA store.
+ *
+ * @param   curlHandle: curl handle opening the connection
+ * @param   sslContext: SSL_CTX of the connection
+ * @param   userData: certificate path -> inputted by CURLOPT_SSL_CTX_DATA
+ *
+ * @return  CURLE_OK, the handshake goes on without certificates if they can't be loaded
+ **/
+static CURLcode _libhttpcomm_sslContext(CURL *curlHandle, void *sslContext, void *userData)
+{
+    X509_STORE *store;
+
+    store = _libhttpcomm_caStoreGet((const char *) userData, false);
+    if (store != NULL)
+    {
+        // the context takes over the reference
+        SSL_CTX_set_cert_store((SSL_CTX *) sslContext, store);
+    }
+
+    return CURLE_OK;
+}
+
+/**
+ * @brief   Gets the CA store of a certificate path, loading it if it isn't yet, or if
+ *              the file changed since it was loaded. The file is looked at no more than
+ *              every HTTPCOMM_CA_STORE_CHECK_SEC seconds, unless forced. If it can't be
+ *              loaded anymore, the certificates loaded before are still used.
+ *
+ * @param   path: certificate file or directory
+ * @param   force: true to look at the file now
+ *
+ * @return  a new reference to the CA store, to release with X509_STORE_free(),
+ *              NULL if the certificates couldn't be loaded
+ **/
+static X509_STORE *_libhttpcomm_caStoreGet(const char *path, bool force)
+{
+    X509_STORE *store = NULL;
+    struct stat fileStat;
+    struct timespec now;
+
+    pthread_once(&sShareMutexOnce, _libhttpcomm_shareMutexInit);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&sCaStoreMutex);
+    if (strcmp(sCaStorePath, path) != 0)
+    {
+        // another certificate, the store of the previous one doesn't apply
+        if (sCaStore != NULL)
         {
-            if (params.verbose == true) SYSLOG_ERR("HTTP error response code:%ld, connect code:%ld", httpResponseCode, httpConnectCode);
-            curlErrno = EHOSTUNREACH;
-            goto out;
+            X509_STORE_free(sCaStore);
+            sCaStore = NULL;
         }
+        snprintf(sCaStorePath, sizeof(sCaStorePath), "%s", path);
+        force = true;
+    }
 
-        if (curlResult != CURLE_OK)
+    if (force == true || now.tv_sec - sCaStoreCheckedSec >= HTTPCOMM_CA_STORE_CHECK_SEC)
+    {
+        sCaStoreCheckedSec = now.tv_sec;
+
+        if (stat(path, &fileStat) != 0)
         {
-            if (curlResult != CURLE_ABORTED_BY_CALLBACK)
+            SYSLOG_ERR("stat %s: %s", path, strerror(errno));
+        }
+        else if (sCaStore == NULL || fileStat.st_ino != sCaStoreStat.st_ino
+                || fileStat.st_dev != sCaStoreStat.st_dev || fileStat.st_mtime != sCaStoreStat.st_mtime
+                || fileStat.st_size != sCaStoreStat.st_size)
+        {
+            store = _libhttpcomm_caStoreRead(path, &fileStat);
+            if (store != NULL)
             {
-                if (curl_easy_getinfo(curlHandle, CURLINFO_OS_ERRNO, &curlErrno) != CURLE_OK)
+                if (sCaStore != NULL)
                 {
-                    curlErrno = ENOEXEC;
-                    SYSLOG_ERR("curl_easy_getinfo");
+                    X509_STORE_free(sCaStore);
                 }
-                if (curlResult == CURLE_OPERATION_TIMEDOUT) curlErrno = ETIMEDOUT; /// time out error must be distinctive
-                else if (curlErrno == 0) curlErrno = ENOEXEC; /// can't be equalt to 0 if curlResult != CURLE_OK
+                sCaStore = store;
+                sCaStoreStat = fileStat;
 
-                if (params.verbose == true) SYSLOG_WARNING("%s, %s for url %s",
-                        curl_easy_strerror(curlResult), strerror((int)curlErrno), url);
-            }else
-            {
-                curlErrno = EAGAIN;
-                if (params.verbose == true) SYSLOG_DEBUG("quitting curl transfer");
+                pthread_mutex_lock(&sCacheStatsMutex);
+                sCacheStats.caStoreLoads++;
+                pthread_mutex_unlock(&sCacheStatsMutex);
+
+                SYSLOG_INFO("Loaded the trusted certificates of %s", path);
             }
-            goto out;
-        }else if (params.verbose == true)
+        }
+    }
+
+    store = sCaStore;
+    if (store != NULL)
+    {
+        X509_STORE_up_ref(store);
+    }
+    pthread_mutex_unlock(&sCaStoreMutex);
+
+    return store;
+}
+
+/**
+ * @brief   Reads the certificates of a PEM file, or of every PEM file of a directory,
+ *              into a new CA store
+ *
+ * @param   path: certificate file or directory
+ * @param   fileStat: status of path
+ *
+ * @return  the CA store, NULL if no certificate could be read
+ **/
+static X509_STORE *_libhttpcomm_caStoreRead(const char *path, const struct stat *fileStat)
+{
+    X509_STORE *store;
+    X509_LOOKUP *lookup;
+    DIR *directory;
+    struct dirent *entry;
+    char fileName[PATH_MAX];
+    int loaded = 0;
+
+    store = X509_STORE_new();
+    if (store == NULL)
+    {
+        SYSLOG_ERR("X509_STORE_new");
+        return NULL;
+    }
+
+    lookup = X509_STORE_add_lookup(store, X509_LOOKUP_file());
+    if (lookup == NULL)
+    {
+        SYSLOG_ERR("X509_STORE_add_lookup");
+        X509_STORE_free(store);
+        return NULL;
+    }
+
+    if (S_ISDIR(fileStat->st_mode))
+    {
+        directory = opendir(path);
+        if (directory != NULL)
         {
-            if (nameResolvingDuration >= 2.0)
+            while ((entry = readdir(directory)) != NULL)
             {
-                SYSLOG_WARNING("connectDuration=%.2lf, nameResolvingDuration=%.2lf, transferDuration=%.2lf, "
-                        "httpConnectCode=%ld",
-                        connectDuration, nameResolvingDuration, transferDuration, httpConnectCode);
-            }
-            else
-            {
-                SYSLOG_DEBUG("connectDuration=%.2lf, nameResolvingDuration=%.2lf, transferDuration=%.2lf, "
-                        "httpConnectCode=%ld",
-                        connectDuration, nameResolvingDuration, transferDuration, httpConnectCode);
+                if (entry->d_name[0] == '.'
+                        || snprintf(fileName, sizeof(fileName), "%s/%s", path, entry->d_name) >= (int) sizeof(fileName))
+                {
+                    continue;
+                }
+
+                // the same certificate may be linked under several names, that's fine
+                loaded += X509_LOOKUP_load_file(lookup, fileName, X509_FILETYPE_PEM) > 0;
             }
+            closedir(directory);
+        }
+    }
+    else
+    {
+        loaded = X509_LOOKUP_load_file(lookup, path, X509_FILETYPE_PEM) > 0;
+    }
+    ERR_clear_error();
+
+    if (loaded == 0)
+    {
+        SYSLOG_ERR("No certificate in %s", path);
+        X509_STORE_free(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+/**
+ * @brief   Adds a host to the resolver, which looks it up in the background and gives its
+ *              address to the requests made to it. A reconnection then never waits for a
+ *              name lookup, and the last known good address is still used when the DNS
+ *              server can't be reached. The resolver thread is started with the first host.
+ *
+ * @param   url: url of the host, or its name
+ *
+ * @return  true if the host is resolved in the background, false otherwise
+ **/
+bool libhttpcomm_resolverAdd(const char *url)
+{
+    char name[HTTPCOMM_HOST_STRING_SIZE];
+    unsigned char literal[sizeof(struct in6_addr)];
+    bool added = true;
+    int i;
+
+    assert(url);
+
+    if (_libhttpcomm_getHostName(url, name, sizeof(name)) < 0 || name[0] == '\0')
+    {
+        SYSLOG_ERR("No host name in %s", url);
+        return false;
+    }
+
+    if (inet_pton(AF_INET, name, literal) == 1 || inet_pton(AF_INET6, name, literal) == 1)
+    {
+        // nothing to look up
+        return true;
+    }
+
+    pthread_once(&sShareMutexOnce, _libhttpcomm_shareMutexInit);
+
+    pthread_mutex_lock(&sResolverMutex);
+    for (i = 0; i < sResolverHostCount; i++)
+    {
+        if (strcmp(sResolverHosts[i].name, name) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == sResolverHostCount)
+    {
+        if (sResolverHostCount == HTTPCOMM_RESOLVER_MAX_HOSTS)
+        {
+            SYSLOG_ERR("Too many hosts to resolve, %s isn't", name);
+            added = false;
+        }
+        else
+        {
+            memset(&sResolverHosts[i], 0, sizeof(struct HttpResolverHost));
+            snprintf(sResolverHosts[i].name, sizeof(sResolverHosts[i].name), "%s", name);
+            sResolverHostCount++;
+        }
+    }
+
+    if (added == true && sResolverRunning == false)
+    {
+        if (pthread_create(&sResolverThread, NULL, _libhttpcomm_resolverThread, NULL) != 0)
+        {
+            SYSLOG_ERR("pthread_create: %s", strerror(errno));
+            added = false;
+        }
+        else
+        {
+            sResolverRunning = true;
         }
+    }
+    pthread_cond_signal(&sResolverCond);
+    pthread_mutex_unlock(&sResolverMutex);
+
+    return added;
+}
+
+/**
+ * @brief   Stops the resolver and forgets its hosts. The requests made afterwards look
+ *              their hosts up through curl again.
+ *
+ * @return  none
+ **/
+void libhttpcomm_resolverStop(void)
+{
+    bool running;
+
+    pthread_once(&sShareMutexOnce, _libhttpcomm_shareMutexInit);
+
+    pthread_mutex_lock(&sResolverMutex);
+    running = sResolverRunning;
+    sResolverStopping = true;
+    pthread_cond_signal(&sResolverCond);
+    pthread_mutex_unlock(&sResolverMutex);
+
+    if (running == true)
+    {
+        // a lookup in progress is not interrupted, the thread stops after it
+        pthread_join(sResolverThread, NULL);
+    }
+
+    pthread_mutex_lock(&sResolverMutex);
+    sResolverHostCount = 0;
+    sResolverRunning = false;
+    sResolverStopping = false;
+    pthread_mutex_unlock(&sResolverMutex);
+}
+
+/**
+ * @brief   Gives curl the address the resolver found for the host of a request
+ *              (CURLOPT_RESOLVE). It is put in curl's DNS cache before each transfer,
+ *              so the cache entry can't expire between two requests.
+ *
+ * @param   curlHandle: curl handle to configure
+ * @param   config: configuration cache of the handle, holds the line given to curl
+ * @param   url: url of the request
+ *
+ * @return  true for success, false for failure
+ **/
+static bool _libhttpcomm_resolverFeed(CURL *curlHandle, struct HttpConfigCache *config, const char *url)
+{
+    char name[HTTPCOMM_HOST_STRING_SIZE];
+    CURLcode curlResult;
+    int port;
+    int i;
+
+    pthread_once(&sShareMutexOnce, _libhttpcomm_shareMutexInit);
+
+    port = _libhttpcomm_getHostName(url, name, sizeof(name));
+
+    pthread_mutex_lock(&sResolverMutex);
+    for (i = 0; i < sResolverHostCount; i++)
+    {
+        if (sResolverHosts[i].address[0] != '\0' && strcmp(sResolverHosts[i].name, name) == 0)
+        {
+            snprintf(config->resolve, sizeof(config->resolve), "%s:%d:%s", name, port, sResolverHosts[i].address);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sResolverMutex);
+
+    if (port < 0 || i == sResolverHostCount)
+    {
+        if (config->resolveLine.data == NULL)
+        {
+            return true;
+        }
+
+        // curl looks this host up by itself
+        config->resolveLine.data = NULL;
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_RESOLVE, NULL);
+    }
+    else
+    {
+        config->resolveLine.data = config->resolve;
+        config->resolveLine.next = NULL;
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_RESOLVE, &config->resolveLine);
+    }
+
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_RESOLVE", curl_easy_strerror(curlResult));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief   Resolver thread. Looks the hosts up again every HTTPCOMM_RESOLVER_REFRESH_SEC
+ *              seconds, or every HTTPCOMM_RESOLVER_RETRY_SEC seconds while the lookups
+ *              fail, keeping their last known good address meanwhile.
+ *
+ * @param   params: unused
+ *
+ * @return  NULL
+ **/
+static void *_libhttpcomm_resolverThread(void *params)
+{
+    char name[HTTPCOMM_HOST_STRING_SIZE];
+    char address[INET6_ADDRSTRLEN];
+    struct timespec now;
+    struct timespec wakeUp;
+    bool resolved;
+    int i;
+
+    pthread_mutex_lock(&sResolverMutex);
+    while (sResolverStopping == false)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        wakeUp.tv_sec = now.tv_sec + HTTPCOMM_RESOLVER_REFRESH_SEC;
+        wakeUp.tv_nsec = 0;
+
+        // hosts are only added while the thread runs, so i stays valid while unlocked
+        for (i = 0; i < sResolverHostCount && sResolverStopping == false; i++)
+        {
+            if (sResolverHosts[i].refreshSec > now.tv_sec)
+            {
+                if (sResolverHosts[i].refreshSec < wakeUp.tv_sec)
+                {
+                    wakeUp.tv_sec = sResolverHosts[i].refreshSec;
+                }
+                continue;
+            }
+
+            strcpy(name, sResolverHosts[i].name);
+            pthread_mutex_unlock(&sResolverMutex);
+            resolved = _libhttpcomm_resolve(name, address, sizeof(address));
+            pthread_mutex_lock(&sResolverMutex);
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (resolved == true)
+            {
+                if (strcmp(sResolverHosts[i].address, address) != 0)
+                {
+                    SYSLOG_INFO("%s is at %s", name, address);
+                    strcpy(sResolverHosts[i].address, address);
+                }
+                sResolverHosts[i].refreshSec = now.tv_sec + HTTPCOMM_RESOLVER_REFRESH_SEC;
+            }
+            else
+            {
+                if (sResolverHosts[i].address[0] != '\0')
+                {
+                    SYSLOG_WARNING("Couldn't look %s up, still using %s", name, sResolverHosts[i].address);
+                }
+                sResolverHosts[i].refreshSec = now.tv_sec + HTTPCOMM_RESOLVER_RETRY_SEC;
+            }
+
+            if (sResolverHosts[i].refreshSec < wakeUp.tv_sec)
+            {
+                wakeUp.tv_sec = sResolverHosts[i].refreshSec;
+            }
+
+            pthread_mutex_lock(&sCacheStatsMutex);
+            if (resolved == true)
+            {
+                sCacheStats.dnsPrefetches++;
+            }
+            else
+            {
+                sCacheStats.dnsPrefetchFailures++;
+            }
+            pthread_mutex_unlock(&sCacheStatsMutex);
+        }
+
+        if (sResolverStopping == false)
+        {
+            pthread_cond_timedwait(&sResolverCond, &sResolverMutex, &wakeUp);
+        }
+    }
+    pthread_mutex_unlock(&sResolverMutex);
+
+    return NULL;
+}
+
+/**
+ * @brief   Looks a host up, the way curl would
+ *
+ * @param   name: host name
+ * @param   address: destination of the first address found
+ * @param   addressSize: size of address, at least INET6_ADDRSTRLEN
+ *
+ * @return  true if the host was found, false otherwise
+ **/
+static bool _libhttpcomm_resolve(const char *name, char *address, int addressSize)
+{
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    const void *binary;
+    int error;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    error = getaddrinfo(name, NULL, &hints, &result);
+    if (error != 0 || result == NULL)
+    {
+        SYSLOG_ERR("getaddrinfo %s: %s", name, gai_strerror(error));
+        return false;
+    }
+
+    if (result->ai_family == AF_INET6)
+    {
+        binary = &((struct sockaddr_in6 *) result->ai_addr)->sin6_addr;
+    }
+    else
+    {
+        binary = &((struct sockaddr_in *) result->ai_addr)->sin_addr;
+    }
+
+    if (inet_ntop(result->ai_family, binary, address, addressSize) == NULL)
+    {
+        SYSLOG_ERR("inet_ntop: %s", strerror(errno));
+        freeaddrinfo(result);
+        return false;
+    }
+
+    freeaddrinfo(result);
+    return true;
+}
+
+/**
+ * @brief   Reads the metrics of every endpoint requested so far: timings, bytes,
+ *              response codes and outcomes. They are recorded for every request, so
+ *              tail latencies can be watched without turning on verbose logs.
+ *
+ * @param   metrics: destination of the metrics, one per endpoint
+ * @param   maxEndpoints: number of elements in metrics
+ *
+ * @return  the number of endpoints copied into metrics
+ **/
+int libhttpcomm_getMetrics(http_endpoint_metrics_t *metrics, int maxEndpoints)
+{
+    int total;
+
+    assert(metrics);
+
+    pthread_once(&sShareMutexOnce, _libhttpcomm_shareMutexInit);
+
+    pthread_mutex_lock(&sMetricsMutex);
+    total = (sMetricsEndpoints < maxEndpoints) ? sMetricsEndpoints : maxEndpoints;
+    if (total > 0)
+    {
+        memcpy(metrics, sMetrics, total * sizeof(http_endpoint_metrics_t));
+    }
+    pthread_mutex_unlock(&sMetricsMutex);
+
+    return total;
+}
+
+/**
+ * @brief   Forgets the metrics of every endpoint, to start a new measurement period
+ *
+ * @return  none
+ **/
+void libhttpcomm_resetMetrics(void)
+{
+    pthread_once(&sShareMutexOnce, _libhttpcomm_shareMutexInit);
+
+    pthread_mutex_lock(&sMetricsMutex);
+    memset(sMetrics, 0, sizeof(sMetrics));
+    sMetricsEndpoints = 0;
+    pthread_mutex_unlock(&sMetricsMutex);
+}
+
+/**
+ * @brief   Estimates a percentile of a latency histogram
+ *
+ * @param   histogram: histogram of an endpoint
+ * @param   percentile: 50 for the median, 99 for the tail latency...
+ *
+ * @return  the upper bound in ms of the bucket holding the percentile, never more than
+ *              the largest duration recorded. 0 if the histogram is empty.
+ **/
+long libhttpcomm_histogramPercentileMs(const http_histogram_t *histogram, double percentile)
+{
+    unsigned long rank;
+    unsigned long seen = 0;
+    long upperBoundMs;
+    int i;
+
+    assert(histogram);
+
+    if (histogram->samples == 0)
+    {
+        return 0;
+    }
+
+    rank = (unsigned long) ((percentile * histogram->samples + 99.0) / 100.0);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    for (i = 0; i < HTTPCOMM_METRICS_BUCKETS - 1; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            break;
+        }
+    }
+
+    upperBoundMs = 1L << i;
+    if (i == HTTPCOMM_METRICS_BUCKETS - 1 || upperBoundMs > (long) histogram->maxMs)
+    {
+        upperBoundMs = (long) (histogram->maxMs + 0.5);
+    }
+    return upperBoundMs;
+}
+
+/**
+ * @brief   Records the timings, sizes and outcome of a transfer into the metrics of
+ *              its endpoint
+ *
+ * @param   curlHandle: curl handle that just performed a transfer
+ * @param   httpMethod: CURLOPT_POST or CURLOPT_HTTPGET
+ * @param   curlResult: result of the transfer
+ *
+ * @return  none
+ **/
+static void _libhttpcomm_updateMetrics(CURL *curlHandle, CURLoption httpMethod, CURLcode curlResult)
+{
+    http_endpoint_metrics_t *metrics = NULL;
+    const char *method = (httpMethod == CURLOPT_POST) ? "POST" : "GET";
+    char endpoint[HTTPCOMM_HOST_STRING_SIZE];
+    char *url = NULL;
+    double nameLookup = 0.0;
+    double connect = 0.0;
+    double appConnect = 0.0;
+    double firstByte = 0.0;
+    double total = 0.0;
+    double bytesUp = 0.0;
+    double bytesDown = 0.0;
+    long httpResponseCode = 0;
+    http_outcome_e outcome;
+    int i;
+
+    curl_easy_getinfo(curlHandle, CURLINFO_EFFECTIVE_URL, &url);
+    curl_easy_getinfo(curlHandle, CURLINFO_NAMELOOKUP_TIME, &nameLookup);
+    curl_easy_getinfo(curlHandle, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(curlHandle, CURLINFO_APPCONNECT_TIME, &appConnect);
+    curl_easy_getinfo(curlHandle, CURLINFO_STARTTRANSFER_TIME, &firstByte);
+    curl_easy_getinfo(curlHandle, CURLINFO_TOTAL_TIME, &total);
+    curl_easy_getinfo(curlHandle, CURLINFO_SIZE_UPLOAD, &bytesUp);
+    curl_easy_getinfo(curlHandle, CURLINFO_SIZE_DOWNLOAD, &bytesDown);
+    curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &httpResponseCode);
+
+    // the query string holds ids and timeouts, it doesn't make another endpoint
+    snprintf(endpoint, sizeof(endpoint), "%s", (url != NULL) ? url : "");
+    endpoint[strcspn(endpoint, "?")] = '\0';
+
+    if (httpResponseCode >= 300)
+    {
+        outcome = HTTPCOMM_OUTCOME_HTTP_ERROR;
+    }
+    else
+    {
+        switch (curlResult)
+        {
+        case CURLE_OK:
+            outcome = HTTPCOMM_OUTCOME_SUCCESS;
+            break;
+        case CURLE_OPERATION_TIMEDOUT:
+            outcome = HTTPCOMM_OUTCOME_TIMEOUT;
+            break;
+        case CURLE_ABORTED_BY_CALLBACK:
+        case CURLE_WRITE_ERROR:
+        case CURLE_READ_ERROR:
+            outcome = HTTPCOMM_OUTCOME_ABORTED;
+            break;
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_RESOLVE_PROXY:
+            outcome = HTTPCOMM_OUTCOME_DNS;
+            break;
+        case CURLE_COULDNT_CONNECT:
+            outcome = HTTPCOMM_OUTCOME_CONNECT;
+            break;
+        case CURLE_SSL_CONNECT_ERROR:
+        case CURLE_PEER_FAILED_VERIFICATION:
+#if LIBCURL_VERSION_NUM < 0x073e00
+        // the same code as CURLE_PEER_FAILED_VERIFICATION since libcurl 7.62.0
+        case CURLE_SSL_CACERT:
+#endif
+        case CURLE_SSL_CERTPROBLEM:
+        case CURLE_SSL_CIPHER:
+        case CURLE_SSL_CACERT_BADFILE:
+            outcome = HTTPCOMM_OUTCOME_TLS;
+            break;
+        default:
+            outcome = HTTPCOMM_OUTCOME_NETWORK;
+            break;
+        }
+    }
+
+    pthread_once(&sShareMutexOnce, _libhttpcomm_shareMutexInit);
+
+    pthread_mutex_lock(&sMetricsMutex);
+    for (i = 0; i < sMetricsEndpoints; i++)
+    {
+        if (strcmp(sMetrics[i].method, method) == 0 && strcmp(sMetrics[i].endpoint, endpoint) == 0)
+        {
+            metrics = &sMetrics[i];
+            break;
+        }
+    }
+
+    if (metrics == NULL)
+    {
+        if (sMetricsEndpoints < HTTPCOMM_METRICS_MAX_ENDPOINTS - 1)
+        {
+            metrics = &sMetrics[sMetricsEndpoints++];
+            snprintf(metrics->method, sizeof(metrics->method), "%s", method);
+            snprintf(metrics->endpoint, sizeof(metrics->endpoint), "%s", endpoint);
+        }
+        else
+        {
+            // the overflow slot has no method nor endpoint
+            metrics = &sMetrics[HTTPCOMM_METRICS_MAX_ENDPOINTS - 1];
+            sMetricsEndpoints = HTTPCOMM_METRICS_MAX_ENDPOINTS;
+        }
+    }
+
+    metrics->requests++;
+    metrics->bytesUp += (unsigned long long) bytesUp;
+    metrics->bytesDown += (unsigned long long) bytesDown;
+    metrics->outcomes[outcome]++;
+    if (httpResponseCode / 100 < HTTPCOMM_METRICS_HTTP_CLASSES)
+    {
+        metrics->httpCodes[httpResponseCode / 100]++;
+    }
+
+    _libhttpcomm_histogramAdd(&metrics->nameLookup, nameLookup);
+    _libhttpcomm_histogramAdd(&metrics->connect, connect);
+    _libhttpcomm_histogramAdd(&metrics->appConnect, appConnect);
+    _libhttpcomm_histogramAdd(&metrics->firstByte, firstByte);
+    _libhttpcomm_histogramAdd(&metrics->total, total);
+    pthread_mutex_unlock(&sMetricsMutex);
+}
+
+/**
+ * @brief   Counts a duration in its histogram bucket
+ *
+ * @param   histogram: histogram to update
+ * @param   durationSec: duration in seconds, as curl reports it
+ *
+ * @return  none
+ **/
+static void _libhttpcomm_histogramAdd(http_histogram_t *histogram, double durationSec)
+{
+    double durationMs = durationSec * 1000.0;
+    int bucket = 0;
+
+    while (bucket < HTTPCOMM_METRICS_BUCKETS - 1 && durationMs >= (double) (1L << bucket))
+    {
+        bucket++;
+    }
+
+    histogram->buckets[bucket]++;
+    histogram->samples++;
+    histogram->sumMs += durationMs;
+    if (durationMs > histogram->maxMs)
+    {
+        histogram->maxMs = durationMs;
+    }
+}
+
+/**
+ * @brief   Wraps a buffer owned by the caller to receive a message. The buffer never
+ *              grows: a message that doesn't fit in it fails the transfer.
+ *
+ * @param   rx: receive buffer to initialize
+ * @param   buffer: memory receiving the message
+ * @param   size: size of buffer in bytes, including the terminating null byte
+ *
+ * @return  none
+ */
+void libhttpcomm_rxBufferInit(http_rxbuffer_t *rx, char *buffer, size_t size)
+{
+    assert(rx);
+    assert(buffer);
+    assert(size > 0);
+
+    rx->buffer = buffer;
+    rx->size = size;
+    rx->maxSize = size;
+    rx->growable = false;
+    rx->sink = NULL;
+    rx->sinkUserData = NULL;
+    libhttpcomm_rxBufferReset(rx);
+}
+
+/**
+ * @brief   Allocates a receive buffer that doubles in size as the message comes in,
+ *              up to maxSize bytes. Must be released with libhttpcomm_rxBufferFree().
+ *
+ * @param   rx: receive buffer to initialize
+ * @param   initialSize: bytes allocated now
+ * @param   maxSize: largest size the buffer can grow to
+ *
+ * @return  true for success, false for failure
+ */
+bool libhttpcomm_rxBufferAlloc(http_rxbuffer_t *rx, size_t initialSize, size_t maxSize)
+{
+    assert(rx);
+
+    if (initialSize == 0)
+    {
+        initialSize = 1;
+    }
+
+    if (maxSize < initialSize)
+    {
+        maxSize = initialSize;
+    }
+
+    rx->sink = NULL;
+    rx->sinkUserData = NULL;
+    rx->truncated = false;
+
+    rx->buffer = (char *) malloc(initialSize);
+    if (rx->buffer == NULL)
+    {
+        SYSLOG_ERR("malloc: %s", strerror(errno));
+        rx->size = 0;
+        rx->maxSize = 0;
+        rx->length = 0;
+        return false;
+    }
+
+    rx->size = initialSize;
+    rx->maxSize = maxSize;
+    rx->growable = true;
+    libhttpcomm_rxBufferReset(rx);
+    return true;
+}
+
+/**
+ * @brief   Releases the memory of a buffer created by libhttpcomm_rxBufferAlloc().
+ *              Buffers wrapped by libhttpcomm_rxBufferInit() are left to their owner.
+ *
+ * @param   rx: receive buffer to release
+ *
+ * @return  none
+ */
+void libhttpcomm_rxBufferFree(http_rxbuffer_t *rx)
+{
+    if (rx == NULL)
+    {
+        return;
+    }
+
+    if (rx->growable == true)
+    {
+        free(rx->buffer);
+    }
+    rx->buffer = NULL;
+    rx->size = 0;
+    rx->maxSize = 0;
+    rx->length = 0;
+}
+
+/**
+ * @brief   Empties a receive buffer so it can receive the next message. Memory that
+ *              was grown is kept.
+ *
+ * @param   rx: receive buffer to empty
+ *
+ * @return  none
+ */
+void libhttpcomm_rxBufferReset(http_rxbuffer_t *rx)
+{
+    assert(rx);
+
+    rx->length = 0;
+    rx->truncated = false;
+    if (rx->buffer != NULL)
+    {
+        rx->buffer[0] = '\0';
+    }
+}
+
+/**
+ * @brief   Hands each chunk of the messages received in a buffer to a sink as soon as
+ *              it arrives, so the message can be consumed before the transfer is over.
+ *              A message that outgrows the buffer then no longer fails the transfer:
+ *              the sink gets all of it and the buffer is marked truncated.
+ *
+ * @param   rx: receive buffer
+ * @param   sink: consumer of the chunks, NULL to stop streaming
+ * @param   userData: passed to the sink
+ *
+ * @return  none
+ */
+void libhttpcomm_rxBufferSetSink(http_rxbuffer_t *rx, http_sink_t sink, void *userData)
+{
+    assert(rx);
+
+    rx->sink = sink;
+    rx->sinkUserData = userData;
+}
+
+/**
+ * @brief   Makes room for neededSize bytes in a growable receive buffer. The size is
+ *              doubled so that receiving a message in many chunks stays linear.
+ *
+ * @param   rx: receive buffer to grow
+ * @param   neededSize: bytes needed, including the terminating null byte
+ *
+ * @return  true if the buffer is large enough, false otherwise
+ */
+static bool _libhttpcomm_rxBufferGrow(http_rxbuffer_t *rx, size_t neededSize)
+{
+    size_t newSize = rx->size;
+    char *newBuffer = NULL;
+
+    if (rx->growable == false || neededSize > rx->maxSize)
+    {
+        return false;
+    }
+
+    while (newSize < neededSize)
+    {
+        newSize *= 2;
+    }
+
+    if (newSize > rx->maxSize)
+    {
+        newSize = rx->maxSize;
+    }
+
+    newBuffer = (char *) realloc(rx->buffer, newSize);
+    if (newBuffer == NULL)
+    {
+        SYSLOG_ERR("realloc: %s", strerror(errno));
+        return false;
+    }
+
+    rx->buffer = newBuffer;
+    rx->size = newSize;
+    return true;
+}
+
+/**
+ * @brief   Opens a session that keeps pre-configured connections to upstream hosts
+ *              alive across requests, so consecutive requests to the same host reuse
+ *              the same TCP (and TLS) connection instead of handshaking every time.
+ *
+ * @param   shareCurlHandle: curl handle shared across connections, NULL if none
+ *
+ * @return  the new session, NULL on failure
+ */
+libhttpcomm_session_t *libhttpcomm_sessionOpen(CURLSH *shareCurlHandle)
+{
+    libhttpcomm_session_t *session = NULL;
+
+    session = (libhttpcomm_session_t *) calloc(1, sizeof(libhttpcomm_session_t));
+    if (session == NULL)
+    {
+        SYSLOG_ERR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_init(&session->mutex, NULL);
+    session->shareCurlHandle = shareCurlHandle;
+    return session;
+}
+
+/**
+ * @brief   Closes a session and all the connections it owns
+ *
+ * @param   session: session returned by libhttpcomm_sessionOpen
+ *
+ * @return  none
+ */
+void libhttpcomm_sessionClose(libhttpcomm_session_t *session)
+{
+    int i;
+
+    if (session == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&session->mutex);
+    for (i = 0; i < HTTPCOMM_SESSION_MAX_HANDLES; i++)
+    {
+        if (session->handles[i].curlHandle != NULL)
+        {
+            if (session->handles[i].inUse == true)
+            {
+                SYSLOG_WARNING("closing a session while a transfer is in progress");
+            }
+            curl_easy_cleanup(session->handles[i].curlHandle);
+            session->handles[i].curlHandle = NULL;
+        }
+        _libhttpcomm_configFree(&session->handles[i].config);
+        free(session->handles[i].compressed.buffer);
+    }
+    pthread_mutex_unlock(&session->mutex);
+
+    pthread_mutex_destroy(&session->mutex);
+    free(session->dictionary);
+    free(session);
+}
+
+/**
+ * @brief   Compresses the messages sent through a session, and lets the server
+ *              compress its responses. Messages smaller than HTTPCOMM_COMPRESSION_MIN_SIZE
+ *              are sent as they are.
+ *
+ *              A preset dictionary holding the strings the messages are made of lets
+ *              even short messages compress well, but the server must inflate them with
+ *              the same dictionary. It is only used by HTTPCOMM_ENCODING_DEFLATE: the gzip
+ *              format has no way to tell the server a dictionary was used.
+ *
+ * @param   session: session returned by libhttpcomm_sessionOpen
+ * @param   encoding: Content-Encoding of the messages, HTTPCOMM_ENCODING_IDENTITY for none
+ * @param   dictionary: preset dictionary, most frequent strings last, NULL if none
+ * @param   dictionaryLength: size of the dictionary in bytes
+ *
+ * @return  true for success, false for failure
+ */
+bool libhttpcomm_sessionSetCompression(libhttpcomm_session_t *session, http_encoding_e encoding,
+        const char *dictionary, size_t dictionaryLength)
+{
+    unsigned char *copy = NULL;
+
+    assert(session);
+
+    if (dictionary != NULL && dictionaryLength > 0 && encoding == HTTPCOMM_ENCODING_DEFLATE)
+    {
+        copy = (unsigned char *) malloc(dictionaryLength);
+        if (copy == NULL)
+        {
+            SYSLOG_ERR("malloc: %s", strerror(errno));
+            return false;
+        }
+        memcpy(copy, dictionary, dictionaryLength);
+    }
+    else if (dictionary != NULL && encoding == HTTPCOMM_ENCODING_GZIP)
+    {
+        SYSLOG_WARNING("gzip can't use a preset dictionary, ignoring it");
+    }
+
+    pthread_mutex_lock(&session->mutex);
+    free(session->dictionary);
+    session->encoding = encoding;
+    session->dictionary = copy;
+    session->dictionaryLength = (copy != NULL) ? dictionaryLength : 0;
+    pthread_mutex_unlock(&session->mutex);
+    return true;
+}
+
+/**
+ * @brief   Lets the caller add header lines of its own to each message sent through a
+ *              session, like a sequence number or a priority. The other lines are built
+ *              once and reused by every request, the hook only writes what changes.
+ *
+ * @param   session: session returned by libhttpcomm_sessionOpen
+ * @param   hook: fills the lines of the next request, NULL to stop adding lines
+ * @param   userData: passed to hook
+ *
+ * @return  none
+ */
+void libhttpcomm_sessionSetHeaderHook(libhttpcomm_session_t *session, http_header_hook_t hook, void *userData)
+{
+    assert(session);
+
+    pthread_mutex_lock(&session->mutex);
+    session->headerHook = hook;
+    session->headerHookUserData = userData;
+    pthread_mutex_unlock(&session->mutex);
+}
+
+/**
+ * @brief   Same as libhttpcomm_sendMsg, but the connection to the server is kept by
+ *              the session and reused by the next request to the same host.
+ *
+ * @param   session: session returned by libhttpcomm_sessionOpen
+ * @param   others: see libhttpcomm_sendMsg
+ *
+ * @return  0 for success, errno value for failure
+ */
+int libhttpcomm_sessionSendMsg(libhttpcomm_session_t *session, CURLoption httpMethod, const char *url,
+                const char *sslCertPath, const char *authToken, char *msgToSendPtr, int msgToSendSize,
+                char *rxBuffer, int maxRxBufferSize, http_param_t params,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    http_rxbuffer_t rx;
+
+    assert(session);
+    assert(rxBuffer);
+
+    libhttpcomm_rxBufferInit(&rx, rxBuffer, maxRxBufferSize);
+    return _libhttpcomm_sendMsg(session, session->shareCurlHandle, httpMethod, url, sslCertPath, authToken,
+            msgToSendPtr, msgToSendSize, &rx, params, ProgressCallback);
+}
+
+/**
+ * @brief   Same as libhttpcomm_sessionSendMsg, but the response is received in a
+ *              length-tracked buffer that may grow, see libhttpcomm_rxBufferAlloc().
+ *
+ * @param   session: session returned by libhttpcomm_sessionOpen
+ * @param   rx: receives the response, rx->length is the number of bytes received
+ * @param   others: see libhttpcomm_sendMsg
+ *
+ * @return  0 for success, errno value for failure
+ */
+int libhttpcomm_sessionSendMsgRx(libhttpcomm_session_t *session, CURLoption httpMethod, const char *url,
+                const char *sslCertPath, const char *authToken, char *msgToSendPtr, int msgToSendSize,
+                http_rxbuffer_t *rx, http_param_t params,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    assert(session);
+    return _libhttpcomm_sendMsg(session, session->shareCurlHandle, httpMethod, url, sslCertPath, authToken,
+            msgToSendPtr, msgToSendSize, rx, params, ProgressCallback);
+}
+
+/**
+ * @brief   Same as libhttpcomm_sendMsgv, but the connection is kept by the session
+ *
+ * @param   session: session returned by libhttpcomm_sessionOpen
+ * @param   others: see libhttpcomm_sendMsgv
+ *
+ * @return  0 for success, errno value for failure
+ */
+int libhttpcomm_sessionSendMsgv(libhttpcomm_session_t *session, CURLoption httpMethod, const char *url,
+                const char *sslCertPath, const char *authToken, const struct iovec *segments, int segmentCount,
+                http_rxbuffer_t *rx, http_param_t params,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    assert(session);
+    return _libhttpcomm_sendMsgv(session, session->shareCurlHandle, httpMethod, url, sslCertPath, authToken,
+            segments, segmentCount, rx, params, ProgressCallback);
+}
+
+/**
+ * @brief   Same as libhttpcomm_getFile, but the connection is kept by the session
+ *
+ * @param   session: session returned by libhttpcomm_sessionOpen
+ * @param   others: see libhttpcomm_getFile
+ *
+ * @return  true for success, false for failure
+ */
+int libhttpcomm_sessionGetFile(libhttpcomm_session_t *session, const char *url, const char *sslCertPath,
+                const char *authToken, FILE *rxFile, int maxRxFileSize, http_timeout_t timeouts,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    assert(session);
+    return _libhttpcomm_getFile(session, session->shareCurlHandle, url, sslCertPath, authToken,
+            rxFile, maxRxFileSize, timeouts, ProgressCallback);
+}
+
+/**
+ * @brief   Same as libhttpcomm_download, but the connection is kept by the session
+ *
+ * @param   session: session returned by libhttpcomm_sessionOpen
+ * @param   others: see libhttpcomm_download
+ *
+ * @return  0 for success, EBADMSG if the file received is corrupt, errno value for failure
+ */
+int libhttpcomm_sessionDownload(libhttpcomm_session_t *session, const char *url, const char *sslCertPath,
+                const char *authToken, http_download_t *download, http_timeout_t timeouts,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    return _libhttpcomm_download(session, session->shareCurlHandle, url, sslCertPath, authToken,
+            download, timeouts, ProgressCallback);
+}
+
+/**
+ * @brief   Same as libhttpcomm_sendFile, but the connection is kept by the session
+ *
+ * @param   session: session returned by libhttpcomm_sessionOpen
+ * @param   others: see libhttpcomm_sendFile
+ *
+ * @return  true for success, false for failure
+ */
+int libhttpcomm_sessionSendFile(libhttpcomm_session_t *session, const char *url, const char *sslCertPath,
+                const char *authToken, char *fileName, char *rxBuffer, int maxRxBufferSize, http_timeout_t timeouts)
+{
+    http_rxbuffer_t rx;
+
+    assert(session);
+    assert(rxBuffer);
+
+    libhttpcomm_rxBufferInit(&rx, rxBuffer, maxRxBufferSize);
+    return _libhttpcomm_sendFile(session, session->shareCurlHandle, url, sslCertPath, authToken,
+            fileName, &rx, timeouts);
+}
+
+/**
+ * @brief   Same as libhttpcomm_upload, but the connection is kept by the session
+ *
+ * @param   session: session returned by libhttpcomm_sessionOpen
+ * @param   others: see libhttpcomm_upload
+ *
+ * @return  0 for success, errno value for failure
+ */
+int libhttpcomm_sessionUpload(libhttpcomm_session_t *session, const char *url, const char *sslCertPath,
+                const char *authToken, http_upload_t *upload, http_rxbuffer_t *rx, http_param_t params,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    assert(session);
+
+    return _libhttpcomm_upload(session, session->shareCurlHandle, url, sslCertPath, authToken,
+            upload, rx, params, ProgressCallback);
+}
+
+/**
+ * @brief   Performs a HTTP Get
+ *
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   url: url of the server (hostname + uri)
+ * @param   sslCertPath: location of where the certificate is
+ * @param   authToken: authentication token to be added in the header
+ * @param   rxBuffer: ptr for storing message received by the server -> must exist
+ * @param   maxRxBufferSize: max size of rxBuffer in bytes -> if 0 it is assumed that rxBuffer is of type FILE*
+ * @param   timeouts: specifies connect and transfer timeouts for the connection
+ * @param   ProgressCallback: function pointer that will be called every second during the connection
+ *
+ * @return  true for success, false for failure
+ */
+int libhttpcomm_getMsg(CURLSH * shareCurlHandle, const char *url, const char *sslCertPath, const char *authToken,
+                char *rxBuffer, int maxRxBufferSize, http_param_t params,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    return libhttpcomm_sendMsg(shareCurlHandle, CURLOPT_HTTPGET, url, sslCertPath, authToken,
+            NULL, 0, rxBuffer, maxRxBufferSize, params, ProgressCallback);
+}
+
+/**
+ * @brief   Sends a message through HTTP to PPC servers. The connection is kept by
+ *              a session private to the calling thread and reused by the next call.
+ *
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   httpMethod: CURLOPT_POST or CURLOPT_HTTPGET
+ * @param   url: url of the server (hostname + uri)
+ * @param   sslCertPath: location of where the certificate is
+ * @param   authToken: authentication token to be added in the header
+ * @param   msgToSendPtr: ptr to message to send. NULL if none
+ * @param   msgToSendSize: send of msgToSendPtr
+ * @param   rxBuffer: ptr for storing message received by the server -> must exist
+ * @param   maxRxBufferSize: max size of rxBuffer in bytes -> if 0 it is assumed that rxBuffer is of type FILE*
+ * @param   timeouts: specifies connect and transfer timeouts for the connection
+ * @param   ProgressCallback: function pointer that will be called every second during the connection
+ *
+ * @return  true for success, false for failure
+ */
+int libhttpcomm_sendMsg(CURLSH * shareCurlHandle, CURLoption httpMethod, const char *url, const char *sslCertPath, const char *authToken,
+                char *msgToSendPtr, int msgToSendSize, char *rxBuffer, int maxRxBufferSize, http_param_t params,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    http_rxbuffer_t rx;
+
+    assert(rxBuffer);
+
+    libhttpcomm_rxBufferInit(&rx, rxBuffer, maxRxBufferSize);
+    return _libhttpcomm_sendMsg(_libhttpcomm_threadSession(), shareCurlHandle, httpMethod, url, sslCertPath,
+            authToken, msgToSendPtr, msgToSendSize, &rx, params, ProgressCallback);
+}
+
+/**
+ * @brief   Same as libhttpcomm_sendMsg, but the response is received in a length-tracked
+ *              buffer that may grow, see libhttpcomm_rxBufferAlloc().
+ *
+ * @param   rx: receives the response, rx->length is the number of bytes received
+ * @param   others: see libhttpcomm_sendMsg
+ *
+ * @return  0 for success, errno value for failure
+ */
+int libhttpcomm_sendMsgRx(CURLSH * shareCurlHandle, CURLoption httpMethod, const char *url, const char *sslCertPath,
+                const char *authToken, char *msgToSendPtr, int msgToSendSize, http_rxbuffer_t *rx, http_param_t params,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    return _libhttpcomm_sendMsg(_libhttpcomm_threadSession(), shareCurlHandle, httpMethod, url, sslCertPath,
+            authToken, msgToSendPtr, msgToSendSize, rx, params, ProgressCallback);
+}
+
+/**
+ * @brief   Sends a message made of several segments, e.g. a header, queued payloads and
+ *              a footer. The segments are streamed one after the other from where they
+ *              are, so the message is never joined in a single buffer.
+ *
+ * @param   segments: parts of the message, in order. They must stay valid during the call.
+ * @param   segmentCount: number of segments
+ * @param   rx: receives the response, rx->length is the number of bytes received
+ * @param   others: see libhttpcomm_sendMsg
+ *
+ * @return  0 for success, errno value for failure
+ */
+int libhttpcomm_sendMsgv(CURLSH * shareCurlHandle, CURLoption httpMethod, const char *url, const char *sslCertPath,
+                const char *authToken, const struct iovec *segments, int segmentCount, http_rxbuffer_t *rx,
+                http_param_t params,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    return _libhttpcomm_sendMsgv(_libhttpcomm_threadSession(), shareCurlHandle, httpMethod, url, sslCertPath,
+            authToken, segments, segmentCount, rx, params, ProgressCallback);
+}
+
+/**
+ * @brief   Get a file through HTTP from PPC servers
+ *
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   url: url of the server (hostname + uri)
+ * @param   sslCertPath: location of where the certificate is
+ * @param   authToken: authentication token to be added in the header
+ * @param   rxFile: FILE ptr to the incoming file
+ * @param   maxRxFileSize: max size of the file to receive
+ * @param   timeouts: specifies connect and transfer timeouts for the connection
+ * @param   ProgressCallback: function pointer that will be called every second during the connection
+ *
+ * @return  true for success, false for failure
+ */
+int libhttpcomm_getFile(CURLSH * shareCurlHandle, const char *url, const char *sslCertPath, const char *authToken,
+                FILE *rxFile, int maxRxFileSize, http_timeout_t timeouts,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    return _libhttpcomm_getFile(_libhttpcomm_threadSession(), shareCurlHandle, url, sslCertPath, authToken,
+            rxFile, maxRxFileSize, timeouts, ProgressCallback);
+}
+
+/**
+ * @brief   Opens the destination of a download. A file left by an interrupted download
+ *              is kept: written through fd, the download resumes from its end; mapped in
+ *              memory, the file is preallocated and the download resumes from the
+ *              durableOffset saved by the caller, if it sets download->offset to it.
+ *
+ * @param   download: download to initialize
+ * @param   path: destination file
+ * @param   expectedSize: size of the file, 0 if unknown
+ * @param   expectedCrc: CRC-32 of the whole file, used with HTTPCOMM_DOWNLOAD_VERIFY_CRC
+ * @param   flags: HTTPCOMM_DOWNLOAD_VERIFY_CRC, HTTPCOMM_DOWNLOAD_MAP, or 0
+ *
+ * @return  true for success, false for failure
+ */
+bool libhttpcomm_downloadOpen(http_download_t *download, const char *path, curl_off_t expectedSize,
+        unsigned long expectedCrc, int flags)
+{
+    struct stat fileStats;
+    void *map;
+
+    assert(download);
+    assert(path);
+
+    memset(download, 0, sizeof(http_download_t));
+    download->flags = flags;
+    download->expectedSize = expectedSize;
+    download->expectedCrc = expectedCrc;
+    download->crc = crc32(0L, Z_NULL, 0);
+
+    if ((flags & HTTPCOMM_DOWNLOAD_MAP) != 0 && expectedSize <= 0)
+    {
+        SYSLOG_ERR("a mapped download needs the size of the file");
+        return false;
+    }
+
+    download->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (download->fd < 0)
+    {
+        SYSLOG_ERR("open(%s): %s", path, strerror(errno));
+        return false;
+    }
+
+    if (fstat(download->fd, &fileStats) < 0)
+    {
+        SYSLOG_ERR("fstat(%s): %s", path, strerror(errno));
+        goto fail;
+    }
+
+    if ((flags & HTTPCOMM_DOWNLOAD_MAP) != 0)
+    {
+        // the blocks are allocated once, a full disk shows up now and not halfway through
+        if (fileStats.st_size != expectedSize && (ftruncate(download->fd, (off_t) expectedSize) < 0
+                || posix_fallocate(download->fd, 0, (off_t) expectedSize) != 0))
+        {
+            SYSLOG_ERR("preallocating %s: %s", path, strerror(errno));
+            goto fail;
+        }
+
+        map = mmap(NULL, (size_t) expectedSize, PROT_READ | PROT_WRITE, MAP_SHARED, download->fd, 0);
+        if (map == MAP_FAILED)
+        {
+            SYSLOG_ERR("mmap(%s): %s", path, strerror(errno));
+            goto fail;
+        }
+        download->map = (unsigned char *) map;
+    }
+    else if (expectedSize > 0 && fileStats.st_size > expectedSize)
+    {
+        // not what an interrupted download of this file leaves behind
+        if (ftruncate(download->fd, 0) < 0)
+        {
+            SYSLOG_ERR("ftruncate(%s): %s", path, strerror(errno));
+            goto fail;
+        }
+    }
+    else
+    {
+        download->offset = (curl_off_t) fileStats.st_size;
+        download->durableOffset = download->offset;
+    }
+
+    return true;
+
+    fail:
+      close(download->fd);
+      download->fd = -1;
+      return false;
+}
+
+/**
+ * @brief   Flushes what was received to storage and closes the destination of a download
+ *
+ * @param   download: download opened by libhttpcomm_downloadOpen
+ *
+ * @return  none
+ */
+void libhttpcomm_downloadClose(http_download_t *download)
+{
+    if (download->fd < 0)
+    {
+        return;
+    }
+
+    _libhttpcomm_downloadSync(download);
+
+    if (download->map != NULL)
+    {
+        munmap(download->map, (size_t) download->expectedSize);
+        download->map = NULL;
+    }
+
+    close(download->fd);
+    download->fd = -1;
+}
+
+/**
+ * @brief   Downloads a file through HTTP into a destination opened by libhttpcomm_downloadOpen.
+ *              Received bytes are written straight to the file, without going through a
+ *              FILE buffer, and flushed every HTTPCOMM_DOWNLOAD_SYNC_SIZE bytes. A dropped
+ *              connection is resumed with an HTTP Range request for the bytes that are
+ *              missing, up to HTTPCOMM_DOWNLOAD_MAX_ATTEMPTS times in a row without progress.
+ *              The size and the CRC-32 are checked once the whole file is received.
+ *
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   url: url of the server (hostname + uri)
+ * @param   sslCertPath: location of where the certificate is
+ * @param   authToken: authentication token to be added in the header
+ * @param   download: destination of the file, its offset tells where to resume
+ * @param   timeouts: specifies connect and transfer timeouts of each attempt
+ * @param   ProgressCallback: function pointer that will be called every second during the
+ *              connection with the download as clientp, and the progress of the whole file
+ *
+ * @return  0 for success, EBADMSG if the file received is corrupt, errno value for failure
+ */
+int libhttpcomm_download(CURLSH * shareCurlHandle, const char *url, const char *sslCertPath, const char *authToken,
+                http_download_t *download, http_timeout_t timeouts,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    return _libhttpcomm_download(_libhttpcomm_threadSession(), shareCurlHandle, url, sslCertPath, authToken,
+            download, timeouts, ProgressCallback);
+}
+
+/**
+ * @brief   Sends a file through HTTP to a remote computer
+ *
+ * @param   url: url of the server (hostname + uri)
+ * @param   sslCertPath: location of where the certificate is
+ * @param   authToken: authentication token to be added in the header
+ * @param   fileName: ptr to message to send. NULL if none
+ * @param   rxBuffer: ptr for storing message received by the server -> must exist
+ * @param   maxRxBufferSize: max size of rxBuffer in bytes.
+ * @param   timeouts: specifies connect and transfer timeouts for the connection
+ *
+ * @return  true for success, false for failure
+ */
+int libhttpcomm_sendFile(const char *url, const char *sslCertPath, const char *authToken,
+                char *fileName, char *rxBuffer, int maxRxBufferSize, http_timeout_t timeouts)
+{
+    http_rxbuffer_t rx;
+
+    assert(rxBuffer);
+
+    libhttpcomm_rxBufferInit(&rx, rxBuffer, maxRxBufferSize);
+    return _libhttpcomm_sendFile(_libhttpcomm_threadSession(), NULL, url, sslCertPath, authToken,
+            fileName, &rx, timeouts);
+}
+
+/**
+ * @brief   Streams data of any size to the server without staging it in memory: a file
+ *              descriptor is read up to its end, or up to upload->size bytes, and a
+ *              producer is called until it has nothing left. When the size isn't known
+ *              up front, the data is sent with Transfer-Encoding: chunked.
+ *
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   url: url of the server (hostname + uri)
+ * @param   sslCertPath: location of where the certificate is
+ * @param   authToken: authentication token to be added in the header
+ * @param   upload: source of the data, its size and bandwidth cap
+ * @param   rx: buffer receiving the response of the server
+ * @param   params: timeouts and verbosity of the transfer
+ * @param   ProgressCallback: function pointer that will be called every second during the connection
+ *
+ * @return  0 for success, errno value for failure
+ */
+int libhttpcomm_upload(CURLSH * shareCurlHandle, const char *url, const char *sslCertPath,
+                const char *authToken, http_upload_t *upload, http_rxbuffer_t *rx, http_param_t params,
+                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    return _libhttpcomm_upload(_libhttpcomm_threadSession(), shareCurlHandle, url, sslCertPath, authToken,
+            upload, rx, params, ProgressCallback);
+}
+
+/**
+ * @brief   Opens an engine running many HTTP transfers at once on one thread. Transfers
+ *              are submitted with libhttpcomm_submit() from any thread, and driven by
+ *              libhttpcomm_multiRun(), or by an external event loop through
+ *              libhttpcomm_multiSetWatcher() and libhttpcomm_multiSocketAction().
+ *
+ * @param   shareCurlHandle: curl handle shared across connections, NULL if none
+ * @param   maxResponseSize: largest response a transfer can receive, in bytes
+ *
+ * @return  the engine, NULL on failure
+ */
+libhttpcomm_multi_t *libhttpcomm_multiOpen(CURLSH *shareCurlHandle, size_t maxResponseSize)
+{
+    libhttpcomm_multi_t *multi = NULL;
+    int i;
+
+    multi = (libhttpcomm_multi_t *) calloc(1, sizeof(libhttpcomm_multi_t));
+    if (multi == NULL)
+    {
+        SYSLOG_ERR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+
+    multi->shareCurlHandle = shareCurlHandle;
+    multi->maxResponseSize = maxResponseSize;
+    multi->timeoutAtMs = -1;
+    for (i = 0; i < HTTPCOMM_MULTI_MAX_SOCKETS; i++)
+    {
+        multi->sockets[i].fd = CURL_SOCKET_BAD;
+    }
+
+    // the loop may be sleeping in select(), submitted transfers wake it up
+    if (pipe(multi->wakeupFd) < 0)
+    {
+        SYSLOG_ERR("pipe: %s", strerror(errno));
+        free(multi);
+        return NULL;
+    }
+    fcntl(multi->wakeupFd[0], F_SETFL, O_NONBLOCK);
+    fcntl(multi->wakeupFd[1], F_SETFL, O_NONBLOCK);
+
+    multi->multiHandle = curl_multi_init();
+    if (multi->multiHandle == NULL)
+    {
+        SYSLOG_ERR("curl_multi_init");
+        goto error;
+    }
+
+    if (curl_multi_setopt(multi->multiHandle, CURLMOPT_SOCKETFUNCTION, _libhttpcomm_multiSocketCallback) != CURLM_OK
+            || curl_multi_setopt(multi->multiHandle, CURLMOPT_SOCKETDATA, multi) != CURLM_OK
+            || curl_multi_setopt(multi->multiHandle, CURLMOPT_TIMERFUNCTION, _libhttpcomm_multiTimerCallback) != CURLM_OK
+            || curl_multi_setopt(multi->multiHandle, CURLMOPT_TIMERDATA, multi) != CURLM_OK)
+    {
+        SYSLOG_ERR("curl_multi_setopt");
+        goto error;
+    }
+
+    pthread_mutex_init(&multi->mutex, NULL);
+    return multi;
+
+    error:
+        if (multi->multiHandle != NULL)
+        {
+            curl_multi_cleanup(multi->multiHandle);
+        }
+        close(multi->wakeupFd[0]);
+        close(multi->wakeupFd[1]);
+        free(multi);
+        return NULL;
+}
+
+/**
+ * @brief   Closes an engine. Transfers still in progress are aborted and their
+ *              completion callback is called with ECANCELED.
+ *
+ * @param   multi: engine returned by libhttpcomm_multiOpen
+ *
+ * @return  none
+ */
+void libhttpcomm_multiClose(libhttpcomm_multi_t *multi)
+{
+    struct HttpTransfer *transfer;
+
+    if (multi == NULL)
+    {
+        return;
+    }
+
+    _libhttpcomm_multiAddPending(multi);
+
+    while ((transfer = multi->active) != NULL)
+    {
+        multi->active = transfer->next;
+        curl_multi_remove_handle(multi->multiHandle, transfer->curlHandle);
+        libhttpcomm_rxBufferReset(&transfer->rx);
+        transfer->onComplete(ECANCELED, &transfer->rx, transfer->userData);
+        _libhttpcomm_transferFree(transfer);
+    }
+
+    while ((transfer = multi->idle) != NULL)
+    {
+        multi->idle = transfer->next;
+        _libhttpcomm_transferFree(transfer);
+    }
+
+    curl_multi_cleanup(multi->multiHandle);
+    close(multi->wakeupFd[0]);
+    close(multi->wakeupFd[1]);
+    pthread_mutex_destroy(&multi->mutex);
+    free(multi);
+}
+
+/**
+ * @brief   Starts a transfer without waiting for it. Can be called from any thread,
+ *              including from a completion callback.
+ *
+ * @param   multi: engine returned by libhttpcomm_multiOpen
+ * @param   request: what to send. The strings are copied, but msgToSendPtr must
+ *              stay valid until the completion callback is called.
+ * @param   onComplete: called on the thread running the engine once the transfer is
+ *              done, with the same result libhttpcomm_sendMsg() would return
+ * @param   userData: passed to onComplete
+ *
+ * @return  0 for success, errno value for failure
+ */
+int libhttpcomm_submit(libhttpcomm_multi_t *multi, const http_request_t *request,
+        http_completion_t onComplete, void *userData)
+{
+    struct HttpTransfer *transfer = NULL;
+    size_t (*readFunction) (void *ptr, size_t size, size_t nmemb, void *userp) = NULL;
+    void *readData = NULL;
+    long msgToSendSize;
+    CURLcode curlResult;
+    char wakeup = 0;
+    int i;
+
+    assert(multi);
+    assert(request);
+    assert(request->url);
+    assert(onComplete);
+
+    pthread_mutex_lock(&multi->mutex);
+    transfer = multi->idle;
+    if (transfer != NULL)
+    {
+        multi->idle = transfer->next;
+        multi->idleCount--;
+    }
+    pthread_mutex_unlock(&multi->mutex);
+
+    if (transfer == NULL)
+    {
+        transfer = _libhttpcomm_transferNew(multi);
+        if (transfer == NULL)
+        {
+            return ENOMEM;
+        }
+    }
+
+    libhttpcomm_rxBufferReset(&transfer->rx);
+    transfer->params = request->params;
+    transfer->httpMethod = request->httpMethod;
+    transfer->onComplete = onComplete;
+    transfer->userData = userData;
+
+    libhttpcomm_rxBufferSetSink(&transfer->rx, request->sink, request->sinkUserData);
+
+    msgToSendSize = request->msgToSendSize;
+    if (request->msgToSendPtr != NULL)
+    {
+        transfer->outBoundCommInfo.buffer = request->msgToSendPtr;
+        transfer->outBoundCommInfo.size = request->msgToSendSize;
+        transfer->outBoundCommInfo.offset = 0;
+        readFunction = read_callback;
+        readData = &transfer->outBoundCommInfo;
+    }
+    else if (request->segments != NULL)
+    {
+        transfer->outBoundVector.segments = request->segments;
+        transfer->outBoundVector.segmentCount = request->segmentCount;
+        transfer->outBoundVector.segment = 0;
+        transfer->outBoundVector.offset = 0;
+        readFunction = read_vector_callback;
+        readData = &transfer->outBoundVector;
+
+        for (msgToSendSize = 0, i = 0; i < request->segmentCount; i++)
+        {
+            msgToSendSize += (long) request->segments[i].iov_len;
+        }
+    }
+
+    if (_libhttpcomm_sessionSetup(request->session, transfer->curlHandle, &transfer->config,
+            request->httpMethod, request->url, request->sslCertPath, request->authToken,
+            readFunction, readData, msgToSendSize, &transfer->rx, request->params,
+            request->ProgressCallback, &transfer->compressed) == false)
+    {
+        _libhttpcomm_transferFree(transfer);
+        return ENOEXEC;
+    }
+
+    curlResult = curl_easy_setopt(transfer->curlHandle, CURLOPT_PRIVATE, transfer);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_PRIVATE", curl_easy_strerror(curlResult));
+        _libhttpcomm_transferFree(transfer);
+        return ENOEXEC;
+    }
+
+    // the transfer is handed to curl by the thread running the engine
+    pthread_mutex_lock(&multi->mutex);
+    transfer->next = NULL;
+    if (multi->pendingTail != NULL)
+    {
+        multi->pendingTail->next = transfer;
+    }
+    else
+    {
+        multi->pending = transfer;
+    }
+    multi->pendingTail = transfer;
+    multi->pendingCount++;
+    pthread_mutex_unlock(&multi->mutex);
+
+    if (write(multi->wakeupFd[1], &wakeup, sizeof(wakeup)) < 0 && errno != EAGAIN)
+    {
+        SYSLOG_WARNING("write: %s", strerror(errno));
+    }
+
+    return 0;
+}
+
+/**
+ * @brief   Hands the sockets of the engine to an external event loop. The watcher is
+ *              called right away for the wakeup descriptor, then every time curl wants
+ *              a socket watched differently (CURL_POLL_IN, CURL_POLL_OUT, CURL_POLL_INOUT)
+ *              or not at all (CURL_POLL_REMOVE). When a descriptor is ready, or when
+ *              libhttpcomm_multiTimeout() expires, call libhttpcomm_multiSocketAction().
+ *
+ * @param   multi: engine returned by libhttpcomm_multiOpen
+ * @param   watcher: called with the descriptor and what to watch it for
+ * @param   userData: passed to watcher
+ *
+ * @return  none
+ */
+void libhttpcomm_multiSetWatcher(libhttpcomm_multi_t *multi, http_watcher_t watcher, void *userData)
+{
+    int i;
+
+    assert(multi);
+
+    multi->watcher = watcher;
+    multi->watcherUserData = userData;
+
+    if (watcher != NULL)
+    {
+        watcher(multi->wakeupFd[0], CURL_POLL_IN, userData);
+        for (i = 0; i < HTTPCOMM_MULTI_MAX_SOCKETS; i++)
+        {
+            if (multi->sockets[i].fd != CURL_SOCKET_BAD)
+            {
+                watcher(multi->sockets[i].fd, multi->sockets[i].events, userData);
+            }
+        }
+    }
+}
+
+/**
+ * @brief   Tells how long an external event loop may wait before calling
+ *              libhttpcomm_multiSocketAction() with CURL_SOCKET_TIMEOUT. The time
+ *              already spent since curl asked for it is taken off.
+ *
+ * @param   multi: engine returned by libhttpcomm_multiOpen
+ *
+ * @return  milliseconds to wait, -1 if only descriptor activity matters
+ */
+long libhttpcomm_multiTimeout(libhttpcomm_multi_t *multi)
+{
+    long long remainingMs;
+
+    assert(multi);
+
+    if (multi->timeoutAtMs < 0)
+    {
+        return -1;
+    }
+
+    remainingMs = multi->timeoutAtMs - _libhttpcomm_nowMs();
+    return (remainingMs > 0) ? (long) remainingMs : 0;
+}
+
+/**
+ * @brief   Lets the engine progress after activity on one of its descriptors, or after
+ *              its timeout expired. Completion callbacks are called from here.
+ *
+ * @param   multi: engine returned by libhttpcomm_multiOpen
+ * @param   fd: descriptor that is ready, CURL_SOCKET_TIMEOUT if the timeout expired
+ * @param   events: CURL_CSELECT_IN, CURL_CSELECT_OUT and/or CURL_CSELECT_ERR, 0 if unknown
+ *
+ * @return  number of transfers not completed yet
+ */
+int libhttpcomm_multiSocketAction(libhttpcomm_multi_t *multi, int fd, int events)
+{
+    int running = 0;
+    int unfinished;
+
+    assert(multi);
+
+    if (fd != multi->wakeupFd[0])
+    {
+        curl_multi_socket_action(multi->multiHandle, fd, events, &running);
+        multi->running = running;
+    }
+
+    _libhttpcomm_multiAddPending(multi);
+    _libhttpcomm_multiComplete(multi);
+
+    pthread_mutex_lock(&multi->mutex);
+    unfinished = multi->running + multi->pendingCount;
+    pthread_mutex_unlock(&multi->mutex);
+    return unfinished;
+}
+
+/**
+ * @brief   Aborts the transfers submitted with a given userData, a long poll for instance.
+ *              Their completion callback is called right away with ECANCELED. Only call
+ *              it from the thread running the engine.
+ *
+ * @param   multi: engine returned by libhttpcomm_multiOpen
+ * @param   userData: userData the transfers were submitted with
+ *
+ * @return  number of transfers aborted
+ */
+int libhttpcomm_cancel(libhttpcomm_multi_t *multi, void *userData)
+{
+    struct HttpTransfer *transfer;
+    struct HttpTransfer **link;
+    int cancelled = 0;
+
+    assert(multi);
+
+    // transfers still pending are handed to curl first, so there is one list to search
+    _libhttpcomm_multiAddPending(multi);
+
+    link = &multi->active;
+    while ((transfer = *link) != NULL)
+    {
+        if (transfer->userData != userData)
+        {
+            link = &transfer->next;
+            continue;
+        }
+
+        *link = transfer->next;
+        curl_multi_remove_handle(multi->multiHandle, transfer->curlHandle);
+        multi->running--;
+        cancelled++;
+
+        libhttpcomm_rxBufferReset(&transfer->rx);
+        transfer->onComplete(ECANCELED, &transfer->rx, transfer->userData);
+        _libhttpcomm_transferRecycle(multi, transfer);
+    }
+
+    return cancelled;
+}
+
+/**
+ * @brief   Runs the engine with its own select() loop until something happens or
+ *              maxWaitMs milliseconds elapse. Call it repeatedly from the thread
+ *              owning the engine.
+ *
+ * @param   multi: engine returned by libhttpcomm_multiOpen
+ * @param   maxWaitMs: longest time to wait for activity
+ *
+ * @return  number of transfers not completed yet
+ */
+int libhttpcomm_multiRun(libhttpcomm_multi_t *multi, long maxWaitMs)
+{
+    struct HttpMultiSocket sockets[HTTPCOMM_MULTI_MAX_SOCKETS];
+    fd_set readFds;
+    fd_set writeFds;
+    fd_set errorFds;
+    struct timeval timeout;
+    long waitMs;
+    int maxFd;
+    int events;
+    int result;
+    int i;
+
+    assert(multi);
+
+    _libhttpcomm_multiAddPending(multi);
+
+    FD_ZERO(&readFds);
+    FD_ZERO(&writeFds);
+    FD_ZERO(&errorFds);
+
+    FD_SET(multi->wakeupFd[0], &readFds);
+    maxFd = multi->wakeupFd[0];
+
+    // curl callbacks may change the sockets while they are processed below
+    memcpy(sockets, multi->sockets, sizeof(sockets));
+    for (i = 0; i < HTTPCOMM_MULTI_MAX_SOCKETS; i++)
+    {
+        if (sockets[i].fd == CURL_SOCKET_BAD)
+        {
+            continue;
+        }
+        if (sockets[i].events & CURL_POLL_IN)
+        {
+            FD_SET(sockets[i].fd, &readFds);
+        }
+        if (sockets[i].events & CURL_POLL_OUT)
+        {
+            FD_SET(sockets[i].fd, &writeFds);
+        }
+        FD_SET(sockets[i].fd, &errorFds);
+        if (sockets[i].fd > maxFd)
+        {
+            maxFd = sockets[i].fd;
+        }
+    }
+
+    waitMs = libhttpcomm_multiTimeout(multi);
+    if (waitMs < 0 || waitMs > maxWaitMs)
+    {
+        waitMs = maxWaitMs;
+    }
+    timeout.tv_sec = waitMs / 1000;
+    timeout.tv_usec = (waitMs % 1000) * 1000;
+
+    result = select(maxFd + 1, &readFds, &writeFds, &errorFds, &timeout);
+    if (result < 0)
+    {
+        if (errno != EINTR)
+        {
+            SYSLOG_ERR("select: %s", strerror(errno));
+        }
+        return libhttpcomm_multiSocketAction(multi, multi->wakeupFd[0], 0);
+    }
+
+    if (result == 0)
+    {
+        return libhttpcomm_multiSocketAction(multi, CURL_SOCKET_TIMEOUT, 0);
+    }
+
+    for (i = 0; i < HTTPCOMM_MULTI_MAX_SOCKETS; i++)
+    {
+        if (sockets[i].fd == CURL_SOCKET_BAD)
+        {
+            continue;
+        }
+
+        events = 0;
+        if (FD_ISSET(sockets[i].fd, &readFds))
+        {
+            events |= CURL_CSELECT_IN;
+        }
+        if (FD_ISSET(sockets[i].fd, &writeFds))
+        {
+            events |= CURL_CSELECT_OUT;
+        }
+        if (FD_ISSET(sockets[i].fd, &errorFds))
+        {
+            events |= CURL_CSELECT_ERR;
+        }
+
+        if (events != 0)
+        {
+            libhttpcomm_multiSocketAction(multi, sockets[i].fd, events);
+        }
+    }
+
+    return libhttpcomm_multiSocketAction(multi, multi->wakeupFd[0], 0);
+}
+
+/**
+ * @brief   Sends a message through HTTP, using (and keeping) a connection of the session
+ *
+ * @param   session: session owning the connection
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   rx: receives the response
+ * @param   others: see libhttpcomm_sendMsg
+ *
+ * @return  0 for success, errno value for failure
+ */
+static int _libhttpcomm_sendMsg(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, CURLoption httpMethod,
+        const char *url, const char *sslCertPath, const char *authToken,
+        char *msgToSendPtr, int msgToSendSize, http_rxbuffer_t *rx, http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    struct HttpIoInfo outBoundCommInfo;
+    int result;
+
+    if (params.verbose == true)
+    {
+        if (msgToSendPtr != NULL)
+        {
+            SYSLOG_DEBUG("httpMethod: 0x%x, url: %s, size: %d, outgoing msg: %s",
+                    httpMethod, url, msgToSendSize, msgToSendPtr);
+        }else
+        {
+            SYSLOG_DEBUG("httpMethod: 0x%x, url: %s", httpMethod, url);
+        }
+    }
+
+    outBoundCommInfo.buffer = msgToSendPtr;
+    outBoundCommInfo.size = msgToSendSize;
+    outBoundCommInfo.offset = 0;
+
+    result = _libhttpcomm_exchange(session, shareCurlHandle, httpMethod, url, sslCertPath, authToken,
+            (msgToSendPtr != NULL) ? read_callback : NULL, &outBoundCommInfo, msgToSendSize,
+            rx, params, ProgressCallback);
+
+    if (result == 0 && msgToSendPtr != NULL)
+    {
+        msgToSendPtr[0] = 0;
+    }
+    return result;
+}
+
+/**
+ * @brief   Sends a message made of several segments through HTTP, using (and keeping)
+ *              a connection of the session
+ *
+ * @param   session: session owning the connection
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   others: see libhttpcomm_sendMsgv
+ *
+ * @return  0 for success, errno value for failure
+ */
+static int _libhttpcomm_sendMsgv(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, CURLoption httpMethod,
+        const char *url, const char *sslCertPath, const char *authToken,
+        const struct iovec *segments, int segmentCount, http_rxbuffer_t *rx, http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    struct HttpIoVector outBoundCommInfo;
+    long msgToSendSize = 0;
+    int i;
+
+    assert(segments != NULL || segmentCount == 0);
+
+    for (i = 0; i < segmentCount; i++)
+    {
+        msgToSendSize += (long) segments[i].iov_len;
+    }
+
+    if (params.verbose == true)
+    {
+        SYSLOG_DEBUG("httpMethod: 0x%x, url: %s, size: %ld in %d segments",
+                httpMethod, url, msgToSendSize, segmentCount);
+    }
+
+    outBoundCommInfo.segments = segments;
+    outBoundCommInfo.segmentCount = segmentCount;
+    outBoundCommInfo.segment = 0;
+    outBoundCommInfo.offset = 0;
+
+    return _libhttpcomm_exchange(session, shareCurlHandle, httpMethod, url, sslCertPath, authToken,
+            read_vector_callback, &outBoundCommInfo, msgToSendSize, rx, params, ProgressCallback);
+}
+
+/**
+ * @brief   Performs a blocking HTTP request on a connection of the session: the message,
+ *              if any, is streamed by readFunction and the response is received in rx
+ *
+ * @param   session: session owning the connection
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   readFunction: streams the message to curl, NULL if there is no message
+ * @param   readData: read state of the message
+ * @param   msgToSendSize: total size of the message
+ * @param   rx: receives the response
+ * @param   others: see libhttpcomm_sendMsg
+ *
+ * @return  0 for success, errno value for failure
+ */
+static int _libhttpcomm_exchange(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, CURLoption httpMethod,
+        const char *url, const char *sslCertPath, const char *authToken,
+        size_t (*readFunction) (void *ptr, size_t size, size_t nmemb, void *userp), void *readData,
+        long msgToSendSize, http_rxbuffer_t *rx, http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    struct HttpSessionHandle *handle = NULL;
+    CURL * curlHandle = NULL;
+    CURLcode curlResult;
+    long curlErrno = 0;
+
+    assert (rx);
+    assert (rx->buffer);
+    assert(url);
+
+    libhttpcomm_rxBufferReset(rx);
+
+    handle = _libhttpcomm_sessionAcquire(session, shareCurlHandle, url);
+    if (handle != NULL)
+    {
+        curlHandle = handle->curlHandle;
+
+        if (_libhttpcomm_sessionSetup(session, curlHandle, &handle->config, httpMethod, url, sslCertPath,
+                authToken, readFunction, readData, msgToSendSize, rx, params, ProgressCallback,
+                &handle->compressed) == false)
+        {
+            curlErrno = ENOEXEC;
+            goto out;
+        }
+
+        curlResult = curl_easy_perform(curlHandle);
+        _libhttpcomm_updateCacheStats(curlHandle);
+        _libhttpcomm_updateMetrics(curlHandle, httpMethod, curlResult);
+
+        curlErrno = _libhttpcomm_msgResult(curlHandle, curlResult, url, rx, params);
+    }
+    else
+    {
+        SYSLOG_ERR("curl_easy_init failed");
+        curlErrno = ENOEXEC;
+    }
+
+    out:
+      _libhttpcomm_closeHttp((handle != NULL) ? &handle->config : NULL);
+      _libhttpcomm_sessionRelease(session, handle);
+      return (int)curlErrno;
+}
+
+/**
+ * @brief   Configures a curl handle for a request with the settings of a session: the
+ *              message is compressed with the Content-Encoding of the session, and the
+ *              header hook of the session adds its lines.
+ *
+ * @param   session: session whose settings apply, NULL for none
+ * @param   curlHandle: curl handle to configure
+ * @param   config: options and header lines the curl handle was last configured with
+ * @param   readFunction: streams the message to curl, NULL if there is no message
+ * @param   readData: read state of the message
+ * @param   msgToSendSize: total size of the message
+ * @param   compressed: receives the compressed message, in the buffer of the
+ *              connection or transfer, must stay valid during the transfer
+ * @param   others: see libhttpcomm_sendMsg
+ *
+ * @return  true for success, false for failure
+ */
+static bool _libhttpcomm_sessionSetup(libhttpcomm_session_t *session, CURL *curlHandle,
+        struct HttpConfigCache *config, CURLoption httpMethod, const char *url, const char *sslCertPath,
+        const char *authToken, size_t (*readFunction) (void *ptr, size_t size, size_t nmemb, void *userp),
+        void *readData, long msgToSendSize, http_rxbuffer_t *rx, http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow),
+        struct HttpDeflateBuffer *compressed)
+{
+    http_encoding_e encoding = HTTPCOMM_ENCODING_IDENTITY;
+    struct iovec message;
+    const struct iovec *segments = &message;
+    int segmentCount = 1;
+    char *contentEncoding = NULL;
+    http_header_hook_t headerHook = NULL;
+    int extraHeaders = 0;
+    CURLcode curlResult;
+    int i;
+
+    if (session != NULL)
+    {
+        encoding = session->encoding;
+    }
+
+    if (readFunction != NULL && encoding != HTTPCOMM_ENCODING_IDENTITY
+            && msgToSendSize >= HTTPCOMM_COMPRESSION_MIN_SIZE)
+    {
+        // deflated straight from the message, read_callback and read_vector_callback are the only readers
+        if (readFunction == read_vector_callback)
+        {
+            segments = ((struct HttpIoVector *) readData)->segments;
+            segmentCount = ((struct HttpIoVector *) readData)->segmentCount;
+        }
+        else
+        {
+            message.iov_base = ((struct HttpIoInfo *) readData)->buffer;
+            message.iov_len = ((struct HttpIoInfo *) readData)->size;
+        }
+
+        if (_libhttpcomm_compress(session, segments, segmentCount, msgToSendSize, compressed) == false)
+        {
+            return false;
+        }
+
+        if (params.verbose == true)
+        {
+            SYSLOG_DEBUG("compressed %ld bytes into %d", msgToSendSize, compressed->info.size);
+        }
+
+        contentEncoding = (encoding == HTTPCOMM_ENCODING_GZIP) ?
+                "Content-Encoding: gzip" : "Content-Encoding: deflate";
+
+        readFunction = read_callback;
+        readData = &compressed->info;
+        msgToSendSize = compressed->info.size;
+    }
+
+    if (_libhttpcomm_setupMsg(curlHandle, config, "Content-Type: text/xml", httpMethod, url,
+            sslCertPath, authToken, readFunction, readData, msgToSendSize, rx, params, ProgressCallback) == false)
+    {
+        return false;
+    }
+
+    // the lines that change from one request to the next are linked after the cached ones
+    if (contentEncoding != NULL)
+    {
+        _libhttpcomm_headersAdd(config, contentEncoding);
+    }
+
+    if (session != NULL)
+    {
+        pthread_mutex_lock(&session->mutex);
+        headerHook = session->headerHook;
+        if (headerHook != NULL)
+        {
+            extraHeaders = headerHook(config->extraHeaders, HTTPCOMM_MAX_EXTRA_HEADERS,
+                    session->headerHookUserData);
+        }
+        pthread_mutex_unlock(&session->mutex);
+    }
+
+    for (i = 0; i < extraHeaders && i < HTTPCOMM_MAX_EXTRA_HEADERS; i++)
+    {
+        config->extraHeaders[i][HTTPCOMM_HEADER_LINE_SIZE - 1] = '\0';
+        _libhttpcomm_headersAdd(config, config->extraHeaders[i]);
+    }
+
+    // an empty string lets curl ask for, and inflate, every encoding it supports
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_ACCEPT_ENCODING,
+            (encoding != HTTPCOMM_ENCODING_IDENTITY) ? "" : NULL);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_ACCEPT_ENCODING", curl_easy_strerror(curlResult));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief   Compresses a whole message in memory, with the Content-Encoding and the
+ *              dictionary of the session. The length of a compressed message is only
+ *              known once it is compressed, and sending it with its Content-Length keeps
+ *              the connection reusable.
+ *
+ * @param   session: session sending the message
+ * @param   segments: the message, deflated straight from its segments
+ * @param   segmentCount: number of segments
+ * @param   msgToSendSize: total size of the message
+ * @param   compressed: receives the compressed message, its buffer is grown if too small
+ *
+ * @return  true for success, false for failure
+ */
+static bool _libhttpcomm_compress(libhttpcomm_session_t *session, const struct iovec *segments,
+        int segmentCount, long msgToSendSize, struct HttpDeflateBuffer *compressed)
+{
+    z_stream stream;
+    uLong bound;
+    int windowBits;
+    int zResult;
+    int i;
+
+    memset(&stream, 0, sizeof(stream));
+
+    // HTTP deflate is the zlib format, gzip adds 16 to the window bits
+    windowBits = (session->encoding == HTTPCOMM_ENCODING_GZIP) ? MAX_WBITS + 16 : MAX_WBITS;
+
+    zResult = deflateInit2(&stream, HTTPCOMM_COMPRESSION_LEVEL, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY);
+    if (zResult != Z_OK)
+    {
+        SYSLOG_ERR("deflateInit2: %d", zResult);
+        return false;
+    }
+
+    if (session->dictionary != NULL)
+    {
+        zResult = deflateSetDictionary(&stream, session->dictionary, session->dictionaryLength);
+        if (zResult != Z_OK)
+        {
+            SYSLOG_ERR("deflateSetDictionary: %d", zResult);
+            deflateEnd(&stream);
+            return false;
+        }
+    }
+
+    // the buffer only grows, its content doesn't need to be kept
+    bound = deflateBound(&stream, (uLong) msgToSendSize);
+    if (bound > compressed->capacity)
+    {
+        free(compressed->buffer);
+        compressed->capacity = 0;
+        compressed->buffer = (char *) malloc(bound);
+        if (compressed->buffer == NULL)
+        {
+            SYSLOG_ERR("malloc: %s", strerror(errno));
+            deflateEnd(&stream);
+            return false;
+        }
+        compressed->capacity = bound;
+    }
+
+    stream.next_out = (Bytef *) compressed->buffer;
+    stream.avail_out = bound;
+
+    for (i = 0; i <= segmentCount; i++)
+    {
+        if (i < segmentCount)
+        {
+            stream.next_in = (Bytef *) segments[i].iov_base;
+            stream.avail_in = (uInt) segments[i].iov_len;
+        }
+
+        zResult = deflate(&stream, (i == segmentCount) ? Z_FINISH : Z_NO_FLUSH);
+        if (zResult == Z_STREAM_ERROR || stream.avail_in != 0)
+        {
+            // can't happen with a deflateBound() sized buffer, unless the size was wrong
+            SYSLOG_ERR("deflate: %d, message larger than %ld bytes", zResult, msgToSendSize);
+            deflateEnd(&stream);
+            return false;
+        }
+    }
+
+    if (zResult != Z_STREAM_END)
+    {
+        SYSLOG_ERR("deflate: %d, message not finished", zResult);
+        deflateEnd(&stream);
+        return false;
+    }
+
+    compressed->info.buffer = compressed->buffer;
+    compressed->info.size = (int) stream.total_out;
+    compressed->info.offset = 0;
+    deflateEnd(&stream);
+    return true;
+}
+
+/**
+ * @brief   Sets the options of a curl handle to send a message and receive the response
+ *              in rx. Used by blocking and asynchronous transfers alike.
+ *
+ * @param   curlHandle: curl handle to configure
+ * @param   config: options and header lines the curl handle was last configured with
+ * @param   contentType: "Content-Type: ..." header line, a static string
+ * @param   readFunction: streams the message to curl, NULL if there is no message
+ * @param   readData: read state of the message, must live until the transfer is done
+ * @param   msgToSendSize: total size of the message
+ * @param   rx: receives the response, must live until the transfer is done
+ * @param   others: see libhttpcomm_sendMsg
+ *
+ * @return  true for success, false for failure
+ */
+static int _libhttpcomm_setupMsg(CURL *curlHandle, struct HttpConfigCache *config, const char *contentType,
+        CURLoption httpMethod, const char *url, const char *sslCertPath, const char *authToken,
+        size_t (*readFunction) (void *ptr, size_t size, size_t nmemb, void *userp), void *readData,
+        long msgToSendSize, http_rxbuffer_t *rx, http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    CURLcode curlResult;
+
+    if (_libhttpcomm_configureHttp(curlHandle, config, contentType, httpMethod, url,
+            sslCertPath, authToken, params.timeouts, ProgressCallback) == false)
+    {
+        return false;
+    }
+
+    // CURLOPT_READFUNCTION and CURLOPT_READDATA in this context refers to
+    // data to be sent to the server... so curl will read data from us.
+    if(readFunction != NULL)
+    {
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_READFUNCTION, readFunction);
+        if (curlResult != CURLE_OK)
+        {
+            SYSLOG_ERR("%s CURLOPT_READFUNCTION", curl_easy_strerror(curlResult));
+            return false;
+        }
+
+        /* pointer to pass to our read function */
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_READDATA, readData);
+        if (curlResult != CURLE_OK)
+        {
+            SYSLOG_ERR("%s CURLOPT_READDATA", curl_easy_strerror(curlResult));
+            return false;
+        }
+
+        // A request retried on a new connection, after a kept-alive one died,
+        // sends its message again from the start
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_SEEKFUNCTION,
+                (readFunction == read_vector_callback) ? seek_vector_callback : seek_callback);
+        if (curlResult != CURLE_OK)
+        {
+            SYSLOG_ERR("%s CURLOPT_SEEKFUNCTION", curl_easy_strerror(curlResult));
+            return false;
+        }
+
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_SEEKDATA, readData);
+        if (curlResult != CURLE_OK)
+        {
+            SYSLOG_ERR("%s CURLOPT_SEEKDATA", curl_easy_strerror(curlResult));
+            return false;
+        }
+
+        // curl writes the Content-Length header itself. Without it, the body would be
+        // sent chunked and the server could not keep the connection open afterwards.
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_POSTFIELDSIZE, msgToSendSize);
+        if (curlResult != CURLE_OK)
+        {
+            SYSLOG_ERR("%s CURLOPT_POSTFIELDSIZE", curl_easy_strerror(curlResult));
+            return false;
+        }
+    }
+
+    // sets maximum size of our internal buffer
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_BUFFERSIZE, (long) rx->maxSize);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_BUFFERSIZE", curl_easy_strerror(curlResult));
+        return false;
+    }
+
+    // CURLOPT_WRITEFUNCTION and CURLOPT_WRITEDATA in this context refers to
+    // data received from the server... so curl will write data to us.
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, writer);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_WRITEFUNCTION", curl_easy_strerror(curlResult));
+        return false;
+    }
+
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, rx);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_WRITEDATA", curl_easy_strerror(curlResult));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief   Turns the outcome of a message transfer into the value returned to the caller
+ *
+ * @param   curlHandle: curl handle that performed the transfer
+ * @param   curlResult: result of the transfer
+ * @param   url: url of the server, for logging
+ * @param   rx: response received, emptied if it is the server's time-out message
+ * @param   params: parameters of the transfer
+ *
+ * @return  0 for success, errno value for failure
+ */
+static int _libhttpcomm_msgResult(CURL *curlHandle, CURLcode curlResult, const char *url, http_rxbuffer_t *rx,
+        http_param_t params)
+{
+    double connectDuration = 0.0;
+    double transferDuration = 0.0;
+    double nameResolvingDuration = 0.0;
+    long httpResponseCode = 0;
+    long httpConnectCode = 0;
+    long curlErrno = 0;
+
+    curl_easy_getinfo(curlHandle, CURLINFO_APPCONNECT_TIME, &connectDuration );
+    curl_easy_getinfo(curlHandle, CURLINFO_NAMELOOKUP_TIME, &nameResolvingDuration );
+    curl_easy_getinfo(curlHandle, CURLINFO_TOTAL_TIME, &transferDuration );
+    curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &httpResponseCode );
+    curl_easy_getinfo(curlHandle, CURLINFO_HTTP_CONNECTCODE, &httpConnectCode );
+
+    if (httpResponseCode >= 300 || httpConnectCode >= 300)
+    {
+        if (params.verbose == true) SYSLOG_ERR("HTTP error response code:%ld, connect code:%ld", httpResponseCode, httpConnectCode);
+        return EHOSTUNREACH;
+    }
+
+    if (curlResult != CURLE_OK)
+    {
+        if (curlResult != CURLE_ABORTED_BY_CALLBACK)
+        {
+            if (curl_easy_getinfo(curlHandle, CURLINFO_OS_ERRNO, &curlErrno) != CURLE_OK)
+            {
+                curlErrno = ENOEXEC;
+                SYSLOG_ERR("curl_easy_getinfo");
+            }
+            if (curlResult == CURLE_OPERATION_TIMEDOUT) curlErrno = ETIMEDOUT; /// time out error must be distinctive
+            else if (curlErrno == 0) curlErrno = _libhttpcomm_connectionLost(curlResult) ? ECONNRESET : ENOEXEC; /// can't be equalt to 0 if curlResult != CURLE_OK
+
+            if (params.verbose == true) SYSLOG_WARNING("%s, %s for url %s",
+                    curl_easy_strerror(curlResult), strerror((int)curlErrno), url);
+        }else
+        {
+            curlErrno = EAGAIN;
+            if (params.verbose == true) SYSLOG_DEBUG("quitting curl transfer");
+        }
+        return (int)curlErrno;
+    }else if (params.verbose == true)
+    {
+        if (nameResolvingDuration >= 2.0)
+        {
+            SYSLOG_WARNING("connectDuration=%.2lf, nameResolvingDuration=%.2lf, transferDuration=%.2lf, "
+                    "httpConnectCode=%ld",
+                    connectDuration, nameResolvingDuration, transferDuration, httpConnectCode);
+        }
+        else
+        {
+            SYSLOG_DEBUG("connectDuration=%.2lf, nameResolvingDuration=%.2lf, transferDuration=%.2lf, "
+                    "httpConnectCode=%ld",
+                    connectDuration, nameResolvingDuration, transferDuration, httpConnectCode);
+        }
+    }
+
+    // the following is a special case - a time-out from the server is going to return a
+    // string with 1 character in it ...
+    if (rx->length > 1)
+    {
+        if (params.verbose == true) SYSLOG_DEBUG("received msg length %zu", rx->length);
+    }else
+    {
+        SYSLOG_DEBUG("received time-out message from the server");
+        libhttpcomm_rxBufferReset(rx);
+        return EAGAIN;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief   Tells the transfers that failed because the connection went away, without
+ *          an errno: the server may take the request on another connection
+ *
+ * @param   curlResult: result of the transfer
+ *
+ * @return  true if the connection was lost
+ */
+static bool _libhttpcomm_connectionLost(CURLcode curlResult)
+{
+    switch (curlResult)
+    {
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_SEND_FAIL_REWIND:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief   Get a file through HTTP, using (and keeping) a connection of the session
+ *
+ * @param   session: session owning the connection
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   others: see libhttpcomm_getFile
+ *
+ * @return  true for success, false for failure
+ */
+static int _libhttpcomm_getFile(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, const char *url,
+        const char *sslCertPath, const char *authToken, FILE *rxFile, int maxRxFileSize, http_timeout_t timeouts,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    struct HttpSessionHandle *handle = NULL;
+    CURL * curlHandle = NULL;
+    CURLcode curlResult;
+    double connectDuration = 0.0;
+    double transferDuration = 0.0;
+    double nameResolvingDuration = 0.0;
+    long curlErrno = 0;
+    long httpResponseCode = 0;
+    long httpConnectCode = 0;
+    bool_t retVal = true;
+
+    assert (rxFile);
+    assert (url);
+
+    SYSLOG_DEBUG("url: %s", url);
+
+    handle = _libhttpcomm_sessionAcquire(session, shareCurlHandle, url);
+    if (handle != NULL)
+    {
+        curlHandle = handle->curlHandle;
+
+        if (_libhttpcomm_configureHttp(curlHandle, &handle->config, NULL, CURLOPT_HTTPGET, url,
+                sslCertPath, authToken, timeouts, ProgressCallback) == false)
+        {
+            retVal = false;
+            goto out;
+        }
+
+        // refuses files announced larger than that, 0 for no limit
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_MAXFILESIZE, (long) maxRxFileSize);
+        if (curlResult != CURLE_OK)
+        {
+            SYSLOG_ERR("%s CURLOPT_MAXFILESIZE", curl_easy_strerror(curlResult));
+            retVal = false;
+            goto out;
+        }
+
+        // NULL restores curl's own fwrite() into the FILE given as CURLOPT_WRITEDATA
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, NULL);
+        if (curlResult != CURLE_OK)
+        {
+            SYSLOG_ERR("%s CURLOPT_WRITEFUNCTION", curl_easy_strerror(curlResult));
+            retVal = false;
+            goto out;
+        }
+
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, rxFile);
+        if (curlResult != CURLE_OK)
+        {
+            SYSLOG_ERR("%s CURLOPT_WRITEDATA", curl_easy_strerror(curlResult));
+            retVal = false;
+            goto out;
+        }
+
+        curlResult = curl_easy_perform(curlHandle);
+        _libhttpcomm_updateCacheStats(curlHandle);
+        _libhttpcomm_updateMetrics(curlHandle, CURLOPT_HTTPGET, curlResult);
+
+        curl_easy_getinfo(curlHandle, CURLINFO_APPCONNECT_TIME, &connectDuration );
+        curl_easy_getinfo(curlHandle, CURLINFO_NAMELOOKUP_TIME, &nameResolvingDuration );
+        curl_easy_getinfo(curlHandle, CURLINFO_TOTAL_TIME, &transferDuration );
+        curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &httpResponseCode );
+        curl_easy_getinfo(curlHandle, CURLINFO_HTTP_CONNECTCODE, &httpConnectCode );
+
+        if (httpResponseCode >= 300 || httpConnectCode >= 300)
+        {
+            retVal = false;
+            goto out;
+        }
+
+        if (nameResolvingDuration >= 2.0)
+        {
+            SYSLOG_WARNING("connectDuration=%.2lf, nameResolvingDuration=%.2lf, transferDuration=%.2lf",
+                    connectDuration, nameResolvingDuration, transferDuration);
+        }
+        else
+        {
+            SYSLOG_DEBUG("connectDuration=%.2lf, nameResolvingDuration=%.2lf, transferDuration=%.2lf",
+                    connectDuration, nameResolvingDuration, transferDuration);
+        }
+
+        if (curlResult != CURLE_OK)
+        {
+            if (curlResult != CURLE_ABORTED_BY_CALLBACK)
+            {
+                if (curl_easy_getinfo(curlHandle, CURLINFO_OS_ERRNO, &curlErrno) != CURLE_OK)
+                {
+                    curlErrno = 0;
+                    SYSLOG_ERR("curl_easy_getinfo");
+                }
+                SYSLOG_ERR("curl_easy_perform: %s, %s for url %s",
+                        curl_easy_strerror(curlResult), strerror((int)curlErrno), url);
+            }else
+            {
+                SYSLOG_DEBUG("quitting curl transfer");
+            }
+            retVal = false;
+            goto out;
+        }
+    }
+    else
+    {
+        SYSLOG_ERR("curl_easy_init failed");
+        retVal = false;
+    }
+
+    out:
+      _libhttpcomm_closeHttp((handle != NULL) ? &handle->config : NULL);
+      _libhttpcomm_sessionRelease(session, handle);
+      return retVal;
+}
+
+/**
+ * @brief   Downloads a file, resuming it after each dropped connection
+ *
+ * @param   session: session owning the connections
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   others: see libhttpcomm_download
+ *
+ * @return  0 for success, EBADMSG if the file received is corrupt, errno value for failure
+ */
+static int _libhttpcomm_download(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, const char *url,
+        const char *sslCertPath, const char *authToken, http_download_t *download, http_timeout_t timeouts,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    unsigned char buffer[4096];
+    curl_off_t startOffset;
+    ssize_t bytesRead;
+    size_t chunkSize;
+    int attempts = 0;
+    int result = 0;
+    bool retry = false;
+
+    assert(download);
+    assert(download->fd >= 0);
+    assert(url);
+
+    if (download->expectedSize > 0 && download->offset > download->expectedSize)
+    {
+        _libhttpcomm_downloadRestart(download);
+    }
+
+    // the CRC of the bytes kept from an earlier download is computed from the file once
+    if (download->crcOffset > download->offset)
+    {
+        download->crc = crc32(0L, Z_NULL, 0);
+        download->crcOffset = 0;
+    }
+
+    while (download->crcOffset < download->offset)
+    {
+        chunkSize = (size_t) (download->offset - download->crcOffset);
+        if (download->map != NULL)
+        {
+            download->crc = crc32(download->crc, download->map + download->crcOffset, (uInt) chunkSize);
+            download->crcOffset += chunkSize;
+            continue;
+        }
+
+        if (chunkSize > sizeof(buffer))
+        {
+            chunkSize = sizeof(buffer);
+        }
+
+        bytesRead = pread(download->fd, buffer, chunkSize, (off_t) download->crcOffset);
+        if (bytesRead <= 0)
+        {
+            // the file is shorter than the offset given, resume from its end
+            download->offset = download->crcOffset;
+            download->durableOffset = download->crcOffset;
+            break;
+        }
+        download->crc = crc32(download->crc, buffer, (uInt) bytesRead);
+        download->crcOffset += bytesRead;
+    }
+
+    if (download->expectedSize > 0 && download->offset == download->expectedSize)
+    {
+        SYSLOG_DEBUG("%s already received", url);
+    }
+    else
+    {
+        do
+        {
+            startOffset = download->offset;
+            result = _libhttpcomm_downloadAttempt(session, shareCurlHandle, url, sslCertPath, authToken,
+                    download, timeouts, ProgressCallback, &retry);
+
+            if (download->offset > startOffset)
+            {
+                // only attempts that bring nothing count, a flaky link may drop many times
+                attempts = 0;
+            }
+            else
+            {
+                attempts++;
+            }
+
+            if (result != 0 && retry == true)
+            {
+                SYSLOG_INFO("resuming %s at byte %lld: %s", url, (long long) download->offset, strerror(result));
+            }
+        } while (result != 0 && retry == true && attempts < HTTPCOMM_DOWNLOAD_MAX_ATTEMPTS);
+
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+
+    if (download->expectedSize > 0 && download->offset != download->expectedSize)
+    {
+        SYSLOG_ERR("received %lld bytes instead of %lld", (long long) download->offset,
+                (long long) download->expectedSize);
+        _libhttpcomm_downloadRestart(download);
+        return EBADMSG;
+    }
+
+    if ((download->flags & HTTPCOMM_DOWNLOAD_VERIFY_CRC) != 0 && download->crc != download->expectedCrc)
+    {
+        SYSLOG_ERR("CRC 0x%08lx instead of 0x%08lx", download->crc, download->expectedCrc);
+        _libhttpcomm_downloadRestart(download);
+        return EBADMSG;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief   Asks the server for the bytes of a download that are missing
+ *
+ * @param   session: session owning the connection
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   retry: set to true if a new attempt may get further
+ * @param   others: see libhttpcomm_download
+ *
+ * @return  0 for success, errno value for failure
+ */
+static int _libhttpcomm_downloadAttempt(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, const char *url,
+        const char *sslCertPath, const char *authToken, http_download_t *download, http_timeout_t timeouts,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow),
+        bool *retry)
+{
+    struct HttpSessionHandle *handle = NULL;
+    struct HttpDownloadTransfer transfer;
+    CURL * curlHandle = NULL;
+    CURLcode curlResult;
+    long httpResponseCode = 0;
+    long curlErrno = 0;
+    int result = 0;
+
+    *retry = false;
+
+    handle = _libhttpcomm_sessionAcquire(session, shareCurlHandle, url);
+    if (handle == NULL)
+    {
+        SYSLOG_ERR("curl_easy_init failed");
+        return ENOEXEC;
+    }
+    curlHandle = handle->curlHandle;
+
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.curlHandle = curlHandle;
+    transfer.download = download;
+    transfer.startOffset = download->offset;
+    transfer.ProgressCallback = ProgressCallback;
+
+    if (_libhttpcomm_configureHttp(curlHandle, &handle->config, NULL, CURLOPT_HTTPGET, url, sslCertPath, authToken,
+            timeouts, (ProgressCallback != NULL) ? _libhttpcomm_downloadProgress : NULL) == false)
+    {
+        result = ENOEXEC;
+        goto out;
+    }
+
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_PROGRESSDATA, &transfer);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_PROGRESSDATA", curl_easy_strerror(curlResult));
+        result = ENOEXEC;
+        goto out;
+    }
+
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, _libhttpcomm_downloadWriter);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_WRITEFUNCTION", curl_easy_strerror(curlResult));
+        result = ENOEXEC;
+        goto out;
+    }
+
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &transfer);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_WRITEDATA", curl_easy_strerror(curlResult));
+        result = ENOEXEC;
+        goto out;
+    }
+
+    // asks for "Range: bytes=offset-", nothing if the offset is 0
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_RESUME_FROM_LARGE, download->offset);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_RESUME_FROM_LARGE", curl_easy_strerror(curlResult));
+        result = ENOEXEC;
+        goto out;
+    }
+
+    curlResult = curl_easy_perform(curlHandle);
+    _libhttpcomm_updateCacheStats(curlHandle);
+    _libhttpcomm_updateMetrics(curlHandle, CURLOPT_HTTPGET, curlResult);
+    curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &httpResponseCode);
+
+    _libhttpcomm_downloadSync(download);
+
+    if (transfer.error != 0)
+    {
+        result = transfer.error;
+    }
+    else if (curlResult == CURLE_RANGE_ERROR || httpResponseCode == 416)
+    {
+        // the server can't resume, or its file changed: start over
+        SYSLOG_WARNING("%s can't be resumed at byte %lld", url, (long long) download->offset);
+        _libhttpcomm_downloadRestart(download);
+        result = ERANGE;
+        *retry = true;
+    }
+    else if (httpResponseCode >= 300)
+    {
+        SYSLOG_ERR("HTTP error response code:%ld for url %s", httpResponseCode, url);
+        result = EHOSTUNREACH;
+    }
+    else if (curlResult == CURLE_ABORTED_BY_CALLBACK)
+    {
+        SYSLOG_DEBUG("quitting curl transfer");
+        result = EAGAIN;
+    }
+    else if (curlResult != CURLE_OK)
+    {
+        if (curl_easy_getinfo(curlHandle, CURLINFO_OS_ERRNO, &curlErrno) != CURLE_OK || curlErrno == 0)
+        {
+            curlErrno = ENOEXEC;
+        }
+        if (curlResult == CURLE_OPERATION_TIMEDOUT)
+        {
+            curlErrno = ETIMEDOUT;
+        }
+        else if (curlResult == CURLE_PARTIAL_FILE)
+        {
+            // the connection dropped before the end of the file
+            curlErrno = ECONNRESET;
+        }
+        SYSLOG_WARNING("curl_easy_perform: %s, %s for url %s",
+                curl_easy_strerror(curlResult), strerror((int) curlErrno), url);
+        result = (int) curlErrno;
+        *retry = true;
+    }
+
+    out:
+      // the next requests made with this handle start from the first byte, without progress data
+      curl_easy_setopt(curlHandle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) 0);
+      curl_easy_setopt(curlHandle, CURLOPT_PROGRESSDATA, NULL);
+      _libhttpcomm_closeHttp(&handle->config);
+      _libhttpcomm_sessionRelease(session, handle);
+      return result;
+}
+
+/**
+ * @brief   Called by curl with the bytes of a download, written where they belong in
+ *              the destination without any intermediate buffer
+ *
+ * @param   ptr: bytes received
+ * @param   size: size of an element
+ * @param   nmemb: number of elements
+ * @param   userp: the HttpDownloadTransfer
+ *
+ * @return  the number of bytes consumed, anything else aborts the transfer
+ */
+static size_t _libhttpcomm_downloadWriter(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    struct HttpDownloadTransfer *transfer = (struct HttpDownloadTransfer *) userp;
+    http_download_t *download = transfer->download;
+    size_t length = size * nmemb;
+    size_t written = 0;
+    ssize_t result;
+
+    if (transfer->httpResponseCode == 0)
+    {
+        curl_easy_getinfo(transfer->curlHandle, CURLINFO_RESPONSE_CODE, &transfer->httpResponseCode);
+    }
+
+    if (transfer->httpResponseCode >= 300)
+    {
+        // an error page, not a part of the file
+        return length;
+    }
+
+    if (download->expectedSize > 0 && download->offset + (curl_off_t) length > download->expectedSize)
+    {
+        SYSLOG_ERR("the file is larger than the %lld bytes expected", (long long) download->expectedSize);
+        transfer->error = EFBIG;
+        return 0;
+    }
+
+    if (download->map != NULL)
+    {
+        memcpy(download->map + download->offset, ptr, length);
+    }
+    else
+    {
+        while (written < length)
+        {
+            result = pwrite(download->fd, (char *) ptr + written, length - written,
+                    (off_t) (download->offset + written));
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                SYSLOG_ERR("pwrite: %s", strerror(errno));
+                transfer->error = errno;
+                return 0;
+            }
+            written += result;
+        }
+    }
+
+    download->crc = crc32(download->crc, (const Bytef *) ptr, (uInt) length);
+    download->offset += length;
+    download->crcOffset = download->offset;
+
+    if (download->offset - download->durableOffset >= HTTPCOMM_DOWNLOAD_SYNC_SIZE)
+    {
+        _libhttpcomm_downloadSync(download);
+    }
+
+    return length;
+}
+
+/**
+ * @brief   Reports the progress of the whole file to the progress callback of a download,
+ *              rather than the progress of the current attempt
+ *
+ * @param   clientp: the HttpDownloadTransfer
+ * @param   others: progress of the current attempt, see CURLOPT_PROGRESSFUNCTION
+ *
+ * @return  what the progress callback of the download returns, anything else than 0
+ *              aborts the transfer
+ */
+static int _libhttpcomm_downloadProgress(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow)
+{
+    struct HttpDownloadTransfer *transfer = (struct HttpDownloadTransfer *) clientp;
+    double total = (double) transfer->download->expectedSize;
+
+    if (total <= 0.0 && dltotal > 0.0)
+    {
+        total = (double) transfer->startOffset + dltotal;
+    }
+
+    return transfer->ProgressCallback(transfer->download, total, (double) transfer->startOffset + dlnow,
+            ultotal, ulnow);
+}
+
+/**
+ * @brief   Flushes the bytes of a download received so far to storage
+ *
+ * @param   download: download to flush
+ *
+ * @return  none
+ */
+static void _libhttpcomm_downloadSync(http_download_t *download)
+{
+    long pageSize;
+    curl_off_t start;
+
+    if (download->offset == download->durableOffset)
+    {
+        return;
+    }
+
+    if (download->map != NULL)
+    {
+        // msync wants an address aligned on a page
+        pageSize = sysconf(_SC_PAGESIZE);
+        start = download->durableOffset - (download->durableOffset % pageSize);
+        if (msync(download->map + start, (size_t) (download->offset - start), MS_SYNC) < 0)
+        {
+            SYSLOG_WARNING("msync: %s", strerror(errno));
+            return;
+        }
+    }
+    else if (fdatasync(download->fd) < 0)
+    {
+        SYSLOG_WARNING("fdatasync: %s", strerror(errno));
+        return;
+    }
+
+    download->durableOffset = download->offset;
+}
+
+/**
+ * @brief   Throws away the bytes received, the next attempt downloads the whole file
+ *
+ * @param   download: download to start over
+ *
+ * @return  none
+ */
+static void _libhttpcomm_downloadRestart(http_download_t *download)
+{
+    if (download->map == NULL && ftruncate(download->fd, 0) < 0)
+    {
+        SYSLOG_WARNING("ftruncate: %s", strerror(errno));
+    }
+
+    download->offset = 0;
+    download->durableOffset = 0;
+    download->crc = crc32(0L, Z_NULL, 0);
+    download->crcOffset = 0;
+}
+
+/**
+ * @brief   Streams an upload to the server, using (and keeping) a connection of the session
+ *
+ * @param   session: session owning the connection
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   others: see libhttpcomm_upload
+ *
+ * @return  0 for success, errno value for failure
+ */
+static int _libhttpcomm_upload(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, const char *url,
+        const char *sslCertPath, const char *authToken, http_upload_t *upload, http_rxbuffer_t *rx,
+        http_param_t params,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+{
+    struct HttpSessionHandle *handle = NULL;
+    struct HttpUploadTransfer transfer;
+    CURL * curlHandle = NULL;
+    CURLcode curlResult;
+    int result = 0;
+
+    assert(url);
+    assert(upload);
+    assert(upload->fd >= 0 || upload->producer != NULL);
+    assert(rx);
+
+    libhttpcomm_rxBufferReset(rx);
+
+    handle = _libhttpcomm_sessionAcquire(session, shareCurlHandle, url);
+    if (handle == NULL)
+    {
+        SYSLOG_ERR("curl_easy_init failed");
+        return ENOEXEC;
+    }
+    curlHandle = handle->curlHandle;
+
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.upload = upload;
+
+    if (upload->fd >= 0)
+    {
+        // the kernel reads ahead of curl, which reads straight into its own buffer
+        posix_fadvise(upload->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (_libhttpcomm_setupMsg(curlHandle, &handle->config, "Content-Type: application/octet-stream", CURLOPT_POST,
+            url, sslCertPath, authToken, _libhttpcomm_uploadReader, &transfer, 0, rx, params,
+            ProgressCallback) == false)
+    {
+        result = ENOEXEC;
+        goto out;
+    }
+
+    // -1 lets curl send the upload in chunks, as it is produced
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_POSTFIELDSIZE_LARGE, upload->size);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_POSTFIELDSIZE_LARGE", curl_easy_strerror(curlResult));
+        result = ENOEXEC;
+        goto out;
+    }
+
+    if (upload->size < 0)
+    {
+        _libhttpcomm_headersAdd(&handle->config, (char *) "Transfer-Encoding: chunked");
+    }
+
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_MAX_SEND_SPEED_LARGE, upload->maxBytesPerSec);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_MAX_SEND_SPEED_LARGE", curl_easy_strerror(curlResult));
+        result = ENOEXEC;
+        goto out;
+    }
+
+    curlResult = curl_easy_perform(curlHandle);
+    _libhttpcomm_updateCacheStats(curlHandle);
+    _libhttpcomm_updateMetrics(curlHandle, CURLOPT_POST, curlResult);
+
+    if (transfer.error != 0)
+    {
+        result = transfer.error;
+    }
+    else
+    {
+        result = _libhttpcomm_msgResult(curlHandle, curlResult, url, rx, params);
+
+        // unlike a poll, an upload may get an empty answer
+        if (result == EAGAIN && curlResult == CURLE_OK)
+        {
+            result = 0;
+        }
+    }
+
+    out:
+      // the next requests made with this handle are not capped
+      curl_easy_setopt(curlHandle, CURLOPT_MAX_SEND_SPEED_LARGE, (curl_off_t) 0);
+      _libhttpcomm_closeHttp(&handle->config);
+      _libhttpcomm_sessionRelease(session, handle);
+      return result;
+}
+
+/**
+ * @brief   Called by curl for the next bytes of an upload, read from the file descriptor
+ *              or the producer straight into the buffer of curl
+ *
+ * @param   ptr: buffer of curl
+ * @param   size: size of an element
+ * @param   nmemb: number of elements
+ * @param   userp: the HttpUploadTransfer
+ *
+ * @return  the number of bytes read, 0 at the end of the upload, CURL_READFUNC_ABORT on failure
+ */
+static size_t _libhttpcomm_uploadReader(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    struct HttpUploadTransfer *transfer = (struct HttpUploadTransfer *) userp;
+    http_upload_t *upload = transfer->upload;
+    size_t length = size * nmemb;
+    ssize_t bytesRead;
+
+    if (upload->size >= 0 && (curl_off_t) length > upload->size - transfer->sent)
+    {
+        length = (size_t) (upload->size - transfer->sent);
+    }
+
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    if (upload->fd >= 0)
+    {
+        do
+        {
+            bytesRead = read(upload->fd, ptr, length);
+        } while (bytesRead < 0 && errno == EINTR);
+
+        if (bytesRead < 0)
+        {
+            SYSLOG_ERR("read: %s", strerror(errno));
+            transfer->error = errno;
+            return CURL_READFUNC_ABORT;
+        }
+    }
+    else
+    {
+        bytesRead = upload->producer((char *) ptr, length, upload->producerUserData);
+        if (bytesRead < 0)
+        {
+            SYSLOG_DEBUG("upload cancelled by its producer");
+            transfer->error = ECANCELED;
+            return CURL_READFUNC_ABORT;
+        }
+    }
+
+    if (bytesRead == 0 && upload->size >= 0)
+    {
+        // curl would wait for the missing bytes until the transfer times out
+        SYSLOG_ERR("upload ended after %lld bytes out of %lld", (long long) transfer->sent, (long long) upload->size);
+        transfer->error = ENODATA;
+        return CURL_READFUNC_ABORT;
+    }
+
+    transfer->sent += bytesRead;
+    return (size_t) bytesRead;
+}
+
+/**
+ * @brief   Sends a file through HTTP, using (and keeping) a connection of the session
+ *
+ * @param   session: session owning the connection
+ * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   others: see libhttpcomm_sendFile
+ *
+ * @return  true for success, false for failure
+ */
+static int _libhttpcomm_sendFile(libhttpcomm_session_t *session, CURLSH *shareCurlHandle, const char *url,
+        const char *sslCertPath, const char *authToken, char *fileName, http_rxbuffer_t *rx,
+        http_timeout_t timeouts)
+{
+    http_upload_t upload;
+    struct stat fileStats;
+    http_param_t params;
+    int result;
+
+    assert (url);
+    assert (fileName);
+    assert (rx);
+
+    memset(&upload, 0, sizeof(upload));
+    upload.fd = open(fileName, O_RDONLY);
+    if (upload.fd < 0)
+    {
+        SYSLOG_ERR("%s opening %s", strerror(errno), fileName);
+        return false;
+    }
+
+    if (fstat(upload.fd, &fileStats) < 0)
+    {
+        SYSLOG_ERR("stats returned %s", strerror(errno));
+        close(upload.fd);
+        return false;
+    }
+    upload.size = (curl_off_t) fileStats.st_size;
+
+    SYSLOG_DEBUG("fileName: %s, url: %s, fileSize = %lld", fileName, url, (long long) upload.size);
+
+    params.timeouts = timeouts;
+    params.verbose = true;
+
+    result = _libhttpcomm_upload(session, shareCurlHandle, url, sslCertPath, authToken, &upload, rx,
+            params, NULL);
+
+    close(upload.fd);
+    return (result == 0) ? true : false;
+}
+
+/**
+ * @brief   Gets a connection of the session for the host of the url. A connection that
+ *              already talked to the same host is preferred so it can be reused;
+ *              otherwise an empty slot is filled or the least recently used one is
+ *              recycled. If all connections are busy, a temporary one is created.
+ *
+ * @param   session: session to take the connection from
+ * @param   shareCurlHandle: curl handle shared across connections, NULL if none
+ * @param   url: url of the server (hostname + uri)
+ *
+ * @return  the connection, NULL on failure
+ */
+static struct HttpSessionHandle *_libhttpcomm_sessionAcquire(libhttpcomm_session_t *session,
+        CURLSH *shareCurlHandle, const char *url)
+{
+    struct HttpSessionHandle *handle = NULL;
+    struct HttpSessionHandle *candidate;
+    struct HttpSessionHandle *emptySlot = NULL;
+    struct HttpSessionHandle *oldest = NULL;
+    char host[HTTPCOMM_HOST_STRING_SIZE];
+    int i;
+
+    _libhttpcomm_getHost(url, host, sizeof(host));
+
+    pthread_mutex_lock(&session->mutex);
+
+    // Prefer an idle connection that already talked to this host, then an empty
+    // slot, then the least recently used idle connection
+    for (i = 0; i < HTTPCOMM_SESSION_MAX_HANDLES; i++)
+    {
+        candidate = &session->handles[i];
+        if (candidate->inUse == true)
+        {
+            continue;
+        }
+
+        if (candidate->curlHandle == NULL)
+        {
+            if (emptySlot == NULL)
+            {
+                emptySlot = candidate;
+            }
+        }
+        else if (strcmp(candidate->host, host) == 0)
+        {
+            handle = candidate;
+            break;
+        }
+        else if (oldest == NULL || candidate->lastUsed < oldest->lastUsed)
+        {
+            oldest = candidate;
+        }
+    }
+
+    if (handle == NULL)
+    {
+        handle = (emptySlot != NULL) ? emptySlot : oldest;
+    }
+
+    if (handle != NULL)
+    {
+        handle->inUse = true;
+    }
+
+    pthread_mutex_unlock(&session->mutex);
+
+    if (handle == NULL)
+    {
+        SYSLOG_DEBUG("all %d session connections are busy, using a temporary one", HTTPCOMM_SESSION_MAX_HANDLES);
+        handle = (struct HttpSessionHandle *) calloc(1, sizeof(struct HttpSessionHandle));
+        if (handle == NULL)
+        {
+            SYSLOG_ERR("calloc: %s", strerror(errno));
+            return NULL;
+        }
+        handle->temporary = true;
+        handle->inUse = true;
+    }
+
+    if (handle->curlHandle != NULL && strcmp(handle->host, host) != 0)
+    {
+        // recycling a connection to another host: start from a clean handle
+        curl_easy_cleanup(handle->curlHandle);
+        handle->curlHandle = NULL;
+        _libhttpcomm_configFree(&handle->config);
+    }
+
+    if (handle->curlHandle == NULL)
+    {
+        handle->curlHandle = curl_easy_init();
+        handle->shareCurlHandle = NULL;
+        if (handle->curlHandle == NULL || _libhttpcomm_initHttp(handle->curlHandle, handle->errorBuffer) == false)
+        {
+            _libhttpcomm_sessionRelease(session, handle);
+            return NULL;
+        }
+    }
+
+    strncpy(handle->host, host, sizeof(handle->host));
+    handle->errorBuffer[0] = '\0';
+
+    if (handle->shareCurlHandle != shareCurlHandle)
+    {
+        if (curl_easy_setopt(handle->curlHandle, CURLOPT_SHARE, shareCurlHandle) != CURLE_OK)
+        {
+            SYSLOG_ERR("CURLOPT_SHARE");
+            _libhttpcomm_sessionRelease(session, handle);
+            return NULL;
+        }
+        handle->shareCurlHandle = shareCurlHandle;
+    }
+
+    return handle;
+}
+
+/**
+ * @brief   Gives a connection back to its session, keeping it open for the next request
+ *
+ * @param   session: session the connection was taken from
+ * @param   handle: connection returned by _libhttpcomm_sessionAcquire, may be NULL
+ *
+ * @return  none
+ */
+static void _libhttpcomm_sessionRelease(libhttpcomm_session_t *session, struct HttpSessionHandle *handle)
+{
+    if (handle == NULL)
+    {
+        return;
+    }
+
+    if (handle->temporary == true)
+    {
+        if (handle->curlHandle != NULL)
+        {
+            curl_easy_cleanup(handle->curlHandle);
+        }
+        _libhttpcomm_configFree(&handle->config);
+        free(handle->compressed.buffer);
+        free(handle);
+        return;
+    }
+
+    pthread_mutex_lock(&session->mutex);
+    handle->lastUsed = time(NULL);
+    handle->inUse = false;
+    pthread_mutex_unlock(&session->mutex);
+}
+
+/**
+ * @brief   Creates the per-thread session used by the one-shot functions
+ *
+ * @return  none
+ */
+static void _libhttpcomm_threadSessionKeyInit(void)
+{
+    pthread_key_create(&sThreadSessionKey, (void (*)(void *)) libhttpcomm_sessionClose);
+}
+
+/**
+ * @brief   Returns the session private to the calling thread, so one-shot calls made
+ *              by the same thread reuse their connections. It is closed when the
+ *              thread exits.
+ *
+ * @return  the session of the calling thread
+ */
+static libhttpcomm_session_t *_libhttpcomm_threadSession(void)
+{
+    libhttpcomm_session_t *session;
+
+    pthread_once(&sThreadSessionOnce, _libhttpcomm_threadSessionKeyInit);
+
+    session = (libhttpcomm_session_t *) pthread_getspecific(sThreadSessionKey);
+    if (session == NULL)
+    {
+        session = libhttpcomm_sessionOpen(NULL);
+        assert(session);
+        pthread_setspecific(sThreadSessionKey, session);
+    }
+
+    return session;
+}
+
+/**
+ * @brief   This function sets the options of a new curl handle that stay the same
+ *              for every request made through it
+ *
+ * @param   curlHandle: curl handle to initialize
+ * @param   errorBuffer: buffer of CURL_ERROR_SIZE bytes receiving curl error messages
+ *
+ * @return  true for success, false for failure
+ */
+static int _libhttpcomm_initHttp(CURL * curlHandle, char *errorBuffer)
+{
+    int retVal = true;
+    CURLcode curlResult;
+
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_ERRORBUFFER, errorBuffer);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_ERRORBUFFER", curl_easy_strerror(curlResult));
+        retVal = false;
+        goto out;
+    }
+
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_DNS_CACHE_TIMEOUT, HTTPCOMM_DEFAULT_DNS_CACHING_TIMEOUT_SEC);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_DNS_CACHE_TIMEOUT", curl_easy_strerror(curlResult));
+        retVal = false;
+        goto out;
+    }
+
+    // for safe multi-threaded operation
+    // now only used in one thread. to be able to disable signal -> c-ares library has be used
+    // for name resolving
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_NOSIGNAL, 1L);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_NOSIGNAL", curl_easy_strerror(curlResult));
+        retVal = false;
+        goto out;
+    }
 
-        // the following is a special case - a time-out from the server is going to return a
-        // string with 1 character in it ...
-        if (strlen(rxBuffer) > 1)
-        {
-            /* put the result into the main buffer and return */
-            if (params.verbose == true) SYSLOG_DEBUG("received msg length %d", strlen(rxBuffer));
-            if(msgToSendPtr != NULL)
-            {
-              msgToSendPtr[0] = 0;
-            }
+    // keep the connection open after the transfer so the next request reuses it
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_FORBID_REUSE, 0L);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_FORBID_REUSE", curl_easy_strerror(curlResult));
+        retVal = false;
+        goto out;
+    }
 
-        }else
-        {
-            SYSLOG_DEBUG("received time-out message from the server");
-            rxBuffer[0] = '\0';
-            curlErrno = EAGAIN;
-            goto out;
-        }
+#if 0
+    //TODO:
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_VERBOSE, true);
+    if (curlResult != CURLE_OK)
+    {
+        SYSLOG_ERR("%s CURLOPT_VERBOSE", curl_easy_strerror(curlResult));
+        retVal = false;
+        goto out;
     }
-    else
+#endif
+
+    curlResult = curl_easy_setopt(curlHandle, CURLOPT_FRESH_CONNECT, 0L);
+    if (curlResult != CURLE_OK)
     {
-        SYSLOG_ERR("curl_easy_init failed");
-        curlErrno = ENOEXEC;
+        SYSLOG_ERR("%s CURLOPT_FRESH_CONNECT", curl_easy_strerror(curlResult));
+        retVal = false;
+        goto out;
     }
 
     out:
-      _libhttpcomm_closeHttp(curlHandle, slist);
-      return (int)curlErrno;
+        return retVal;
 }
 
 /**
- * @brief   Get a file through HTTP from PPC servers
+ * @brief   This function configures a HTTP connection with PPC standard parameters.
+ *              The curl handle keeps the options of its previous request, so only the
+ *              options that changed since then are set again. The header lines that stay
+ *              the same from one request to the next are built once, and built again only
+ *              when the content type or the authentication token changes.
  *
- * @param   shareCurlHandle: Curl handle shared across connections
+ * @param   curlHandle: curl handle to configure
+ * @param   config: options and header lines the curl handle was last configured with
+ * @param   contentType: "Content-Type: ..." header line, a static string, NULL if none
+ * @param   httpMethod: HTTP RESTFUL method to use (GET, POST, DELETE PUT)
  * @param   url: url of the server (hostname + uri)
  * @param   sslCertPath: location of where the certificate is
  * @param   authToken: authentication token to be added in the header
- * @param   rxFile: FILE ptr to the incoming file
- * @param   maxRxFileSize: max size of the file to receive
  * @param   timeouts: specifies connect and transfer timeouts for the connection
- * @param   ProgressCallback: function pointer that will be called every second during the connection
+ * @param   ProgressCallback: Function to be called periodically by curl every second
+ *              while the transfer is underway
  *
  * @return  true for success, false for failure
  */
-int libhttpcomm_getFile(CURLSH * shareCurlHandle, const char *url, const char *sslCertPath, const char *authToken,
-                FILE *rxFile, int maxRxFileSize, http_timeout_t timeouts,
-                int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+static int _libhttpcomm_configureHttp(CURL * curlHandle, struct HttpConfigCache *config, const char *contentType, CURLoption httpMethod,
+        const char *url, const char *sslCertPath, const char *authToken, http_timeout_t timeouts,
+        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
 {
-    CURL * curlHandle;
+    int retVal = true;
     CURLcode curlResult;
-    char errorBuffer[CURL_ERROR_SIZE];
-    struct curl_slist *slist = NULL;
-    double connectDuration = 0.0;
-    double transferDuration = 0.0;
-    double nameResolvingDuration = 0.0;
-    long curlErrno = 0;
-    long httpResponseCode = 0;
-    long httpConnectCode = 0;
-    bool_t retVal = true;
 
-    assert (rxFile);
-    assert (url);
-
-    SYSLOG_DEBUG("url: %s", url);
+    // the lines of the previous request are not sent again
+    _libhttpcomm_closeHttp(config);
 
-    curlHandle = curl_easy_init();
-    if (curlHandle)
+    if (config->valid == false || config->timeouts.connectTimeout != timeouts.connectTimeout)
     {
-        if (_libhttpcomm_configureHttp(curlHandle, shareCurlHandle, slist, CURLOPT_HTTPGET, url,
-                sslCertPath, authToken, timeouts, ProgressCallback) == false)
+        // less than 30 seconds is not reliable, 0 restores curl's default
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_CONNECTTIMEOUT, timeouts.connectTimeout);
+        if (curlResult != CURLE_OK)
         {
+            SYSLOG_ERR("%s CURLOPT_CONNECTTIMEOUT", curl_easy_strerror(curlResult));
             retVal = false;
             goto out;
         }
+    }
 
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_ERRORBUFFER, errorBuffer);
+    if (config->valid == false || config->timeouts.transferTimeout != timeouts.transferTimeout)
+    {
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_TIMEOUT, timeouts.transferTimeout);
         if (curlResult != CURLE_OK)
         {
-            SYSLOG_ERR("%s CURLOPT_ERRORBUFFER", curl_easy_strerror(curlResult));
+            SYSLOG_ERR("%s CURLOPT_TIMEOUT", curl_easy_strerror(curlResult));
             retVal = false;
             goto out;
         }
+    }
+    config->timeouts = timeouts;
 
-        // sets maximum size of our internal buffer
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_BUFFERSIZE, maxRxFileSize);
+    if (config->valid == false || config->ProgressCallback != ProgressCallback)
+    {
+        // set progress meter so that we can read if the push pipe is getting full
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_NOPROGRESS, (ProgressCallback != NULL) ? 0L : 1L);
         if (curlResult != CURLE_OK)
         {
-            SYSLOG_ERR("%s CURLOPT_BUFFERSIZE", curl_easy_strerror(curlResult));
+            SYSLOG_ERR("%s CURLOPT_NOPROGRESS", curl_easy_strerror(curlResult));
             retVal = false;
             goto out;
         }
 
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, rxFile);
-        if (curlResult != CURLE_OK)
+        if(ProgressCallback != NULL)
         {
-            SYSLOG_ERR("%s CURLOPT_WRITEDATA", curl_easy_strerror(curlResult));
-            retVal = false;
-            goto out;
+            curlResult = curl_easy_setopt(curlHandle, CURLOPT_PROGRESSFUNCTION, ProgressCallback);
+            if (curlResult != CURLE_OK)
+            {
+                SYSLOG_ERR("%s CURLOPT_PROGRESSFUNCTION", curl_easy_strerror(curlResult));
+                retVal = false;
+                goto out;
+            }
         }
+        config->ProgressCallback = ProgressCallback;
+    }
 
-        curlResult = curl_easy_perform(curlHandle);
-
-        curl_easy_getinfo(curlHandle, CURLINFO_APPCONNECT_TIME, &connectDuration );
-        curl_easy_getinfo(curlHandle, CURLINFO_NAMELOOKUP_TIME, &nameResolvingDuration );
-        curl_easy_getinfo(curlHandle, CURLINFO_TOTAL_TIME, &transferDuration );
-        curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &httpResponseCode );
-        curl_easy_getinfo(curlHandle, CURLINFO_HTTP_CONNECTCODE, &httpConnectCode );
-
-        if (httpResponseCode >= 300 || httpConnectCode >= 300)
+    if (config->valid == false || _libhttpcomm_stringChanged(config->sslCertPath, sslCertPath))
+    {
+        // set in both cases, a handle used with a certificate path before must verify the peer again without one
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_SSL_VERIFYPEER, (sslCertPath != NULL) ? 0L : 1L);
+        if (curlResult != CURLE_OK)
         {
+            SYSLOG_ERR("%s CURLOPT_SSL_VERIFYPEER", curl_easy_strerror(curlResult));
             retVal = false;
             goto out;
         }
 
-        if (nameResolvingDuration >= 2.0)
-        {
-            SYSLOG_WARNING("connectDuration=%.2lf, nameResolvingDuration=%.2lf, transferDuration=%.2lf",
-                    connectDuration, nameResolvingDuration, transferDuration);
-        }
-        else
-        {
-            SYSLOG_DEBUG("connectDuration=%.2lf, nameResolvingDuration=%.2lf, transferDuration=%.2lf",
-                    connectDuration, nameResolvingDuration, transferDuration);
-        }
-
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_SSL_VERIFYHOST, 2L);
         if (curlResult != CURLE_OK)
         {
-            if (curlResult != CURLE_ABORTED_BY_CALLBACK)
-            {
-                if (curl_easy_getinfo(curlHandle, CURLINFO_OS_ERRNO, &curlErrno) != CURLE_OK)
-                {
-                    curlErrno = 0;
-                    SYSLOG_ERR("curl_easy_getinfo");
-                }
-                SYSLOG_ERR("curl_easy_perform: %s, %s for url %s",
-                        curl_easy_strerror(curlResult), strerror((int)curlErrno), url);
-            }else
-            {
-                SYSLOG_DEBUG("quitting curl transfer");
-            }
+            SYSLOG_ERR("%s CURLOPT_SSL_VERIFYHOST", curl_easy_strerror(curlResult));
             retVal = false;
             goto out;
         }
-    }
-    else
-    {
-        SYSLOG_ERR("curl_easy_init failed");
-        retVal = false;
-    }
-
-    out:
-      _libhttpcomm_closeHttp(curlHandle, slist);
-      return retVal;
-}
-
-/**
- * @brief   Sends a file through HTTP to a remote computer
- *
- * @param   url: url of the server (hostname + uri)
- * @param   sslCertPath: location of where the certificate is
- * @param   authToken: authentication token to be added in the header
- * @param   fileName: ptr to message to send. NULL if none
- * @param   rxBuffer: ptr for storing message received by the server -> must exist
- * @param   maxRxBufferSize: max size of rxBuffer in bytes.
- * @param   timeouts: specifies connect and transfer timeouts for the connection
- *
- * @return  true for success, false for failure
- */
-int libhttpcomm_sendFile(const char *url, const char *sslCertPath, const char *authToken,
-                char *fileName, char *rxBuffer, int maxRxBufferSize, http_timeout_t timeouts)
-{
-    CURL * curlHandle;
-    CURLcode curlResult;
-    FILE *file = NULL;
-    char tempString[PATH_MAX];
-    char errorBuffer[CURL_ERROR_SIZE];
-    int fileSize = 0;
-    struct HttpIoInfo inBoundCommInfo;
-    struct curl_slist *slist = NULL;
-    struct stat fileStats;
-    double connectDuration = 0.0;
-    double transferDuration = 0.0;
-    double nameResolvingDuration = 0.0;
-    long httpResponseCode = 0;
-    long httpConnectCode = 0;
-    long curlErrno = 0;
-    bool_t retVal = true;
-
-    assert (url);
-    assert (fileName);
 
-    curlHandle = curl_easy_init();
-    if (curlHandle)
-    {
-        //creating the curl object
-        // TODO: not sure that setting a pointer to a pointer that is scoped elsewhere is correct.
-        file = fopen(fileName, "r");
-        if (file == NULL)
+        if (_libhttpcomm_stringSet(&config->sslCertPath, sslCertPath) == false)
         {
-            SYSLOG_ERR("%s opening %s", strerror(errno), fileName);
             retVal = false;
             goto out;
         }
 
-        if (stat (fileName, &fileStats) >= 0)
-        {
-            fileSize = (int)fileStats.st_size;
-        }else
-        {
-            SYSLOG_ERR("stats returned %s", strerror(errno));
-        }
-
-        slist = curl_slist_append(slist, "Content-Type: application/octet-stream");
-        snprintf(tempString, sizeof(tempString), "Content-Length: %d", fileSize);
-        slist = curl_slist_append(slist, tempString);
-
-        SYSLOG_DEBUG("fileName: %s, url: %s, fileSize = %d", fileName, url, fileSize);
-
-        if (_libhttpcomm_configureHttp(curlHandle, NULL, slist, CURLOPT_POST, url,
-                sslCertPath, authToken, timeouts, NULL) == false)
+        // the certificates are loaded once for all the connections, not by each of them
+        if (_libhttpcomm_setCaStore(curlHandle, config->sslCertPath) == false)
         {
             retVal = false;
             goto out;
         }
+    }
 
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_ERRORBUFFER, errorBuffer);
+    if (config->valid == false || _libhttpcomm_stringChanged(config->url, url))
+    {
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_URL, url);
         if (curlResult != CURLE_OK)
         {
-            SYSLOG_ERR("%s CURLOPT_ERRORBUFFER", curl_easy_strerror(curlResult));
+            SYSLOG_ERR("%s CURLOPT_URL", curl_easy_strerror(curlResult));
             retVal = false;
             goto out;
         }
 
-        /* pointer to pass to our read function */
-        // here you must put the file info
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_READDATA, file);
-        if (curlResult != CURLE_OK)
+        if (_libhttpcomm_stringSet(&config->url, url) == false)
         {
-            SYSLOG_ERR("%s CURLOPT_READDATA", curl_easy_strerror(curlResult));
             retVal = false;
             goto out;
         }
+    }
+
+    // given again for every request, so curl never has to look the host up itself
+    if (_libhttpcomm_resolverFeed(curlHandle, config, url) == false)
+    {
+        retVal = false;
+        goto out;
+    }
 
-        // sets maximum size of our internal buffer
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_BUFFERSIZE, maxRxBufferSize);
+    if (config->valid == false || config->httpMethod != httpMethod)
+    {
+        curlResult = curl_easy_setopt(curlHandle, httpMethod, 1L);
         if (curlResult != CURLE_OK)
         {
-            SYSLOG_ERR("%s CURLOPT_BUFFERSIZE", curl_easy_strerror(curlResult));
+            SYSLOG_ERR("%s CURLOPT_POST", curl_easy_strerror(curlResult));
             retVal = false;
             goto out;
         }
+        config->httpMethod = httpMethod;
+    }
 
-        // CURLOPT_WRITEFUNCTION and CURLOPT_WRITEDATA in this context refers to
-        // data received from the server... so curl will write data to us.
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, writer);
-        if (curlResult != CURLE_OK)
+    if (config->headers == NULL || _libhttpcomm_stringChanged(config->contentType, contentType)
+            || _libhttpcomm_stringChanged(config->authToken, authToken))
+    {
+        if (_libhttpcomm_headersBuild(config, contentType, authToken) == false)
         {
-            SYSLOG_ERR("%s CURLOPT_WRITEFUNCTION", curl_easy_strerror(curlResult));
             retVal = false;
             goto out;
         }
 
-        inBoundCommInfo.buffer = rxBuffer;
-        inBoundCommInfo.size = maxRxBufferSize;
-
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &inBoundCommInfo);
+        curlResult = curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, config->headers);
         if (curlResult != CURLE_OK)
         {
-            SYSLOG_ERR("%s CURLOPT_WRITEDATA", curl_easy_strerror(curlResult));
+            SYSLOG_ERR("%s CURLOPT_HTTPHEADER", curl_easy_strerror(curlResult));
             retVal = false;
             goto out;
         }
+    }
 
-        curlResult = curl_easy_perform(curlHandle);
-
-        curl_easy_getinfo(curlHandle, CURLINFO_APPCONNECT_TIME, &connectDuration );
-        curl_easy_getinfo(curlHandle, CURLINFO_NAMELOOKUP_TIME, &nameResolvingDuration );
-        curl_easy_getinfo(curlHandle, CURLINFO_TOTAL_TIME, &transferDuration );
-        curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &httpResponseCode );
-        curl_easy_getinfo(curlHandle, CURLINFO_HTTP_CONNECTCODE, &httpConnectCode );
+    config->valid = true;
 
-        if (nameResolvingDuration >= 2.0)
-        {
-            SYSLOG_WARNING("connectDuration=%.2lf, nameResolvingDuration=%.2lf, transferDuration=%.2lf, "
-                    "httpConnectCode=%ld",
-                    connectDuration, nameResolvingDuration, transferDuration, httpConnectCode);
-        }
-        else
+    out:
+        if (retVal == false)
         {
-            SYSLOG_DEBUG("connectDuration=%.2lf, nameResolvingDuration=%.2lf, transferDuration=%.2lf, "
-                    "httpConnectCode=%ld",
-                    connectDuration, nameResolvingDuration, transferDuration, httpConnectCode);
+            // every option is set again by the next request
+            config->valid = false;
         }
+        return retVal;
+}
 
-        if (httpResponseCode >= 300 || httpConnectCode >= 300)
-        {
-            SYSLOG_ERR("HTTP error response code: %ld, connect code: %ld", httpResponseCode, httpConnectCode);
-            retVal = false;
-            goto out;
-        }
+/**
+ * @brief   This function cleans up request parameters after a transfer has been made.
+ *              The curl handle itself stays open in its session, with the header lines
+ *              it reuses; only the lines of this request are taken off.
+ *
+ * @param   config: options and header lines of the curl handle, NULL if none
+ *
+ * @return  None
+ */
+static void _libhttpcomm_closeHttp(struct HttpConfigCache *config)
+{
+    if (config == NULL)
+    {
+        return;
+    }
 
-        if (curlResult != CURLE_OK)
-        {
-            if (curlResult != CURLE_ABORTED_BY_CALLBACK)
-            {
-                if (curl_easy_getinfo(curlHandle, CURLINFO_OS_ERRNO, &curlErrno) != CURLE_OK)
-                {
-                    curlErrno = 0;
-                    SYSLOG_ERR("curl_easy_getinfo");
-                }
-                SYSLOG_ERR("curl_easy_perform: %s, %s for url %s",
-                        curl_easy_strerror(curlResult), strerror((int)curlErrno), url);
-            }else
-            {
-                SYSLOG_DEBUG("quitting curl transfer");
-            }
-            retVal = false;
-            goto out;
-        }
+    if (config->headersTail != NULL)
+    {
+        config->headersTail->next = NULL;
+    }
+    config->requestLineCount = 0;
+}
+
+/**
+ * @brief   Builds the header lines that stay the same from one request to the next
+ *
+ * @param   config: options and header lines of the curl handle, the lines are set
+ *              to curl by the caller
+ * @param   contentType: "Content-Type: ..." header line, a static string, NULL if none
+ * @param   authToken: authentication token to be added in the header, NULL if none
+ *
+ * @return  true for success, false for failure
+ */
+static bool _libhttpcomm_headersBuild(struct HttpConfigCache *config, const char *contentType, const char *authToken)
+{
+    struct curl_slist *headers = NULL;
+    struct curl_slist *appended;
+    const char *lines[4];
+    char tempString[256];
+    int lineCount = 0;
+    int i;
+
+    if (contentType != NULL)
+    {
+        lines[lineCount++] = contentType;
+    }
+
+    //generic http header
+    lines[lineCount++] = "User-Agent: IOT Proxy";
+
+    // without this, curl waits for the server to answer "100 Continue" before
+    // sending a message over 1 KB, a round trip for nothing
+    lines[lineCount++] = "Expect:";
+
+    if (authToken != NULL)
+    {
+        snprintf(tempString, sizeof(tempString), "PPCAuthorization: esp token=%s", authToken);
+        lines[lineCount++] = tempString;
+    }
 
-        // the following is a special case - a time-out from the server is going to return a
-        // string with 1 character in it ...
-        if (strlen(rxBuffer) > 1)
-        {
-            /* put the result into the main buffer and return */
-            SYSLOG_DEBUG("received msg length %d", strlen(rxBuffer));
-        }else
+    for (i = 0; i < lineCount; i++)
+    {
+        appended = curl_slist_append(headers, lines[i]);
+        if (appended == NULL)
         {
-            if (strlen(rxBuffer) == 1)
-            {
-                SYSLOG_DEBUG("received time-out message from the server");
-            }
-            rxBuffer[0] = '\0';
-            goto out;
+            SYSLOG_ERR("curl_slist_append failed");
+            curl_slist_free_all(headers);
+            return false;
         }
+        headers = appended;
+    }
+
+    if (_libhttpcomm_stringSet(&config->authToken, authToken) == false)
+    {
+        curl_slist_free_all(headers);
+        return false;
+    }
+
+    _libhttpcomm_closeHttp(config);
+    curl_slist_free_all(config->headers);
+
+    config->headers = headers;
+    config->headersTail = headers;
+    while (config->headersTail->next != NULL)
+    {
+        config->headersTail = config->headersTail->next;
+    }
+    config->contentType = contentType;
+    return true;
+}
+
+/**
+ * @brief   Adds a header line to the next request only, after the lines that stay the
+ *              same. No memory is allocated, the line is linked to the cached list until
+ *              _libhttpcomm_closeHttp.
+ *
+ * @param   config: options and header lines of the curl handle, configured for the request
+ * @param   line: header line, must live until the transfer is done
+ *
+ * @return  true for success, false if there is no room for another line
+ */
+static bool _libhttpcomm_headersAdd(struct HttpConfigCache *config, char *line)
+{
+    struct curl_slist *node;
+
+    if (config->headersTail == NULL || config->requestLineCount >= HTTPCOMM_MAX_EXTRA_HEADERS + 1)
+    {
+        SYSLOG_WARNING("no room for header line %s", line);
+        return false;
+    }
+
+    node = &config->requestLines[config->requestLineCount];
+    node->data = line;
+    node->next = NULL;
+
+    if (config->requestLineCount == 0)
+    {
+        config->headersTail->next = node;
     }
     else
     {
-        SYSLOG_ERR("curl_easy_init failed");
-        retVal = false;
+        config->requestLines[config->requestLineCount - 1].next = node;
     }
+    config->requestLineCount++;
+    return true;
+}
 
-    out:
-      fclose(file);
-      _libhttpcomm_closeHttp(curlHandle, slist);
-      return retVal;
+/**
+ * @brief   Frees the options and header lines cached for a curl handle, which must be
+ *              cleaned up or configured again from scratch
+ *
+ * @param   config: options and header lines to free
+ *
+ * @return  none
+ */
+static void _libhttpcomm_configFree(struct HttpConfigCache *config)
+{
+    _libhttpcomm_closeHttp(config);
+    curl_slist_free_all(config->headers);
+    free(config->url);
+    free(config->sslCertPath);
+    free(config->authToken);
+    memset(config, 0, sizeof(struct HttpConfigCache));
 }
 
 /**
- * @brief   This function configures a HTTP connection with PPC standard parameters
+ * @brief   Compares a cached option with the value of a new request
  *
- * @param   curlHandle: curl handle to configure
- * @param   shareCurlHandle: curl handle shared across connections, used for DNS caching.
- * @param   slist: linked list that stores the HTTP Header
- * @param   httpMethod: HTTP RESTFUL method to use (GET, POST, DELETE PUT)
- * @param   url: url of the server (hostname + uri)
- * @param   sslCertPath: location of where the certificate is
- * @param   authToken: authentication token to be added in the header
- * @param   fileName: ptr to message to send. NULL if none
- * @param   rxBuffer: ptr for storing message received by the server -> must exist
- * @param   maxRxBufferSize: max size of rxBuffer in bytes.
- * @param   timeouts: specifies connect and transfer timeouts for the connection
- * @param   ProgressCallback: Function to be called periodically by curl every second
- *              while the transfer is underway
+ * @param   cached: cached value, NULL if none
+ * @param   value: new value, NULL if none
+ *
+ * @return  true if they differ
+ */
+static bool _libhttpcomm_stringChanged(const char *cached, const char *value)
+{
+    if (cached == NULL || value == NULL)
+    {
+        return cached != value;
+    }
+    return strcmp(cached, value) != 0;
+}
+
+/**
+ * @brief   Replaces a cached option by a copy of a new value
+ *
+ * @param   cached: cached value, freed and replaced
+ * @param   value: new value, NULL if none
  *
  * @return  true for success, false for failure
  */
-int _libhttpcomm_configureHttp(CURL * curlHandle, CURLSH * shareCurlHandle, struct curl_slist *slist, CURLoption httpMethod,
-        const char *url, const char *sslCertPath, const char *authToken, http_timeout_t timeouts,
-        int (*ProgressCallback) (void *clientp, double dltotal, double dlnow, double ultotal, double ulnow))
+static bool _libhttpcomm_stringSet(char **cached, const char *value)
 {
-    int retVal = true;
-    CURLcode curlResult;
-    char tempString[256];
+    char *copy = NULL;
 
-    if (shareCurlHandle != NULL)
+    if (value != NULL)
     {
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_SHARE, shareCurlHandle);
-        if (curlResult != CURLE_OK)
+        copy = strdup(value);
+        if (copy == NULL)
         {
-            SYSLOG_ERR("%s CURLOPT_SHARE", curl_easy_strerror(curlResult));
-            retVal = false;
-            goto out;
+            SYSLOG_ERR("strdup: %s", strerror(errno));
+            return false;
         }
     }
 
-    curlResult = curl_easy_setopt(curlHandle, CURLOPT_DNS_CACHE_TIMEOUT, HTTPCOMM_DEFAULT_DNS_CACHING_TIMEOUT_SEC);
-    if (curlResult != CURLE_OK)
+    free(*cached);
+    *cached = copy;
+    return true;
+}
+
+/**
+ * @brief   Extracts the "scheme://host:port" part of a url, which identifies the
+ *              connection a request can reuse
+ *
+ * @param   url: url of the server (hostname + uri)
+ * @param   host: buffer receiving the host part
+ * @param   hostSize: size of the host buffer
+ *
+ * @return  none
+ */
+static void _libhttpcomm_getHost(const char *url, char *host, int hostSize)
+{
+    const char *start;
+    int length;
+
+    start = strstr(url, "://");
+    start = (start != NULL) ? start + 3 : url;
+    length = (int) strcspn(start, "/?#") + (int) (start - url);
+
+    if (length >= hostSize)
     {
-        SYSLOG_ERR("%s CURLOPT_FORBID_REUSE", curl_easy_strerror(curlResult));
-        retVal = false;
-        goto out;
+        length = hostSize - 1;
     }
 
-    // no signals when using c-ares
-    curlResult = curl_easy_setopt(curlHandle, CURLOPT_NOSIGNAL, 1L);
-    if (curlResult != CURLE_OK)
+    memcpy(host, url, length);
+    host[length] = '\0';
+}
+
+/**
+ * @brief   Finds the host name and the port of a url. Without scheme, the port
+ *              defaults to the one of http.
+ *
+ * @param   url: url, "scheme://host:port/path" or part of it
+ * @param   name: destination of the host name
+ * @param   nameSize: size of name
+ *
+ * @return  the port, -1 if the url is not valid
+ */
+static int _libhttpcomm_getHostName(const char *url, char *name, int nameSize)
+{
+    const char *start;
+    const char *end;
+    int length;
+    int port = 80;
+
+    start = strstr(url, "://");
+    if (start != NULL)
     {
-        SYSLOG_ERR("%s CURLOPT_NOSIGNAL", curl_easy_strerror(curlResult));
-        retVal = false;
-        goto out;
+        if (start - url == 5 && strncasecmp(url, "https", 5) == 0)
+        {
+            port = 443;
+        }
+        start += 3;
+    }
+    else
+    {
+        start = url;
     }
 
-    //making sure that this is a new connection
-    curlResult = curl_easy_setopt(curlHandle, CURLOPT_FORBID_REUSE, false);
-    if (curlResult != CURLE_OK)
+    length = (int) strcspn(start, ":/?#");
+    if (length >= nameSize)
     {
-        SYSLOG_ERR("%s CURLOPT_FORBID_REUSE", curl_easy_strerror(curlResult));
-        retVal = false;
-        goto out;
+        name[0] = '\0';
+        return -1;
     }
 
-#if 0
-    //TODO:
-    curlResult = curl_easy_setopt(curlHandle, CURLOPT_VERBOSE, true);
-    if (curlResult != CURLE_OK)
+    memcpy(name, start, length);
+    name[length] = '\0';
+
+    end = start + length;
+    if (*end == ':')
     {
-        SYSLOG_ERR("%s CURLOPT_VERBOSE", curl_easy_strerror(curlResult));
-        retVal = false;
-        goto out;
+        port = atoi(end + 1);
+        if (port <= 0 || port > 65535)
+        {
+            return -1;
+        }
     }
-#endif
 
-    curlResult = curl_easy_setopt(curlHandle, CURLOPT_FRESH_CONNECT, false);
-    if (curlResult != CURLE_OK)
+    return port;
+}
+
+/**
+ * @brief   Creates a transfer of the engine, with a curl handle ready to be configured
+ *
+ * @param   multi: engine the transfer belongs to
+ *
+ * @return  the transfer, NULL on failure
+ */
+static struct HttpTransfer *_libhttpcomm_transferNew(libhttpcomm_multi_t *multi)
+{
+    struct HttpTransfer *transfer = NULL;
+
+    transfer = (struct HttpTransfer *) calloc(1, sizeof(struct HttpTransfer));
+    if (transfer == NULL)
     {
-        SYSLOG_ERR("%s CURLOPT_FRESH_CONNECT", curl_easy_strerror(curlResult));
-        retVal = false;
-        goto out;
+        SYSLOG_ERR("calloc: %s", strerror(errno));
+        return NULL;
     }
 
-    // for safe multi-threaded operation
-    // now only used in one thread. to be able to disable signal -> c-ares library has be used
-    // for name resolving
-    curlResult = curl_easy_setopt(curlHandle, CURLOPT_NOSIGNAL, 1);
-    if (curlResult != CURLE_OK)
+    if (libhttpcomm_rxBufferAlloc(&transfer->rx, HTTPCOMM_MULTI_RX_INITIAL_SIZE, multi->maxResponseSize) == false)
     {
-        SYSLOG_ERR("%s CURLOPT_NOSIGNAL", curl_easy_strerror(curlResult));
-        retVal = false;
-        goto out;
+        free(transfer);
+        return NULL;
     }
 
-    // less than 30 seconds is not reliable
-    if (timeouts.connectTimeout != 0)
+    transfer->curlHandle = curl_easy_init();
+    if (transfer->curlHandle == NULL
+            || _libhttpcomm_initHttp(transfer->curlHandle, transfer->errorBuffer) == false
+            || curl_easy_setopt(transfer->curlHandle, CURLOPT_SHARE, multi->shareCurlHandle) != CURLE_OK)
     {
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_CONNECTTIMEOUT, timeouts.connectTimeout);
-        if (curlResult != CURLE_OK)
-        {
-            SYSLOG_ERR("%s CURLOPT_CONNECTTIMEOUT", curl_easy_strerror(curlResult));
-            retVal = false;
-            goto out;
-        }
+        SYSLOG_ERR("curl_easy_init failed");
+        _libhttpcomm_transferFree(transfer);
+        return NULL;
     }
 
-    if (timeouts.transferTimeout != 0)
+    return transfer;
+}
+
+/**
+ * @brief   Destroys a transfer that is not attached to the multi handle
+ *
+ * @param   transfer: transfer to destroy
+ *
+ * @return  none
+ */
+static void _libhttpcomm_transferFree(struct HttpTransfer *transfer)
+{
+    if (transfer->curlHandle != NULL)
     {
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_TIMEOUT, timeouts.transferTimeout);
-        if (curlResult != CURLE_OK)
-        {
-            SYSLOG_ERR("%s CURLOPT_TIMEOUT", curl_easy_strerror(curlResult));
-            retVal = false;
-            goto out;
-        }
+        curl_easy_cleanup(transfer->curlHandle);
+    }
+    _libhttpcomm_configFree(&transfer->config);
+    libhttpcomm_rxBufferFree(&transfer->rx);
+    free(transfer->compressed.buffer);
+    free(transfer);
+}
+
+/**
+ * @brief   Hands the transfers submitted since the last call to curl. Only called by the
+ *              thread running the engine, since the multi handle isn't thread safe.
+ *
+ * @param   multi: engine
+ *
+ * @return  none
+ */
+static void _libhttpcomm_multiAddPending(libhttpcomm_multi_t *multi)
+{
+    struct HttpTransfer *transfer;
+    struct HttpTransfer *pending;
+    char wakeup[64];
+    int running = 0;
+    CURLMcode multiResult;
+
+    pthread_mutex_lock(&multi->mutex);
+    while (read(multi->wakeupFd[0], wakeup, sizeof(wakeup)) > 0);
+    pending = multi->pending;
+    multi->pending = NULL;
+    multi->pendingTail = NULL;
+    pthread_mutex_unlock(&multi->mutex);
+
+    if (pending == NULL)
+    {
+        return;
     }
 
-    // set progress meter so that we can read if the push pipe is getting full
-    if(ProgressCallback != NULL)
+    while ((transfer = pending) != NULL)
     {
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_NOPROGRESS, 0);
-        if (curlResult != CURLE_OK)
+        pending = transfer->next;
+
+        multiResult = curl_multi_add_handle(multi->multiHandle, transfer->curlHandle);
+        if (multiResult != CURLM_OK)
         {
-            SYSLOG_ERR("%s CURLOPT_NOPROGRESS", curl_easy_strerror(curlResult));
-            retVal = false;
-            goto out;
+            SYSLOG_ERR("curl_multi_add_handle: %s", curl_multi_strerror(multiResult));
+            transfer->onComplete(ENOEXEC, &transfer->rx, transfer->userData);
+            _libhttpcomm_transferFree(transfer);
         }
-
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_PROGRESSFUNCTION, ProgressCallback);
-        if (curlResult != CURLE_OK)
+        else
         {
-            SYSLOG_ERR("%s CURLOPT_PROGRESSFUNCTION", curl_easy_strerror(curlResult));
-            retVal = false;
-            goto out;
+            transfer->next = multi->active;
+            multi->active = transfer;
+            multi->running++;
         }
+
+        pthread_mutex_lock(&multi->mutex);
+        multi->pendingCount--;
+        pthread_mutex_unlock(&multi->mutex);
     }
 
-    if (sslCertPath != NULL)
+    // kick the new transfers off, curl will then ask for its sockets and timer
+    curl_multi_socket_action(multi->multiHandle, CURL_SOCKET_TIMEOUT, 0, &running);
+    multi->running = running;
+}
+
+/**
+ * @brief   Calls the completion callback of every finished transfer and keeps its curl
+ *              handle, with its connection, for a later transfer
+ *
+ * @param   multi: engine
+ *
+ * @return  none
+ */
+static void _libhttpcomm_multiComplete(libhttpcomm_multi_t *multi)
+{
+    struct HttpTransfer *transfer;
+    struct HttpTransfer **link;
+    CURLMsg *message;
+    char *url = NULL;
+    int messagesLeft = 0;
+    int result;
+
+    while ((message = curl_multi_info_read(multi->multiHandle, &messagesLeft)) != NULL)
     {
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_SSL_VERIFYPEER, 0L);
-        if (curlResult != CURLE_OK)
+        if (message->msg != CURLMSG_DONE)
         {
-            SYSLOG_ERR("%s CURLOPT_SSL_VERIFYPEER", curl_easy_strerror(curlResult));
-            retVal = false;
-            goto out;
+            continue;
         }
 
-        curlResult = curl_easy_setopt(curlHandle, CURLOPT_CAPATH, sslCertPath);
-        if (curlResult != CURLE_OK)
+        transfer = NULL;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **) &transfer);
+        curl_multi_remove_handle(multi->multiHandle, message->easy_handle);
+        if (transfer == NULL)
         {
-            SYSLOG_ERR("%s CURLOPT_CAPATH", curl_easy_strerror(curlResult));
-            retVal = false;
-            goto out;
+            continue;
+        }
+
+        for (link = &multi->active; *link != NULL; link = &(*link)->next)
+        {
+            if (*link == transfer)
+            {
+                *link = transfer->next;
+                break;
+            }
         }
+
+        _libhttpcomm_updateCacheStats(transfer->curlHandle);
+        _libhttpcomm_updateMetrics(transfer->curlHandle, transfer->httpMethod, message->data.result);
+        curl_easy_getinfo(transfer->curlHandle, CURLINFO_EFFECTIVE_URL, &url);
+        result = _libhttpcomm_msgResult(transfer->curlHandle, message->data.result, url,
+                &transfer->rx, transfer->params);
+
+        transfer->onComplete(result, &transfer->rx, transfer->userData);
+        _libhttpcomm_transferRecycle(multi, transfer);
     }
+}
 
-    curlResult = curl_easy_setopt(curlHandle, CURLOPT_URL, url);
-    if (curlResult != CURLE_OK)
+/**
+ * @brief   Keeps the curl handle of a completed transfer for the next transfers, or
+ *              frees it if enough are kept already
+ *
+ * @param   multi: engine
+ * @param   transfer: transfer done, removed from the multi handle
+ *
+ * @return  none
+ */
+static void _libhttpcomm_transferRecycle(libhttpcomm_multi_t *multi, struct HttpTransfer *transfer)
+{
+    pthread_mutex_lock(&multi->mutex);
+    if (multi->idleCount < HTTPCOMM_SESSION_MAX_HANDLES)
     {
-        SYSLOG_ERR("%s CURLOPT_URL", curl_easy_strerror(curlResult));
-        retVal = false;
-        goto out;
+        transfer->next = multi->idle;
+        multi->idle = transfer;
+        multi->idleCount++;
+        transfer = NULL;
     }
+    pthread_mutex_unlock(&multi->mutex);
 
-    curlResult = curl_easy_setopt(curlHandle, httpMethod, 1L);
-    if (curlResult != CURLE_OK)
+    if (transfer != NULL)
     {
-        SYSLOG_ERR("%s CURLOPT_POST", curl_easy_strerror(curlResult));
-        retVal = false;
-        goto out;
+        _libhttpcomm_transferFree(transfer);
     }
+}
 
-    // all is ready, so do it -> set the http header
-    //generic http header
-    slist = curl_slist_append(slist, "User-Agent: IOT Proxy");
+/**
+ * @brief   Called by curl when a socket must be watched differently (CURLMOPT_SOCKETFUNCTION)
+ *
+ * @param   easy: curl handle using the socket
+ * @param   fd: the socket
+ * @param   what: CURL_POLL_IN, CURL_POLL_OUT, CURL_POLL_INOUT or CURL_POLL_REMOVE
+ * @param   userp: the engine
+ * @param   socketp: unused
+ *
+ * @return  0
+ */
+static int _libhttpcomm_multiSocketCallback(CURL *easy, curl_socket_t fd, int what, void *userp, void *socketp)
+{
+    libhttpcomm_multi_t *multi = (libhttpcomm_multi_t *) userp;
+    struct HttpMultiSocket *slot = NULL;
+    int i;
 
-    if (authToken != NULL)
+    for (i = 0; i < HTTPCOMM_MULTI_MAX_SOCKETS; i++)
     {
-        snprintf(tempString, sizeof(tempString), "PPCAuthorization: esp token=%s", authToken);
-        slist = curl_slist_append(slist, tempString);
+        if (multi->sockets[i].fd == fd)
+        {
+            slot = &multi->sockets[i];
+            break;
+        }
+        if (slot == NULL && multi->sockets[i].fd == CURL_SOCKET_BAD)
+        {
+            slot = &multi->sockets[i];
+        }
     }
 
-    //TODO: may want to add a paramter for an optional header line
-    curlResult = curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, slist);
-    if (curlResult != CURLE_OK)
+    if (what == CURL_POLL_REMOVE)
     {
-        SYSLOG_ERR("%s CURLOPT_HTTPHEADER", curl_easy_strerror(curlResult));
-        retVal = false;
-        goto out;
+        if (slot != NULL && slot->fd == fd)
+        {
+            slot->fd = CURL_SOCKET_BAD;
+            slot->events = 0;
+        }
+    }
+    else if (slot != NULL)
+    {
+        slot->fd = fd;
+        slot->events = what;
+    }
+    else
+    {
+        SYSLOG_ERR("more than %d sockets, raise HTTPCOMM_MULTI_MAX_SOCKETS", HTTPCOMM_MULTI_MAX_SOCKETS);
     }
 
-    out:
-        return retVal;
+    if (multi->watcher != NULL)
+    {
+        multi->watcher(fd, what, multi->watcherUserData);
+    }
+
+    return 0;
 }
 
 /**
- * @brief   This function cleans up connection parameters after a transfer has been made.
+ * @brief   Called by curl when its timeout changes (CURLMOPT_TIMERFUNCTION)
  *
- * @param   curlHandle: curl handle to close/clean
- * @param   slist: linked list used for the header to close/clean
+ * @param   multiHandle: the multi handle
+ * @param   timeoutMs: milliseconds until curl must be called, -1 for none
+ * @param   userp: the engine
  *
- * @return  None
+ * @return  0
+ */
+static int _libhttpcomm_multiTimerCallback(CURLM *multiHandle, long timeoutMs, void *userp)
+{
+    libhttpcomm_multi_t *multi = (libhttpcomm_multi_t *) userp;
+
+    multi->timeoutAtMs = (timeoutMs < 0) ? -1 : _libhttpcomm_nowMs() + timeoutMs;
+    return 0;
+}
+
+/**
+ * @brief   Reads the monotonic clock
+ *
+ * @return  the monotonic time in milliseconds
  */
-void _libhttpcomm_closeHttp(CURL * curlHandle, struct curl_slist *slist)
+static long long _libhttpcomm_nowMs(void)
 {
-    curl_slist_free_all(slist); /* free the list again */
-    curl_easy_cleanup(curlHandle);
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
@@ -38,6 +38,8 @@
 #include <limits.h>
 #include <rpc/types.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /** Maximum time for an HTTP connection, including name resolving */
 #define HTTPCOMM_DEFAULT_CONNECT_TIMEOUT_SEC 30
@@ -57,6 +59,56 @@
 /** Size of a string needed to hold a authentication token */
 #define HTTPCOMM_AUTHENTICATION_STRING_SIZE 128
 
+/** Size of a string needed to hold the "scheme://host:port" part of a URL */
+#define HTTPCOMM_HOST_STRING_SIZE 256
+
+/** Maximum number of connections a session keeps open, can be overridden at compile time */
+#ifndef HTTPCOMM_SESSION_MAX_HANDLES
+#define HTTPCOMM_SESSION_MAX_HANDLES 4
+#endif
+
+/** Most sockets a libhttpcomm_multi_t engine watches at once, can be overridden at compile time */
+#ifndef HTTPCOMM_MULTI_MAX_SOCKETS
+#define HTTPCOMM_MULTI_MAX_SOCKETS 32
+#endif
+
+/** Initial size of the buffer receiving the response of an asynchronous transfer */
+#define HTTPCOMM_MULTI_RX_INITIAL_SIZE 1024
+
+/** Most header lines a http_header_hook_t adds to a request, can be overridden at compile time */
+#ifndef HTTPCOMM_MAX_EXTRA_HEADERS
+#define HTTPCOMM_MAX_EXTRA_HEADERS 4
+#endif
+
+/** Size of a header line added by a http_header_hook_t, terminating NUL included */
+#define HTTPCOMM_HEADER_LINE_SIZE 128
+
+/** Attempts of a download that make no progress before giving up, can be overridden at compile time */
+#ifndef HTTPCOMM_DOWNLOAD_MAX_ATTEMPTS
+#define HTTPCOMM_DOWNLOAD_MAX_ATTEMPTS 5
+#endif
+
+/** Bytes received between two flushes of a download to storage, can be overridden at compile time */
+#ifndef HTTPCOMM_DOWNLOAD_SYNC_SIZE
+#define HTTPCOMM_DOWNLOAD_SYNC_SIZE (64 * 1024)
+#endif
+
+/** libhttpcomm_downloadOpen() flag: check the CRC-32 of the whole file once received */
+#define HTTPCOMM_DOWNLOAD_VERIFY_CRC 0x01
+
+/** libhttpcomm_downloadOpen() flag: preallocate the file and write it through a memory map */
+#define HTTPCOMM_DOWNLOAD_MAP 0x02
+
+/** Messages smaller than this are sent uncompressed, can be overridden at compile time */
+#ifndef HTTPCOMM_COMPRESSION_MIN_SIZE
+#define HTTPCOMM_COMPRESSION_MIN_SIZE 256
+#endif
+
+/** zlib compression level of the messages sent, 1 (fastest) to 9 (smallest) */
+#ifndef HTTPCOMM_COMPRESSION_LEVEL
+#define HTTPCOMM_COMPRESSION_LEVEL 9
+#endif
+
 
 typedef struct http_timeout_t {
   long connectTimeout;
@@ -64,17 +116,232 @@ typedef struct http_timeout_t {
 } http_timeout_t;
 
 
+/** Content-Encoding of the messages sent by a session, see libhttpcomm_sessionSetCompression() */
+typedef enum http_encoding_e {
+  HTTPCOMM_ENCODING_IDENTITY = 0,
+  HTTPCOMM_ENCODING_DEFLATE,
+  HTTPCOMM_ENCODING_GZIP,
+} http_encoding_e;
+
 typedef struct http_param_t {
   http_timeout_t timeouts;
   bool verbose;
 } http_param_t;
 
+/**
+ * Called before each message sent through a session to add header lines that
+ * change from one request to the next, like "X-Sequence: 42". Fills up to
+ * maxHeaders lines and returns how many it filled.
+ */
+typedef int (*http_header_hook_t)(char headers[][HTTPCOMM_HEADER_LINE_SIZE], int maxHeaders, void *userData);
+
+/**
+ * Called with each chunk of a message as it is received, before it is stored in the
+ * receive buffer. Returns 0 to go on, anything else aborts the transfer.
+ */
+typedef int (*http_sink_t)(const char *data, size_t length, void *userData);
+
+/**
+ * Called for the next bytes of a streamed upload, see http_upload_t. Fills up to
+ * size bytes of buffer and returns how many it filled, 0 once there is nothing left
+ * to send, or -1 to cancel the upload.
+ */
+typedef ssize_t (*http_producer_t)(char *buffer, size_t size, void *userData);
+
+/** Data streamed to the server by libhttpcomm_upload() */
+typedef struct http_upload_t {
+  int fd;                       /// source read up to its end, -1 to call producer
+  http_producer_t producer;
+  void *producerUserData;
+  curl_off_t size;              /// bytes to send, -1 if unknown: sent with Transfer-Encoding: chunked
+  curl_off_t maxBytesPerSec;    /// bandwidth cap, 0 for none
+} http_upload_t;
+
+/**
+ * Buffer receiving a message from the server. The length of the message is tracked,
+ * so it may contain null bytes; a null byte is still kept after the last byte
+ * received so text messages can be used as strings.
+ */
+typedef struct http_rxbuffer_t {
+  char *buffer;
+  size_t length;    /// bytes received
+  size_t size;      /// bytes allocated in buffer
+  size_t maxSize;   /// size the buffer may grow to
+  bool growable;    /// true if allocated by libhttpcomm_rxBufferAlloc()
+  http_sink_t sink; /// NULL, or consumer of the message as it arrives
+  void *sinkUserData;
+  bool truncated;   /// true if the sink got more than the buffer could keep
+} http_rxbuffer_t;
+
+/**
+ * File downloaded in one or more attempts, see libhttpcomm_downloadOpen(). Each
+ * attempt asks the server for the bytes after offset only.
+ */
+typedef struct http_download_t {
+  int fd;
+  unsigned char *map;           /// destination mapped in memory, NULL to write to fd
+  int flags;                    /// HTTPCOMM_DOWNLOAD_VERIFY_CRC, HTTPCOMM_DOWNLOAD_MAP
+  curl_off_t expectedSize;      /// 0 if unknown
+  unsigned long expectedCrc;    /// CRC-32 of the whole file
+  curl_off_t offset;            /// bytes received, may be set to a durableOffset saved earlier
+  curl_off_t durableOffset;     /// bytes flushed to storage, save it to resume after a reboot
+  unsigned long crc;            /// CRC-32 of the first crcOffset bytes
+  curl_off_t crcOffset;
+} http_download_t;
+
+/** Seconds between two checks for changes of the trusted certificates, can be overridden at compile time */
+#ifndef HTTPCOMM_CA_STORE_CHECK_SEC
+#define HTTPCOMM_CA_STORE_CHECK_SEC 60
+#endif
+
+/** Hosts the resolver looks up in the background, can be overridden at compile time */
+#ifndef HTTPCOMM_RESOLVER_MAX_HOSTS
+#define HTTPCOMM_RESOLVER_MAX_HOSTS 4
+#endif
+
+/** Seconds between two background lookups of a host, can be overridden at compile time */
+#ifndef HTTPCOMM_RESOLVER_REFRESH_SEC
+#define HTTPCOMM_RESOLVER_REFRESH_SEC (HTTPCOMM_DEFAULT_DNS_CACHING_TIMEOUT_SEC / 2)
+#endif
+
+/** Seconds before a failed background lookup is tried again, can be overridden at compile time */
+#ifndef HTTPCOMM_RESOLVER_RETRY_SEC
+#define HTTPCOMM_RESOLVER_RETRY_SEC 10
+#endif
+
+/** A name lookup of a new connection faster than this was answered by the DNS cache */
+#define HTTPCOMM_DNS_CACHE_HIT_SEC 0.001
+
+/** Counters of the connection, DNS and SSL caches, see libhttpcomm_getCacheStats() */
+typedef struct http_cache_stats_t {
+  unsigned long connectionsReused;
+  unsigned long connectionsCreated;
+  unsigned long dnsHits;
+  unsigned long dnsMisses;
+  unsigned long sslHandshakes;
+  unsigned long caStoreLoads;   /// times the trusted certificates were read from the filesystem
+  unsigned long dnsPrefetches;  /// background lookups, see libhttpcomm_resolverAdd()
+  unsigned long dnsPrefetchFailures;
+} http_cache_stats_t;
+
+/** Endpoints with metrics of their own, the others share the last slot, can be overridden at compile time */
+#ifndef HTTPCOMM_METRICS_MAX_ENDPOINTS
+#define HTTPCOMM_METRICS_MAX_ENDPOINTS 16
+#endif
+
+/** Buckets of a latency histogram: bucket i counts durations under 2^i ms, the last one all the longer ones */
+#define HTTPCOMM_METRICS_BUCKETS 18
+
+/** Classes of HTTP response codes counted, index code / 100, 0 when there was no response */
+#define HTTPCOMM_METRICS_HTTP_CLASSES 6
+
+/** How a request ended, see http_endpoint_metrics_t */
+typedef enum http_outcome_e {
+  HTTPCOMM_OUTCOME_SUCCESS = 0,
+  HTTPCOMM_OUTCOME_HTTP_ERROR,  /// the server answered with a code >= 300
+  HTTPCOMM_OUTCOME_TIMEOUT,
+  HTTPCOMM_OUTCOME_ABORTED,     /// stopped by a callback or by a full receive buffer
+  HTTPCOMM_OUTCOME_DNS,         /// name lookup failed
+  HTTPCOMM_OUTCOME_CONNECT,     /// TCP connection refused or unreachable
+  HTTPCOMM_OUTCOME_TLS,         /// handshake or certificate failure
+  HTTPCOMM_OUTCOME_NETWORK,     /// connection lost, or any other failure
+  HTTPCOMM_OUTCOME_COUNT,
+} http_outcome_e;
+
+/** Latency histogram in milliseconds, see libhttpcomm_histogramPercentileMs() */
+typedef struct http_histogram_t {
+  unsigned long buckets[HTTPCOMM_METRICS_BUCKETS];
+  unsigned long samples;
+  double sumMs;
+  double maxMs;
+} http_histogram_t;
+
+/**
+ * Metrics of the requests made to one endpoint, a method and a URL without its
+ * query string. The durations are measured from the start of the request, like
+ * curl does: a TLS handshake takes appConnect - connect.
+ */
+typedef struct http_endpoint_metrics_t {
+  char method[8];                                   /// "GET" or "POST", empty for the overflow slot
+  char endpoint[HTTPCOMM_HOST_STRING_SIZE];
+  unsigned long requests;
+  unsigned long long bytesUp;                       /// bodies sent, after compression
+  unsigned long long bytesDown;                     /// bodies received
+  unsigned long httpCodes[HTTPCOMM_METRICS_HTTP_CLASSES];
+  unsigned long outcomes[HTTPCOMM_OUTCOME_COUNT];
+  http_histogram_t nameLookup;
+  http_histogram_t connect;
+  http_histogram_t appConnect;                      /// TLS handshake done, 0 without a new TLS connection
+  http_histogram_t firstByte;                       /// first byte of the response received
+  http_histogram_t total;
+} http_endpoint_metrics_t;
+
+/** Asynchronous request, see libhttpcomm_submit() */
+typedef struct http_request_t {
+  CURLoption httpMethod;        /// CURLOPT_POST or CURLOPT_HTTPGET
+  const char *url;
+  const char *sslCertPath;
+  const char *authToken;
+  char *msgToSendPtr;           /// NULL if none, must stay valid until completion
+  int msgToSendSize;
+  http_param_t params;
+  int (*ProgressCallback)(void *clientp, double dltotal, double dlnow,
+      double ultotal, double ulnow);
+  const struct iovec *segments; /// message made of segments if msgToSendPtr is NULL, must stay valid until completion
+  int segmentCount;
+  struct libhttpcomm_session_t *session; /// compression and header hook to apply, NULL for none
+  http_sink_t sink;             /// receives the response as it arrives, NULL if none
+  void *sinkUserData;
+} http_request_t;
+
+/**
+ * Called once an asynchronous request is done. result is 0 for success or an errno
+ * value, like libhttpcomm_sendMsg(). The response belongs to libhttpcomm and is only
+ * valid during the call.
+ */
+typedef void (*http_completion_t)(int result, http_rxbuffer_t *response, void *userData);
+
+/** Called when a descriptor of a libhttpcomm_multi_t must be watched for the CURL_POLL_* events */
+typedef void (*http_watcher_t)(int fd, int what, void *userData);
+
+/** Engine running many asynchronous requests on one thread, see libhttpcomm_multiOpen() */
+typedef struct libhttpcomm_multi_t libhttpcomm_multi_t;
+
+/** Long-lived, pre-configured connections to upstream hosts, see libhttpcomm_sessionOpen() */
+typedef struct libhttpcomm_session_t libhttpcomm_session_t;
+
 
 /***************** Public Prototypes *****************/
-void libhttpcomm_curlShareInit(CURLSH *curlHandle);
+CURLSH *libhttpcomm_curlShareInit(void);
 
 void libhttpcomm_curlShareClose(CURLSH *curHandle);
 
+void libhttpcomm_getCacheStats(http_cache_stats_t *stats);
+
+bool libhttpcomm_loadCaStore(const char *sslCertPath);
+
+void libhttpcomm_unloadCaStore(void);
+
+bool libhttpcomm_resolverAdd(const char *url);
+
+void libhttpcomm_resolverStop(void);
+
+int libhttpcomm_getMetrics(http_endpoint_metrics_t *metrics, int maxEndpoints);
+
+void libhttpcomm_resetMetrics(void);
+
+long libhttpcomm_histogramPercentileMs(const http_histogram_t *histogram, double percentile);
+
+void libhttpcomm_rxBufferInit(http_rxbuffer_t *rx, char *buffer, size_t size);
+
+bool libhttpcomm_rxBufferAlloc(http_rxbuffer_t *rx, size_t initialSize, size_t maxSize);
+
+void libhttpcomm_rxBufferFree(http_rxbuffer_t *rx);
+
+void libhttpcomm_rxBufferReset(http_rxbuffer_t *rx);
+
+void libhttpcomm_rxBufferSetSink(http_rxbuffer_t *rx, http_sink_t sink, void *userData);
+
 int libhttpcomm_getMsg(CURLSH * shareCurlHandle, const char *url,
     const char *sslCertPath, const char *authToken, char *rxBuffer,
     int maxRxBufferSize, http_param_t params, int(*ProgressCallback)(
@@ -87,6 +354,18 @@ int libhttpcomm_sendMsg(CURLSH * shareCurlHandle, CURLoption httpMethod,
     http_param_t params, int(*ProgressCallback)(void *clientp, double dltotal,
         double dlnow, double ultotal, double ulnow));
 
+int libhttpcomm_sendMsgRx(CURLSH * shareCurlHandle, CURLoption httpMethod,
+    const char *url, const char *sslCertPath, const char *authToken,
+    char *msgToSendPtr, int msgToSendSize, http_rxbuffer_t *rx,
+    http_param_t params, int(*ProgressCallback)(void *clientp, double dltotal,
+        double dlnow, double ultotal, double ulnow));
+
+int libhttpcomm_sendMsgv(CURLSH * shareCurlHandle, CURLoption httpMethod,
+    const char *url, const char *sslCertPath, const char *authToken,
+    const struct iovec *segments, int segmentCount, http_rxbuffer_t *rx,
+    http_param_t params, int(*ProgressCallback)(void *clientp, double dltotal,
+        double dlnow, double ultotal, double ulnow));
+
 int libhttpcomm_getFile(CURLSH * shareCurlHandle, const char *url,
     const char *sslCertPath, const char *authToken, FILE *rxfile,
     int maxRxFileSize, http_timeout_t timeouts, int(*ProgressCallback)(
@@ -97,4 +376,95 @@ int libhttpcomm_sendFile(const char *url, const char *sslCertPath,
     const char *authToken, char *fileName, char *rxBuffer, int maxRxBufferSize,
     http_timeout_t timeouts);
 
+bool libhttpcomm_downloadOpen(http_download_t *download, const char *path,
+    curl_off_t expectedSize, unsigned long expectedCrc, int flags);
+
+void libhttpcomm_downloadClose(http_download_t *download);
+
+int libhttpcomm_download(CURLSH * shareCurlHandle, const char *url,
+    const char *sslCertPath, const char *authToken, http_download_t *download,
+    http_timeout_t timeouts, int(*ProgressCallback)(void *clientp,
+        double dltotal, double dlnow, double ultotal, double ulnow));
+
+int libhttpcomm_upload(CURLSH * shareCurlHandle, const char *url,
+    const char *sslCertPath, const char *authToken, http_upload_t *upload,
+    http_rxbuffer_t *rx, http_param_t params, int(*ProgressCallback)(
+        void *clientp, double dltotal, double dlnow, double ultotal,
+        double ulnow));
+
+libhttpcomm_session_t *libhttpcomm_sessionOpen(CURLSH *shareCurlHandle);
+
+void libhttpcomm_sessionClose(libhttpcomm_session_t *session);
+
+bool libhttpcomm_sessionSetCompression(libhttpcomm_session_t *session, http_encoding_e encoding,
+    const char *dictionary, size_t dictionaryLength);
+
+void libhttpcomm_sessionSetHeaderHook(libhttpcomm_session_t *session,
+    http_header_hook_t hook, void *userData);
+
+int libhttpcomm_sessionSendMsg(libhttpcomm_session_t *session,
+    CURLoption httpMethod, const char *url, const char *sslCertPath,
+    const char *authToken, char *msgToSendPtr, int msgToSendSize,
+    char *rxBuffer, int maxRxBufferSize, http_param_t params,
+    int(*ProgressCallback)(void *clientp, double dltotal, double dlnow,
+        double ultotal, double ulnow));
+
+int libhttpcomm_sessionSendMsgRx(libhttpcomm_session_t *session,
+    CURLoption httpMethod, const char *url, const char *sslCertPath,
+    const char *authToken, char *msgToSendPtr, int msgToSendSize,
+    http_rxbuffer_t *rx, http_param_t params,
+    int(*ProgressCallback)(void *clientp, double dltotal, double dlnow,
+        double ultotal, double ulnow));
+
+int libhttpcomm_sessionSendMsgv(libhttpcomm_session_t *session,
+    CURLoption httpMethod, const char *url, const char *sslCertPath,
+    const char *authToken, const struct iovec *segments, int segmentCount,
+    http_rxbuffer_t *rx, http_param_t params,
+    int(*ProgressCallback)(void *clientp, double dltotal, double dlnow,
+        double ultotal, double ulnow));
+
+int libhttpcomm_sessionGetFile(libhttpcomm_session_t *session, const char *url,
+    const char *sslCertPath, const char *authToken, FILE *rxfile,
+    int maxRxFileSize, http_timeout_t timeouts, int(*ProgressCallback)(
+        void *clientp, double dltotal, double dlnow, double ultotal,
+        double ulnow));
+
+int libhttpcomm_sessionSendFile(libhttpcomm_session_t *session,
+    const char *url, const char *sslCertPath, const char *authToken,
+    char *fileName, char *rxBuffer, int maxRxBufferSize,
+    http_timeout_t timeouts);
+
+int libhttpcomm_sessionUpload(libhttpcomm_session_t *session,
+    const char *url, const char *sslCertPath, const char *authToken,
+    http_upload_t *upload, http_rxbuffer_t *rx, http_param_t params,
+    int(*ProgressCallback)(void *clientp, double dltotal, double dlnow,
+        double ultotal, double ulnow));
+
+int libhttpcomm_sessionDownload(libhttpcomm_session_t *session,
+    const char *url, const char *sslCertPath, const char *authToken,
+    http_download_t *download, http_timeout_t timeouts,
+    int(*ProgressCallback)(void *clientp, double dltotal, double dlnow,
+        double ultotal, double ulnow));
+
+libhttpcomm_multi_t *libhttpcomm_multiOpen(CURLSH *shareCurlHandle,
+    size_t maxResponseSize);
+
+void libhttpcomm_multiClose(libhttpcomm_multi_t *multi);
+
+int libhttpcomm_submit(libhttpcomm_multi_t *multi,
+    const http_request_t *request, http_completion_t onComplete,
+    void *userData);
+
+int libhttpcomm_multiRun(libhttpcomm_multi_t *multi, long maxWaitMs);
+
+void libhttpcomm_multiSetWatcher(libhttpcomm_multi_t *multi,
+    http_watcher_t watcher, void *userData);
+
+long libhttpcomm_multiTimeout(libhttpcomm_multi_t *multi);
+
+int libhttpcomm_multiSocketAction(libhttpcomm_multi_t *multi, int fd,
+    int events);
+
+int libhttpcomm_cancel(libhttpcomm_multi_t *multi, void *userData);
+
 #endif
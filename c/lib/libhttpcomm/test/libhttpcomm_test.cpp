@@ -0,0 +1,478 @@
+/*
+ * Copyright (c) 2011 People Power Company
+ * All rights reserved.
+ *
+ * This open source code was developed with funding from People Power Company
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the People Power Corporation nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * PEOPLE POWER CO. OR ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <zlib.h>
+
+#include "cppunit/extensions/HelperMacros.h"
+
+extern "C" {
+#include "libhttpcomm_test.h"
+#include "libhttpcomm.h"
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION( LibHttpCommTest );
+
+enum {
+  STANDIN_BUFFER_SIZE = 65536,
+
+  /** Time a connection of the stand-in server waits for the next request, in ms */
+  STANDIN_IDLE_MS = 2000,
+};
+
+/** Local stand-in for the server, over TLS with a self-signed certificate or plain HTTP */
+static struct {
+  pthread_mutex_t mutex;
+
+  int listenFd;
+
+  bool stop;
+
+  /** Context of the TLS connections, NULL for plain HTTP */
+  SSL_CTX *ssl;
+
+  /** Requests taken, answered unless the connection failed */
+  int requests;
+
+  /** Request taken then left unanswered by closing its connection, 0 for none */
+  int dropRequest;
+
+  /** Body of the last request taken */
+  char body[STANDIN_BUFFER_SIZE];
+
+  int bodyLength;
+} sStandIn;
+
+/** Self-signed certificate of the stand-in server, given to libhttpcomm as its certificate path */
+static char sCertPath[] = "/tmp/libhttpcomm_test.XXXXXX";
+
+/**
+ * Create the self-signed certificate of 127.0.0.1 for a TLS context, and
+ * write it to sCertPath
+ */
+static void makeCertificate(SSL_CTX *ssl) {
+  EVP_PKEY_CTX *keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+  EVP_PKEY *key = NULL;
+  X509 *certificate = X509_new();
+  X509_NAME *name;
+  FILE *file;
+  int fd;
+
+  CPPUNIT_ASSERT(keyContext != NULL && EVP_PKEY_keygen_init(keyContext) > 0);
+  CPPUNIT_ASSERT(EVP_PKEY_CTX_set_rsa_keygen_bits(keyContext, 2048) > 0);
+  CPPUNIT_ASSERT(EVP_PKEY_keygen(keyContext, &key) > 0);
+  EVP_PKEY_CTX_free(keyContext);
+
+  X509_set_version(certificate, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+  X509_gmtime_adj(X509_get_notBefore(certificate), -3600);
+  X509_gmtime_adj(X509_get_notAfter(certificate), 3600);
+  X509_set_pubkey(certificate, key);
+
+  name = X509_get_subject_name(certificate);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "127.0.0.1", -1, -1, 0);
+  X509_set_issuer_name(certificate, name);
+  CPPUNIT_ASSERT(X509_sign(certificate, key, EVP_sha256()) > 0);
+
+  CPPUNIT_ASSERT(SSL_CTX_use_certificate(ssl, certificate) == 1);
+  CPPUNIT_ASSERT(SSL_CTX_use_PrivateKey(ssl, key) == 1);
+
+  fd = mkstemp(sCertPath);
+  CPPUNIT_ASSERT(fd >= 0);
+  file = fdopen(fd, "w");
+  PEM_write_X509(file, certificate);
+  fclose(file);
+
+  X509_free(certificate);
+  EVP_PKEY_free(key);
+}
+
+/**
+ * Answers the requests of one connection, HTTP/1.1 with keep-alive, until
+ * the request to drop
+ */
+static void *standInConnection(void *arg) {
+  int fd = (int) (intptr_t) arg;
+  char *buffer = (char *) malloc(STANDIN_BUFFER_SIZE);
+  const char *response = "HTTP/1.1 200 OK\r\nContent-Length: 19\r\n\r\n<s2h status=\"ACK\"/>";
+  struct timeval idle = { STANDIN_IDLE_MS / 1000, 0 };
+  SSL *ssl = NULL;
+  char *headerEnd;
+  char *contentLength;
+  int length = 0;
+  int total;
+  int received;
+  bool drop;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+  if(sStandIn.ssl != NULL) {
+    ssl = SSL_new(sStandIn.ssl);
+    SSL_set_fd(ssl, fd);
+
+    if(SSL_accept(ssl) != 1) {
+      length = STANDIN_BUFFER_SIZE;
+    }
+  }
+
+  while(!sStandIn.stop && length < STANDIN_BUFFER_SIZE - 1) {
+    if(ssl != NULL) {
+      received = SSL_read(ssl, buffer + length, STANDIN_BUFFER_SIZE - 1 - length);
+    } else {
+      received = recv(fd, buffer + length, STANDIN_BUFFER_SIZE - 1 - length, 0);
+    }
+
+    if(received <= 0) {
+      break;
+    }
+    length += received;
+    buffer[length] = '\0';
+
+    if((headerEnd = strstr(buffer, "\r\n\r\n")) == NULL) {
+      continue;
+    }
+
+    contentLength = strcasestr(buffer, "Content-Length:");
+    total = headerEnd + 4 - buffer + (contentLength != NULL && contentLength < headerEnd ? atoi(contentLength + 15) : 0);
+    if(length < total) {
+      continue;
+    }
+
+    // Counted before the client hears about it
+    pthread_mutex_lock(&sStandIn.mutex);
+    drop = (++sStandIn.requests == sStandIn.dropRequest);
+    sStandIn.bodyLength = total - (headerEnd + 4 - buffer);
+    memcpy(sStandIn.body, headerEnd + 4, sStandIn.bodyLength);
+    pthread_mutex_unlock(&sStandIn.mutex);
+
+    if(drop) {
+      break;
+    }
+
+    if(ssl != NULL) {
+      received = SSL_write(ssl, response, strlen(response));
+    } else {
+      received = send(fd, response, strlen(response), MSG_NOSIGNAL);
+    }
+
+    if(received <= 0) {
+      break;
+    }
+
+    memmove(buffer, buffer + total, length - total);
+    length -= total;
+    buffer[length] = '\0';
+  }
+
+  if(ssl != NULL) {
+    SSL_free(ssl);
+  }
+  close(fd);
+  free(buffer);
+  return NULL;
+}
+
+/**
+ * Accepts the connections of libhttpcomm until the stand-in server stops
+ */
+static void *standInListen(void *arg) {
+  pthread_t thread;
+  int fd;
+
+  while(!sStandIn.stop) {
+    fd = accept(sStandIn.listenFd, NULL, NULL);
+    if(fd >= 0) {
+      pthread_create(&thread, NULL, standInConnection, (void *) (intptr_t) fd);
+      pthread_detach(thread);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Start the stand-in server on a free port of the loopback interface
+ * @param tls true to serve HTTPS with a self-signed certificate
+ * @return the port
+ */
+static int standInStart(pthread_t *thread, bool tls) {
+  struct sockaddr_in address;
+  socklen_t addressLen = sizeof(address);
+  struct timeval wait = { 0, 100000 };
+
+  memset(&sStandIn, 0, sizeof(sStandIn));
+  pthread_mutex_init(&sStandIn.mutex, NULL);
+
+  if(tls) {
+    sStandIn.ssl = SSL_CTX_new(SSLv23_server_method());
+    CPPUNIT_ASSERT(sStandIn.ssl != NULL);
+    makeCertificate(sStandIn.ssl);
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  sStandIn.listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  CPPUNIT_ASSERT(sStandIn.listenFd >= 0);
+  CPPUNIT_ASSERT(bind(sStandIn.listenFd, (struct sockaddr *) &address, sizeof(address)) == 0);
+  CPPUNIT_ASSERT(listen(sStandIn.listenFd, 8) == 0);
+  CPPUNIT_ASSERT(getsockname(sStandIn.listenFd, (struct sockaddr *) &address, &addressLen) == 0);
+
+  // accept() gives up every 100 ms to see if the server is stopping
+  setsockopt(sStandIn.listenFd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+
+  CPPUNIT_ASSERT(pthread_create(thread, NULL, standInListen, NULL) == 0);
+  return ntohs(address.sin_port);
+}
+
+/**
+ * Stop the stand-in server started by standInStart()
+ */
+static void standInStop(pthread_t thread) {
+  sStandIn.stop = true;
+  pthread_join(thread, NULL);
+  close(sStandIn.listenFd);
+
+  if(sStandIn.ssl != NULL) {
+    SSL_CTX_free(sStandIn.ssl);
+    unlink(sCertPath);
+    strcpy(sCertPath, "/tmp/libhttpcomm_test.XXXXXX");
+  }
+}
+
+/**
+ * @return the requests taken by the stand-in server
+ */
+static int standInRequests() {
+  int requests;
+
+  pthread_mutex_lock(&sStandIn.mutex);
+  requests = sStandIn.requests;
+  pthread_mutex_unlock(&sStandIn.mutex);
+  return requests;
+}
+
+/**
+ * POST a small message through a session
+ * @return 0 for success, errno value for failure
+ */
+static int post(libhttpcomm_session_t *session, const char *url, const char *sslCertPath) {
+  char message[] = "<h2s><m>0</m></h2s>";
+  char response[256];
+  http_param_t params;
+
+  memset(&params, 0, sizeof(params));
+  params.timeouts.connectTimeout = 5;
+  params.timeouts.transferTimeout = 5;
+
+  return libhttpcomm_sessionSendMsg(session, CURLOPT_POST, url, sslCertPath, NULL,
+      message, strlen(message), response, sizeof(response), params, NULL);
+}
+
+void LibHttpCommTest::testVerifyPeerRestored(void) {
+  libhttpcomm_session_t *session;
+  pthread_t thread;
+  char url[64];
+
+  curl_global_init(CURL_GLOBAL_ALL);
+  snprintf(url, sizeof(url), "https://127.0.0.1:%d/test", standInStart(&thread, true));
+  session = libhttpcomm_sessionOpen(NULL);
+  CPPUNIT_ASSERT(session != NULL);
+
+  // A certificate path turns the verification of the peer off
+  CPPUNIT_ASSERT_MESSAGE("POST with a certificate path failed\n", post(session, url, sCertPath) == 0);
+  CPPUNIT_ASSERT(standInRequests() == 1);
+
+  // The same connection of the session verifies the peer again without one
+  CPPUNIT_ASSERT_MESSAGE("Took a self-signed certificate without verifying it\n", post(session, url, NULL) != 0);
+  CPPUNIT_ASSERT(standInRequests() == 1);
+
+  CPPUNIT_ASSERT_MESSAGE("POST with a certificate path failed again\n", post(session, url, sCertPath) == 0);
+  CPPUNIT_ASSERT(standInRequests() == 2);
+
+  libhttpcomm_sessionClose(session);
+  standInStop(thread);
+}
+
+void LibHttpCommTest::testRewindMessage(void) {
+  libhttpcomm_session_t *session;
+  pthread_t thread;
+  char url[64];
+
+  curl_global_init(CURL_GLOBAL_ALL);
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d/test", standInStart(&thread, false));
+  sStandIn.dropRequest = 2;
+  session = libhttpcomm_sessionOpen(NULL);
+  CPPUNIT_ASSERT(session != NULL);
+
+  CPPUNIT_ASSERT_MESSAGE("First POST failed\n", post(session, url, NULL) == 0);
+  CPPUNIT_ASSERT(standInRequests() == 1);
+
+  // The kept-alive connection dies with the message sent: it is sent again from the start
+  CPPUNIT_ASSERT_MESSAGE("POST dropped by the server was not sent again\n", post(session, url, NULL) == 0);
+  CPPUNIT_ASSERT(standInRequests() == 3);
+
+  libhttpcomm_sessionClose(session);
+  standInStop(thread);
+}
+
+void LibHttpCommTest::testRewindSegments(void) {
+  char header[] = "<h2s>";
+  char measure[] = "<m>0</m>";
+  char footer[] = "</h2s>";
+  struct iovec segments[] = {
+    { header, strlen(header) },
+    { measure, strlen(measure) },
+    { footer, strlen(footer) },
+  };
+  libhttpcomm_session_t *session;
+  http_rxbuffer_t rx;
+  http_param_t params;
+  char response[256];
+  pthread_t thread;
+  char url[64];
+  int i;
+
+  curl_global_init(CURL_GLOBAL_ALL);
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d/test", standInStart(&thread, false));
+  sStandIn.dropRequest = 2;
+  session = libhttpcomm_sessionOpen(NULL);
+  CPPUNIT_ASSERT(session != NULL);
+
+  memset(&params, 0, sizeof(params));
+  params.timeouts.connectTimeout = 5;
+  params.timeouts.transferTimeout = 5;
+
+  // The second message is dropped with all its segments sent, and sent again from the first one
+  for(i = 1; i <= 2; i++) {
+    libhttpcomm_rxBufferInit(&rx, response, sizeof(response));
+    CPPUNIT_ASSERT_MESSAGE("POST of segments failed\n", libhttpcomm_sessionSendMsgv(session, CURLOPT_POST,
+        url, NULL, NULL, segments, 3, &rx, params, NULL) == 0);
+    CPPUNIT_ASSERT(strstr(response, "ACK") != NULL);
+  }
+  CPPUNIT_ASSERT(standInRequests() == 3);
+
+  libhttpcomm_sessionClose(session);
+  standInStop(thread);
+}
+
+/**
+ * Inflate the last body taken by the stand-in server
+ * @return the length of the message, -1 if the body isn't gzip
+ */
+static int standInInflate(char *message, int size) {
+  z_stream stream;
+  int length = -1;
+
+  memset(&stream, 0, sizeof(stream));
+  CPPUNIT_ASSERT(inflateInit2(&stream, MAX_WBITS + 16) == Z_OK);
+
+  pthread_mutex_lock(&sStandIn.mutex);
+  stream.next_in = (Bytef *) sStandIn.body;
+  stream.avail_in = sStandIn.bodyLength;
+  stream.next_out = (Bytef *) message;
+  stream.avail_out = size;
+  if(inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.avail_in == 0) {
+    length = stream.total_out;
+  }
+  pthread_mutex_unlock(&sStandIn.mutex);
+
+  inflateEnd(&stream);
+  return length;
+}
+
+void LibHttpCommTest::testCompressedSegments(void) {
+  char header[] = "<h2s>";
+  char measures[1024];
+  char footer[] = "</h2s>";
+  struct iovec segments[] = {
+    { header, strlen(header) },
+    { measures, 0 },
+    { footer, strlen(footer) },
+  };
+  libhttpcomm_session_t *session;
+  http_rxbuffer_t rx;
+  http_param_t params;
+  char response[256];
+  char expected[2048];
+  char message[2048];
+  pthread_t thread;
+  char url[64];
+  int lengths[] = { 900, 300 };
+  int i;
+  int j;
+
+  curl_global_init(CURL_GLOBAL_ALL);
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d/test", standInStart(&thread, false));
+  sStandIn.dropRequest = 2;
+  session = libhttpcomm_sessionOpen(NULL);
+  CPPUNIT_ASSERT(session != NULL);
+  CPPUNIT_ASSERT(libhttpcomm_sessionSetCompression(session, HTTPCOMM_ENCODING_GZIP, NULL, 0));
+
+  memset(&params, 0, sizeof(params));
+  params.timeouts.connectTimeout = 5;
+  params.timeouts.transferTimeout = 5;
+
+  // The smaller message is compressed in the buffer of the larger one, and sent again once dropped
+  for(i = 0; i < 2; i++) {
+    for(j = 0; j < lengths[i]; j++) {
+      measures[j] = "<m>0123456789</m>"[(i + j) % 17];
+    }
+    segments[1].iov_len = lengths[i];
+    snprintf(expected, sizeof(expected), "%s%.*s%s", header, lengths[i], measures, footer);
+
+    libhttpcomm_rxBufferInit(&rx, response, sizeof(response));
+    CPPUNIT_ASSERT_MESSAGE("POST of compressed segments failed\n", libhttpcomm_sessionSendMsgv(session, CURLOPT_POST,
+        url, NULL, NULL, segments, 3, &rx, params, NULL) == 0);
+
+    CPPUNIT_ASSERT(standInInflate(message, sizeof(message)) == (int) strlen(expected));
+    CPPUNIT_ASSERT_MESSAGE("Wrong message once inflated\n", memcmp(message, expected, strlen(expected)) == 0);
+  }
+  CPPUNIT_ASSERT(standInRequests() == 3);
+
+  libhttpcomm_sessionClose(session);
+  standInStop(thread);
+}